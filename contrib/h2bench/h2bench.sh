@@ -0,0 +1,96 @@
+#!/bin/sh
+
+# Runs many concurrent HTTP/2 streams over a single connection against
+# the given nginx binary and reports wall time and worker CPU time.
+#
+# usage: h2bench.sh nginx [streams] [rounds] [size] [port]
+#
+# h2load is used if available, nghttp otherwise.  CPU time is read
+# from /proc, so it is only reported on Linux.
+
+nginx=${1:?usage: $0 nginx [streams] [rounds] [size] [port]}
+streams=${2:-1000}
+rounds=${3:-10}
+size=${4:-65536}
+port=${5:-8980}
+
+if command -v h2load > /dev/null; then
+    client=h2load
+
+elif command -v nghttp > /dev/null; then
+    client=nghttp
+
+else
+    echo "$0: neither h2load nor nghttp found" >&2
+    exit 1
+fi
+
+dir=`mktemp -d /tmp/h2bench.XXXXXX` || exit 1
+
+trap 'rm -rf $dir' EXIT
+
+mkdir $dir/logs $dir/html
+
+dd if=/dev/zero of=$dir/html/f bs=$size count=1 2>/dev/null
+
+cat > $dir/nginx.conf << END
+daemon on;
+master_process off;
+pid logs/nginx.pid;
+error_log logs/error.log;
+
+events {
+}
+
+http {
+    access_log off;
+
+    server {
+        listen 127.0.0.1:$port http2;
+
+        http2_max_concurrent_streams $streams;
+
+        location / {
+            root html;
+        }
+    }
+}
+END
+
+$nginx -p $dir/ -c nginx.conf || exit 1
+
+sleep 1
+
+pid=`cat $dir/logs/nginx.pid`
+url=http://127.0.0.1:$port/f
+
+cpu() {
+    if [ -r /proc/$pid/stat ]; then
+        awk '{ print $14 + $15 }' /proc/$pid/stat
+    else
+        echo 0
+    fi
+}
+
+c0=`cpu`
+t0=`date +%s%N`
+
+if [ $client = h2load ]; then
+    h2load -c 1 -m $streams -n `expr $streams \* $rounds` $url > /dev/null
+
+else
+    i=0
+    while [ $i -lt $rounds ]; do
+        nghttp -n -m $streams $url || echo "round $i failed"
+        i=`expr $i + 1`
+    done
+fi
+
+t1=`date +%s%N`
+c1=`cpu`
+
+kill $pid
+
+echo "streams: $streams, rounds: $rounds, size: $size"
+echo "wall: `expr \( $t1 - $t0 \) / 1000000` ms"
+echo "worker cpu: `expr $c1 - $c0` ticks"
@@ -108,6 +108,7 @@ ngx_test_full_name(ngx_str_t *name)
 ssize_t
 ngx_write_chain_to_temp_file(ngx_temp_file_t *tf, ngx_chain_t *chain)
 {
+    ssize_t    n;
     ngx_int_t  rc;
 
     if (tf->file.fd == NGX_INVALID_FILE) {
@@ -122,10 +123,21 @@ ngx_write_chain_to_temp_file(ngx_temp_file_t *tf, ngx_chain_t *chain)
             ngx_log_error(tf->log_level, tf->file.log, 0, "%s %V",
                           tf->warn, &tf->file.name);
         }
+
+        if (tf->preallocate
+            && ngx_preallocate_file(tf->file.fd, tf->preallocate)
+               == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_WARN, tf->file.log, ngx_errno,
+                          ngx_preallocate_file_n " \"%V\" failed",
+                          &tf->file.name);
+        }
     }
 
 #if (NGX_THREADS && NGX_HAVE_PWRITEV)
 
+    /* writeback of tf->file.write_behind files is started by the thread */
+
     if (tf->thread_write) {
         return ngx_thread_write_chain_to_file(&tf->file, chain, tf->offset,
                                               tf->pool);
@@ -133,7 +145,20 @@ ngx_write_chain_to_temp_file(ngx_temp_file_t *tf, ngx_chain_t *chain)
 
 #endif
 
-    return ngx_write_chain_to_file(&tf->file, chain, tf->offset, tf->pool);
+    n = ngx_write_chain_to_file(&tf->file, chain, tf->offset, tf->pool);
+
+    /* start writeback of the written range, do not wait for it */
+
+    if (n > 0
+        && tf->file.write_behind
+        && ngx_write_behind(tf->file.fd, tf->offset, n) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, tf->file.log, ngx_errno,
+                      ngx_write_behind_n " \"%s\" failed",
+                      tf->file.name.data);
+    }
+
+    return n;
 }
 
 
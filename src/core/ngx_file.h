@@ -36,6 +36,7 @@ struct ngx_file_s {
 
     unsigned                   valid_info:1;
     unsigned                   directio:1;
+    unsigned                   write_behind:1;
 };
 
 
@@ -71,6 +72,7 @@ typedef struct {
 typedef struct {
     ngx_file_t                 file;
     off_t                      offset;
+    off_t                      preallocate;
     ngx_path_t                *path;
     ngx_pool_t                *pool;
     char                      *warn;
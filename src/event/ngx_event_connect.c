@@ -85,6 +85,26 @@ ngx_event_connect_peer(ngx_peer_connection_t *pc)
         }
     }
 
+#if (NGX_HAVE_TCP_FASTOPEN_CONNECT)
+
+    if (pc->fastopen && type == SOCK_STREAM
+        && pc->sockaddr->sa_family != AF_UNIX)
+    {
+        /* connect() returns at once, SYN is sent with the first data */
+
+        value = 1;
+
+        if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                       (const void *) &value, sizeof(int))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
+                          "setsockopt(TCP_FASTOPEN_CONNECT) failed, ignored");
+        }
+    }
+
+#endif
+
     if (ngx_nonblocking(s) == -1) {
         ngx_log_error(NGX_LOG_ALERT, pc->log, ngx_socket_errno,
                       ngx_nonblocking_n " failed");
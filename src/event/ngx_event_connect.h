@@ -63,6 +63,7 @@ struct ngx_peer_connection_s {
     unsigned                         cached:1;
     unsigned                         transparent:1;
     unsigned                         so_keepalive:1;
+    unsigned                         fastopen:1;
     unsigned                         down:1;
 
                                      /* ngx_connection_log_error_e */
@@ -17,6 +17,19 @@ static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
 static ngx_inline void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 static ngx_int_t ngx_event_pipe_drain_chains(ngx_event_pipe_t *p);
+static ngx_buf_t *ngx_event_pipe_alloc_buf(ngx_event_pipe_t *p, size_t size);
+static void ngx_event_pipe_cleanup_buf(void *data);
+static ngx_int_t ngx_event_pipe_cache_index(size_t size);
+
+
+#define NGX_EVENT_PIPE_CACHE_CLASSES  16
+#define NGX_EVENT_PIPE_CACHE_SIZE     (4 * 1024 * 1024)
+
+
+/* per worker lists of free buffers, one list for each power of 2 pages */
+
+static void    *ngx_event_pipe_cache[NGX_EVENT_PIPE_CACHE_CLASSES];
+static size_t   ngx_event_pipe_cached;
 
 
 ngx_int_t
@@ -102,6 +115,7 @@ static ngx_int_t
 ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 {
     off_t         limit;
+    size_t        len;
     ssize_t       n, size;
     ngx_int_t     rc;
     ngx_buf_t    *b;
@@ -229,16 +243,29 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
                     p->free_raw_bufs = NULL;
                 }
 
-            } else if (p->allocated < p->bufs.num) {
+            } else if (p->allocated_size
+                       < (size_t) p->bufs.num * p->bufs.size)
+            {
+
+                /*
+                 * allocate a new buf if it's still allowed: bufs start
+                 * from a page and grow up to p->bufs.size while reads
+                 * fill them, within the memory of p->bufs.num bufs
+                 */
+
+                if (p->buf_size == 0) {
+                    p->buf_size = ngx_min(ngx_pagesize, p->bufs.size);
+                }
 
-                /* allocate a new buf if it's still allowed */
+                len = (size_t) p->bufs.num * p->bufs.size - p->allocated_size;
 
-                b = ngx_create_temp_buf(p->pool, p->bufs.size);
+                b = ngx_event_pipe_alloc_buf(p, ngx_min(p->buf_size, len));
                 if (b == NULL) {
                     return NGX_ABORT;
                 }
 
                 p->allocated++;
+                p->allocated_size += b->end - b->start;
 
                 chain = ngx_alloc_chain_link(p->pool);
                 if (chain == NULL) {
@@ -373,6 +400,12 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
             ln->next = p->free_raw_bufs;
             p->free_raw_bufs = cl;
+
+        } else if (p->buf_size && p->buf_size < p->bufs.size) {
+
+            /* all bufs were filled, the next allocated one will be larger */
+
+            p->buf_size = ngx_min(p->buf_size * 2, p->bufs.size);
         }
 
         if (delay > 0) {
@@ -1052,6 +1085,107 @@ ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf)
 }
 
 
+static ngx_buf_t *
+ngx_event_pipe_alloc_buf(ngx_event_pipe_t *p, size_t size)
+{
+    u_char              *m;
+    ngx_int_t            i;
+    ngx_buf_t           *b;
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(p->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    b = ngx_calloc_buf(p->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    i = ngx_event_pipe_cache_index(size);
+
+    if (i != NGX_ERROR && ngx_event_pipe_cache[i]) {
+        m = ngx_event_pipe_cache[i];
+        ngx_event_pipe_cache[i] = *(void **) m;
+        ngx_event_pipe_cached -= size;
+
+    } else {
+        m = ngx_alloc(size, p->log);
+        if (m == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe buf alloc: %p:%uz", m, size);
+
+    b->start = m;
+    b->pos = m;
+    b->last = m;
+    b->end = m + size;
+    b->temporary = 1;
+
+    cln->handler = ngx_event_pipe_cleanup_buf;
+    cln->data = b;
+
+    return b;
+}
+
+
+static void
+ngx_event_pipe_cleanup_buf(void *data)
+{
+    ngx_buf_t  *b = data;
+
+    size_t     size;
+    ngx_int_t  i;
+
+    size = b->end - b->start;
+
+    i = ngx_event_pipe_cache_index(size);
+
+    if (i == NGX_ERROR
+        || ngx_event_pipe_cached + size > NGX_EVENT_PIPE_CACHE_SIZE)
+    {
+        ngx_free(b->start);
+        return;
+    }
+
+    *(void **) b->start = ngx_event_pipe_cache[i];
+    ngx_event_pipe_cache[i] = b->start;
+    ngx_event_pipe_cached += size;
+}
+
+
+static ngx_int_t
+ngx_event_pipe_cache_index(size_t size)
+{
+    size_t      n;
+    ngx_uint_t  i;
+
+    if (size & (ngx_pagesize - 1)) {
+        return NGX_ERROR;
+    }
+
+    n = size >> ngx_pagesize_shift;
+
+    if (n & (n - 1)) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; n > 1; i++) {
+        n >>= 1;
+    }
+
+    if (i >= NGX_EVENT_PIPE_CACHE_CLASSES) {
+        return NGX_ERROR;
+    }
+
+    return i;
+}
+
+
 ngx_int_t
 ngx_event_pipe_add_free_buf(ngx_event_pipe_t *p, ngx_buf_t *b)
 {
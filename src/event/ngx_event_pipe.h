@@ -68,6 +68,8 @@ struct ngx_event_pipe_s {
     unsigned           aio:1;
 
     ngx_int_t          allocated;
+    size_t             allocated_size;
+    size_t             buf_size;
     ngx_bufs_t         bufs;
     ngx_buf_tag_t      tag;
 
@@ -0,0 +1,435 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_probe.h>
+
+
+static void ngx_event_probe_start(ngx_event_t *ev);
+static void ngx_event_probe_write_handler(ngx_event_t *wev);
+static void ngx_event_probe_read_handler(ngx_event_t *rev);
+static void ngx_event_probe_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_event_probe_test_connect(ngx_connection_t *c);
+#if (NGX_SSL)
+static void ngx_event_probe_ssl_init(ngx_event_probe_t *probe);
+static void ngx_event_probe_ssl_handshake(ngx_connection_t *c);
+static ngx_int_t ngx_event_probe_ssl_name(ngx_event_probe_t *probe);
+#endif
+static void ngx_event_probe_finalize(ngx_event_probe_t *probe, ngx_int_t rc);
+
+
+ngx_int_t
+ngx_event_probe_init(ngx_event_probe_t *probe, ngx_pool_t *pool,
+    ngx_log_t *log)
+{
+    probe->response = ngx_create_temp_buf(pool, ngx_pagesize);
+    if (probe->response == NULL) {
+        return NGX_ERROR;
+    }
+
+    probe->event.handler = ngx_event_probe_start;
+    probe->event.data = probe;
+    probe->event.log = log;
+    probe->event.cancelable = 1;
+
+    /* spread the first probes over the interval */
+
+    ngx_add_timer(&probe->event, ngx_random() % probe->interval + 1);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_event_probe_start(ngx_event_t *ev)
+{
+    ngx_int_t           rc;
+    ngx_connection_t   *c;
+    ngx_event_probe_t  *probe;
+
+    probe = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_memzero(&probe->pc, sizeof(ngx_peer_connection_t));
+
+    if (probe->peer(probe) != NGX_OK) {
+        ngx_add_timer(ev, probe->interval);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "probe \"%V\"", probe->pc.name);
+
+    probe->pc.type = probe->type;
+    probe->pc.get = ngx_event_get_peer;
+    probe->pc.log = ev->log;
+    probe->pc.log_error = NGX_ERROR_INFO;
+
+    probe->sent = probe->request.data;
+    probe->response->pos = probe->response->start;
+    probe->response->last = probe->response->start;
+    probe->connected = 0;
+    probe->eof = 0;
+
+    rc = ngx_event_connect_peer(&probe->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+        return;
+    }
+
+    c = probe->pc.connection;
+
+    c->data = probe;
+    c->log = ev->log;
+    c->log_error = NGX_ERROR_INFO;
+
+    c->read->handler = ngx_event_probe_read_handler;
+    c->write->handler = ngx_event_probe_write_handler;
+
+    /* the timeout covers the whole probe */
+
+    ngx_add_timer(c->read, probe->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_event_probe_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_event_probe_write_handler(ngx_event_t *wev)
+{
+    ssize_t             n, size;
+    ngx_connection_t   *c;
+    ngx_event_probe_t  *probe;
+
+    c = wev->data;
+    probe = c->data;
+
+    if (!probe->connected) {
+
+        if (ngx_event_probe_test_connect(c) != NGX_OK) {
+            ngx_event_probe_finalize(probe, NGX_ERROR);
+            return;
+        }
+
+        probe->connected = 1;
+
+#if (NGX_SSL)
+
+        if (probe->ssl && probe->type == SOCK_STREAM) {
+            ngx_event_probe_ssl_init(probe);
+            return;
+        }
+
+#endif
+    }
+
+    size = probe->request.data + probe->request.len - probe->sent;
+
+    if (size) {
+        n = c->send(c, probe->sent, size);
+
+        if (n == NGX_ERROR) {
+            ngx_event_probe_finalize(probe, NGX_ERROR);
+            return;
+        }
+
+        if (n > 0) {
+            probe->sent += n;
+            size -= n;
+        }
+    }
+
+    if (size == 0) {
+
+        if (probe->check == NULL && probe->type == SOCK_STREAM) {
+            ngx_event_probe_finalize(probe, NGX_OK);
+            return;
+        }
+
+        wev->handler = ngx_event_probe_dummy_handler;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_event_probe_read_handler(ngx_event_t *rev)
+{
+    ssize_t             n, size;
+    ngx_int_t           rc;
+    ngx_buf_t          *b;
+    ngx_connection_t   *c;
+    ngx_event_probe_t  *probe;
+
+    c = rev->data;
+    probe = c->data;
+
+    if (rev->timedout) {
+
+        if (probe->type == SOCK_DGRAM && probe->check == NULL) {
+            ngx_event_probe_finalize(probe, NGX_OK);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, rev->log, NGX_ETIMEDOUT,
+                      "health check of upstream server %V timed out",
+                      probe->pc.name);
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+        return;
+    }
+
+    b = probe->response;
+
+    for ( ;; ) {
+
+        size = b->end - b->last;
+
+        if (size == 0) {
+            probe->eof = 1;
+            break;
+        }
+
+        n = c->recv(c, b->last, size);
+
+        if (n > 0) {
+            b->last += n;
+
+            rc = probe->check ? probe->check(probe) : NGX_OK;
+
+            if (rc != NGX_AGAIN) {
+                ngx_event_probe_finalize(probe, rc);
+                return;
+            }
+
+            if (probe->type == SOCK_DGRAM) {
+                probe->eof = 1;
+                break;
+            }
+
+            continue;
+        }
+
+        if (n == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_event_probe_finalize(probe, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_event_probe_finalize(probe, NGX_ERROR);
+            return;
+        }
+
+        probe->eof = 1;
+        break;
+    }
+
+    rc = probe->check ? probe->check(probe) : NGX_OK;
+
+    ngx_event_probe_finalize(probe, (rc == NGX_AGAIN) ? NGX_ERROR : rc);
+}
+
+
+static void
+ngx_event_probe_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "probe dummy handler");
+}
+
+
+static ngx_int_t
+ngx_event_probe_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+
+        if (err) {
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_SSL)
+
+static void
+ngx_event_probe_ssl_init(ngx_event_probe_t *probe)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = probe->pc.connection;
+
+    /* the pool is only needed for the SSL connection */
+
+    c->pool = ngx_create_pool(128, c->log);
+    if (c->pool == NULL) {
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_ssl_create_connection(probe->ssl, c,
+                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_event_probe_ssl_name(probe) != NGX_OK) {
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+        return;
+    }
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+        c->ssl->handler = ngx_event_probe_ssl_handshake;
+        return;
+    }
+
+    ngx_event_probe_ssl_handshake(c);
+}
+
+
+static void
+ngx_event_probe_ssl_handshake(ngx_connection_t *c)
+{
+    ngx_event_probe_t  *probe;
+
+    probe = c->data;
+
+    if (!c->ssl->handshaked) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "health check of upstream server %V: "
+                      "SSL handshake failed", probe->pc.name);
+        ngx_event_probe_finalize(probe, NGX_ERROR);
+        return;
+    }
+
+    c->read->handler = ngx_event_probe_read_handler;
+    c->write->handler = ngx_event_probe_write_handler;
+
+    ngx_event_probe_write_handler(c->write);
+}
+
+
+static ngx_int_t
+ngx_event_probe_ssl_name(ngx_event_probe_t *probe)
+{
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    u_char            *p;
+    ngx_str_t         *name;
+    ngx_connection_t  *c;
+
+    name = &probe->ssl_name;
+    c = probe->pc.connection;
+
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+    if (name->len == 0 || name->data[0] == '[') {
+        return NGX_OK;
+    }
+
+    if (ngx_inet_addr(name->data, name->len) != INADDR_NONE) {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(c->pool, name->len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_cpystrn(p, name->data, name->len + 1);
+
+    if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) p) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_set_tlsext_host_name(\"%s\") failed", p);
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_event_probe_finalize(ngx_event_probe_t *probe, ngx_int_t rc)
+{
+    ngx_pool_t        *pool;
+    ngx_connection_t  *c;
+
+    c = probe->pc.connection;
+
+    if (c) {
+
+#if (NGX_SSL)
+        if (c->ssl) {
+            c->ssl->no_wait_shutdown = 1;
+            (void) ngx_ssl_shutdown(c);
+        }
+#endif
+
+        pool = c->pool;
+
+        ngx_close_connection(c);
+
+        if (pool) {
+            ngx_destroy_pool(pool);
+        }
+
+        probe->pc.connection = NULL;
+    }
+
+    probe->done(probe, rc);
+
+    ngx_add_timer(&probe->event, probe->interval);
+}
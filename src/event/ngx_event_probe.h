@@ -0,0 +1,65 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_PROBE_H_INCLUDED_
+#define _NGX_EVENT_PROBE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+
+typedef struct ngx_event_probe_s  ngx_event_probe_t;
+
+typedef ngx_int_t (*ngx_event_probe_peer_pt)(ngx_event_probe_t *probe);
+typedef ngx_int_t (*ngx_event_probe_check_pt)(ngx_event_probe_t *probe);
+typedef void (*ngx_event_probe_done_pt)(ngx_event_probe_t *probe,
+    ngx_int_t rc);
+
+
+struct ngx_event_probe_s {
+    ngx_event_t                 event;
+    ngx_peer_connection_t       pc;
+
+    ngx_msec_t                  interval;
+    ngx_msec_t                  timeout;
+    int                         type;
+
+    ngx_str_t                   request;
+    u_char                     *sent;
+    ngx_buf_t                  *response;
+
+#if (NGX_SSL)
+    ngx_ssl_t                  *ssl;
+    ngx_str_t                   ssl_name;
+#endif
+
+    /* sets the address of the peer, or declines the probe */
+    ngx_event_probe_peer_pt     peer;
+
+    /*
+     * tests the response received so far, NGX_AGAIN asks for more;
+     * without it, a TCP probe passes once the request is sent,
+     * and a UDP probe passes unless an error is reported
+     */
+    ngx_event_probe_check_pt    check;
+
+    ngx_event_probe_done_pt     done;
+
+    void                       *data;
+
+    unsigned                    connected:1;
+    unsigned                    eof:1;
+};
+
+
+ngx_int_t ngx_event_probe_init(ngx_event_probe_t *probe, ngx_pool_t *pool,
+    ngx_log_t *log);
+
+
+#endif /* _NGX_EVENT_PROBE_H_INCLUDED_ */
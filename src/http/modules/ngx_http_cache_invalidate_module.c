@@ -0,0 +1,285 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_str_t                      zone;
+} ngx_http_cache_invalidate_loc_conf_t;
+
+
+static ngx_int_t ngx_http_cache_invalidate_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_cache_invalidate_arg(ngx_http_request_t *r,
+    char *name, size_t len, ngx_str_t *value);
+static void *ngx_http_cache_invalidate_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_cache_invalidate_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_set_cache_invalidate(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+
+static ngx_command_t  ngx_http_cache_invalidate_commands[] = {
+
+    { ngx_string("cache_invalidate"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_cache_invalidate,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_cache_invalidate_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_cache_invalidate_create_loc_conf,
+                                           /* create location configuration */
+    ngx_http_cache_invalidate_merge_loc_conf
+                                           /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_cache_invalidate_module = {
+    NGX_MODULE_V1,
+    &ngx_http_cache_invalidate_module_ctx, /* module context */
+    ngx_http_cache_invalidate_commands,    /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_cache_invalidate_handler(ngx_http_request_t *r)
+{
+    size_t                                 len;
+    ngx_int_t                              rc;
+    ngx_buf_t                             *b;
+    ngx_str_t                              value;
+    ngx_uint_t                             n, prefix, unindexed, cold;
+    ngx_chain_t                            out;
+    ngx_http_file_cache_t                 *cache;
+    ngx_http_cache_invalidate_loc_conf_t  *cilcf;
+
+    if (!(r->method & (NGX_HTTP_POST|NGX_HTTP_DELETE))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    cilcf = ngx_http_get_module_loc_conf(r, ngx_http_cache_invalidate_module);
+
+    cache = ngx_http_file_cache_find((ngx_cycle_t *) ngx_cycle, &cilcf->zone);
+
+    if (cache == NULL || cache->sh == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache \"%V\" not found", &cilcf->zone);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    rc = ngx_http_cache_invalidate_arg(r, "tag", 3, &value);
+
+    if (rc == NGX_OK) {
+        prefix = 0;
+
+    } else if (rc == NGX_DECLINED) {
+        rc = ngx_http_cache_invalidate_arg(r, "prefix", 6, &value);
+        prefix = 1;
+
+    } else {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache invalidation requires \"tag\" "
+                      "or \"prefix\" argument");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_file_cache_invalidate(cache, &value, prefix, &n) != NGX_OK) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache \"%V\" does not index %s \"%V\"",
+                      &cilcf->zone, prefix ? "prefix" : "tag", &value);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    /*
+     * entries loaded from disk after a restart are not indexed
+     * until they are sent from the cache or stored again, so they
+     * cannot be invalidated; their number is reported, as well as
+     * a cache which is still being loaded
+     */
+
+    unindexed = cache->sh->unindexed;
+    cold = cache->sh->cold;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "cache \"%V\" %s \"%V\" invalidated, entries: %ui, "
+                  "not indexed: %ui%s",
+                  &cilcf->zone, prefix ? "prefix" : "tag", &value, n,
+                  unindexed, cold ? ", loading" : "");
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    len = sizeof("Invalidated: \n") - 1 + NGX_INT_T_LEN
+          + sizeof("Not indexed: \n") - 1 + NGX_INT_T_LEN
+          + sizeof("Loading: yes\n") - 1;
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    b->last = ngx_sprintf(b->last, "Invalidated: %ui\n", n);
+
+    if (unindexed || cold) {
+        b->last = ngx_sprintf(b->last, "Not indexed: %ui\n", unindexed);
+    }
+
+    if (cold) {
+        b->last = ngx_cpymem(b->last, "Loading: yes\n",
+                             sizeof("Loading: yes\n") - 1);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_cache_invalidate_arg(ngx_http_request_t *r, char *name, size_t len,
+    ngx_str_t *value)
+{
+    u_char     *dst, *src;
+    ngx_str_t   arg;
+
+    if (ngx_http_arg(r, (u_char *) name, len, &arg) != NGX_OK
+        || arg.len == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    dst = ngx_pnalloc(r->pool, arg.len);
+    if (dst == NULL) {
+        return NGX_ERROR;
+    }
+
+    value->data = dst;
+    src = arg.data;
+
+    ngx_unescape_uri(&dst, &src, arg.len, 0);
+
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_cache_invalidate_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_cache_invalidate_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_cache_invalidate_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->zone = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_cache_invalidate_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_cache_invalidate_loc_conf_t *conf = child;
+
+    /* all caches of the http block are known at this point */
+
+    if (conf->zone.data
+        && ngx_http_file_cache_find(cf->cycle, &conf->zone) == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"cache_invalidate\" zone \"%V\" is unknown",
+                           &conf->zone);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_set_cache_invalidate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_cache_invalidate_loc_conf_t *cilcf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (cilcf->zone.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    cilcf->zone = value[1];
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_cache_invalidate_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,211 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_str_t                  zone;
+} ngx_http_cache_status_loc_conf_t;
+
+
+static ngx_int_t ngx_http_cache_status_handler(ngx_http_request_t *r);
+static void *ngx_http_cache_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_set_cache_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_cache_status_commands[] = {
+
+    { ngx_string("cache_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_cache_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_cache_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_cache_status_create_loc_conf, /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_cache_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_cache_status_module_ctx,     /* module context */
+    ngx_http_cache_status_commands,        /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_cache_status_handler(ngx_http_request_t *r)
+{
+    off_t                              size;
+    size_t                             len;
+    ngx_int_t                          rc;
+    ngx_buf_t                         *b;
+    ngx_uint_t                         count, protected, ratio;
+    ngx_chain_t                        out;
+    ngx_atomic_uint_t                  hits, misses, admitted, rejected,
+                                       evicted;
+    ngx_http_file_cache_t             *cache;
+    ngx_http_cache_status_loc_conf_t  *cslcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    cslcf = ngx_http_get_module_loc_conf(r, ngx_http_cache_status_module);
+
+    cache = ngx_http_file_cache_find((ngx_cycle_t *) ngx_cycle, &cslcf->zone);
+
+    if (cache == NULL || cache->sh == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache \"%V\" not found", &cslcf->zone);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    size = cache->sh->size;
+    count = cache->sh->count;
+    protected = cache->sh->protected_count;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    hits = cache->sh->stat.hits;
+    misses = cache->sh->stat.misses;
+    admitted = cache->sh->stat.admitted;
+    rejected = cache->sh->stat.rejected;
+    evicted = cache->sh->stat.evicted;
+
+    /* hit ratio in hundredths of a percent */
+
+    ratio = (hits + misses) ? (ngx_uint_t) (hits * 10000 / (hits + misses))
+                            : 0;
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    len = sizeof("Cache size:  entries:  protected: \n") - 1
+          + NGX_OFF_T_LEN + 2 * NGX_INT_T_LEN
+          + sizeof("hits misses ratio\n") - 1
+          + sizeof("   .%\n") - 1 + 2 * NGX_ATOMIC_T_LEN + NGX_INT_T_LEN
+          + sizeof("admitted rejected evicted\n") - 1
+          + sizeof("   \n") - 1 + 3 * NGX_ATOMIC_T_LEN;
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    b->last = ngx_sprintf(b->last, "Cache size: %O entries: %ui "
+                          "protected: %ui\n",
+                          size * cache->bsize, count, protected);
+
+    b->last = ngx_cpymem(b->last, "hits misses ratio\n",
+                         sizeof("hits misses ratio\n") - 1);
+
+    b->last = ngx_sprintf(b->last, " %uA %uA %ui.%02ui%%\n",
+                          hits, misses, ratio / 100, ratio % 100);
+
+    b->last = ngx_cpymem(b->last, "admitted rejected evicted\n",
+                         sizeof("admitted rejected evicted\n") - 1);
+
+    b->last = ngx_sprintf(b->last, " %uA %uA %uA\n",
+                          admitted, rejected, evicted);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void *
+ngx_http_cache_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_cache_status_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_cache_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->zone = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_set_cache_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_cache_status_loc_conf_t *cslcf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (cslcf->zone.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    cslcf->zone = value[1];
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_cache_status_handler;
+
+    return NGX_CONF_OK;
+}
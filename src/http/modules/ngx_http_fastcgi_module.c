@@ -42,6 +42,8 @@ typedef struct {
 
     ngx_flag_t                     keep_conn;
 
+    ngx_http_upstream_mux_conf_t   mux;
+
 #if (NGX_HTTP_CACHE)
     ngx_http_complex_value_t       cache_key;
 #endif
@@ -147,6 +149,26 @@ typedef struct {
 } ngx_http_fastcgi_request_start_t;
 
 
+typedef struct {
+    ngx_http_upstream_mux_stream_t   stream;
+
+    size_t                           rest;
+    ngx_uint_t                       hlen;
+    ngx_http_fastcgi_header_t        header;
+} ngx_http_fastcgi_stream_t;
+
+
+typedef struct {
+    ngx_http_upstream_mux_t          mux;
+
+    ngx_uint_t                       id;
+    ngx_uint_t                       type;
+    size_t                           rest;
+    ngx_uint_t                       hlen;
+    ngx_http_fastcgi_header_t        header;
+} ngx_http_fastcgi_mux_t;
+
+
 static ngx_int_t ngx_http_fastcgi_eval(ngx_http_request_t *r,
     ngx_http_fastcgi_loc_conf_t *flcf);
 #if (NGX_HTTP_CACHE)
@@ -168,6 +190,13 @@ static void ngx_http_fastcgi_abort_request(ngx_http_request_t *r);
 static void ngx_http_fastcgi_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
 
+static ngx_int_t ngx_http_fastcgi_mux_init_peer(ngx_http_request_t *r);
+static ngx_int_t ngx_http_fastcgi_mux_send(
+    ngx_http_upstream_mux_stream_t *us, u_char *p, size_t size);
+static ngx_int_t ngx_http_fastcgi_mux_parse(ngx_http_upstream_mux_t *um);
+static ngx_int_t ngx_http_fastcgi_mux_abort(
+    ngx_http_upstream_mux_stream_t *us);
+
 static ngx_int_t ngx_http_fastcgi_add_variables(ngx_conf_t *cf);
 static void *ngx_http_fastcgi_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf);
@@ -205,6 +234,17 @@ static ngx_conf_post_t  ngx_http_fastcgi_lowat_post =
     { ngx_http_fastcgi_lowat_check };
 
 
+static ngx_http_upstream_mux_handler_t  ngx_http_fastcgi_mux_handler = {
+    ngx_string("fastcgi://"),
+    sizeof(ngx_http_fastcgi_mux_t),
+    sizeof(ngx_http_fastcgi_stream_t),
+    NULL,
+    ngx_http_fastcgi_mux_send,
+    ngx_http_fastcgi_mux_parse,
+    ngx_http_fastcgi_mux_abort
+};
+
+
 static ngx_conf_bitmask_t  ngx_http_fastcgi_next_upstream_masks[] = {
     { ngx_string("error"), NGX_HTTP_UPSTREAM_FT_ERROR },
     { ngx_string("timeout"), NGX_HTTP_UPSTREAM_FT_TIMEOUT },
@@ -296,6 +336,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, upstream.socket_keepalive),
       NULL },
 
+    { ngx_string("fastcgi_socket_fastopen"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, upstream.socket_fastopen),
+      NULL },
+
     { ngx_string("fastcgi_connect_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -438,6 +485,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, upstream.cache_max_range_offset),
       NULL },
 
+    { ngx_string("fastcgi_cache_partial"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, upstream.cache_partial),
+      NULL },
+
     { ngx_string("fastcgi_cache_use_stale"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
@@ -531,6 +585,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, upstream.next_upstream_timeout),
       NULL },
 
+    { ngx_string("fastcgi_next_upstream_hedge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_hedge_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, upstream.hedge),
+      NULL },
+
     { ngx_string("fastcgi_param"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE23,
       ngx_http_upstream_param_set_slot,
@@ -573,6 +634,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, keep_conn),
       NULL },
 
+    { ngx_string("fastcgi_multiplex"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_multiplex_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, mux.multiplex),
+      NULL },
+
       ngx_null_command
 };
 
@@ -742,6 +810,10 @@ ngx_http_fastcgi_handler(ngx_http_request_t *r)
     u->input_filter = ngx_http_fastcgi_non_buffered_filter;
     u->input_filter_ctx = r;
 
+    if (flcf->mux.multiplex && (ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        u->init_peer = ngx_http_fastcgi_mux_init_peer;
+    }
+
     if (!flcf->upstream.request_buffering
         && flcf->upstream.pass_request_body)
     {
@@ -840,6 +912,7 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
                                   allocated;
     ngx_uint_t                    i, n, next, hash, skip_empty, header_params;
     ngx_buf_t                    *b;
+    ngx_str_t                     range;
     ngx_chain_t                  *cl, *body;
     ngx_list_part_t              *part;
     ngx_table_elt_t              *header, *hn, **ignored;
@@ -895,6 +968,20 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
         }
     }
 
+    range.len = 0;
+
+#if (NGX_HTTP_CACHE)
+
+    if (ngx_http_upstream_cache_range(r, &range) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    if (range.len) {
+        len += 1 + sizeof("HTTP_RANGE") - 1 + 1 + range.len;
+    }
+
     if (flcf->upstream.pass_request_headers) {
 
         allocated = 0;
@@ -1108,6 +1195,18 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
     }
 
 
+    if (range.len) {
+        *b->last++ = (u_char) (sizeof("HTTP_RANGE") - 1);
+        *b->last++ = (u_char) range.len;
+
+        b->last = ngx_cpymem(b->last, "HTTP_RANGE", sizeof("HTTP_RANGE") - 1);
+        b->last = ngx_cpymem(b->last, range.data, range.len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "fastcgi param: \"HTTP_RANGE: %V\"", &range);
+    }
+
+
     if (flcf->upstream.pass_request_headers) {
 
         part = &r->headers_in.headers.part;
@@ -2808,6 +2907,235 @@ ngx_http_fastcgi_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 }
 
 
+static ngx_int_t
+ngx_http_fastcgi_mux_init_peer(ngx_http_request_t *r)
+{
+    ngx_http_fastcgi_loc_conf_t  *flcf;
+
+    flcf = ngx_http_get_module_loc_conf(r, ngx_http_fastcgi_module);
+
+    return ngx_http_upstream_mux_init_peer(r, &flcf->mux,
+                                           &ngx_http_fastcgi_mux_handler);
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_send(ngx_http_upstream_mux_stream_t *us, u_char *p,
+    size_t size)
+{
+    size_t                      n;
+    ngx_http_upstream_mux_t    *mux;
+    ngx_http_fastcgi_stream_t  *stream;
+
+    stream = (ngx_http_fastcgi_stream_t *) us;
+    mux = us->mux;
+
+    while (size) {
+
+        if (stream->hlen < sizeof(ngx_http_fastcgi_header_t)) {
+            n = ngx_min(sizeof(ngx_http_fastcgi_header_t) - stream->hlen,
+                        size);
+
+            ngx_memcpy((u_char *) &stream->header + stream->hlen, p, n);
+
+            stream->hlen += n;
+            p += n;
+            size -= n;
+
+            if (stream->hlen < sizeof(ngx_http_fastcgi_header_t)) {
+                break;
+            }
+
+            /* the request always uses the request id 1 */
+
+            stream->header.request_id_hi = (u_char) (us->id >> 8);
+            stream->header.request_id_lo = (u_char) us->id;
+
+            stream->rest = (stream->header.content_length_hi << 8)
+                           + stream->header.content_length_lo
+                           + stream->header.padding_length;
+
+            if (ngx_http_upstream_mux_append(mux, &us->out, &us->out_last,
+                                             (u_char *) &stream->header,
+                                             sizeof(ngx_http_fastcgi_header_t))
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+        } else {
+            n = ngx_min(stream->rest, size);
+
+            if (ngx_http_upstream_mux_append(mux, &us->out, &us->out_last,
+                                             p, n)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            stream->rest -= n;
+            p += n;
+            size -= n;
+        }
+
+        if (stream->rest) {
+            continue;
+        }
+
+        /* only complete records are interleaved with other requests */
+
+        if (mux->out) {
+            mux->out_last->next = us->out;
+
+        } else {
+            mux->out = us->out;
+        }
+
+        mux->out_last = us->out_last;
+
+        us->out = NULL;
+        us->out_last = NULL;
+        us->started = 1;
+
+        stream->hlen = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_parse(ngx_http_upstream_mux_t *um)
+{
+    size_t                           n;
+    u_char                          *p;
+    ngx_buf_t                       *b;
+    ngx_http_fastcgi_mux_t          *mux;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    mux = (ngx_http_fastcgi_mux_t *) um;
+    b = um->buffer;
+
+    while (b->pos < b->last) {
+
+        if (um->blocked) {
+            return NGX_AGAIN;
+        }
+
+        if (mux->hlen < sizeof(ngx_http_fastcgi_header_t)) {
+            n = ngx_min(sizeof(ngx_http_fastcgi_header_t) - mux->hlen,
+                        (size_t) (b->last - b->pos));
+
+            ngx_memcpy((u_char *) &mux->header + mux->hlen, b->pos, n);
+
+            mux->hlen += n;
+            b->pos += n;
+
+            if (mux->hlen < sizeof(ngx_http_fastcgi_header_t)) {
+                break;
+            }
+
+            if (mux->header.version != 1) {
+                ngx_log_error(NGX_LOG_ERR, um->connection->log, 0,
+                              "upstream sent unsupported FastCGI "
+                              "protocol version: %d", mux->header.version);
+                return NGX_ERROR;
+            }
+
+            mux->id = (mux->header.request_id_hi << 8)
+                      + mux->header.request_id_lo;
+            mux->type = mux->header.type;
+            mux->rest = (mux->header.content_length_hi << 8)
+                        + mux->header.content_length_lo
+                        + mux->header.padding_length;
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, um->connection->log, 0,
+                           "fastcgi mux record type:%ui id:%ui len:%uz",
+                           mux->type, mux->id, mux->rest);
+
+            /* management records with the request id 0 are not used */
+
+            if (mux->id > um->max
+                || (mux->id && um->streams[mux->id - 1] == NULL))
+            {
+                ngx_log_error(NGX_LOG_ERR, um->connection->log, 0,
+                              "upstream sent FastCGI record for "
+                              "unknown request id %ui", mux->id);
+                return NGX_ERROR;
+            }
+
+            /* the request expects the request id 1 */
+
+            mux->header.request_id_hi = 0;
+            mux->header.request_id_lo = 1;
+
+            p = (u_char *) &mux->header;
+            n = sizeof(ngx_http_fastcgi_header_t);
+
+        } else {
+            p = b->pos;
+            n = ngx_min(mux->rest, (size_t) (b->last - b->pos));
+
+            mux->rest -= n;
+            b->pos += n;
+        }
+
+        stream = mux->id ? um->streams[mux->id - 1] : NULL;
+
+        if (stream == NGX_HTTP_UPSTREAM_MUX_ABORTED) {
+            stream = NULL;
+        }
+
+        if (stream && ngx_http_upstream_mux_input(stream, p, n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (mux->rest == 0) {
+
+            /* the record is complete */
+
+            mux->hlen = 0;
+
+            if (mux->type == NGX_HTTP_FASTCGI_END_REQUEST && mux->id) {
+
+                if (stream) {
+                    stream->done = 1;
+
+                } else {
+                    ngx_http_upstream_mux_release(um, mux->id);
+                }
+            }
+        }
+
+        if (stream) {
+            ngx_http_upstream_mux_post(stream);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_abort(ngx_http_upstream_mux_stream_t *us)
+{
+    ngx_http_fastcgi_header_t  h;
+
+    /* the request id is reused only after FCGI_END_REQUEST */
+
+    ngx_memzero(&h, sizeof(ngx_http_fastcgi_header_t));
+
+    h.version = 1;
+    h.type = NGX_HTTP_FASTCGI_ABORT_REQUEST;
+    h.request_id_hi = (u_char) (us->id >> 8);
+    h.request_id_lo = (u_char) us->id;
+
+    return ngx_http_upstream_mux_append(us->mux, &us->mux->out,
+                                        &us->mux->out_last,
+                                        (u_char *) &h, sizeof(h));
+}
+
+
 static ngx_int_t
 ngx_http_fastcgi_add_variables(ngx_conf_t *cf)
 {
@@ -2887,11 +3215,13 @@ ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
 
     conf->upstream.local = NGX_CONF_UNSET_PTR;
     conf->upstream.socket_keepalive = NGX_CONF_UNSET;
+    conf->upstream.socket_fastopen = NGX_CONF_UNSET;
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.hedge = NGX_CONF_UNSET_PTR;
 
     conf->upstream.send_lowat = NGX_CONF_UNSET_SIZE;
     conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
@@ -2908,6 +3238,7 @@ ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache = NGX_CONF_UNSET;
     conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
     conf->upstream.cache_max_range_offset = NGX_CONF_UNSET;
+    conf->upstream.cache_partial = NGX_CONF_UNSET_SIZE;
     conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
     conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
@@ -2931,6 +3262,7 @@ ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
     conf->catch_stderr = NGX_CONF_UNSET_PTR;
 
     conf->keep_conn = NGX_CONF_UNSET;
+    conf->mux.multiplex = NGX_CONF_UNSET;
 
     ngx_str_set(&conf->upstream.module, "fastcgi");
 
@@ -2993,6 +3325,9 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.socket_keepalive,
                               prev->upstream.socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->upstream.socket_fastopen,
+                              prev->upstream.socket_fastopen, 0);
+
     ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
                               prev->upstream.connect_timeout, 60000);
 
@@ -3005,6 +3340,8 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->upstream.next_upstream_timeout,
                               prev->upstream.next_upstream_timeout, 0);
 
+    ngx_conf_merge_ptr_value(conf->upstream.hedge, prev->upstream.hedge, NULL);
+
     ngx_conf_merge_size_value(conf->upstream.send_lowat,
                               prev->upstream.send_lowat, 0);
 
@@ -3161,6 +3498,9 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               prev->upstream.cache_max_range_offset,
                               NGX_MAX_OFF_T_VALUE);
 
+    ngx_conf_merge_size_value(conf->upstream.cache_partial,
+                              prev->upstream.cache_partial, 0);
+
     ngx_conf_merge_bitmask_value(conf->upstream.cache_use_stale,
                               prev->upstream.cache_use_stale,
                               (NGX_CONF_BITMASK_SET
@@ -3227,7 +3567,9 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->catch_stderr, prev->catch_stderr, NULL);
 
     ngx_conf_merge_value(conf->keep_conn, prev->keep_conn, 0);
+    ngx_conf_merge_value(conf->mux.multiplex, prev->mux.multiplex, 0);
 
+    ngx_queue_init(&conf->mux.connections);
 
     ngx_conf_merge_str_value(conf->index, prev->index, "");
 
@@ -3258,6 +3600,24 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         clcf->handler = ngx_http_fastcgi_handler;
     }
 
+    if (conf->mux.multiplex && !conf->keep_conn
+        && (conf->upstream.upstream || conf->fastcgi_lengths))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fastcgi_multiplex\" requires "
+                           "\"fastcgi_keep_conn on\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->mux.multiplex && conf->upstream.hedge
+        && (conf->upstream.upstream || conf->fastcgi_lengths))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fastcgi_next_upstream_hedge\" cannot be used "
+                           "with \"fastcgi_multiplex\"");
+        return NGX_CONF_ERROR;
+    }
+
 #if (NGX_PCRE)
     if (conf->split_regex == NULL) {
         conf->split_regex = prev->split_regex;
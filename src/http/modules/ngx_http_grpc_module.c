@@ -8,14 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
-
-
-typedef struct {
-    ngx_array_t               *flushes;
-    ngx_array_t               *lengths;
-    ngx_array_t               *values;
-    ngx_hash_t                 hash;
-} ngx_http_grpc_headers_t;
+#include <ngx_http_grpc_module.h>
 
 
 typedef struct {
@@ -25,11 +18,12 @@ typedef struct {
     ngx_array_t               *headers_source;
 
     ngx_str_t                  host;
-    ngx_uint_t                 host_set;
 
     ngx_array_t               *grpc_lengths;
     ngx_array_t               *grpc_values;
 
+    ngx_http_grpc_mux_conf_t   mux;
+
 #if (NGX_HTTP_SSL)
     ngx_uint_t                 ssl;
     ngx_uint_t                 ssl_protocols;
@@ -125,7 +119,11 @@ typedef struct {
 
     ngx_http_request_t        *request;
 
+    ngx_http_grpc_headers_t   *headers;
     ngx_str_t                  host;
+    ngx_str_t                  path;
+
+    ngx_http_grpc_mux_conf_t  *mux;
 } ngx_http_grpc_ctx_t;
 
 
@@ -142,8 +140,131 @@ typedef struct {
 } ngx_http_grpc_frame_t;
 
 
-static ngx_int_t ngx_http_grpc_eval(ngx_http_request_t *r,
-    ngx_http_grpc_ctx_t *ctx, ngx_http_grpc_loc_conf_t *glcf);
+typedef struct ngx_http_grpc_mux_s  ngx_http_grpc_mux_t;
+
+
+typedef struct {
+    ngx_connection_t           connection;
+    ngx_event_t                read;
+    ngx_event_t                write;
+
+    ngx_http_grpc_mux_t       *mux;
+    ngx_rbtree_node_t          node;
+    ngx_queue_t                queue;
+    ngx_queue_t                waiting;
+
+    ngx_chain_t               *in;
+    ngx_chain_t               *in_last;
+    size_t                     size;
+    ssize_t                    recv_window;
+
+    ngx_chain_t               *out;
+    ngx_chain_t               *out_last;
+    size_t                     preface;
+    size_t                     rest;
+    ngx_uint_t                 hlen;
+    ngx_http_grpc_frame_t      header;
+
+    unsigned                   skip:1;
+    unsigned                   fin:1;
+    unsigned                   blocked:1;
+    unsigned                   queued:1;
+    unsigned                   started:1;
+    unsigned                   in_closed:1;
+    unsigned                   out_closed:1;
+} ngx_http_grpc_stream_t;
+
+
+typedef struct {
+    ngx_http_request_t        *request;
+    ngx_http_grpc_mux_conf_t  *conf;
+    ngx_http_grpc_stream_t    *stream;
+
+    void                      *data;
+
+    ngx_event_get_peer_pt      original_get_peer;
+    ngx_event_free_peer_pt     original_free_peer;
+} ngx_http_grpc_mux_peer_data_t;
+
+
+struct ngx_http_grpc_mux_s {
+    ngx_connection_t          *connection;
+    ngx_pool_t                *pool;
+    ngx_log_t                  log;
+    ngx_queue_t                queue;
+
+    struct sockaddr           *sockaddr;
+    socklen_t                  socklen;
+    ngx_str_t                  name;
+    ngx_str_t                  schema;
+    ngx_addr_t                *local;
+
+#if (NGX_HTTP_SSL)
+    ngx_str_t                  ssl_name;
+    ngx_str_t                  ssl_host;
+    ngx_http_grpc_mux_peer_data_t  *session;
+#endif
+
+    ngx_rbtree_t               streams;
+    ngx_rbtree_node_t          sentinel;
+    ngx_queue_t                attached;
+    ngx_queue_t                waiting;
+
+    ngx_uint_t                 multiplex;
+    ngx_uint_t                 max;
+    ngx_uint_t                 used;
+    ngx_uint_t                 next_id;
+
+    size_t                     init_window;
+    size_t                     send_window;
+    size_t                     recv_window;
+
+    size_t                     buffer_size;
+    ngx_msec_t                 send_timeout;
+    ngx_msec_t                 connect_timeout;
+
+    ngx_buf_t                 *buffer;
+    ngx_chain_t               *out;
+    ngx_chain_t               *out_last;
+    ngx_chain_t               *free;
+
+    ngx_http_grpc_stream_t    *stream;
+    ngx_uint_t                 stream_id;
+    ngx_uint_t                 type;
+    ngx_uint_t                 flags;
+    size_t                     rest;
+    ngx_uint_t                 hlen;
+    ngx_http_grpc_frame_t      header;
+
+    ngx_uint_t                 plen;
+    u_char                     payload[8];
+
+    unsigned                   draining:1;
+    unsigned                   error:1;
+    unsigned                   ssl:1;
+    unsigned                   ssl_verify:1;
+};
+
+
+#define NGX_HTTP_GRPC_MUX_WINDOW   (256 * 1024)
+#define NGX_HTTP_GRPC_MUX_TIMEOUT  60000
+
+#define NGX_HTTP_GRPC_NO_ERROR     0x0
+#define NGX_HTTP_GRPC_CANCEL       0x8
+
+#define NGX_HTTP_GRPC_PREFACE_SIZE                                            \
+    (sizeof("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") - 1)
+
+#define ngx_http_grpc_frame_length(f)                                         \
+    ((size_t) (f)->length_0 << 16 | (f)->length_1 << 8 | (f)->length_2)
+
+#define ngx_http_grpc_frame_stream_id(f)                                      \
+    ((ngx_uint_t) ((f)->stream_id_0 & 0x7f) << 24 | (f)->stream_id_1 << 16    \
+     | (f)->stream_id_2 << 8 | (f)->stream_id_3)
+
+
+static ngx_int_t ngx_http_grpc_eval(ngx_http_request_t *r, ngx_str_t *host,
+    ngx_http_grpc_loc_conf_t *glcf);
 static ngx_int_t ngx_http_grpc_create_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_grpc_reinit_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_grpc_body_output_filter(void *data, ngx_chain_t *in);
@@ -190,6 +311,63 @@ static void ngx_http_grpc_abort_request(ngx_http_request_t *r);
 static void ngx_http_grpc_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
 
+static ngx_int_t ngx_http_grpc_mux_init_peer(ngx_http_request_t *r);
+static ngx_int_t ngx_http_grpc_mux_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_grpc_mux_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state);
+static ngx_http_grpc_mux_t *ngx_http_grpc_mux_connect(
+    ngx_peer_connection_t *pc, ngx_http_grpc_mux_peer_data_t *mp,
+    ngx_int_t *rc);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_grpc_mux_ssl_name(ngx_http_request_t *r,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_grpc_mux_ssl_init(ngx_http_grpc_mux_t *mux,
+    ngx_http_grpc_mux_peer_data_t *mp, ngx_str_t *name);
+static void ngx_http_grpc_mux_ssl_handshake(ngx_http_grpc_mux_t *mux);
+static void ngx_http_grpc_mux_ssl_handshake_handler(ngx_connection_t *c);
+static void ngx_http_grpc_mux_ssl_save_session(ngx_connection_t *c);
+#endif
+static ngx_int_t ngx_http_grpc_mux_attach(ngx_http_grpc_mux_t *mux,
+    ngx_http_grpc_stream_t *stream);
+static void ngx_http_grpc_mux_detach(ngx_http_grpc_stream_t *stream);
+static ngx_http_grpc_stream_t *ngx_http_grpc_mux_stream(ngx_connection_t *c);
+static ngx_http_grpc_stream_t *ngx_http_grpc_mux_lookup(
+    ngx_http_grpc_mux_t *mux, ngx_uint_t id);
+static ssize_t ngx_http_grpc_mux_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_http_grpc_mux_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_grpc_mux_queue(ngx_http_grpc_stream_t *stream,
+    ngx_buf_t *b);
+static ngx_int_t ngx_http_grpc_mux_start_frame(
+    ngx_http_grpc_stream_t *stream);
+static ngx_int_t ngx_http_grpc_mux_push(ngx_http_grpc_stream_t *stream);
+static ngx_int_t ngx_http_grpc_mux_append(ngx_http_grpc_mux_t *mux,
+    ngx_chain_t **chain, ngx_chain_t **last, u_char *p, size_t size);
+static ngx_int_t ngx_http_grpc_mux_frame(ngx_http_grpc_mux_t *mux,
+    ngx_chain_t **chain, ngx_chain_t **last, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t id, u_char *payload, size_t size);
+static ngx_int_t ngx_http_grpc_mux_deliver(ngx_http_grpc_stream_t *stream,
+    ngx_uint_t type, u_char *payload, size_t size);
+static void ngx_http_grpc_mux_set_stream_id(ngx_http_grpc_frame_t *f,
+    ngx_uint_t id);
+static ngx_int_t ngx_http_grpc_mux_write(ngx_http_grpc_mux_t *mux);
+static void ngx_http_grpc_mux_write_handler(ngx_event_t *wev);
+static void ngx_http_grpc_mux_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_grpc_mux_parse(ngx_http_grpc_mux_t *mux);
+static ngx_int_t ngx_http_grpc_mux_frame_header(ngx_http_grpc_mux_t *mux);
+static ngx_int_t ngx_http_grpc_mux_control(ngx_http_grpc_mux_t *mux);
+static ngx_int_t ngx_http_grpc_mux_control_done(ngx_http_grpc_mux_t *mux);
+static ngx_int_t ngx_http_grpc_mux_setting(ngx_http_grpc_mux_t *mux);
+static ngx_int_t ngx_http_grpc_mux_goaway(ngx_http_grpc_mux_t *mux);
+static void ngx_http_grpc_mux_drain(ngx_http_grpc_mux_t *mux);
+static void ngx_http_grpc_mux_idle(ngx_http_grpc_mux_t *mux);
+static void ngx_http_grpc_mux_close(ngx_http_grpc_mux_t *mux,
+    ngx_uint_t error);
+static u_char *ngx_http_grpc_mux_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
 static ngx_int_t ngx_http_grpc_internal_trailers_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 
@@ -197,9 +375,6 @@ static ngx_int_t ngx_http_grpc_add_variables(ngx_conf_t *cf);
 static void *ngx_http_grpc_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_grpc_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
-static ngx_int_t ngx_http_grpc_init_headers(ngx_conf_t *cf,
-    ngx_http_grpc_loc_conf_t *conf, ngx_http_grpc_headers_t *headers,
-    ngx_keyval_t *default_headers);
 
 static char *ngx_http_grpc_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -272,6 +447,13 @@ static ngx_command_t  ngx_http_grpc_commands[] = {
       offsetof(ngx_http_grpc_loc_conf_t, upstream.socket_keepalive),
       NULL },
 
+    { ngx_string("grpc_socket_fastopen"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_grpc_loc_conf_t, upstream.socket_fastopen),
+      NULL },
+
     { ngx_string("grpc_connect_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -328,6 +510,13 @@ static ngx_command_t  ngx_http_grpc_commands[] = {
       offsetof(ngx_http_grpc_loc_conf_t, upstream.next_upstream_timeout),
       NULL },
 
+    { ngx_string("grpc_multiplex"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_multiplex_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_grpc_loc_conf_t, mux.multiplex),
+      NULL },
+
     { ngx_string("grpc_set_header"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
       ngx_conf_set_keyval_slot,
@@ -498,6 +687,18 @@ static u_char  ngx_http_grpc_connection_start[] =
     "\x7f\xff\x00\x00";
 
 
+static u_char  ngx_http_grpc_mux_start[] =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"         /* connection preface */
+
+    "\x00\x00\x12\x04\x00\x00\x00\x00\x00"     /* settings frame */
+    "\x00\x01\x00\x00\x00\x00"                 /* header table size */
+    "\x00\x02\x00\x00\x00\x00"                 /* disable push */
+    "\x00\x04\x00\x04\x00\x00"                 /* initial window */
+
+    "\x00\x00\x04\x08\x00\x00\x00\x00\x00"     /* window update frame */
+    "\x7f\xff\x00\x00";
+
+
 static ngx_keyval_t  ngx_http_grpc_headers[] = {
     { ngx_string("Content-Length"), ngx_string("$content_length") },
     { ngx_string("TE"), ngx_string("$grpc_internal_trailers") },
@@ -537,29 +738,20 @@ static ngx_int_t
 ngx_http_grpc_handler(ngx_http_request_t *r)
 {
     ngx_int_t                  rc;
+    ngx_str_t                  host;
     ngx_http_upstream_t       *u;
-    ngx_http_grpc_ctx_t       *ctx;
     ngx_http_grpc_loc_conf_t  *glcf;
 
     if (ngx_http_upstream_create(r) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_grpc_ctx_t));
-    if (ctx == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-    ctx->request = r;
-
-    ngx_http_set_ctx(r, ctx, ngx_http_grpc_module);
-
     glcf = ngx_http_get_module_loc_conf(r, ngx_http_grpc_module);
 
     u = r->upstream;
 
     if (glcf->grpc_lengths == NULL) {
-        ctx->host = glcf->host;
+        host = glcf->host;
 
 #if (NGX_HTTP_SSL)
         u->ssl = (glcf->upstream.ssl != NULL);
@@ -575,15 +767,59 @@ ngx_http_grpc_handler(ngx_http_request_t *r)
 #endif
 
     } else {
-        if (ngx_http_grpc_eval(r, ctx, glcf) != NGX_OK) {
+        if (ngx_http_grpc_eval(r, &host, glcf) != NGX_OK) {
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 
-    u->output.tag = (ngx_buf_tag_t) &ngx_http_grpc_module;
+    if (ngx_http_grpc_init_upstream(r, &glcf->headers, &host, NULL)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
     u->conf = &glcf->upstream;
 
+    ngx_http_grpc_multiplex(r, &glcf->mux);
+
+    r->request_body_no_buffering = 1;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+
+ngx_int_t
+ngx_http_grpc_init_upstream(ngx_http_request_t *r,
+    ngx_http_grpc_headers_t *headers, ngx_str_t *host, ngx_str_t *path)
+{
+    ngx_http_upstream_t  *u;
+    ngx_http_grpc_ctx_t  *ctx;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_grpc_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->request = r;
+    ctx->headers = headers;
+    ctx->host = *host;
+
+    if (path) {
+        ctx->path = *path;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_grpc_module);
+
+    u = r->upstream;
+
+    u->output.tag = (ngx_buf_tag_t) &ngx_http_grpc_module;
+
     u->create_request = ngx_http_grpc_create_request;
     u->reinit_request = ngx_http_grpc_reinit_request;
     u->process_header = ngx_http_grpc_process_header;
@@ -594,20 +830,49 @@ ngx_http_grpc_handler(ngx_http_request_t *r)
     u->input_filter = ngx_http_grpc_filter;
     u->input_filter_ctx = ctx;
 
-    r->request_body_no_buffering = 1;
+    return NGX_OK;
+}
 
-    rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
 
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-        return rc;
+void
+ngx_http_grpc_multiplex(ngx_http_request_t *r, ngx_http_grpc_mux_conf_t *mcf)
+{
+    ngx_http_upstream_t  *u;
+    ngx_http_grpc_ctx_t  *ctx;
+
+    u = r->upstream;
+
+    /*
+     * the mux connection relies on edge-triggered events, and it is
+     * shared by requests, so client certificates cannot vary per request
+     */
+
+    if (mcf->multiplex == 0 || !(ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        return;
     }
 
-    return NGX_DONE;
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl
+        && u->conf->ssl_certificate
+        && u->conf->ssl_certificate->value.len
+        && (u->conf->ssl_certificate->lengths
+            || u->conf->ssl_certificate_key->lengths))
+    {
+        return;
+    }
+
+#endif
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_grpc_module);
+
+    ctx->mux = mcf;
+    u->init_peer = ngx_http_grpc_mux_init_peer;
 }
 
 
 static ngx_int_t
-ngx_http_grpc_eval(ngx_http_request_t *r, ngx_http_grpc_ctx_t *ctx,
+ngx_http_grpc_eval(ngx_http_request_t *r, ngx_str_t *host,
     ngx_http_grpc_loc_conf_t *glcf)
 {
     size_t                add;
@@ -688,15 +953,15 @@ ngx_http_grpc_eval(ngx_http_request_t *r, ngx_http_grpc_ctx_t *ctx,
     if (url.family != AF_UNIX) {
 
         if (url.no_port) {
-            ctx->host = url.host;
+            *host = url.host;
 
         } else {
-            ctx->host.len = url.host.len + 1 + url.port_text.len;
-            ctx->host.data = url.host.data;
+            host->len = url.host.len + 1 + url.port_text.len;
+            host->data = url.host.data;
         }
 
     } else {
-        ngx_str_set(&ctx->host, "localhost");
+        ngx_str_set(host, "localhost");
     }
 
     return NGX_OK;
@@ -718,16 +983,16 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
     ngx_http_upstream_t          *u;
     ngx_http_grpc_frame_t        *f;
     ngx_http_script_code_pt       code;
-    ngx_http_grpc_loc_conf_t     *glcf;
+    ngx_http_grpc_headers_t      *headers;
     ngx_http_script_engine_t      e, le;
     ngx_http_script_len_code_pt   lcode;
 
     u = r->upstream;
 
-    glcf = ngx_http_get_module_loc_conf(r, ngx_http_grpc_module);
-
     ctx = ngx_http_get_module_ctx(r, ngx_http_grpc_module);
 
+    headers = ctx->headers;
+
     len = sizeof(ngx_http_grpc_connection_start) - 1
           + sizeof(ngx_http_grpc_frame_t);             /* headers frame */
 
@@ -748,7 +1013,11 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
 
     /* :path header */
 
-    if (r->valid_unparsed_uri) {
+    if (ctx->path.len) {
+        escape = 0;
+        uri_len = ctx->path.len;
+
+    } else if (r->valid_unparsed_uri) {
         escape = 0;
         uri_len = r->unparsed_uri.len;
 
@@ -766,7 +1035,7 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
 
     /* :authority header */
 
-    if (!glcf->host_set) {
+    if (!headers->host_set) {
         len += 1 + NGX_HTTP_V2_INT_OCTETS + ctx->host.len;
 
         if (tmp_len < ctx->host.len) {
@@ -776,10 +1045,10 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
 
     /* other headers */
 
-    ngx_http_script_flush_no_cacheable_variables(r, glcf->headers.flushes);
+    ngx_http_script_flush_no_cacheable_variables(r, headers->flushes);
     ngx_memzero(&le, sizeof(ngx_http_script_engine_t));
 
-    le.ip = glcf->headers.lengths->elts;
+    le.ip = headers->lengths->elts;
     le.request = r;
     le.flushed = 1;
 
@@ -809,7 +1078,7 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
         }
     }
 
-    if (glcf->upstream.pass_request_headers) {
+    if (u->conf->pass_request_headers) {
         part = &r->headers_in.headers.part;
         header = part->elts;
 
@@ -825,7 +1094,7 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
                 i = 0;
             }
 
-            if (ngx_hash_find(&glcf->headers.hash, header[i].hash,
+            if (ngx_hash_find(&headers->hash, header[i].hash,
                               header[i].lowcase_key, header[i].key.len))
             {
                 continue;
@@ -929,7 +1198,15 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
                        "grpc header: \":scheme: http\"");
     }
 
-    if (r->valid_unparsed_uri) {
+    if (ctx->path.len) {
+        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
+        b->last = ngx_http_v2_write_value(b->last, ctx->path.data,
+                                          ctx->path.len, tmp);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "grpc header: \":path: %V\"", &ctx->path);
+
+    } else if (r->valid_unparsed_uri) {
 
         if (r->unparsed_uri.len == 1 && r->unparsed_uri.data[0] == '/') {
             *b->last++ = ngx_http_v2_indexed(NGX_HTTP_V2_PATH_ROOT_INDEX);
@@ -974,7 +1251,7 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
                        "grpc header: \":path: %V\"", &r->uri);
     }
 
-    if (!glcf->host_set) {
+    if (!headers->host_set) {
         *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_AUTHORITY_INDEX);
         b->last = ngx_http_v2_write_value(b->last, ctx->host.data,
                                           ctx->host.len, tmp);
@@ -985,11 +1262,11 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
 
     ngx_memzero(&e, sizeof(ngx_http_script_engine_t));
 
-    e.ip = glcf->headers.values->elts;
+    e.ip = headers->values->elts;
     e.request = r;
     e.flushed = 1;
 
-    le.ip = glcf->headers.lengths->elts;
+    le.ip = headers->lengths->elts;
 
     while (*(uintptr_t *) le.ip) {
 
@@ -1045,7 +1322,7 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
 #endif
     }
 
-    if (glcf->upstream.pass_request_headers) {
+    if (u->conf->pass_request_headers) {
         part = &r->headers_in.headers.part;
         header = part->elts;
 
@@ -1061,7 +1338,7 @@ ngx_http_grpc_create_request(ngx_http_request_t *r)
                 i = 0;
             }
 
-            if (ngx_hash_find(&glcf->headers.hash, header[i].hash,
+            if (ngx_hash_find(&headers->hash, header[i].hash,
                               header[i].lowcase_key, header[i].key.len))
             {
                 continue;
@@ -4279,117 +4556,2093 @@ ngx_http_grpc_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 
 
 static ngx_int_t
-ngx_http_grpc_internal_trailers_variable(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t data)
+ngx_http_grpc_mux_init_peer(ngx_http_request_t *r)
 {
-    ngx_table_elt_t  *te;
+    ngx_http_upstream_t            *u;
+    ngx_http_grpc_ctx_t            *ctx;
+    ngx_http_grpc_mux_peer_data_t  *mp;
 
-    te = r->headers_in.te;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init grpc mux peer");
 
-    if (te == NULL) {
-        v->not_found = 1;
-        return NGX_OK;
+    mp = ngx_palloc(r->pool, sizeof(ngx_http_grpc_mux_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
     }
 
-    if (ngx_strlcasestrn(te->value.data, te->value.data + te->value.len,
-                         (u_char *) "trailers", 8 - 1)
-        == NULL)
-    {
-        v->not_found = 1;
-        return NGX_OK;
-    }
+    u = r->upstream;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_grpc_module);
 
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
+    mp->request = r;
+    mp->conf = ctx->mux;
+    mp->stream = NULL;
+    mp->data = u->peer.data;
+    mp->original_get_peer = u->peer.get;
+    mp->original_free_peer = u->peer.free;
 
-    v->data = (u_char *) "trailers";
-    v->len = sizeof("trailers") - 1;
+    u->peer.data = mp;
+    u->peer.get = ngx_http_grpc_mux_get_peer;
+    u->peer.free = ngx_http_grpc_mux_free_peer;
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_grpc_add_variables(ngx_conf_t *cf)
+ngx_http_grpc_mux_get_peer(ngx_peer_connection_t *pc, void *data)
 {
-    ngx_http_variable_t  *var, *v;
+    ngx_http_grpc_mux_peer_data_t  *mp = data;
 
-    for (v = ngx_http_grpc_vars; v->name.len; v++) {
-        var = ngx_http_add_variable(cf, &v->name, v->flags);
-        if (var == NULL) {
-            return NGX_ERROR;
-        }
+    ngx_int_t                  rc;
+    ngx_queue_t               *q;
+    ngx_http_upstream_t       *u;
+    ngx_http_grpc_mux_t       *mux;
+    ngx_http_grpc_stream_t    *stream;
+    ngx_http_grpc_mux_conf_t  *mcf;
+#if (NGX_HTTP_SSL)
+    ngx_str_t                  name;
+#endif
 
-        var->get_handler = v->get_handler;
-        var->data = v->data;
-    }
+    rc = mp->original_get_peer(pc, mp->data);
 
-    return NGX_OK;
-}
+    if (rc != NGX_OK) {
 
+        /* NGX_DONE: a connection cached by keepalive is used as is */
 
-static void *
-ngx_http_grpc_create_loc_conf(ngx_conf_t *cf)
-{
-    ngx_http_grpc_loc_conf_t  *conf;
+        return rc;
+    }
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_grpc_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    stream = ngx_pcalloc(mp->request->pool, sizeof(ngx_http_grpc_stream_t));
+    if (stream == NULL) {
+        return NGX_ERROR;
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->upstream.ignore_headers = 0;
-     *     conf->upstream.next_upstream = 0;
-     *     conf->upstream.hide_headers_hash = { NULL, 0 };
-     *
-     *     conf->headers.lengths = NULL;
-     *     conf->headers.values = NULL;
-     *     conf->headers.hash = { NULL, 0 };
-     *     conf->host = { 0, NULL };
-     *     conf->host_set = 0;
-     *     conf->ssl = 0;
-     *     conf->ssl_protocols = 0;
-     *     conf->ssl_ciphers = { 0, NULL };
-     *     conf->ssl_trusted_certificate = { 0, NULL };
-     *     conf->ssl_crl = { 0, NULL };
-     */
+    u = mp->request->upstream;
+    mcf = mp->conf;
 
-    conf->upstream.local = NGX_CONF_UNSET_PTR;
-    conf->upstream.socket_keepalive = NGX_CONF_UNSET;
-    conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
-    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+#if (NGX_HTTP_SSL)
 
-    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+    /* TLS connections are only shared by requests to the same server name */
 
-    conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
-    conf->upstream.pass_headers = NGX_CONF_UNSET_PTR;
+    ngx_str_null(&name);
 
-    conf->upstream.intercept_errors = NGX_CONF_UNSET;
+    if (u->ssl && ngx_http_grpc_mux_ssl_name(mp->request, &name) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-#if (NGX_HTTP_SSL)
-    conf->upstream.ssl_session_reuse = NGX_CONF_UNSET;
-    conf->upstream.ssl_name = NGX_CONF_UNSET_PTR;
-    conf->upstream.ssl_server_name = NGX_CONF_UNSET;
-    conf->upstream.ssl_verify = NGX_CONF_UNSET;
-    conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
-    conf->upstream.ssl_certificate = NGX_CONF_UNSET_PTR;
-    conf->upstream.ssl_certificate_key = NGX_CONF_UNSET_PTR;
-    conf->upstream.ssl_passwords = NGX_CONF_UNSET_PTR;
-    conf->ssl_conf_commands = NGX_CONF_UNSET_PTR;
 #endif
 
-    /* the hardcoded values */
-    conf->upstream.cyclic_temp_file = 0;
-    conf->upstream.buffering = 0;
-    conf->upstream.ignore_client_abort = 0;
-    conf->upstream.send_lowat = 0;
+    for (q = ngx_queue_head(&mcf->connections);
+         q != ngx_queue_sentinel(&mcf->connections);
+         q = ngx_queue_next(q))
+    {
+        mux = ngx_queue_data(q, ngx_http_grpc_mux_t, queue);
+
+        if (mux->used < mux->max
+            && mux->local == pc->local
+            && ngx_cmp_sockaddr(mux->sockaddr, mux->socklen,
+                                pc->sockaddr, pc->socklen, 1)
+               == NGX_OK
+#if (NGX_HTTP_SSL)
+            && mux->ssl == u->ssl
+            && mux->ssl_name.len == name.len
+            && ngx_strncmp(mux->ssl_name.data, name.data, name.len) == 0
+#endif
+           )
+        {
+            goto found;
+        }
+    }
+
+    mux = ngx_http_grpc_mux_connect(pc, mp, &rc);
+
+    if (mux == NULL) {
+        return rc;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl && ngx_http_grpc_mux_ssl_init(mux, mp, &name) != NGX_OK) {
+        ngx_http_grpc_mux_close(mux, 1);
+        return NGX_ERROR;
+    }
+
+#endif
+
+found:
+
+    mp->stream = stream;
+
+    if (ngx_http_grpc_mux_attach(mux, stream) != NGX_OK) {
+        ngx_http_grpc_mux_detach(stream);
+        mp->stream = NULL;
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get grpc mux peer: connection %p, %ui streams",
+                   mux->connection, mux->used);
+
+    pc->connection = &stream->connection;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_grpc_mux_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_grpc_mux_peer_data_t  *mp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free grpc mux peer");
+
+    if (mp->stream) {
+        ngx_http_grpc_mux_detach(mp->stream);
+
+        mp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    mp->original_free_peer(pc, mp->data, state);
+}
+
+
+static ngx_http_grpc_mux_t *
+ngx_http_grpc_mux_connect(ngx_peer_connection_t *pc,
+    ngx_http_grpc_mux_peer_data_t *mp, ngx_int_t *rc)
+{
+    ngx_pool_t                *pool;
+    ngx_connection_t          *c;
+    ngx_http_grpc_mux_t       *mux;
+    ngx_peer_connection_t      peer;
+    ngx_http_upstream_conf_t  *conf;
+
+    *rc = NGX_ERROR;
+
+    conf = mp->request->upstream->conf;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    mux = ngx_pcalloc(pool, sizeof(ngx_http_grpc_mux_t));
+    if (mux == NULL) {
+        goto failed;
+    }
+
+    mux->sockaddr = ngx_palloc(pool, pc->socklen);
+    if (mux->sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(mux->sockaddr, pc->sockaddr, pc->socklen);
+    mux->socklen = pc->socklen;
+
+    mux->name.data = ngx_pstrdup(pool, pc->name);
+    if (mux->name.data == NULL) {
+        goto failed;
+    }
+
+    mux->name.len = pc->name->len;
+
+    mux->schema.data = ngx_pstrdup(pool, &mp->request->upstream->schema);
+    if (mux->schema.data == NULL) {
+        goto failed;
+    }
+
+    mux->schema.len = mp->request->upstream->schema.len;
+
+    mux->buffer = ngx_create_temp_buf(pool, conf->buffer_size);
+    if (mux->buffer == NULL) {
+        goto failed;
+    }
+
+    ngx_rbtree_init(&mux->streams, &mux->sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&mux->attached);
+    ngx_queue_init(&mux->waiting);
+
+    mux->pool = pool;
+    mux->local = pc->local;
+    mux->multiplex = mp->conf->multiplex;
+    mux->max = mp->conf->multiplex;
+    mux->next_id = 1;
+    mux->buffer_size = conf->buffer_size;
+    mux->send_timeout = conf->send_timeout;
+    mux->connect_timeout = conf->connect_timeout;
+
+    /* the preface below opens the connection window to the maximum */
+
+    mux->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    mux->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    mux->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+
+    if (ngx_http_grpc_mux_append(mux, &mux->out, &mux->out_last,
+                                 ngx_http_grpc_mux_start,
+                                 sizeof(ngx_http_grpc_mux_start) - 1)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    mux->log = *ngx_cycle->log;
+    mux->log.handler = ngx_http_grpc_mux_log_error;
+    mux->log.data = mux;
+    mux->log.action = NULL;
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = mux->sockaddr;
+    peer.socklen = mux->socklen;
+    peer.name = &mux->name;
+    peer.local = pc->local;
+    peer.type = pc->type;
+    peer.get = ngx_event_get_peer;
+    peer.log = pc->log;
+    peer.log_error = pc->log_error;
+
+    *rc = ngx_event_connect_peer(&peer);
+
+    if (*rc == NGX_ERROR || *rc == NGX_BUSY || *rc == NGX_DECLINED) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = peer.connection;
+
+    c->data = mux;
+    c->log = &mux->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->read->handler = ngx_http_grpc_mux_read_handler;
+    c->write->handler = ngx_http_grpc_mux_write_handler;
+
+    mux->connection = c;
+
+    if (*rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, conf->connect_timeout);
+    }
+
+    ngx_queue_insert_tail(&mp->conf->connections, &mux->queue);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "grpc mux connection %p to %V", c, &mux->name);
+
+    return mux;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_grpc_mux_ssl_name(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    if (u->conf->ssl_name) {
+        return ngx_http_complex_value(r, u->conf->ssl_name, name);
+    }
+
+    *name = u->ssl_name;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_ssl_init(ngx_http_grpc_mux_t *mux,
+    ngx_http_grpc_mux_peer_data_t *mp, ngx_str_t *name)
+{
+    ngx_str_t               ssl_name;
+    ngx_connection_t       *c;
+    ngx_http_request_t     *r;
+    ngx_http_upstream_t    *u;
+    ngx_peer_connection_t   peer;
+
+    r = mp->request;
+    u = r->upstream;
+    c = mux->connection;
+
+    /*
+     * the SSL connection lives as long as the mux; frames are already
+     * coalesced into mux buffers, hence no SSL buffering
+     */
+
+    c->pool = mux->pool;
+
+    if (ngx_ssl_create_connection(u->conf->ssl, c, NGX_SSL_CLIENT) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    mux->ssl = 1;
+    mux->ssl_verify = u->conf->ssl_verify;
+
+    mux->ssl_name.len = name->len;
+    mux->ssl_name.data = ngx_pstrdup(mux->pool, name);
+    if (mux->ssl_name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (u->conf->ssl_server_name || u->conf->ssl_verify) {
+
+        /* the request keeps its name for another connection attempt */
+
+        ssl_name = u->ssl_name;
+
+        if (ngx_http_upstream_ssl_name(r, u, c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        mux->ssl_host.len = u->ssl_name.len;
+        mux->ssl_host.data = ngx_pstrdup(mux->pool, &u->ssl_name);
+
+        u->ssl_name = ssl_name;
+
+        if (mux->ssl_host.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (u->conf->ssl_session_reuse) {
+        c->ssl->save_session = ngx_http_grpc_mux_ssl_save_session;
+
+        peer = u->peer;
+        peer.connection = c;
+
+        if (u->peer.set_session(&peer, mp->data) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        mux->session = mp;
+    }
+
+    /* the handshake starts as soon as the connection is established */
+
+    if (c->write->ready) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_grpc_mux_ssl_handshake(ngx_http_grpc_mux_t *mux)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = mux->connection;
+
+    c->log->action = "SSL handshaking to upstream";
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+
+        if (!c->write->timer_set) {
+            ngx_add_timer(c->write, mux->connect_timeout);
+        }
+
+        c->ssl->handler = ngx_http_grpc_mux_ssl_handshake_handler;
+        return;
+    }
+
+    ngx_http_grpc_mux_ssl_handshake_handler(c);
+}
+
+
+static void
+ngx_http_grpc_mux_ssl_handshake_handler(ngx_connection_t *c)
+{
+    long                  rc;
+    ngx_http_grpc_mux_t  *mux;
+
+    mux = c->data;
+
+    if (!c->ssl->handshaked) {
+
+        if (c->read->timedout || c->write->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out");
+        }
+
+        c->log->action = NULL;
+
+        ngx_http_grpc_mux_close(mux, 1);
+        return;
+    }
+
+    c->log->action = NULL;
+
+    if (mux->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_grpc_mux_close(mux, 1);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &mux->ssl_host) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &mux->ssl_host);
+            ngx_http_grpc_mux_close(mux, 1);
+            return;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "grpc mux connection %p ssl handshaked", c);
+
+    c->read->handler = ngx_http_grpc_mux_read_handler;
+    c->write->handler = ngx_http_grpc_mux_write_handler;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_http_grpc_mux_write(mux) != NGX_OK) {
+        return;
+    }
+
+    /* the server preface might have been read along with the handshake */
+
+    ngx_post_event(c->read, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_grpc_mux_ssl_save_session(ngx_connection_t *c)
+{
+    ngx_http_upstream_t            *u;
+    ngx_http_grpc_mux_t            *mux;
+    ngx_peer_connection_t           peer;
+    ngx_http_grpc_mux_peer_data_t  *mp;
+
+    mux = c->data;
+    mp = mux->session;
+
+    /*
+     * the session is saved to the balancer through the request
+     * which opened the connection, as long as it is still attached
+     */
+
+    if (mp == NULL) {
+        return;
+    }
+
+    u = mp->request->upstream;
+
+    peer = u->peer;
+    peer.connection = c;
+
+    u->peer.save_session(&peer, mp->data);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_grpc_mux_attach(ngx_http_grpc_mux_t *mux,
+    ngx_http_grpc_stream_t *stream)
+{
+    u_char             payload[6];
+    ngx_event_t       *rev, *wev;
+    ngx_connection_t  *c;
+
+    ngx_queue_insert_tail(&mux->attached, &stream->queue);
+    mux->used++;
+
+    stream->mux = mux;
+    stream->recv_window = NGX_HTTP_GRPC_MUX_WINDOW;
+
+    /*
+     * the request sees a connection of its own, where its stream
+     * is the only one; the stream id is assigned on the first frame
+     * sent, and connection level frames are handled by the mux
+     */
+
+    c = &stream->connection;
+    rev = &stream->read;
+    wev = &stream->write;
+
+    c->fd = mux->connection->fd;
+    c->read = rev;
+    c->write = wev;
+    c->recv = ngx_http_grpc_mux_recv;
+    c->send_chain = ngx_http_grpc_mux_send_chain;
+    c->log = ngx_cycle->log;
+
+#if (NGX_HTTP_SSL)
+
+    /* TLS is handled by the mux, the upstream sees it as established */
+
+    c->ssl = mux->connection->ssl;
+
+#endif
+
+    rev->data = c;
+    rev->index = NGX_INVALID_INDEX;
+    rev->log = c->log;
+    rev->active = 1;
+
+    wev->data = c;
+    wev->index = NGX_INVALID_INDEX;
+    wev->log = c->log;
+    wev->write = 1;
+    wev->active = 1;
+    wev->ready = 1;
+
+    /*
+     * the server's initial window is announced to the request, while
+     * the connection window is only limited by the mux
+     */
+
+    (void) ngx_http_v2_write_uint16(payload, 0x04);
+    (void) ngx_http_v2_write_uint32(&payload[2], mux->init_window);
+
+    if (ngx_http_grpc_mux_deliver(stream, NGX_HTTP_V2_SETTINGS_FRAME,
+                                  payload, 6)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(payload, NGX_HTTP_V2_MAX_WINDOW
+                                             - NGX_HTTP_V2_DEFAULT_WINDOW);
+
+    if (ngx_http_grpc_mux_deliver(stream, NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                  payload, 4)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    c = mux->connection;
+
+    c->idle = 0;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_grpc_mux_detach(ngx_http_grpc_stream_t *stream)
+{
+    u_char                payload[4];
+    ngx_uint_t            id;
+    ngx_connection_t     *c;
+    ngx_http_grpc_mux_t  *mux;
+
+    mux = stream->mux;
+    c = &stream->connection;
+    id = stream->node.key;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "grpc mux detach stream %ui, started:%ud closed:%ud:%ud",
+                   id, stream->started, stream->in_closed,
+                   stream->out_closed);
+
+    if (stream->read.timer_set) {
+        ngx_del_timer(&stream->read);
+    }
+
+    if (stream->write.timer_set) {
+        ngx_del_timer(&stream->write);
+    }
+
+    if (stream->read.posted) {
+        ngx_delete_posted_event(&stream->read);
+    }
+
+    if (stream->write.posted) {
+        ngx_delete_posted_event(&stream->write);
+    }
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+        c->pool = NULL;
+    }
+
+    if (stream->in) {
+        stream->in_last->next = mux->free;
+        mux->free = stream->in;
+    }
+
+    if (stream->out) {
+        stream->out_last->next = mux->free;
+        mux->free = stream->out;
+    }
+
+    if (stream->queued) {
+        ngx_queue_remove(&stream->waiting);
+    }
+
+    ngx_queue_remove(&stream->queue);
+
+    if (id) {
+        ngx_rbtree_delete(&mux->streams, &stream->node);
+    }
+
+    mux->used--;
+
+#if (NGX_HTTP_SSL)
+
+    if (mux->session && mux->session->stream == stream) {
+        mux->session = NULL;
+    }
+
+#endif
+
+    if (mux->connection == NULL) {
+
+        if (mux->used == 0) {
+            ngx_destroy_pool(mux->pool);
+        }
+
+        return;
+    }
+
+    if (mux->stream == stream) {
+        mux->stream = NULL;
+    }
+
+    if (stream->started && !(stream->in_closed && stream->out_closed)) {
+
+        /* the server is told to forget the stream */
+
+        (void) ngx_http_v2_write_uint32(payload, stream->in_closed
+                                                 ? NGX_HTTP_GRPC_NO_ERROR
+                                                 : NGX_HTTP_GRPC_CANCEL);
+
+        if (ngx_http_grpc_mux_frame(mux, &mux->out, &mux->out_last,
+                                    NGX_HTTP_V2_RST_STREAM_FRAME, 0, id,
+                                    payload, 4)
+            != NGX_OK)
+        {
+            ngx_http_grpc_mux_close(mux, 1);
+            return;
+        }
+
+        if (ngx_http_grpc_mux_write(mux) != NGX_OK) {
+            return;
+        }
+    }
+
+    ngx_http_grpc_mux_idle(mux);
+}
+
+
+static ngx_http_grpc_stream_t *
+ngx_http_grpc_mux_stream(ngx_connection_t *c)
+{
+    ngx_http_request_t             *r;
+    ngx_http_grpc_mux_peer_data_t  *mp;
+
+    r = c->data;
+    mp = r->upstream->peer.data;
+
+    return mp->stream;
+}
+
+
+static ngx_http_grpc_stream_t *
+ngx_http_grpc_mux_lookup(ngx_http_grpc_mux_t *mux, ngx_uint_t id)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = mux->streams.root;
+    sentinel = mux->streams.sentinel;
+
+    while (node != sentinel) {
+
+        if (id < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (id > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        return ngx_rbtree_data(node, ngx_http_grpc_stream_t, node);
+    }
+
+    return NULL;
+}
+
+
+static ssize_t
+ngx_http_grpc_mux_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    u_char                   payload[4];
+    size_t                   n, len;
+    ssize_t                  window;
+    ngx_buf_t               *b;
+    ngx_chain_t             *cl;
+    ngx_http_grpc_mux_t     *mux;
+    ngx_http_grpc_stream_t  *stream;
+
+    stream = ngx_http_grpc_mux_stream(c);
+    mux = stream->mux;
+
+    n = 0;
+
+    while (stream->in && n < size) {
+        cl = stream->in;
+        b = cl->buf;
+
+        len = ngx_min(size - n, (size_t) (b->last - b->pos));
+
+        ngx_memcpy(buf + n, b->pos, len);
+
+        b->pos += len;
+        n += len;
+
+        if (b->pos == b->last) {
+            stream->in = cl->next;
+            cl->next = mux->free;
+            mux->free = cl;
+        }
+    }
+
+    if (n == 0) {
+
+        if (mux->connection == NULL) {
+
+            if (mux->error) {
+                c->read->error = 1;
+                return NGX_ERROR;
+            }
+
+            c->read->eof = 1;
+            return 0;
+        }
+
+        c->read->ready = 0;
+
+        return NGX_AGAIN;
+    }
+
+    stream->size -= n;
+
+    if (stream->in == NULL) {
+        stream->in_last = NULL;
+
+        if (mux->connection) {
+            c->read->ready = 0;
+        }
+    }
+
+    if (mux->connection == NULL || !stream->started || stream->in_closed) {
+        return n;
+    }
+
+    /*
+     * the stream window is updated once half of it is consumed;
+     * buffered frame headers make the estimate conservative
+     */
+
+    window = NGX_HTTP_GRPC_MUX_WINDOW - stream->recv_window
+             - (ssize_t) stream->size;
+
+    if (window < NGX_HTTP_GRPC_MUX_WINDOW / 2) {
+        return n;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "grpc mux stream %ui window update: %z",
+                   stream->node.key, window);
+
+    (void) ngx_http_v2_write_uint32(payload, window);
+
+    stream->recv_window += window;
+
+    if (ngx_http_grpc_mux_frame(mux, &mux->out, &mux->out_last,
+                                NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0,
+                                stream->node.key, payload, 4)
+        != NGX_OK)
+    {
+        ngx_http_grpc_mux_close(mux, 1);
+        return n;
+    }
+
+    (void) ngx_http_grpc_mux_write(mux);
+
+    return n;
+}
+
+
+static ngx_chain_t *
+ngx_http_grpc_mux_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    size_t                   size;
+    ngx_buf_t               *b;
+    ngx_int_t                rc;
+    ngx_http_grpc_mux_t     *mux;
+    ngx_http_grpc_stream_t  *stream;
+
+    stream = ngx_http_grpc_mux_stream(c);
+    mux = stream->mux;
+
+    if (mux->connection == NULL) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (stream->queued) {
+        c->write->ready = 0;
+        return in;
+    }
+
+    if (mux->out) {
+
+        /* wait for the frames of other streams to be sent */
+
+        goto wait;
+    }
+
+    /* sendfile is disabled, so all buffers are in memory */
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        size = b->last - b->pos;
+
+        rc = ngx_http_grpc_mux_queue(stream, b);
+
+        c->sent += size - (b->last - b->pos);
+
+        if (rc == NGX_ERROR) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+
+            /*
+             * the frame waits for the connection window to be updated,
+             * and will be sent by the mux
+             */
+
+            if (b->pos == b->last) {
+                in = in->next;
+            }
+
+            break;
+        }
+    }
+
+    if (ngx_http_grpc_mux_write(mux) != NGX_OK) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (!stream->blocked) {
+        return in;
+    }
+
+wait:
+
+    ngx_queue_insert_tail(&mux->waiting, &stream->waiting);
+    stream->queued = 1;
+
+    c->write->ready = 0;
+
+    return in;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_queue(ngx_http_grpc_stream_t *stream, ngx_buf_t *b)
+{
+    size_t                n;
+    ngx_uint_t            type;
+    ngx_http_grpc_mux_t  *mux;
+
+    mux = stream->mux;
+
+    while (b->pos < b->last) {
+
+        if (stream->preface < NGX_HTTP_GRPC_PREFACE_SIZE) {
+
+            /* the connection preface was sent by the mux */
+
+            n = ngx_min(NGX_HTTP_GRPC_PREFACE_SIZE - stream->preface,
+                        (size_t) (b->last - b->pos));
+
+            stream->preface += n;
+            b->pos += n;
+
+            continue;
+        }
+
+        if (stream->hlen < sizeof(ngx_http_grpc_frame_t)) {
+            n = ngx_min(sizeof(ngx_http_grpc_frame_t) - stream->hlen,
+                        (size_t) (b->last - b->pos));
+
+            ngx_memcpy((u_char *) &stream->header + stream->hlen, b->pos, n);
+
+            stream->hlen += n;
+            b->pos += n;
+
+            if (stream->hlen < sizeof(ngx_http_grpc_frame_t)) {
+                break;
+            }
+
+            stream->rest = ngx_http_grpc_frame_length(&stream->header);
+
+            /*
+             * connection level frames and flow control of responses
+             * are handled by the mux
+             */
+
+            stream->skip = (ngx_http_grpc_frame_stream_id(&stream->header)
+                            == 0
+                            || stream->header.type
+                               == NGX_HTTP_V2_WINDOW_UPDATE_FRAME);
+
+            if (!stream->skip
+                && ngx_http_grpc_mux_start_frame(stream) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+        } else {
+            n = ngx_min(stream->rest, (size_t) (b->last - b->pos));
+
+            if (!stream->skip
+                && ngx_http_grpc_mux_append(mux, &stream->out,
+                                            &stream->out_last, b->pos, n)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            stream->rest -= n;
+            b->pos += n;
+        }
+
+        if (stream->rest) {
+            continue;
+        }
+
+        /* the frame is complete */
+
+        stream->hlen = 0;
+
+        if (stream->skip) {
+            continue;
+        }
+
+        type = stream->header.type;
+
+        if ((type == NGX_HTTP_V2_HEADERS_FRAME
+             || type == NGX_HTTP_V2_CONTINUATION_FRAME)
+            && !(stream->header.flags & NGX_HTTP_V2_END_HEADERS_FLAG))
+        {
+            /* a header block is not interleaved with other frames */
+            continue;
+        }
+
+        if (ngx_http_grpc_mux_push(stream) == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_start_frame(ngx_http_grpc_stream_t *stream)
+{
+    ngx_uint_t            type;
+    ngx_http_grpc_mux_t  *mux;
+
+    mux = stream->mux;
+
+    if (stream->node.key == 0) {
+
+        if (mux->draining) {
+            ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                          "upstream http2 connection is closing");
+            return NGX_ERROR;
+        }
+
+        /*
+         * the request header block is passed at once,
+         * so stream ids are sent in order
+         */
+
+        stream->node.key = mux->next_id;
+        ngx_rbtree_insert(&mux->streams, &stream->node);
+
+        mux->next_id += 2;
+
+        if (mux->next_id > 0x7fffffff) {
+            ngx_http_grpc_mux_drain(mux);
+        }
+    }
+
+    ngx_http_grpc_mux_set_stream_id(&stream->header, stream->node.key);
+
+    type = stream->header.type;
+
+    if ((type == NGX_HTTP_V2_HEADERS_FRAME || type == NGX_HTTP_V2_DATA_FRAME)
+        && (stream->header.flags & NGX_HTTP_V2_END_STREAM_FLAG))
+    {
+        stream->fin = 1;
+    }
+
+    return ngx_http_grpc_mux_append(mux, &stream->out, &stream->out_last,
+                                    (u_char *) &stream->header,
+                                    sizeof(ngx_http_grpc_frame_t));
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_push(ngx_http_grpc_stream_t *stream)
+{
+    size_t                len;
+    ngx_http_grpc_mux_t  *mux;
+
+    mux = stream->mux;
+
+    if (stream->header.type == NGX_HTTP_V2_DATA_FRAME) {
+        len = ngx_http_grpc_frame_length(&stream->header);
+
+        if (len > mux->send_window) {
+            stream->blocked = 1;
+            return NGX_AGAIN;
+        }
+
+        mux->send_window -= len;
+    }
+
+    stream->blocked = 0;
+    stream->started = 1;
+
+    if (stream->fin) {
+        stream->out_closed = 1;
+    }
+
+    if (mux->out) {
+        mux->out_last->next = stream->out;
+
+    } else {
+        mux->out = stream->out;
+    }
+
+    mux->out_last = stream->out_last;
+
+    stream->out = NULL;
+    stream->out_last = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_append(ngx_http_grpc_mux_t *mux, ngx_chain_t **chain,
+    ngx_chain_t **last, u_char *p, size_t size)
+{
+    size_t        n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    while (size) {
+
+        cl = *last;
+
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+
+            cl = mux->free;
+
+            if (cl) {
+                mux->free = cl->next;
+
+                b = cl->buf;
+                b->pos = b->start;
+                b->last = b->start;
+
+            } else {
+                cl = ngx_alloc_chain_link(mux->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = ngx_create_temp_buf(mux->pool, mux->buffer_size);
+                if (cl->buf == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            cl->next = NULL;
+
+            if (*last) {
+                (*last)->next = cl;
+
+            } else {
+                *chain = cl;
+            }
+
+            *last = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min((size_t) (b->end - b->last), size);
+
+        b->last = ngx_cpymem(b->last, p, n);
+
+        p += n;
+        size -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_frame(ngx_http_grpc_mux_t *mux, ngx_chain_t **chain,
+    ngx_chain_t **last, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t id,
+    u_char *payload, size_t size)
+{
+    ngx_http_grpc_frame_t  f;
+
+    f.length_0 = (u_char) (size >> 16);
+    f.length_1 = (u_char) (size >> 8);
+    f.length_2 = (u_char) size;
+    f.type = (u_char) type;
+    f.flags = (u_char) flags;
+
+    ngx_http_grpc_mux_set_stream_id(&f, id);
+
+    if (ngx_http_grpc_mux_append(mux, chain, last, (u_char *) &f,
+                                 sizeof(ngx_http_grpc_frame_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_grpc_mux_append(mux, chain, last, payload, size);
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_deliver(ngx_http_grpc_stream_t *stream, ngx_uint_t type,
+    u_char *payload, size_t size)
+{
+    if (ngx_http_grpc_mux_frame(stream->mux, &stream->in, &stream->in_last,
+                                type, 0, 0, payload, size)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    stream->size += sizeof(ngx_http_grpc_frame_t) + size;
+
+    stream->read.ready = 1;
+    ngx_post_event(&stream->read, &ngx_posted_events);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_grpc_mux_set_stream_id(ngx_http_grpc_frame_t *f, ngx_uint_t id)
+{
+    f->stream_id_0 = (u_char) ((id >> 24) & 0x7f);
+    f->stream_id_1 = (u_char) (id >> 16);
+    f->stream_id_2 = (u_char) (id >> 8);
+    f->stream_id_3 = (u_char) id;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_write(ngx_http_grpc_mux_t *mux)
+{
+    ngx_uint_t               pushed;
+    ngx_queue_t             *q, *next;
+    ngx_chain_t             *cl, *out;
+    ngx_connection_t        *c;
+    ngx_http_grpc_stream_t  *stream;
+
+    c = mux->connection;
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl && !c->ssl->handshaked) {
+        return NGX_OK;
+    }
+
+#endif
+
+    do {
+        if (mux->out && c->write->ready) {
+
+            c->log->action = "sending to upstream";
+
+            out = c->send_chain(c, mux->out, 0);
+
+            c->log->action = NULL;
+
+            if (out == NGX_CHAIN_ERROR) {
+                ngx_http_grpc_mux_close(mux, 1);
+                return NGX_ERROR;
+            }
+
+            while (mux->out != out) {
+                cl = mux->out;
+                mux->out = cl->next;
+
+                cl->next = mux->free;
+                mux->free = cl;
+            }
+
+            if (out == NULL) {
+                mux->out_last = NULL;
+            }
+        }
+
+        if (mux->out) {
+
+            if (!c->write->timer_set) {
+                ngx_add_timer(c->write, mux->send_timeout);
+            }
+
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_http_grpc_mux_close(mux, 1);
+                return NGX_ERROR;
+            }
+
+            return NGX_OK;
+        }
+
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+
+        /*
+         * waiting streams are resumed in order; DATA frames held
+         * for the connection window are sent once they fit into it
+         */
+
+        pushed = 0;
+
+        for (q = ngx_queue_head(&mux->waiting);
+             q != ngx_queue_sentinel(&mux->waiting);
+             q = next)
+        {
+            next = ngx_queue_next(q);
+
+            stream = ngx_queue_data(q, ngx_http_grpc_stream_t, waiting);
+
+            if (stream->blocked) {
+
+                if (ngx_http_grpc_mux_push(stream) == NGX_AGAIN) {
+                    continue;
+                }
+
+                pushed = 1;
+            }
+
+            ngx_queue_remove(q);
+            stream->queued = 0;
+
+            stream->write.ready = 1;
+            ngx_post_event(&stream->write, &ngx_posted_events);
+        }
+
+    } while (pushed);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_grpc_mux_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t     *c;
+    ngx_http_grpc_mux_t  *mux;
+
+    c = wev->data;
+    mux = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_grpc_mux_close(mux, 1);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl && !c->ssl->handshaked) {
+        ngx_http_grpc_mux_ssl_handshake(mux);
+        return;
+    }
+
+#endif
+
+    (void) ngx_http_grpc_mux_write(mux);
+}
+
+
+static void
+ngx_http_grpc_mux_read_handler(ngx_event_t *rev)
+{
+    ssize_t               n;
+    ngx_buf_t            *b;
+    ngx_connection_t     *c;
+    ngx_http_grpc_mux_t  *mux;
+
+    c = rev->data;
+    mux = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "grpc mux read handler, %ui streams", mux->used);
+
+    if (c->close || rev->timedout) {
+        ngx_http_grpc_mux_close(mux, 0);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl && !c->ssl->handshaked) {
+        return;
+    }
+
+#endif
+
+    b = mux->buffer;
+
+    for ( ;; ) {
+
+        b->pos = b->start;
+        b->last = b->start;
+
+        c->log->action = "reading from upstream";
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        c->log->action = NULL;
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_http_grpc_mux_close(mux, n == NGX_ERROR);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_grpc_mux_parse(mux) != NGX_OK) {
+            ngx_http_grpc_mux_close(mux, 1);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_grpc_mux_close(mux, 1);
+        return;
+    }
+
+    if (ngx_http_grpc_mux_write(mux) != NGX_OK) {
+        return;
+    }
+
+    ngx_http_grpc_mux_idle(mux);
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_parse(ngx_http_grpc_mux_t *mux)
+{
+    size_t                   n;
+    ngx_buf_t               *b;
+    ngx_http_grpc_stream_t  *stream;
+
+    b = mux->buffer;
+
+    while (b->pos < b->last) {
+
+        if (mux->hlen < sizeof(ngx_http_grpc_frame_t)) {
+            n = ngx_min(sizeof(ngx_http_grpc_frame_t) - mux->hlen,
+                        (size_t) (b->last - b->pos));
+
+            ngx_memcpy((u_char *) &mux->header + mux->hlen, b->pos, n);
+
+            mux->hlen += n;
+            b->pos += n;
+
+            if (mux->hlen < sizeof(ngx_http_grpc_frame_t)) {
+                break;
+            }
+
+            if (ngx_http_grpc_mux_frame_header(mux) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else if (mux->stream_id == 0) {
+
+            if (ngx_http_grpc_mux_control(mux) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            n = ngx_min(mux->rest, (size_t) (b->last - b->pos));
+
+            stream = mux->stream;
+
+            if (stream) {
+                if (ngx_http_grpc_mux_append(mux, &stream->in,
+                                             &stream->in_last, b->pos, n)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                stream->size += n;
+            }
+
+            mux->rest -= n;
+            b->pos += n;
+        }
+
+        stream = mux->stream;
+
+        if (mux->rest == 0) {
+
+            /* the frame is complete */
+
+            if (mux->stream_id == 0
+                && ngx_http_grpc_mux_control_done(mux) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            mux->hlen = 0;
+            mux->stream = NULL;
+        }
+
+        if (stream) {
+            stream->read.ready = 1;
+            ngx_post_event(&stream->read, &ngx_posted_events);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_frame_header(ngx_http_grpc_mux_t *mux)
+{
+    u_char                   payload[4];
+    ngx_log_t               *log;
+    ngx_uint_t               type;
+    ngx_http_grpc_frame_t    h;
+    ngx_http_grpc_stream_t  *stream;
+
+    log = mux->connection->log;
+
+    type = mux->header.type;
+
+    mux->type = type;
+    mux->flags = mux->header.flags;
+    mux->rest = ngx_http_grpc_frame_length(&mux->header);
+    mux->stream_id = ngx_http_grpc_frame_stream_id(&mux->header);
+    mux->plen = 0;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "grpc mux frame type:%ui f:%Xi l:%uz sid:%ui",
+                   type, mux->flags, mux->rest, mux->stream_id);
+
+    if (mux->rest > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "upstream sent frame with too long length: %uz",
+                      mux->rest);
+        return NGX_ERROR;
+    }
+
+    if (mux->stream_id == 0) {
+
+        if ((type == NGX_HTTP_V2_SETTINGS_FRAME
+             && ((mux->flags & NGX_HTTP_V2_ACK_FLAG) ? mux->rest != 0
+                                                     : mux->rest % 6 != 0))
+            || (type == NGX_HTTP_V2_PING_FRAME && mux->rest != 8)
+            || (type == NGX_HTTP_V2_WINDOW_UPDATE_FRAME && mux->rest != 4)
+            || (type == NGX_HTTP_V2_GOAWAY_FRAME && mux->rest < 8))
+        {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "upstream sent frame type %ui "
+                          "with invalid length: %uz", type, mux->rest);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (type == NGX_HTTP_V2_DATA_FRAME) {
+
+        if (mux->rest > mux->recv_window) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "upstream violated connection flow control, "
+                          "received data frame with length %uz, "
+                          "available window %uz",
+                          mux->rest, mux->recv_window);
+            return NGX_ERROR;
+        }
+
+        mux->recv_window -= mux->rest;
+
+        if (mux->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+
+            (void) ngx_http_v2_write_uint32(payload, NGX_HTTP_V2_MAX_WINDOW
+                                                     - mux->recv_window);
+
+            if (ngx_http_grpc_mux_frame(mux, &mux->out, &mux->out_last,
+                                        NGX_HTTP_V2_WINDOW_UPDATE_FRAME, 0, 0,
+                                        payload, 4)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            mux->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+        }
+    }
+
+    stream = ngx_http_grpc_mux_lookup(mux, mux->stream_id);
+
+    if (stream == NULL) {
+
+        /* frames of reset streams are ignored */
+
+        return NGX_OK;
+    }
+
+    if (type == NGX_HTTP_V2_DATA_FRAME) {
+
+        if ((ssize_t) mux->rest > stream->recv_window) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "upstream violated stream flow control, "
+                          "received data frame with length %uz, "
+                          "available window %z",
+                          mux->rest, stream->recv_window);
+            return NGX_ERROR;
+        }
+
+        stream->recv_window -= mux->rest;
+    }
+
+    if (type == NGX_HTTP_V2_RST_STREAM_FRAME
+        || ((type == NGX_HTTP_V2_HEADERS_FRAME
+             || type == NGX_HTTP_V2_DATA_FRAME)
+            && (mux->flags & NGX_HTTP_V2_END_STREAM_FLAG)))
+    {
+        stream->in_closed = 1;
+    }
+
+    /* the request expects the stream id 1 */
+
+    h = mux->header;
+    ngx_http_grpc_mux_set_stream_id(&h, 1);
+
+    if (ngx_http_grpc_mux_append(mux, &stream->in, &stream->in_last,
+                                 (u_char *) &h, sizeof(ngx_http_grpc_frame_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    stream->size += sizeof(ngx_http_grpc_frame_t);
+
+    mux->stream = stream;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_control(ngx_http_grpc_mux_t *mux)
+{
+    size_t      n, unit;
+    ngx_buf_t  *b;
+
+    b = mux->buffer;
+
+    switch (mux->type) {
+
+    case NGX_HTTP_V2_SETTINGS_FRAME:
+        unit = 6;
+        break;
+
+    case NGX_HTTP_V2_PING_FRAME:
+    case NGX_HTTP_V2_GOAWAY_FRAME:
+        unit = 8;
+        break;
+
+    case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+        unit = 4;
+        break;
+
+    default:
+        unit = 0;
+    }
+
+    n = ngx_min(mux->rest, (size_t) (b->last - b->pos));
+
+    if (mux->plen < unit) {
+        n = ngx_min(n, unit - mux->plen);
+
+        ngx_memcpy(&mux->payload[mux->plen], b->pos, n);
+        mux->plen += n;
+    }
+
+    mux->rest -= n;
+    b->pos += n;
+
+    if (mux->type == NGX_HTTP_V2_SETTINGS_FRAME && mux->plen == unit) {
+        mux->plen = 0;
+        return ngx_http_grpc_mux_setting(mux);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_control_done(ngx_http_grpc_mux_t *mux)
+{
+    size_t  window;
+
+    switch (mux->type) {
+
+    case NGX_HTTP_V2_SETTINGS_FRAME:
+
+        if (mux->flags & NGX_HTTP_V2_ACK_FLAG) {
+            return NGX_OK;
+        }
+
+        return ngx_http_grpc_mux_frame(mux, &mux->out, &mux->out_last,
+                                       NGX_HTTP_V2_SETTINGS_FRAME,
+                                       NGX_HTTP_V2_ACK_FLAG, 0, NULL, 0);
+
+    case NGX_HTTP_V2_PING_FRAME:
+
+        if (mux->flags & NGX_HTTP_V2_ACK_FLAG) {
+            return NGX_OK;
+        }
+
+        return ngx_http_grpc_mux_frame(mux, &mux->out, &mux->out_last,
+                                       NGX_HTTP_V2_PING_FRAME,
+                                       NGX_HTTP_V2_ACK_FLAG, 0,
+                                       mux->payload, 8);
+
+    case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+        window = ngx_http_v2_parse_window(mux->payload);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                       "grpc mux window update: %uz", window);
+
+        if (window > NGX_HTTP_V2_MAX_WINDOW - mux->send_window) {
+            ngx_log_error(NGX_LOG_ERR, mux->connection->log, 0,
+                          "upstream sent too large window update");
+            return NGX_ERROR;
+        }
+
+        /* blocked streams are resumed by ngx_http_grpc_mux_write() */
+
+        mux->send_window += window;
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_GOAWAY_FRAME:
+        return ngx_http_grpc_mux_goaway(mux);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_setting(ngx_http_grpc_mux_t *mux)
+{
+    ngx_uint_t               id, value;
+    ngx_queue_t             *q;
+    ngx_http_grpc_stream_t  *stream;
+
+    id = ngx_http_v2_parse_uint16(mux->payload);
+    value = ngx_http_v2_parse_uint32(&mux->payload[2]);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                   "grpc mux setting: %ui %ui", id, value);
+
+    switch (id) {
+
+    case 0x03:
+        /* SETTINGS_MAX_CONCURRENT_STREAMS */
+
+        mux->max = ngx_min(value, mux->multiplex);
+        break;
+
+    case 0x04:
+        /* SETTINGS_INITIAL_WINDOW_SIZE */
+
+        if (value > NGX_HTTP_V2_MAX_WINDOW) {
+            ngx_log_error(NGX_LOG_ERR, mux->connection->log, 0,
+                          "upstream sent settings frame "
+                          "with too large initial window size: %ui",
+                          value);
+            return NGX_ERROR;
+        }
+
+        mux->init_window = value;
+
+        /* the requests track their stream windows themselves */
+
+        for (q = ngx_queue_head(&mux->attached);
+             q != ngx_queue_sentinel(&mux->attached);
+             q = ngx_queue_next(q))
+        {
+            stream = ngx_queue_data(q, ngx_http_grpc_stream_t, queue);
+
+            if (stream->in_closed) {
+                continue;
+            }
+
+            if (ngx_http_grpc_mux_deliver(stream, NGX_HTTP_V2_SETTINGS_FRAME,
+                                          mux->payload, 6)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_mux_goaway(ngx_http_grpc_mux_t *mux)
+{
+    u_char                   payload[8];
+    ngx_uint_t               last, error;
+    ngx_queue_t             *q;
+    ngx_http_grpc_stream_t  *stream;
+
+    last = ngx_http_v2_parse_sid(mux->payload);
+    error = ngx_http_v2_parse_uint32(&mux->payload[4]);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                   "grpc mux goaway: %ui, error: %ui", last, error);
+
+    ngx_http_grpc_mux_drain(mux);
+
+    /*
+     * streams not processed by the server see the goaway
+     * as if it was sent before they were started
+     */
+
+    (void) ngx_http_v2_write_uint32(payload, 0);
+    (void) ngx_http_v2_write_uint32(&payload[4], error);
+
+    for (q = ngx_queue_head(&mux->attached);
+         q != ngx_queue_sentinel(&mux->attached);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_http_grpc_stream_t, queue);
+
+        if (stream->in_closed
+            || (stream->node.key && stream->node.key <= last))
+        {
+            continue;
+        }
+
+        stream->in_closed = 1;
+        stream->out_closed = 1;
+
+        if (ngx_http_grpc_mux_deliver(stream, NGX_HTTP_V2_GOAWAY_FRAME,
+                                      payload, 8)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_grpc_mux_drain(ngx_http_grpc_mux_t *mux)
+{
+    if (mux->draining) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                   "grpc mux connection %p is draining", mux->connection);
+
+    /* new requests use other connections */
+
+    mux->draining = 1;
+    ngx_queue_remove(&mux->queue);
+}
+
+
+static void
+ngx_http_grpc_mux_idle(ngx_http_grpc_mux_t *mux)
+{
+    ngx_connection_t  *c;
+
+    if (mux->used) {
+        return;
+    }
+
+    c = mux->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "grpc mux connection %p is idle", c);
+
+    if (mux->draining || ngx_terminate || ngx_exiting) {
+        ngx_http_grpc_mux_close(mux, 0);
+        return;
+    }
+
+    c->idle = 1;
+
+    ngx_add_timer(c->read, NGX_HTTP_GRPC_MUX_TIMEOUT);
+}
+
+
+static void
+ngx_http_grpc_mux_close(ngx_http_grpc_mux_t *mux, ngx_uint_t error)
+{
+    ngx_queue_t             *q;
+    ngx_http_grpc_stream_t  *stream;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                   "close grpc mux connection %p, error:%ui",
+                   mux->connection, error);
+
+    ngx_http_grpc_mux_drain(mux);
+
+#if (NGX_HTTP_SSL)
+
+    if (mux->connection->ssl) {
+        mux->connection->ssl->no_wait_shutdown = 1;
+        mux->connection->ssl->no_send_shutdown = error;
+
+        (void) ngx_ssl_shutdown(mux->connection);
+    }
+
+#endif
+
+    ngx_close_connection(mux->connection);
+
+    mux->connection = NULL;
+    mux->error = error;
+
+    /* the requests will see the end of the connection */
+
+    for (q = ngx_queue_head(&mux->attached);
+         q != ngx_queue_sentinel(&mux->attached);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_http_grpc_stream_t, queue);
+
+        stream->connection.fd = (ngx_socket_t) -1;
+
+        stream->read.ready = 1;
+        ngx_post_event(&stream->read, &ngx_posted_events);
+
+        if (stream->queued) {
+            stream->queued = 0;
+
+            stream->write.ready = 1;
+            ngx_post_event(&stream->write, &ngx_posted_events);
+        }
+    }
+
+    ngx_queue_init(&mux->waiting);
+
+    if (mux->used == 0) {
+        ngx_destroy_pool(mux->pool);
+    }
+}
+
+
+static u_char *
+ngx_http_grpc_mux_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char               *p;
+    ngx_http_grpc_mux_t  *mux;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    mux = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: %V%V", &mux->schema, &mux->name);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_internal_trailers_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_table_elt_t  *te;
+
+    te = r->headers_in.te;
+
+    if (te == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if (ngx_strlcasestrn(te->value.data, te->value.data + te->value.len,
+                         (u_char *) "trailers", 8 - 1)
+        == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    v->data = (u_char *) "trailers";
+    v->len = sizeof("trailers") - 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_grpc_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_grpc_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_grpc_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_grpc_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_grpc_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream.ignore_headers = 0;
+     *     conf->upstream.next_upstream = 0;
+     *     conf->upstream.hide_headers_hash = { NULL, 0 };
+     *
+     *     conf->headers.lengths = NULL;
+     *     conf->headers.values = NULL;
+     *     conf->headers.hash = { NULL, 0 };
+     *     conf->headers.host_set = 0;
+     *     conf->host = { 0, NULL };
+     *     conf->ssl = 0;
+     *     conf->ssl_protocols = 0;
+     *     conf->ssl_ciphers = { 0, NULL };
+     *     conf->ssl_trusted_certificate = { 0, NULL };
+     *     conf->ssl_crl = { 0, NULL };
+     */
+
+    conf->upstream.local = NGX_CONF_UNSET_PTR;
+    conf->upstream.socket_keepalive = NGX_CONF_UNSET;
+    conf->upstream.socket_fastopen = NGX_CONF_UNSET;
+    conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
+    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+
+    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+
+    conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
+    conf->upstream.pass_headers = NGX_CONF_UNSET_PTR;
+
+    conf->upstream.intercept_errors = NGX_CONF_UNSET;
+
+#if (NGX_HTTP_SSL)
+    conf->upstream.ssl_session_reuse = NGX_CONF_UNSET;
+    conf->upstream.ssl_name = NGX_CONF_UNSET_PTR;
+    conf->upstream.ssl_server_name = NGX_CONF_UNSET;
+    conf->upstream.ssl_verify = NGX_CONF_UNSET;
+    conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
+    conf->upstream.ssl_certificate = NGX_CONF_UNSET_PTR;
+    conf->upstream.ssl_certificate_key = NGX_CONF_UNSET_PTR;
+    conf->upstream.ssl_passwords = NGX_CONF_UNSET_PTR;
+    conf->ssl_conf_commands = NGX_CONF_UNSET_PTR;
+#endif
+
+    /* the hardcoded values */
+    conf->upstream.cyclic_temp_file = 0;
+    conf->upstream.buffering = 0;
+    conf->upstream.ignore_client_abort = 0;
+    conf->upstream.send_lowat = 0;
     conf->upstream.bufs.num = 0;
     conf->upstream.busy_buffers_size = 0;
     conf->upstream.max_temp_file_size = 0;
@@ -4402,6 +6655,8 @@ ngx_http_grpc_create_loc_conf(ngx_conf_t *cf)
 
     conf->headers_source = NGX_CONF_UNSET_PTR;
 
+    conf->mux.multiplex = NGX_CONF_UNSET;
+
     ngx_str_set(&conf->upstream.module, "grpc");
 
     return conf;
@@ -4424,6 +6679,9 @@ ngx_http_grpc_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.socket_keepalive,
                               prev->upstream.socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->upstream.socket_fastopen,
+                              prev->upstream.socket_fastopen, 0);
+
     ngx_conf_merge_uint_value(conf->upstream.next_upstream_tries,
                               prev->upstream.next_upstream_tries, 0);
 
@@ -4461,6 +6719,10 @@ ngx_http_grpc_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.intercept_errors,
                               prev->upstream.intercept_errors, 0);
 
+    ngx_conf_merge_value(conf->mux.multiplex, prev->mux.multiplex, 0);
+
+    ngx_queue_init(&conf->mux.connections);
+
 #if (NGX_HTTP_SSL)
 
     ngx_conf_merge_value(conf->upstream.ssl_session_reuse,
@@ -4538,10 +6800,9 @@ ngx_http_grpc_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     if (conf->headers_source == prev->headers_source) {
         conf->headers = prev->headers;
-        conf->host_set = prev->host_set;
     }
 
-    rc = ngx_http_grpc_init_headers(cf, conf, &conf->headers,
+    rc = ngx_http_grpc_init_headers(cf, conf->headers_source, &conf->headers,
                                     ngx_http_grpc_headers);
     if (rc != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -4556,15 +6817,14 @@ ngx_http_grpc_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         && conf->headers_source == prev->headers_source)
     {
         prev->headers = conf->headers;
-        prev->host_set = conf->host_set;
     }
 
     return NGX_CONF_OK;
 }
 
 
-static ngx_int_t
-ngx_http_grpc_init_headers(ngx_conf_t *cf, ngx_http_grpc_loc_conf_t *conf,
+ngx_int_t
+ngx_http_grpc_init_headers(ngx_conf_t *cf, ngx_array_t *headers_source,
     ngx_http_grpc_headers_t *headers, ngx_keyval_t *default_headers)
 {
     u_char                       *p;
@@ -4604,15 +6864,15 @@ ngx_http_grpc_init_headers(ngx_conf_t *cf, ngx_http_grpc_loc_conf_t *conf,
         return NGX_ERROR;
     }
 
-    if (conf->headers_source) {
+    if (headers_source) {
 
-        src = conf->headers_source->elts;
-        for (i = 0; i < conf->headers_source->nelts; i++) {
+        src = headers_source->elts;
+        for (i = 0; i < headers_source->nelts; i++) {
 
             if (src[i].key.len == 4
                 && ngx_strncasecmp(src[i].key.data, (u_char *) "Host", 4) == 0)
             {
-                conf->host_set = 1;
+                headers->host_set = 1;
             }
 
             s = ngx_array_push(&headers_merged);
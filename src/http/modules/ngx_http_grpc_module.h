@@ -0,0 +1,43 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_GRPC_H_INCLUDED_
+#define _NGX_HTTP_GRPC_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_array_t               *flushes;
+    ngx_array_t               *lengths;
+    ngx_array_t               *values;
+    ngx_hash_t                 hash;
+    ngx_uint_t                 host_set;
+} ngx_http_grpc_headers_t;
+
+
+typedef struct {
+    ngx_int_t                  multiplex;
+    ngx_queue_t                connections;
+} ngx_http_grpc_mux_conf_t;
+
+
+ngx_int_t ngx_http_grpc_init_upstream(ngx_http_request_t *r,
+    ngx_http_grpc_headers_t *headers, ngx_str_t *host, ngx_str_t *path);
+ngx_int_t ngx_http_grpc_init_headers(ngx_conf_t *cf,
+    ngx_array_t *headers_source, ngx_http_grpc_headers_t *headers,
+    ngx_keyval_t *default_headers);
+void ngx_http_grpc_multiplex(ngx_http_request_t *r,
+    ngx_http_grpc_mux_conf_t *mcf);
+
+
+extern ngx_module_t  ngx_http_grpc_module;
+
+
+#endif /* _NGX_HTTP_GRPC_H_INCLUDED_ */
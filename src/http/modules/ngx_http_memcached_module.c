@@ -11,9 +11,11 @@
 
 
 typedef struct {
-    ngx_http_upstream_conf_t   upstream;
-    ngx_int_t                  index;
-    ngx_uint_t                 gzip_flag;
+    ngx_http_upstream_conf_t       upstream;
+    ngx_int_t                      index;
+    ngx_uint_t                     gzip_flag;
+    ngx_uint_t                     protocol;
+    ngx_http_upstream_mux_conf_t   mux;
 } ngx_http_memcached_loc_conf_t;
 
 
@@ -21,18 +23,87 @@ typedef struct {
     size_t                     rest;
     ngx_http_request_t        *request;
     ngx_str_t                  key;
+    ngx_str_t                  end;
 } ngx_http_memcached_ctx_t;
 
 
+typedef struct {
+    u_char                     magic;
+    u_char                     opcode;
+    u_char                     key_length[2];
+    u_char                     extras_length;
+    u_char                     data_type;
+    u_char                     status[2];      /* vbucket id in requests */
+    u_char                     body_length[4];
+    u_char                     opaque[4];
+    u_char                     cas[8];
+} ngx_http_memcached_binary_header_t;
+
+
+typedef struct {
+    ngx_http_upstream_mux_t          mux;
+
+    ngx_uint_t                       protocol;
+
+    /* ids of the requests sent, in the order the responses will come */
+    ngx_uint_t                      *waiting;
+    ngx_uint_t                       first;
+    ngx_uint_t                       nwaiting;
+
+    size_t                           rest;
+    size_t                           hlen;
+    u_char                          *header;
+
+    unsigned                         header_done:1;
+} ngx_http_memcached_mux_t;
+
+
+#define NGX_HTTP_MEMCACHED_TEXT       0
+#define NGX_HTTP_MEMCACHED_META       1
+#define NGX_HTTP_MEMCACHED_BINARY     2
+
+
+#define NGX_HTTP_MEMCACHED_REQUEST    0x80
+#define NGX_HTTP_MEMCACHED_RESPONSE   0x81
+#define NGX_HTTP_MEMCACHED_GET        0x00
+
+#define NGX_HTTP_MEMCACHED_OK         0x0000
+#define NGX_HTTP_MEMCACHED_NOT_FOUND  0x0001
+
+
+#define NGX_HTTP_MEMCACHED_MUX_LINE  1024
+
+
+#define ngx_http_memcached_parse_uint16(p)                                    \
+    ((ngx_uint_t) (p)[0] << 8 | (p)[1])
+
+#define ngx_http_memcached_parse_uint32(p)                                    \
+    ((uint32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+
 static ngx_int_t ngx_http_memcached_create_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_memcached_reinit_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_memcached_process_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_process_meta_header(
+    ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_process_binary_header(
+    ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_gzip(ngx_http_request_t *r);
 static ngx_int_t ngx_http_memcached_filter_init(void *data);
 static ngx_int_t ngx_http_memcached_filter(void *data, ssize_t bytes);
 static void ngx_http_memcached_abort_request(ngx_http_request_t *r);
 static void ngx_http_memcached_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
 
+static ngx_int_t ngx_http_memcached_mux_init_peer(ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_mux_init(ngx_http_upstream_mux_t *um,
+    ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_mux_send(
+    ngx_http_upstream_mux_stream_t *stream, u_char *p, size_t size);
+static ngx_int_t ngx_http_memcached_mux_parse(ngx_http_upstream_mux_t *um);
+static ngx_int_t ngx_http_memcached_mux_response(
+    ngx_http_memcached_mux_t *mux);
+
 static void *ngx_http_memcached_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_memcached_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
@@ -51,6 +122,25 @@ static ngx_conf_bitmask_t  ngx_http_memcached_next_upstream_masks[] = {
 };
 
 
+static ngx_conf_enum_t  ngx_http_memcached_protocols[] = {
+    { ngx_string("text"), NGX_HTTP_MEMCACHED_TEXT },
+    { ngx_string("meta"), NGX_HTTP_MEMCACHED_META },
+    { ngx_string("binary"), NGX_HTTP_MEMCACHED_BINARY },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_http_upstream_mux_handler_t  ngx_http_memcached_mux_handler = {
+    ngx_string("memcached://"),
+    sizeof(ngx_http_memcached_mux_t),
+    sizeof(ngx_http_upstream_mux_stream_t),
+    ngx_http_memcached_mux_init,
+    ngx_http_memcached_mux_send,
+    ngx_http_memcached_mux_parse,
+    NULL
+};
+
+
 static ngx_command_t  ngx_http_memcached_commands[] = {
 
     { ngx_string("memcached_pass"),
@@ -74,6 +164,13 @@ static ngx_command_t  ngx_http_memcached_commands[] = {
       offsetof(ngx_http_memcached_loc_conf_t, upstream.socket_keepalive),
       NULL },
 
+    { ngx_string("memcached_socket_fastopen"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_memcached_loc_conf_t, upstream.socket_fastopen),
+      NULL },
+
     { ngx_string("memcached_connect_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -130,6 +227,20 @@ static ngx_command_t  ngx_http_memcached_commands[] = {
       offsetof(ngx_http_memcached_loc_conf_t, gzip_flag),
       NULL },
 
+    { ngx_string("memcached_protocol"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_memcached_loc_conf_t, protocol),
+      &ngx_http_memcached_protocols },
+
+    { ngx_string("memcached_pipeline"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_multiplex_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_memcached_loc_conf_t, mux.multiplex),
+      NULL },
+
       ngx_null_command
 };
 
@@ -168,8 +279,11 @@ ngx_module_t  ngx_http_memcached_module = {
 static ngx_str_t  ngx_http_memcached_key = ngx_string("memcached_key");
 
 
-#define NGX_HTTP_MEMCACHED_END   (sizeof(ngx_http_memcached_end) - 1)
-static u_char  ngx_http_memcached_end[] = CRLF "END" CRLF;
+static ngx_str_t  ngx_http_memcached_end[] = {
+    ngx_string(CRLF "END" CRLF),
+    ngx_string(CRLF),
+    ngx_null_string
+};
 
 
 static ngx_int_t
@@ -209,7 +323,21 @@ ngx_http_memcached_handler(ngx_http_request_t *r)
 
     u->create_request = ngx_http_memcached_create_request;
     u->reinit_request = ngx_http_memcached_reinit_request;
-    u->process_header = ngx_http_memcached_process_header;
+
+    switch (mlcf->protocol) {
+
+    case NGX_HTTP_MEMCACHED_META:
+        u->process_header = ngx_http_memcached_process_meta_header;
+        break;
+
+    case NGX_HTTP_MEMCACHED_BINARY:
+        u->process_header = ngx_http_memcached_process_binary_header;
+        break;
+
+    default: /* NGX_HTTP_MEMCACHED_TEXT */
+        u->process_header = ngx_http_memcached_process_header;
+    }
+
     u->abort_request = ngx_http_memcached_abort_request;
     u->finalize_request = ngx_http_memcached_finalize_request;
 
@@ -219,6 +347,7 @@ ngx_http_memcached_handler(ngx_http_request_t *r)
     }
 
     ctx->request = r;
+    ctx->end = ngx_http_memcached_end[mlcf->protocol];
 
     ngx_http_set_ctx(r, ctx, ngx_http_memcached_module);
 
@@ -226,6 +355,10 @@ ngx_http_memcached_handler(ngx_http_request_t *r)
     u->input_filter = ngx_http_memcached_filter;
     u->input_filter_ctx = ctx;
 
+    if (mlcf->mux.multiplex && (ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        u->init_peer = ngx_http_memcached_mux_init_peer;
+    }
+
     r->main->count++;
 
     ngx_http_upstream_init(r);
@@ -237,13 +370,14 @@ ngx_http_memcached_handler(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_memcached_create_request(ngx_http_request_t *r)
 {
-    size_t                          len;
-    uintptr_t                       escape;
-    ngx_buf_t                      *b;
-    ngx_chain_t                    *cl;
-    ngx_http_memcached_ctx_t       *ctx;
-    ngx_http_variable_value_t      *vv;
-    ngx_http_memcached_loc_conf_t  *mlcf;
+    size_t                               len;
+    uintptr_t                            escape;
+    ngx_buf_t                           *b;
+    ngx_chain_t                         *cl;
+    ngx_http_memcached_ctx_t            *ctx;
+    ngx_http_variable_value_t           *vv;
+    ngx_http_memcached_loc_conf_t       *mlcf;
+    ngx_http_memcached_binary_header_t  *h;
 
     mlcf = ngx_http_get_module_loc_conf(r, ngx_http_memcached_module);
 
@@ -257,7 +391,28 @@ ngx_http_memcached_create_request(ngx_http_request_t *r)
 
     escape = 2 * ngx_escape_uri(NULL, vv->data, vv->len, NGX_ESCAPE_MEMCACHED);
 
-    len = sizeof("get ") - 1 + vv->len + escape + sizeof(CRLF) - 1;
+    len = vv->len + escape;
+
+    switch (mlcf->protocol) {
+
+    case NGX_HTTP_MEMCACHED_META:
+        len += sizeof("mg ") - 1 + sizeof(" v f" CRLF) - 1;
+        break;
+
+    case NGX_HTTP_MEMCACHED_BINARY:
+
+        if (len > 0xffff) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "the \"$memcached_key\" variable is too long");
+            return NGX_ERROR;
+        }
+
+        len += sizeof(ngx_http_memcached_binary_header_t);
+        break;
+
+    default: /* NGX_HTTP_MEMCACHED_TEXT */
+        len += sizeof("get ") - 1 + sizeof(CRLF) - 1;
+    }
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
@@ -274,7 +429,27 @@ ngx_http_memcached_create_request(ngx_http_request_t *r)
 
     r->upstream->request_bufs = cl;
 
-    *b->last++ = 'g'; *b->last++ = 'e'; *b->last++ = 't'; *b->last++ = ' ';
+    h = NULL;
+
+    switch (mlcf->protocol) {
+
+    case NGX_HTTP_MEMCACHED_META:
+        *b->last++ = 'm'; *b->last++ = 'g'; *b->last++ = ' ';
+        break;
+
+    case NGX_HTTP_MEMCACHED_BINARY:
+        h = (ngx_http_memcached_binary_header_t *) b->last;
+        b->last += sizeof(ngx_http_memcached_binary_header_t);
+
+        ngx_memzero(h, sizeof(ngx_http_memcached_binary_header_t));
+
+        h->magic = NGX_HTTP_MEMCACHED_REQUEST;
+        h->opcode = NGX_HTTP_MEMCACHED_GET;
+        break;
+
+    default: /* NGX_HTTP_MEMCACHED_TEXT */
+        *b->last++ = 'g'; *b->last++ = 'e'; *b->last++ = 't'; *b->last++ = ' ';
+    }
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
 
@@ -293,7 +468,25 @@ ngx_http_memcached_create_request(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http memcached request: \"%V\"", &ctx->key);
 
-    *b->last++ = CR; *b->last++ = LF;
+    switch (mlcf->protocol) {
+
+    case NGX_HTTP_MEMCACHED_META:
+
+        /* return the value and the client flags */
+
+        b->last = ngx_cpymem(b->last, " v f" CRLF, sizeof(" v f" CRLF) - 1);
+        break;
+
+    case NGX_HTTP_MEMCACHED_BINARY:
+        h->key_length[0] = (u_char) (ctx->key.len >> 8);
+        h->key_length[1] = (u_char) ctx->key.len;
+        h->body_length[2] = (u_char) (ctx->key.len >> 8);
+        h->body_length[3] = (u_char) ctx->key.len;
+        break;
+
+    default: /* NGX_HTTP_MEMCACHED_TEXT */
+        *b->last++ = CR; *b->last++ = LF;
+    }
 
     return NGX_OK;
 }
@@ -312,7 +505,6 @@ ngx_http_memcached_process_header(ngx_http_request_t *r)
     u_char                         *p, *start;
     ngx_str_t                       line;
     ngx_uint_t                      flags;
-    ngx_table_elt_t                *h;
     ngx_http_upstream_t            *u;
     ngx_http_memcached_ctx_t       *ctx;
     ngx_http_memcached_loc_conf_t  *mlcf;
@@ -395,16 +587,9 @@ found:
         }
 
         if (flags & mlcf->gzip_flag) {
-            h = ngx_list_push(&r->headers_out.headers);
-            if (h == NULL) {
+            if (ngx_http_memcached_gzip(r) != NGX_OK) {
                 return NGX_ERROR;
             }
-
-            h->hash = 1;
-            h->next = NULL;
-            ngx_str_set(&h->key, "Content-Encoding");
-            ngx_str_set(&h->value, "gzip");
-            r->headers_out.content_encoding = h;
         }
 
     length:
@@ -450,6 +635,253 @@ no_valid:
 }
 
 
+static ngx_int_t
+ngx_http_memcached_process_meta_header(ngx_http_request_t *r)
+{
+    u_char                         *p, *last, *start;
+    ngx_str_t                       line;
+    ngx_int_t                       flags;
+    ngx_http_upstream_t            *u;
+    ngx_http_memcached_ctx_t       *ctx;
+    ngx_http_memcached_loc_conf_t  *mlcf;
+
+    u = r->upstream;
+
+    p = ngx_strlchr(u->buffer.pos, u->buffer.last, LF);
+
+    if (p == NULL) {
+        return NGX_AGAIN;
+    }
+
+    line.data = u->buffer.pos;
+    line.len = p - u->buffer.pos;
+
+    if (line.len == 0 || *(p - 1) != CR) {
+        goto no_valid;
+    }
+
+    line.len--;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "memcached: \"%V\"", &line);
+
+    p = line.data;
+    last = line.data + line.len;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_memcached_module);
+
+    if (line.len > sizeof("VA ") - 1
+        && ngx_strncmp(p, "VA ", sizeof("VA ") - 1) == 0)
+    {
+        p += sizeof("VA ") - 1;
+
+        /* length */
+
+        for (start = p; p < last && *p != ' '; p++) { /* void */ }
+
+        u->headers_in.content_length_n = ngx_atoof(start, p - start);
+        if (u->headers_in.content_length_n == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "memcached sent invalid length in response \"%V\" "
+                          "for key \"%V\"",
+                          &line, &ctx->key);
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        /* return flags */
+
+        flags = 0;
+
+        while (p < last) {
+
+            for (start = ++p; p < last && *p != ' '; p++) { /* void */ }
+
+            if (p - start < 2 || *start != 'f') {
+                continue;
+            }
+
+            flags = ngx_atoi(start + 1, p - start - 1);
+
+            if (flags == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "memcached sent invalid flags in response "
+                              "\"%V\" for key \"%V\"",
+                              &line, &ctx->key);
+                return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+            }
+        }
+
+        if ((ngx_uint_t) flags & mlcf->gzip_flag) {
+            if (ngx_http_memcached_gzip(r) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        u->headers_in.status_n = 200;
+        u->state->status = 200;
+        u->buffer.pos = last + sizeof(CRLF) - 1;
+
+        return NGX_OK;
+    }
+
+    if (line.len == sizeof("EN") - 1
+        && ngx_strncmp(p, "EN", sizeof("EN") - 1) == 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "key: \"%V\" was not found by memcached", &ctx->key);
+
+        u->headers_in.content_length_n = 0;
+        u->headers_in.status_n = 404;
+        u->state->status = 404;
+        u->buffer.pos = last + sizeof(CRLF) - 1;
+        u->keepalive = 1;
+
+        return NGX_OK;
+    }
+
+no_valid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "memcached sent invalid response: \"%V\"", &line);
+
+    return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+}
+
+
+static ngx_int_t
+ngx_http_memcached_process_binary_header(ngx_http_request_t *r)
+{
+    size_t                               size, len;
+    uint32_t                             flags;
+    ngx_uint_t                           status;
+    ngx_http_upstream_t                 *u;
+    ngx_http_memcached_ctx_t            *ctx;
+    ngx_http_memcached_loc_conf_t       *mlcf;
+    ngx_http_memcached_binary_header_t  *h;
+
+    u = r->upstream;
+
+    size = u->buffer.last - u->buffer.pos;
+
+    if (size < sizeof(ngx_http_memcached_binary_header_t)) {
+        return NGX_AGAIN;
+    }
+
+    h = (ngx_http_memcached_binary_header_t *) u->buffer.pos;
+
+    status = ngx_http_memcached_parse_uint16(h->status);
+    len = ngx_http_memcached_parse_uint32(h->body_length);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "memcached: opcode:%ui status:%ui length:%uz",
+                   (ngx_uint_t) h->opcode, status, len);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
+
+    if (h->magic != NGX_HTTP_MEMCACHED_RESPONSE
+        || h->opcode != NGX_HTTP_MEMCACHED_GET
+        || len < h->extras_length
+                 + ngx_http_memcached_parse_uint16(h->key_length))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "memcached sent invalid response for key \"%V\"",
+                      &ctx->key);
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    if (status == NGX_HTTP_MEMCACHED_NOT_FOUND) {
+
+        /* the body is an error message, it is skipped */
+
+        if (size < sizeof(ngx_http_memcached_binary_header_t) + len) {
+
+            if (u->buffer.last == u->buffer.end) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "memcached sent too long error message "
+                              "for key \"%V\"", &ctx->key);
+                return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "key: \"%V\" was not found by memcached", &ctx->key);
+
+        u->headers_in.content_length_n = 0;
+        u->headers_in.status_n = 404;
+        u->state->status = 404;
+        u->buffer.pos += sizeof(ngx_http_memcached_binary_header_t) + len;
+        u->keepalive = 1;
+
+        return NGX_OK;
+    }
+
+    if (status != NGX_HTTP_MEMCACHED_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "memcached returned status %ui for key \"%V\"",
+                      status, &ctx->key);
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    size -= sizeof(ngx_http_memcached_binary_header_t);
+
+    if (size < (size_t) h->extras_length
+               + ngx_http_memcached_parse_uint16(h->key_length))
+    {
+        return NGX_AGAIN;
+    }
+
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_memcached_module);
+
+    if (h->extras_length >= sizeof(uint32_t)) {
+
+        /* the extras of a get response are the client flags */
+
+        flags = ngx_http_memcached_parse_uint32(
+                    u->buffer.pos + sizeof(ngx_http_memcached_binary_header_t));
+
+        if (flags & mlcf->gzip_flag) {
+            if (ngx_http_memcached_gzip(r) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    len -= h->extras_length + ngx_http_memcached_parse_uint16(h->key_length);
+
+    u->headers_in.content_length_n = len;
+    u->headers_in.status_n = 200;
+    u->state->status = 200;
+    u->buffer.pos += sizeof(ngx_http_memcached_binary_header_t)
+                     + h->extras_length
+                     + ngx_http_memcached_parse_uint16(h->key_length);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_memcached_gzip(ngx_http_request_t *r)
+{
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    h->next = NULL;
+    ngx_str_set(&h->key, "Content-Encoding");
+    ngx_str_set(&h->value, "gzip");
+    r->headers_out.content_encoding = h;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_memcached_filter_init(void *data)
 {
@@ -460,8 +892,12 @@ ngx_http_memcached_filter_init(void *data)
     u = ctx->request->upstream;
 
     if (u->headers_in.status_n != 404) {
-        u->length = u->headers_in.content_length_n + NGX_HTTP_MEMCACHED_END;
-        ctx->rest = NGX_HTTP_MEMCACHED_END;
+        u->length = u->headers_in.content_length_n + ctx->end.len;
+        ctx->rest = ctx->end.len;
+
+        if (u->length == 0) {
+            u->keepalive = 1;
+        }
 
     } else {
         u->length = 0;
@@ -487,9 +923,8 @@ ngx_http_memcached_filter(void *data, ssize_t bytes)
     if (u->length == (ssize_t) ctx->rest) {
 
         if (bytes > u->length
-            || ngx_strncmp(b->last,
-                   ngx_http_memcached_end + NGX_HTTP_MEMCACHED_END - ctx->rest,
-                   bytes)
+            || ngx_strncmp(b->last, ctx->end.data + ctx->end.len - ctx->rest,
+                           bytes)
                != 0)
         {
             ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
@@ -535,15 +970,20 @@ ngx_http_memcached_filter(void *data, ssize_t bytes)
                    "memcached filter bytes:%z size:%z length:%O rest:%z",
                    bytes, b->last - b->pos, u->length, ctx->rest);
 
-    if (bytes <= (ssize_t) (u->length - NGX_HTTP_MEMCACHED_END)) {
+    if (bytes <= (ssize_t) (u->length - ctx->end.len)) {
         u->length -= bytes;
+
+        if (u->length == 0) {
+            u->keepalive = 1;
+        }
+
         return NGX_OK;
     }
 
-    last += (size_t) (u->length - NGX_HTTP_MEMCACHED_END);
+    last += (size_t) (u->length - ctx->end.len);
 
     if (bytes > u->length
-        || ngx_strncmp(last, ngx_http_memcached_end, b->last - last) != 0)
+        || ngx_strncmp(last, ctx->end.data, b->last - last) != 0)
     {
         ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
                       "memcached sent invalid trailer");
@@ -587,6 +1027,260 @@ ngx_http_memcached_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 }
 
 
+static ngx_int_t
+ngx_http_memcached_mux_init_peer(ngx_http_request_t *r)
+{
+    ngx_http_memcached_loc_conf_t  *mlcf;
+
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_memcached_module);
+
+    return ngx_http_upstream_mux_init_peer(r, &mlcf->mux,
+                                           &ngx_http_memcached_mux_handler);
+}
+
+
+static ngx_int_t
+ngx_http_memcached_mux_init(ngx_http_upstream_mux_t *um, ngx_http_request_t *r)
+{
+    ngx_http_memcached_mux_t       *mux;
+    ngx_http_memcached_loc_conf_t  *mlcf;
+
+    mux = (ngx_http_memcached_mux_t *) um;
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_memcached_module);
+
+    mux->protocol = mlcf->protocol;
+
+    mux->waiting = ngx_pcalloc(um->pool, um->max * sizeof(ngx_uint_t));
+    if (mux->waiting == NULL) {
+        return NGX_ERROR;
+    }
+
+    mux->header = ngx_pnalloc(um->pool, NGX_HTTP_MEMCACHED_MUX_LINE);
+    if (mux->header == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_memcached_mux_send(ngx_http_upstream_mux_stream_t *stream, u_char *p,
+    size_t size)
+{
+    ngx_http_upstream_mux_t   *um;
+    ngx_http_memcached_mux_t  *mux;
+
+    um = stream->mux;
+    mux = (ngx_http_memcached_mux_t *) um;
+
+    /*
+     * a request is a single small buffer, so it is copied
+     * as a whole and sent along with the requests of others
+     */
+
+    if (!stream->started) {
+        stream->started = 1;
+
+        mux->waiting[(mux->first + mux->nwaiting) % um->max] = stream->id;
+        mux->nwaiting++;
+    }
+
+    return ngx_http_upstream_mux_append(um, &um->out, &um->out_last, p, size);
+}
+
+
+static ngx_int_t
+ngx_http_memcached_mux_parse(ngx_http_upstream_mux_t *um)
+{
+    size_t                           n;
+    u_char                          *p;
+    ngx_buf_t                       *b;
+    ngx_uint_t                       id;
+    ngx_http_memcached_mux_t        *mux;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    mux = (ngx_http_memcached_mux_t *) um;
+    b = um->buffer;
+
+    while (b->pos < b->last) {
+
+        if (um->blocked) {
+            return NGX_AGAIN;
+        }
+
+        if (mux->nwaiting == 0) {
+            ngx_log_error(NGX_LOG_ERR, um->connection->log, 0,
+                          "upstream sent data without a request");
+            return NGX_ERROR;
+        }
+
+        /* the responses come in the order of requests */
+
+        id = mux->waiting[mux->first];
+        stream = um->streams[id - 1];
+
+        if (stream == NGX_HTTP_UPSTREAM_MUX_ABORTED) {
+            stream = NULL;
+        }
+
+        n = b->last - b->pos;
+
+        if (!mux->header_done) {
+
+            if (mux->protocol == NGX_HTTP_MEMCACHED_BINARY) {
+                n = ngx_min(sizeof(ngx_http_memcached_binary_header_t)
+                            - mux->hlen, n);
+
+            } else {
+                p = ngx_strlchr(b->pos, b->last, LF);
+
+                if (p) {
+                    n = p + 1 - b->pos;
+                }
+            }
+
+            if (mux->hlen + n > NGX_HTTP_MEMCACHED_MUX_LINE) {
+                ngx_log_error(NGX_LOG_ERR, um->connection->log, 0,
+                              "upstream sent too long response line");
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(mux->header + mux->hlen, b->pos, n);
+            mux->hlen += n;
+
+            if (mux->protocol == NGX_HTTP_MEMCACHED_BINARY
+                ? mux->hlen == sizeof(ngx_http_memcached_binary_header_t)
+                : mux->header[mux->hlen - 1] == LF)
+            {
+                if (ngx_http_memcached_mux_response(mux) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                mux->header_done = 1;
+            }
+
+        } else {
+            n = ngx_min(mux->rest, n);
+            mux->rest -= n;
+        }
+
+        if (stream
+            && ngx_http_upstream_mux_input(stream, b->pos, n) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        b->pos += n;
+
+        if (mux->header_done && mux->rest == 0) {
+
+            /* the response is complete */
+
+            mux->header_done = 0;
+            mux->hlen = 0;
+
+            mux->first = (mux->first + 1) % um->max;
+            mux->nwaiting--;
+
+            if (stream) {
+                stream->done = 1;
+
+            } else {
+                ngx_http_upstream_mux_release(um, id);
+            }
+        }
+
+        if (stream) {
+            ngx_http_upstream_mux_post(stream);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_memcached_mux_response(ngx_http_memcached_mux_t *mux)
+{
+    u_char                              *p, *last, *start;
+    off_t                                len;
+    ngx_str_t                            value;
+    ngx_uint_t                           skip;
+    ngx_http_memcached_binary_header_t  *h;
+
+    /* the length of the response after its first line or header */
+
+    if (mux->protocol == NGX_HTTP_MEMCACHED_BINARY) {
+        h = (ngx_http_memcached_binary_header_t *) mux->header;
+
+        if (h->magic != NGX_HTTP_MEMCACHED_RESPONSE) {
+            ngx_log_error(NGX_LOG_ERR, mux->mux.connection->log, 0,
+                          "upstream sent invalid binary header");
+            return NGX_ERROR;
+        }
+
+        mux->rest = ngx_http_memcached_parse_uint32(h->body_length);
+
+        return NGX_OK;
+    }
+
+    if (mux->protocol == NGX_HTTP_MEMCACHED_META) {
+        ngx_str_set(&value, "VA ");
+        skip = 0;
+
+    } else {
+        ngx_str_set(&value, "VALUE ");
+        skip = 2;
+    }
+
+    p = mux->header;
+    last = mux->header + mux->hlen;
+
+    if (mux->hlen < value.len || ngx_strncmp(p, value.data, value.len) != 0) {
+
+        /* a miss or an error is a single line */
+
+        mux->rest = 0;
+
+        return NGX_OK;
+    }
+
+    p += value.len;
+
+    /* skip the key and the flags of the "VALUE" line */
+
+    while (skip--) {
+        p = ngx_strlchr(p, last, ' ');
+
+        if (p == NULL) {
+            goto invalid;
+        }
+
+        p++;
+    }
+
+    for (start = p; p < last && *p >= '0' && *p <= '9'; p++) { /* void */ }
+
+    len = ngx_atoof(start, p - start);
+
+    if (len == NGX_ERROR) {
+        goto invalid;
+    }
+
+    mux->rest = (size_t) len + ngx_http_memcached_end[mux->protocol].len;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, mux->mux.connection->log, 0,
+                  "upstream sent invalid length in response line");
+
+    return NGX_ERROR;
+}
+
+
 static void *
 ngx_http_memcached_create_loc_conf(ngx_conf_t *cf)
 {
@@ -607,6 +1301,7 @@ ngx_http_memcached_create_loc_conf(ngx_conf_t *cf)
 
     conf->upstream.local = NGX_CONF_UNSET_PTR;
     conf->upstream.socket_keepalive = NGX_CONF_UNSET;
+    conf->upstream.socket_fastopen = NGX_CONF_UNSET;
     conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
@@ -632,6 +1327,8 @@ ngx_http_memcached_create_loc_conf(ngx_conf_t *cf)
 
     conf->index = NGX_CONF_UNSET;
     conf->gzip_flag = NGX_CONF_UNSET_UINT;
+    conf->protocol = NGX_CONF_UNSET_UINT;
+    conf->mux.multiplex = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -649,6 +1346,9 @@ ngx_http_memcached_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.socket_keepalive,
                               prev->upstream.socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->upstream.socket_fastopen,
+                              prev->upstream.socket_fastopen, 0);
+
     ngx_conf_merge_uint_value(conf->upstream.next_upstream_tries,
                               prev->upstream.next_upstream_tries, 0);
 
@@ -689,6 +1389,13 @@ ngx_http_memcached_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_uint_value(conf->gzip_flag, prev->gzip_flag, 0);
 
+    ngx_conf_merge_uint_value(conf->protocol, prev->protocol,
+                              NGX_HTTP_MEMCACHED_TEXT);
+
+    ngx_conf_merge_value(conf->mux.multiplex, prev->mux.multiplex, 0);
+
+    ngx_queue_init(&conf->mux.connections);
+
     return NGX_CONF_OK;
 }
 
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HTTP_GRPC)
+#include <ngx_http_grpc_module.h>
+#endif
+
 
 #define  NGX_HTTP_PROXY_COOKIE_SECURE           0x0001
 #define  NGX_HTTP_PROXY_COOKIE_SECURE_ON        0x0002
@@ -92,6 +96,11 @@ typedef struct {
 #endif
     ngx_array_t                   *headers_source;
 
+#if (NGX_HTTP_GRPC)
+    ngx_http_grpc_headers_t        headers_v2;
+    ngx_http_grpc_mux_conf_t       mux;
+#endif
+
     ngx_array_t                   *proxy_lengths;
     ngx_array_t                   *proxy_values;
 
@@ -146,6 +155,10 @@ typedef struct {
 
 static ngx_int_t ngx_http_proxy_eval(ngx_http_request_t *r,
     ngx_http_proxy_ctx_t *ctx, ngx_http_proxy_loc_conf_t *plcf);
+#if (NGX_HTTP_GRPC)
+static ngx_int_t ngx_http_proxy_v2_handler(ngx_http_request_t *r,
+    ngx_http_proxy_ctx_t *ctx, ngx_http_proxy_loc_conf_t *plcf);
+#endif
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_proxy_create_key(ngx_http_request_t *r);
 #endif
@@ -285,6 +298,9 @@ static ngx_conf_post_t  ngx_http_proxy_ssl_conf_command_post =
 static ngx_conf_enum_t  ngx_http_proxy_http_version[] = {
     { ngx_string("1.0"), NGX_HTTP_VERSION_10 },
     { ngx_string("1.1"), NGX_HTTP_VERSION_11 },
+#if (NGX_HTTP_GRPC)
+    { ngx_string("2"), NGX_HTTP_VERSION_20 },
+#endif
     { ngx_null_string, 0 }
 };
 
@@ -357,6 +373,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.request_buffering),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.splice),
+      NULL },
+
     { ngx_string("proxy_ignore_client_abort"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -378,6 +401,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.socket_keepalive),
       NULL },
 
+    { ngx_string("proxy_socket_fastopen"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.socket_fastopen),
+      NULL },
+
     { ngx_string("proxy_connect_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -555,6 +585,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_max_range_offset),
       NULL },
 
+    { ngx_string("proxy_cache_partial"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_partial),
+      NULL },
+
     { ngx_string("proxy_cache_use_stale"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
@@ -655,6 +692,20 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.next_upstream_timeout),
       NULL },
 
+    { ngx_string("proxy_next_upstream_hedge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_hedge_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.hedge),
+      NULL },
+
+    { ngx_string("proxy_collapse"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_upstream_collapse_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.collapse),
+      NULL },
+
     { ngx_string("proxy_pass_header"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_array_slot,
@@ -683,6 +734,17 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, http_version),
       &ngx_http_proxy_http_version },
 
+#if (NGX_HTTP_GRPC)
+
+    { ngx_string("proxy_multiplex"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_multiplex_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, mux.multiplex),
+      NULL },
+
+#endif
+
 #if (NGX_HTTP_SSL)
 
     { ngx_string("proxy_ssl_session_reuse"),
@@ -830,6 +892,23 @@ static ngx_keyval_t  ngx_http_proxy_headers[] = {
 };
 
 
+#if (NGX_HTTP_GRPC)
+
+static ngx_keyval_t  ngx_http_proxy_v2_headers[] = {
+    { ngx_string("Content-Length"), ngx_string("$content_length") },
+    { ngx_string("Host"), ngx_string("") },
+    { ngx_string("Connection"), ngx_string("") },
+    { ngx_string("Transfer-Encoding"), ngx_string("") },
+    { ngx_string("TE"), ngx_string("") },
+    { ngx_string("Keep-Alive"), ngx_string("") },
+    { ngx_string("Expect"), ngx_string("") },
+    { ngx_string("Upgrade"), ngx_string("") },
+    { ngx_null_string, ngx_null_string }
+};
+
+#endif
+
+
 static ngx_str_t  ngx_http_proxy_hide_headers[] = {
     ngx_string("Date"),
     ngx_string("Server"),
@@ -994,6 +1073,16 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
         u->rewrite_cookie = ngx_http_proxy_rewrite_cookie;
     }
 
+    u->accel = 1;
+
+#if (NGX_HTTP_GRPC)
+
+    if (plcf->http_version == NGX_HTTP_VERSION_20) {
+        return ngx_http_proxy_v2_handler(r, ctx, plcf);
+    }
+
+#endif
+
     u->buffering = plcf->upstream.buffering;
 
     u->pipe = ngx_pcalloc(r->pool, sizeof(ngx_event_pipe_t));
@@ -1008,8 +1097,6 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
     u->input_filter = ngx_http_proxy_non_buffered_copy_filter;
     u->input_filter_ctx = r;
 
-    u->accel = 1;
-
     if (!plcf->upstream.request_buffering
         && plcf->body_values == NULL && plcf->upstream.pass_request_body
         && (!r->headers_in.chunked
@@ -1028,6 +1115,109 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
 }
 
 
+#if (NGX_HTTP_GRPC)
+
+static ngx_int_t
+ngx_http_proxy_v2_handler(ngx_http_request_t *r, ngx_http_proxy_ctx_t *ctx,
+    ngx_http_proxy_loc_conf_t *plcf)
+{
+    u_char               *p;
+    size_t                loc_len;
+    uintptr_t             escape;
+    ngx_int_t             rc;
+    ngx_str_t             path;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    /* the same URI as in the HTTP/1.x request line */
+
+    if (plcf->proxy_lengths && ctx->vars.uri.len) {
+        path = ctx->vars.uri;
+
+    } else if (ctx->vars.uri.len == 0 && r->valid_unparsed_uri) {
+        path = r->unparsed_uri;
+
+    } else {
+        loc_len = (r->valid_location && ctx->vars.uri.len) ?
+                      plcf->location.len : 0;
+
+        escape = 0;
+
+        if (r->quoted_uri || r->internal) {
+            escape = 2 * ngx_escape_uri(NULL, r->uri.data + loc_len,
+                                        r->uri.len - loc_len, NGX_ESCAPE_URI);
+        }
+
+        path.len = ctx->vars.uri.len + r->uri.len - loc_len + escape
+                   + sizeof("?") - 1 + r->args.len;
+
+        path.data = ngx_pnalloc(r->pool, path.len);
+        if (path.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        p = path.data;
+
+        if (r->valid_location) {
+            p = ngx_copy(p, ctx->vars.uri.data, ctx->vars.uri.len);
+        }
+
+        if (escape) {
+            ngx_escape_uri(p, r->uri.data + loc_len,
+                           r->uri.len - loc_len, NGX_ESCAPE_URI);
+            p += r->uri.len - loc_len + escape;
+
+        } else {
+            p = ngx_copy(p, r->uri.data + loc_len, r->uri.len - loc_len);
+        }
+
+        if (r->args.len > 0) {
+            *p++ = '?';
+            p = ngx_copy(p, r->args.data, r->args.len);
+        }
+
+        path.len = p - path.data;
+    }
+
+    if (path.len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "zero length URI to proxy");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    u->uri = path;
+
+    if (ngx_http_grpc_init_upstream(r, &plcf->headers_v2,
+                                    &ctx->vars.host_header, &path)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_grpc_multiplex(r, &plcf->mux);
+
+    /* HTTP/2 responses are only passed unbuffered */
+
+    u->buffering = 0;
+
+    if (!plcf->upstream.request_buffering && plcf->upstream.pass_request_body)
+    {
+        r->request_body_no_buffering = 1;
+    }
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_proxy_eval(ngx_http_request_t *r, ngx_http_proxy_ctx_t *ctx,
     ngx_http_proxy_loc_conf_t *plcf)
@@ -1392,6 +1582,13 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (u->cacheable && r->cache && r->cache->partial_size) {
+        len += sizeof("Range: bytes=-" CRLF) - 1 + 2 * NGX_OFF_T_LEN;
+    }
+
+#endif
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
@@ -1539,6 +1736,25 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
     }
 
 
+#if (NGX_HTTP_CACHE)
+
+    /* the slices needed for a partially cached response */
+
+    if (u->cacheable && r->cache && r->cache->partial_size) {
+
+        if (r->cache->partial_end == -1) {
+            b->last = ngx_sprintf(b->last, "Range: bytes=%O-" CRLF,
+                                  r->cache->partial_start);
+
+        } else {
+            b->last = ngx_sprintf(b->last, "Range: bytes=%O-%O" CRLF,
+                                  r->cache->partial_start,
+                                  r->cache->partial_end);
+        }
+    }
+
+#endif
+
     /* add "\r\n" at the header end */
     *b->last++ = CR; *b->last++ = LF;
 
@@ -2090,6 +2306,10 @@ ngx_http_proxy_input_filter_init(void *data)
 
         u->pipe->length = u->headers_in.content_length_n;
         u->length = u->headers_in.content_length_n;
+
+        /* the body is passed as is */
+
+        u->raw_body = 1;
     }
 
     return NGX_OK;
@@ -3356,16 +3576,20 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->upstream.buffering = NGX_CONF_UNSET;
     conf->upstream.request_buffering = NGX_CONF_UNSET;
+    conf->upstream.splice = NGX_CONF_UNSET;
     conf->upstream.ignore_client_abort = NGX_CONF_UNSET;
     conf->upstream.force_ranges = NGX_CONF_UNSET;
 
     conf->upstream.local = NGX_CONF_UNSET_PTR;
     conf->upstream.socket_keepalive = NGX_CONF_UNSET;
+    conf->upstream.socket_fastopen = NGX_CONF_UNSET;
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.hedge = NGX_CONF_UNSET_PTR;
+    conf->upstream.collapse = NGX_CONF_UNSET_PTR;
 
     conf->upstream.send_lowat = NGX_CONF_UNSET_SIZE;
     conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
@@ -3382,6 +3606,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache = NGX_CONF_UNSET;
     conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
     conf->upstream.cache_max_range_offset = NGX_CONF_UNSET;
+    conf->upstream.cache_partial = NGX_CONF_UNSET_SIZE;
     conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
     conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
@@ -3427,6 +3652,10 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
 
     conf->http_version = NGX_CONF_UNSET_UINT;
 
+#if (NGX_HTTP_GRPC)
+    conf->mux.multiplex = NGX_CONF_UNSET;
+#endif
+
     conf->headers_hash_max_size = NGX_CONF_UNSET_UINT;
     conf->headers_hash_bucket_size = NGX_CONF_UNSET_UINT;
 
@@ -3482,6 +3711,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.request_buffering,
                               prev->upstream.request_buffering, 1);
 
+    ngx_conf_merge_value(conf->upstream.splice,
+                              prev->upstream.splice, 0);
+
     ngx_conf_merge_value(conf->upstream.ignore_client_abort,
                               prev->upstream.ignore_client_abort, 0);
 
@@ -3494,6 +3726,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.socket_keepalive,
                               prev->upstream.socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->upstream.socket_fastopen,
+                              prev->upstream.socket_fastopen, 0);
+
     ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
                               prev->upstream.connect_timeout, 60000);
 
@@ -3506,6 +3741,10 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->upstream.next_upstream_timeout,
                               prev->upstream.next_upstream_timeout, 0);
 
+    ngx_conf_merge_ptr_value(conf->upstream.hedge, prev->upstream.hedge, NULL);
+    ngx_conf_merge_ptr_value(conf->upstream.collapse,
+                             prev->upstream.collapse, NULL);
+
     ngx_conf_merge_size_value(conf->upstream.send_lowat,
                               prev->upstream.send_lowat, 0);
 
@@ -3661,6 +3900,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               prev->upstream.cache_max_range_offset,
                               NGX_MAX_OFF_T_VALUE);
 
+    ngx_conf_merge_size_value(conf->upstream.cache_partial,
+                              prev->upstream.cache_partial, 0);
+
     ngx_conf_merge_bitmask_value(conf->upstream.cache_use_stale,
                               prev->upstream.cache_use_stale,
                               (NGX_CONF_BITMASK_SET
@@ -3722,6 +3964,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.intercept_errors,
                               prev->upstream.intercept_errors, 0);
 
+    ngx_conf_merge_uint_value(conf->http_version, prev->http_version,
+                              NGX_HTTP_VERSION_10);
+
 #if (NGX_HTTP_SSL)
 
     ngx_conf_merge_value(conf->upstream.ssl_session_reuse,
@@ -3760,6 +4005,15 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    /* the upstream is probed over TLS as well */
+
+    if (conf->ssl
+        && conf->upstream.upstream
+        && conf->upstream.upstream->ssl == NULL)
+    {
+        conf->upstream.upstream->ssl = conf->upstream.ssl;
+    }
+
 #endif
 
     ngx_conf_merge_ptr_value(conf->method, prev->method, NULL);
@@ -3821,9 +4075,6 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_ptr_value(conf->cookie_flags, prev->cookie_flags, NULL);
 
-    ngx_conf_merge_uint_value(conf->http_version, prev->http_version,
-                              NGX_HTTP_VERSION_10);
-
     ngx_conf_merge_uint_value(conf->headers_hash_max_size,
                               prev->headers_hash_max_size, 512);
 
@@ -3916,6 +4167,59 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         }
     }
 
+#endif
+
+#if (NGX_HTTP_GRPC)
+
+    if (conf->mux.multiplex > 0
+        && conf->http_version != NGX_HTTP_VERSION_20)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"proxy_multiplex\" requires "
+                           "\"proxy_http_version 2\"");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_value(conf->mux.multiplex, prev->mux.multiplex, 0);
+
+    ngx_queue_init(&conf->mux.connections);
+
+    if (conf->http_version == NGX_HTTP_VERSION_20) {
+
+#if (NGX_HTTP_CACHE)
+        if (conf->upstream.cache) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"proxy_cache\" cannot be used "
+                               "with \"proxy_http_version 2\"");
+            return NGX_CONF_ERROR;
+        }
+#endif
+
+        if (conf->body_source.data || conf->method) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"proxy_set_body\" and \"proxy_method\" "
+                               "cannot be used with \"proxy_http_version 2\"");
+            return NGX_CONF_ERROR;
+        }
+
+        /* responses over HTTP/2 are never buffered */
+
+        conf->upstream.change_buffering = 0;
+        conf->upstream.preserve_output = 1;
+
+        if (conf->headers_source == prev->headers_source) {
+            conf->headers_v2 = prev->headers_v2;
+        }
+
+        if (ngx_http_grpc_init_headers(cf, conf->headers_source,
+                                       &conf->headers_v2,
+                                       ngx_http_proxy_v2_headers)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
 #endif
 
     /*
@@ -5020,6 +5324,22 @@ ngx_http_proxy_set_ssl(ngx_conf_t *cf, ngx_http_proxy_loc_conf_t *plcf)
         return NGX_ERROR;
     }
 
+#if (NGX_HTTP_GRPC)
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    if (plcf->http_version == NGX_HTTP_VERSION_20
+        && SSL_CTX_set_alpn_protos(plcf->upstream.ssl->ctx,
+                                   (u_char *) "\x02h2", 3)
+           != 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0,
+                      "SSL_CTX_set_alpn_protos() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+#endif
+
     return NGX_OK;
 }
 
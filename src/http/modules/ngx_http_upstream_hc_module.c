@@ -0,0 +1,585 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_event_probe.h>
+
+
+typedef struct {
+    ngx_msec_t                        interval;
+    ngx_msec_t                        timeout;
+    ngx_uint_t                        fails;
+    ngx_uint_t                        passes;
+    ngx_str_t                         uri;
+    ngx_uint_t                        status_min;
+    ngx_uint_t                        status_max;
+    ngx_str_t                         body;
+    ngx_str_t                         request;
+    ngx_flag_t                        enable;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_event_probe_t                 probe;
+
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    ngx_uint_t                        fails;
+    ngx_uint_t                        passes;
+
+    unsigned                          down:1;
+} ngx_http_upstream_hc_peer_t;
+
+
+static ngx_int_t ngx_http_upstream_hc_init_peers(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_hc_srv_conf_t *hcf);
+static ngx_int_t ngx_http_upstream_hc_peer(ngx_event_probe_t *probe);
+static ngx_int_t ngx_http_upstream_hc_check(ngx_event_probe_t *probe);
+static void ngx_http_upstream_hc_done(ngx_event_probe_t *probe, ngx_int_t rc);
+
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf);
+static char *ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hc,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    ngx_http_upstream_hc_init_main_conf,   /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    /* checks are run by the first worker process only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_hc_module);
+
+        if (!hcf->enable) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        if (ngx_http_upstream_hc_init_peers(cycle, uscfp[i], peers, hcf)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (peers->next
+            && ngx_http_upstream_hc_init_peers(cycle, uscfp[i], peers->next,
+                                               hcf)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_peers(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_hc_srv_conf_t *hcf)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->down && !peer->resolve) {
+            continue;
+        }
+
+        hp = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_hc_peer_t));
+        if (hp == NULL) {
+            return NGX_ERROR;
+        }
+
+        hp->peers = peers;
+        hp->peer = peer;
+        hp->conf = hcf;
+
+        hp->probe.interval = hcf->interval;
+        hp->probe.timeout = hcf->timeout;
+        hp->probe.type = SOCK_STREAM;
+        hp->probe.request = hcf->request;
+
+#if (NGX_HTTP_SSL)
+
+        /* probes use TLS if the upstream is proxied to over TLS */
+
+        hp->probe.ssl = uscf->ssl;
+        hp->probe.ssl_name = uscf->host;
+
+#endif
+
+        hp->probe.peer = ngx_http_upstream_hc_peer;
+        hp->probe.check = ngx_http_upstream_hc_check;
+        hp->probe.done = ngx_http_upstream_hc_done;
+        hp->probe.data = hp;
+
+        if (ngx_event_probe_init(&hp->probe, cycle->pool, cycle->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_peer(ngx_event_probe_t *probe)
+{
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    hp = probe->data;
+
+    ngx_http_upstream_rr_peers_rlock(hp->peers);
+
+    if (hp->peer->spare) {
+
+        /* a slot of a server resolved at run time, not in use */
+
+        ngx_http_upstream_rr_peers_unlock(hp->peers);
+
+        hp->fails = 0;
+        hp->passes = 0;
+        hp->down = 0;
+
+        return NGX_DECLINED;
+    }
+
+    probe->pc.sockaddr = hp->peer->sockaddr;
+    probe->pc.socklen = hp->peer->socklen;
+    probe->pc.name = &hp->peer->name;
+
+    ngx_http_upstream_rr_peers_unlock(hp->peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_check(ngx_event_probe_t *probe)
+{
+    u_char                           *p, *last;
+    ngx_int_t                         status;
+    ngx_http_upstream_hc_peer_t      *hp;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    /* the response is tested once it is read completely */
+
+    if (!probe->eof) {
+        return NGX_AGAIN;
+    }
+
+    hp = probe->data;
+    hcf = hp->conf;
+
+    p = probe->response->pos;
+    last = probe->response->last;
+
+    /* "HTTP/1.x 200 ..." */
+
+    if (last - p < 12 || ngx_strncmp(p, "HTTP/", 5) != 0) {
+        ngx_log_error(NGX_LOG_INFO, probe->event.log, 0,
+                      "health check of upstream server %V: "
+                      "invalid response", &hp->peer->name);
+        return NGX_ERROR;
+    }
+
+    p = ngx_strlchr(p, last, ' ');
+
+    if (p == NULL || last - p < 4) {
+        return NGX_ERROR;
+    }
+
+    status = ngx_atoi(p + 1, 3);
+
+    if (status == NGX_ERROR
+        || (ngx_uint_t) status < hcf->status_min
+        || (ngx_uint_t) status > hcf->status_max)
+    {
+        ngx_log_error(NGX_LOG_INFO, probe->event.log, 0,
+                      "health check of upstream server %V: "
+                      "unexpected status %i", &hp->peer->name, status);
+        return NGX_ERROR;
+    }
+
+    if (hcf->body.len == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_strnstr(p, "\r\n\r\n", last - p);
+
+    if (p == NULL
+        || ngx_strnstr(p + 4, (char *) hcf->body.data, last - p - 4) == NULL)
+    {
+        ngx_log_error(NGX_LOG_INFO, probe->event.log, 0,
+                      "health check of upstream server %V: "
+                      "body does not match", &hp->peer->name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hc_done(ngx_event_probe_t *probe, ngx_int_t rc)
+{
+    ngx_http_upstream_hc_peer_t      *hp;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hp = probe->data;
+    hcf = hp->conf;
+    peer = hp->peer;
+
+    ngx_http_upstream_rr_peers_rlock(hp->peers);
+    ngx_http_upstream_rr_peer_lock(hp->peers, peer);
+
+    if (rc == NGX_OK) {
+        hp->fails = 0;
+        hp->passes++;
+
+        if (hp->down && hp->passes >= hcf->passes && !peer->spare) {
+            hp->down = 0;
+
+            peer->down = 0;
+            peer->fails = 0;
+            peer->start_time = ngx_current_msec;
+
+            ngx_log_error(NGX_LOG_NOTICE, probe->event.log, 0,
+                          "upstream server %V is healthy", &peer->name);
+        }
+
+    } else {
+        hp->passes = 0;
+        hp->fails++;
+
+        /* the slot may have been refilled with a new address */
+
+        if (hp->fails >= hcf->fails && !peer->down) {
+            hp->down = 1;
+
+            peer->down = 1;
+
+            ngx_log_error(NGX_LOG_WARN, probe->event.log, 0,
+                          "upstream server %V is unhealthy", &peer->name);
+        }
+    }
+
+    ngx_http_upstream_rr_peer_unlock(hp->peers, peer);
+    ngx_http_upstream_rr_peers_unlock(hp->peers);
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->uri = { 0, NULL };
+     *     conf->body = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     *     conf->enable = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    u_char                           *p;
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_hc_module);
+
+        if (!hcf->enable) {
+            continue;
+        }
+
+        /* the state of servers is shared by all worker processes */
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires upstream \"%V\" "
+                          "to be in shared memory in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+
+        hcf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + hcf->uri.len
+                           + sizeof("Host: " CRLF) - 1 + uscfp[i]->host.len
+                           + sizeof("Connection: close" CRLF CRLF) - 1;
+
+        p = ngx_pnalloc(cf->pool, hcf->request.len);
+        if (p == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        hcf->request.data = p;
+
+        ngx_sprintf(p, "GET %V HTTP/1.0" CRLF "Host: %V" CRLF
+                    "Connection: close" CRLF CRLF,
+                    &hcf->uri, &uscfp[i]->host);
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char     *p;
+    ngx_int_t   n;
+    ngx_str_t  *value, s;
+    ngx_uint_t  i;
+
+    if (hcf->enable) {
+        return "is duplicate";
+    }
+
+    hcf->enable = 1;
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+    ngx_str_set(&hcf->uri, "/");
+    hcf->status_min = 200;
+    hcf->status_max = 399;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR
+                || hcf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            hcf->uri.len = value[i].len - 4;
+            hcf->uri.data = &value[i].data[4];
+
+            if (hcf->uri.len == 0 || hcf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            p = ngx_strlchr(s.data, s.data + s.len, '-');
+
+            if (p) {
+                n = ngx_atoi(s.data, p - s.data);
+                hcf->status_max = ngx_atoi(p + 1, s.data + s.len - p - 1);
+
+            } else {
+                n = ngx_atoi(s.data, s.len);
+                hcf->status_max = n;
+            }
+
+            if (n < 100 || n > 599
+                || hcf->status_max < (ngx_uint_t) n
+                || hcf->status_max > 599)
+            {
+                goto invalid;
+            }
+
+            hcf->status_min = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hcf->body.len = value[i].len - 5;
+            hcf->body.data = &value[i].data[5];
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
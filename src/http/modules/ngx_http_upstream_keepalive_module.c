@@ -9,6 +9,21 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if !(NGX_WIN32)
+#include <ngx_channel.h>
+#endif
+
+
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_WARM          1000
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_WARM_MAX      60000
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_WARM_TIMEOUT  10000
+
+
+typedef struct {
+    ngx_atomic_t                       idle;
+    ngx_atomic_t                       wanted;
+} ngx_http_upstream_keepalive_shm_t;
+
 
 typedef struct {
     ngx_uint_t                         max_cached;
@@ -18,6 +33,20 @@ typedef struct {
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_uint_t                         cached;
+
+    ngx_uint_t                         max_shared;
+    uint32_t                           hash;
+    ngx_shm_zone_t                    *shm_zone;
+
+    ngx_uint_t                         min_idle;
+    ngx_uint_t                         warming;
+    ngx_uint_t                         next;
+    ngx_msec_t                         backoff;
+    ngx_event_t                        warm;
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_conf_t          *upstream_conf;
+    ngx_uint_t                         ssl;
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
@@ -62,6 +91,39 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+    struct sockaddr *sockaddr, socklen_t socklen);
+static void ngx_http_upstream_keepalive_count(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_int_t n);
+
+#if !(NGX_WIN32)
+static ngx_int_t ngx_http_upstream_keepalive_lend(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_receive(ngx_channel_t *ch);
+static ngx_int_t ngx_http_upstream_keepalive_known_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen);
+static ngx_uint_t ngx_http_upstream_keepalive_total(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+#endif
+
+static void ngx_http_upstream_keepalive_warm_timer(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_keepalive_warm(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static void ngx_http_upstream_keepalive_warm_handler(ngx_event_t *ev);
+static void ngx_http_upstream_keepalive_warm_done(ngx_connection_t *c,
+    ngx_int_t rc);
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_keepalive_warm_ssl(ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_warm_ssl_handshake(
+    ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_warm_session(ngx_connection_t *c,
+    ngx_uint_t save);
+static void ngx_http_upstream_keepalive_warm_name(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_str_t *name);
+#endif
+
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
@@ -73,9 +135,16 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static char *ngx_http_upstream_keepalive_init_main_conf(ngx_conf_t *cf,
+    void *conf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_keepalive_shared(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
@@ -108,6 +177,20 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_shared"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_keepalive_shared,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("keepalive_min_idle"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, min_idle),
+      NULL },
+
       ngx_null_command
 };
 
@@ -117,7 +200,7 @@ static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_upstream_keepalive_init_main_conf, /* init main configuration */
 
     ngx_http_upstream_keepalive_create_conf, /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -134,7 +217,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -160,6 +243,9 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_conf_init_msec_value(kcf->time, 3600000);
     ngx_conf_init_msec_value(kcf->timeout, 60000);
     ngx_conf_init_uint_value(kcf->requests, 1000);
+    ngx_conf_init_uint_value(kcf->min_idle, 0);
+
+    kcf->upstream = us;
 
     if (kcf->original_init_upstream(cf, us) != NGX_OK) {
         return NGX_ERROR;
@@ -211,6 +297,18 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
+    if (kcf->min_idle) {
+
+        /* connections are warmed with settings of the last request */
+
+        kcf->upstream_conf = r->upstream->conf;
+        kcf->ssl = r->upstream->ssl;
+
+        if (!kcf->warm.timer_set && !kcf->warm.posted) {
+            ngx_post_event(&kcf->warm, &ngx_posted_events);
+        }
+    }
+
     kp->conf = kcf;
     kp->upstream = r->upstream;
     kp->data = r->upstream->peer.data;
@@ -237,6 +335,7 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
+    ngx_http_upstream_keepalive_shm_t        *sh;
 
     ngx_int_t          rc;
     ngx_queue_t       *q, *cache;
@@ -275,10 +374,27 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+    if (kp->conf->shm_zone && !ngx_exiting) {
+
+        /* ask other worker processes to lend a connection */
+
+        sh = kp->conf->shm_zone->data;
+        sh[ngx_process_slot].wanted = 1;
+    }
+
     return NGX_OK;
 
 found:
 
+    ngx_http_upstream_keepalive_count(kp->conf, -1);
+
+    if (kp->conf->min_idle
+        && kp->conf->cached + kp->conf->warming < kp->conf->min_idle
+        && !kp->conf->warm.posted)
+    {
+        ngx_post_event(&kp->conf->warm, &ngx_posted_events);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
@@ -306,9 +422,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
-    ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
 
@@ -355,12 +469,50 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+#if !(NGX_WIN32)
+
+    if (kp->conf->shm_zone) {
+
+        if (pc->sockaddr->sa_family != AF_UNIX
+            && ngx_http_upstream_keepalive_lend(kp->conf, c) == NGX_OK)
+        {
+            pc->connection = NULL;
+            goto invalid;
+        }
+
+        if (!ngx_queue_empty(&kp->conf->free)
+            && ngx_http_upstream_keepalive_total(kp->conf)
+               >= kp->conf->max_shared)
+        {
+            goto invalid;
+        }
+    }
+
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    pc->connection = NULL;
+
+    ngx_http_upstream_keepalive_save(kp->conf, c, pc->sockaddr, pc->socklen);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c, struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    if (ngx_queue_empty(&kcf->free)) {
 
-        q = ngx_queue_last(&kp->conf->cache);
+        q = ngx_queue_last(&kcf->cache);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
@@ -368,20 +520,20 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_http_upstream_keepalive_close(item->connection);
 
     } else {
-        q = ngx_queue_head(&kp->conf->free);
+        q = ngx_queue_head(&kcf->free);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        ngx_http_upstream_keepalive_count(kcf, 1);
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&kcf->cache, q);
 
     item->connection = c;
 
-    pc->connection = NULL;
-
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, kcf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -397,18 +549,288 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->socklen = socklen;
+    ngx_memcpy(&item->sockaddr, sockaddr, socklen);
 
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
+}
 
-invalid:
 
-    kp->original_free_peer(pc, kp->data, state);
+static void
+ngx_http_upstream_keepalive_count(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_int_t n)
+{
+    ngx_http_upstream_keepalive_shm_t  *sh;
+
+    kcf->cached += n;
+
+    if (kcf->shm_zone) {
+        sh = kcf->shm_zone->data;
+        sh[ngx_process_slot].idle = kcf->cached;
+    }
+}
+
+
+#if !(NGX_WIN32)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_lend(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c)
+{
+    ngx_int_t                           i, s;
+    ngx_channel_t                       ch;
+    ngx_http_upstream_keepalive_shm_t  *sh;
+
+    /* only a surplus connection is lent */
+
+    if (kcf->cached == 0 || ngx_exiting) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    sh = kcf->shm_zone->data;
+
+    for (i = 1; i < ngx_last_process; i++) {
+
+        s = (ngx_process_slot + i) % ngx_last_process;
+
+        if (ngx_processes[s].pid == -1
+            || ngx_processes[s].channel[0] == -1
+            || !sh[s].wanted)
+        {
+            continue;
+        }
+
+        if (!ngx_atomic_cmp_set(&sh[s].wanted, 1, 0)) {
+            continue;
+        }
+
+        ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+        ch.command = NGX_CMD_CONNECTION;
+        ch.pid = ngx_pid;
+        ch.slot = ngx_process_slot;
+        ch.fd = c->fd;
+        ch.tag = kcf->hash;
+        ch.requests = c->requests;
+        ch.start_time = c->start_time;
+
+        if (ngx_write_channel(ngx_processes[s].channel[0], &ch,
+                              sizeof(ngx_channel_t), c->log)
+            != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "free keepalive peer: lending connection %p to %P",
+                       c, ngx_processes[s].pid);
+
+        /* the socket stays open in the other process */
+
+        if (ngx_event_flags & NGX_USE_EPOLL_EVENT) {
+            ngx_del_conn(c, 0);
+        }
+
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_upstream_keepalive_receive(ngx_channel_t *ch)
+{
+    ngx_uint_t                               i;
+    socklen_t                                socklen;
+    ngx_sockaddr_t                           sa;
+    ngx_connection_t                        *c;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+
+    if (umcf == NULL || ngx_terminate || ngx_exiting) {
+        goto failed;
+    }
+
+    /*
+     * the lending worker may run another configuration generation,
+     * so the upstream is looked up by its name, and the connection
+     * is only taken if it goes to one of the upstream's servers
+     */
+
+    uscfp = umcf->upstreams.elts;
+    kcf = NULL;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->shm_zone && kcf->hash == ch->tag) {
+            break;
+        }
+    }
+
+    if (i == umcf->upstreams.nelts || kcf->max_cached == 0) {
+        goto failed;
+    }
+
+    socklen = sizeof(ngx_sockaddr_t);
+
+    if (getpeername(ch->fd, &sa.sockaddr, &socklen) == -1) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, ngx_socket_errno,
+                      "getpeername() of lent connection failed");
+        goto failed;
+    }
+
+    if (ngx_http_upstream_keepalive_known_peer(kcf, &sa.sockaddr, socklen)
+        != NGX_OK)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "keepalive connection lent by %P to unknown peer",
+                       ch->pid);
+        goto failed;
+    }
+
+    c = ngx_get_connection(ch->fd, ngx_cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+    c->sendfile = 1;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c->requests = ch->requests;
+    c->start_time = ch->start_time;
+
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->write->ready = 1;
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            goto close;
+        }
+
+    } else if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto close;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "keepalive connection %p lent by %P", c, ch->pid);
+
+    ngx_http_upstream_keepalive_save(kcf, c, &sa.sockaddr, socklen);
+
+    return;
+
+close:
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+
+    return;
+
+failed:
+
+    if (close(ch->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() lent connection failed");
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_known_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen)
+{
+    ngx_int_t                      rc;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    rc = NGX_DECLINED;
+
+    for (peers = kcf->upstream->peer.data; peers; peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_rlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (!peer->spare
+                && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                    sockaddr, socklen, 1)
+                   == NGX_OK)
+            {
+                rc = NGX_OK;
+                break;
+            }
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if (rc == NGX_OK) {
+            break;
+        }
+    }
+
+    return rc;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_keepalive_total(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_int_t                           s;
+    ngx_uint_t                          total;
+    ngx_http_upstream_keepalive_shm_t  *sh;
+
+    sh = kcf->shm_zone->data;
+
+    total = kcf->cached;
+
+    for (s = 0; s < ngx_last_process; s++) {
+        if (s != ngx_process_slot && ngx_processes[s].pid != -1) {
+            total += sh[s].idle;
+        }
+    }
+
+    return total;
 }
 
+#endif
+
 
 static void
 ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
@@ -458,6 +880,8 @@ close:
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&conf->free, &item->queue);
+
+    ngx_http_upstream_keepalive_count(conf, -1);
 }
 
 
@@ -484,64 +908,606 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
-#if (NGX_HTTP_SSL)
-
-static ngx_int_t
-ngx_http_upstream_keepalive_set_session(ngx_peer_connection_t *pc, void *data)
+static void
+ngx_http_upstream_keepalive_warm_timer(ngx_event_t *ev)
 {
-    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_int_t                                rc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
 
-    return kp->original_set_session(pc, kp->data);
-}
+    kcf = ev->data;
 
+    if (ngx_exiting || kcf->upstream_conf == NULL) {
+        return;
+    }
 
-static void
-ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
-{
-    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive warm \"%V\": %ui cached, %ui warming",
+                   &kcf->upstream->host, kcf->cached, kcf->warming);
 
-    kp->original_save_session(pc, kp->data);
-    return;
-}
+    while (kcf->cached + kcf->warming < kcf->min_idle
+           && !ngx_queue_empty(&kcf->free))
+    {
+        rc = ngx_http_upstream_keepalive_warm(kcf);
 
-#endif
+        if (rc == NGX_DECLINED) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            kcf->backoff = ngx_min(kcf->backoff * 2,
+                                   NGX_HTTP_UPSTREAM_KEEPALIVE_WARM_MAX);
+            break;
+        }
+    }
 
+    ngx_add_timer(ev, kcf->backoff);
+}
 
-static void *
-ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
-{
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
-    conf = ngx_pcalloc(cf->pool,
-                       sizeof(ngx_http_upstream_keepalive_srv_conf_t));
-    if (conf == NULL) {
-        return NULL;
+static ngx_int_t
+ngx_http_upstream_keepalive_warm(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    time_t                                now;
+    ngx_int_t                             rc;
+    ngx_uint_t                            i, n;
+    ngx_queue_t                          *q;
+    ngx_connection_t                     *c;
+    ngx_peer_connection_t                 pc;
+    ngx_http_upstream_conf_t             *conf;
+    ngx_http_upstream_rr_peer_t          *peer, *first;
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    conf = kcf->upstream_conf;
+
+    if (conf->local && conf->local->value) {
+        return NGX_DECLINED;
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->original_init_upstream = NULL;
-     *     conf->original_init_peer = NULL;
-     *     conf->max_cached = 0;
-     */
+    peers = kcf->upstream->peer.data;
 
-    conf->time = NGX_CONF_UNSET_MSEC;
-    conf->timeout = NGX_CONF_UNSET_MSEC;
-    conf->requests = NGX_CONF_UNSET_UINT;
+    /* choose peers in turn, skipping unavailable ones */
 
-    return conf;
-}
+    now = ngx_time();
+    first = NULL;
+    n = 0;
 
+    ngx_http_upstream_rr_peers_rlock(peers);
 
-static char *
-ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_upstream_srv_conf_t            *uscf;
-    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
 
-    ngx_int_t    n;
-    ngx_str_t   *value;
+        if (peer->down || peer->spare) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        if (i >= kcf->next) {
+            n = i;
+            break;
+        }
+
+        if (first == NULL) {
+            first = peer;
+            n = i;
+        }
+    }
+
+    if (peer == NULL) {
+        peer = first;
+    }
+
+    if (peer == NULL) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_DECLINED;
+    }
+
+    kcf->next = n + 1;
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->socklen = peer->socklen;
+    ngx_memcpy(&item->sockaddr, peer->sockaddr, peer->socklen);
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = &item->sockaddr.sockaddr;
+    pc.socklen = item->socklen;
+    pc.name = &kcf->upstream->host;
+    pc.get = ngx_event_get_peer;
+    pc.log = kcf->warm.log;
+    pc.log_error = NGX_ERROR_INFO;
+    pc.local = conf->local ? conf->local->addr : NULL;
+    pc.so_keepalive = conf->socket_keepalive;
+
+    /*
+     * with TCP Fast Open the SYN is only sent with the first data,
+     * so it is only of use when a TLS handshake follows
+     */
+
+    pc.fastopen = kcf->ssl && conf->socket_fastopen;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_queue_insert_head(&kcf->free, q);
+        return NGX_ERROR;
+    }
+
+    c = pc.connection;
+
+    c->pool = ngx_create_pool(128, kcf->warm.log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        ngx_queue_insert_head(&kcf->free, q);
+        return NGX_ERROR;
+    }
+
+    kcf->warming++;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, kcf->warm.log, 0,
+                   "keepalive warm: connecting %p", c);
+
+    c->data = item;
+    c->log = kcf->warm.log;
+    c->log_error = NGX_ERROR_INFO;
+
+    c->read->handler = ngx_http_upstream_keepalive_warm_handler;
+    c->write->handler = ngx_http_upstream_keepalive_warm_handler;
+
+    ngx_add_timer(c->write, conf->connect_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_keepalive_warm_handler(c->write);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_handler(ngx_event_t *ev)
+{
+    int                                      err;
+    socklen_t                                len;
+    ngx_connection_t                        *c;
+    ngx_http_upstream_keepalive_cache_t     *item;
+
+    c = ev->data;
+    item = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "upstream \"%V\" timed out while warming "
+                      "keepalive connection", &item->conf->upstream->host);
+        ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+        return;
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    /*
+     * BSDs and Linux return 0 and set a pending error in err
+     * Solaris returns -1 and sets errno
+     */
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+        == -1)
+    {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_INFO, c->log, err,
+                      "connect() to upstream \"%V\" failed while warming "
+                      "keepalive connection", &item->conf->upstream->host);
+        ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (item->conf->ssl) {
+        ngx_http_upstream_keepalive_warm_ssl(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_keepalive_warm_done(c, NGX_OK);
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_done(ngx_connection_t *c, ngx_int_t rc)
+{
+    socklen_t                                socklen;
+    ngx_sockaddr_t                           sockaddr;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+
+    kcf->warming--;
+
+    ngx_queue_insert_head(&kcf->free, &item->queue);
+
+    if (rc == NGX_OK
+        && !ngx_terminate
+        && !ngx_exiting
+        && ngx_handle_read_event(c->read, 0) == NGX_OK)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "keepalive warm: saving connection %p", c);
+
+        kcf->backoff = NGX_HTTP_UPSTREAM_KEEPALIVE_WARM;
+
+        socklen = item->socklen;
+        ngx_memcpy(&sockaddr, &item->sockaddr, socklen);
+
+        ngx_http_upstream_keepalive_save(kcf, c, &sockaddr.sockaddr, socklen);
+        return;
+    }
+
+    kcf->backoff = ngx_min(kcf->backoff * 2,
+                           NGX_HTTP_UPSTREAM_KEEPALIVE_WARM_MAX);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static void
+ngx_http_upstream_keepalive_warm_ssl(ngx_connection_t *c)
+{
+    u_char                                  *p;
+    ngx_int_t                                rc;
+    ngx_str_t                                name;
+    ngx_http_upstream_conf_t                *conf;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+    conf = kcf->upstream_conf;
+
+    /*
+     * server names and certificates with variables depend on
+     * a request, such connections are not warmed up
+     */
+
+    if (conf->ssl_name
+        || (conf->ssl_certificate
+            && conf->ssl_certificate->value.len
+            && (conf->ssl_certificate->lengths
+                || conf->ssl_certificate_key->lengths)))
+    {
+        ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_ssl_create_connection(conf->ssl, c,
+                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+        return;
+    }
+
+    ngx_http_upstream_keepalive_warm_name(kcf, &name);
+
+    c->ssl->handler = ngx_http_upstream_keepalive_warm_ssl_handshake;
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    if (conf->ssl_server_name
+        && name.len
+        && *name.data != '['
+        && ngx_inet_addr(name.data, name.len) == INADDR_NONE)
+    {
+        p = ngx_pnalloc(c->pool, name.len + 1);
+        if (p == NULL) {
+            ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+            return;
+        }
+
+        (void) ngx_cpystrn(p, name.data, name.len + 1);
+
+        if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) p) == 0) {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_tlsext_host_name(\"%s\") failed", p);
+            ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
+    if (conf->ssl_session_reuse) {
+        ngx_http_upstream_keepalive_warm_session(c, 0);
+    }
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_http_upstream_keepalive_warm_ssl_handshake(c);
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_ssl_handshake(ngx_connection_t *c)
+{
+    long                                     rc;
+    ngx_str_t                                name;
+    ngx_http_upstream_conf_t                *conf;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+    conf = kcf->upstream_conf;
+
+    if (!c->ssl->handshaked) {
+        ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+        return;
+    }
+
+    if (conf->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+            return;
+        }
+
+        ngx_http_upstream_keepalive_warm_name(kcf, &name);
+
+        if (ngx_ssl_check_host(c, &name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &name);
+            ngx_http_upstream_keepalive_warm_done(c, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (conf->ssl_session_reuse) {
+        ngx_http_upstream_keepalive_warm_session(c, 1);
+    }
+
+    if (!c->ssl->sendfile) {
+        c->sendfile = 0;
+    }
+
+    ngx_http_upstream_keepalive_warm_done(c, NGX_OK);
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_session(ngx_connection_t *c, ngx_uint_t save)
+{
+    ngx_peer_connection_t                 pc;
+    ngx_http_upstream_rr_peer_t          *peer;
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_rr_peer_data_t      rrp;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    item = c->data;
+
+    /* sessions are kept in round robin peers, look up the one connected */
+
+    peers = item->conf->upstream->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                         (u_char *) peer->sockaddr,
+                         item->socklen, peer->socklen)
+            == 0)
+        {
+            break;
+        }
+    }
+
+    if (peer) {
+        ngx_memzero(&rrp, sizeof(ngx_http_upstream_rr_peer_data_t));
+        ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+        rrp.peers = peers;
+        rrp.current = peer;
+
+        pc.connection = c;
+        pc.log = c->log;
+
+        if (save) {
+            ngx_http_upstream_save_round_robin_peer_session(&pc, &rrp);
+
+        } else {
+            (void) ngx_http_upstream_set_round_robin_peer_session(&pc, &rrp);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_name(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_str_t *name)
+{
+    u_char  *p, *last;
+
+    /* the name ngx_http_upstream_ssl_name() uses without proxy_ssl_name */
+
+    *name = kcf->upstream->host;
+
+    p = name->data;
+    last = name->data + name->len;
+
+    if (*p == '[') {
+        p = ngx_strlchr(p, last, ']');
+
+        if (p == NULL) {
+            p = name->data;
+        }
+    }
+
+    p = ngx_strlchr(p, last, ':');
+
+    if (p != NULL) {
+        name->len = p - name->data;
+    }
+}
+
+#endif
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+
+    return kp->original_set_session(pc, kp->data);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+
+    kp->original_save_session(pc, kp->data);
+    return;
+}
+
+#endif
+
+
+static char *
+ngx_http_upstream_keepalive_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->shm_zone && kcf->max_cached == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"keepalive_shared\" requires \"keepalive\" "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+
+        if (kcf->min_idle == NGX_CONF_UNSET_UINT || kcf->min_idle == 0) {
+            continue;
+        }
+
+        if (kcf->max_cached == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"keepalive_min_idle\" requires \"keepalive\" "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+
+        if (kcf->min_idle > kcf->max_cached) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"keepalive_min_idle\" exceeds \"keepalive\" "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_cached = 0;
+     *     conf->max_shared = 0;
+     *     conf->shm_zone = NULL;
+     */
+
+    conf->time = NGX_CONF_UNSET_MSEC;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->min_idle = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value;
 
     if (kcf->max_cached) {
         return "is duplicate";
@@ -574,3 +1540,162 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_upstream_keepalive_shared(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+#if (NGX_WIN32)
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "\"keepalive_shared\" is not supported "
+                       "on this platform, ignored");
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_int_t                      n;
+    ngx_str_t                     *value, name;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (kcf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->max_shared = n;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    /* connections are lent by the upstream name, it survives reloads */
+
+    kcf->hash = ngx_crc32_short(uscf->host.data, uscf->host.len);
+
+    name.len = sizeof("upstream_keepalive:") - 1 + uscf->host.len;
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(name.data, "upstream_keepalive:%V", &uscf->host);
+
+    kcf->shm_zone = ngx_shared_memory_add(cf, &name,
+                          sizeof(ngx_http_upstream_keepalive_shm_t)
+                          * NGX_MAX_PROCESSES + 8 * ngx_pagesize,
+                          &ngx_http_upstream_keepalive_module);
+    if (kcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+
+    return NGX_CONF_OK;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_upstream_keepalive_shm_t  *sh;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    /* counters are indexed by process slots */
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_http_upstream_keepalive_shm_t)
+                                 * NGX_MAX_PROCESSES);
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_shm_t       *sh;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->max_cached && kcf->min_idle) {
+            kcf->warm.handler = ngx_http_upstream_keepalive_warm_timer;
+            kcf->warm.log = cycle->log;
+            kcf->warm.data = kcf;
+            kcf->warm.cancelable = 1;
+
+            kcf->backoff = NGX_HTTP_UPSTREAM_KEEPALIVE_WARM;
+        }
+
+        if (kcf->shm_zone == NULL) {
+            continue;
+        }
+
+        /* the slot may have been used by an exited process */
+
+        sh = kcf->shm_zone->data;
+
+        sh[ngx_process_slot].idle = 0;
+        sh[ngx_process_slot].wanted = 0;
+
+#if !(NGX_WIN32)
+        ngx_channel_connection_handler = ngx_http_upstream_keepalive_receive;
+#endif
+    }
+
+    return NGX_OK;
+}
@@ -10,6 +10,18 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_uint_t                      npeers;
+    ngx_str_t                      *server;
+    ngx_str_t                       name;
+    in_port_t                       port;
+    ngx_event_t                     event;
+} ngx_http_upstream_host_t;
+
+
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
@@ -19,6 +31,16 @@ static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_copy_peer(
     ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src);
 
+static char *ngx_http_upstream_zone_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static ngx_int_t ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_upstream_zone_init_hosts(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers);
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *event);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_upstream_zone_update_host(ngx_http_upstream_host_t *host,
+    ngx_resolver_addr_t *addrs, ngx_uint_t naddrs);
+
 
 static ngx_command_t  ngx_http_upstream_zone_commands[] = {
 
@@ -38,7 +60,7 @@ static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_upstream_zone_init_main_conf, /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -55,7 +77,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_process,   /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -323,3 +345,366 @@ failed:
 
     return NULL;
 }
+
+
+static char *
+ngx_http_upstream_zone_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                      i, j;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->servers == NULL) {
+            continue;
+        }
+
+        server = uscf->servers->elts;
+
+        for (j = 0; j < uscf->servers->nelts; j++) {
+            if (server[j].resolve) {
+                break;
+            }
+        }
+
+        if (j == uscf->servers->nelts) {
+            continue;
+        }
+
+        if (uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "resolving names at run time requires "
+                          "upstream \"%V\" in %s:%ui "
+                          "to be in shared memory",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_CONF_ERROR;
+        }
+
+        if (clcf->resolver == NULL
+            || clcf->resolver->connections.nelts == 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no resolver defined to resolve names "
+                          "at run time in upstream \"%V\" in %s:%ui",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_CONF_ERROR;
+        }
+
+        uscf->resolver = clcf->resolver;
+        uscf->resolver_timeout = clcf->resolver_timeout;
+
+        if (uscf->resolver_timeout == NGX_CONF_UNSET_MSEC) {
+            uscf->resolver_timeout = 30000;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    /* names are resolved by the first worker process only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->shm_zone == NULL || uscfp[i]->resolver == NULL) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        if (ngx_http_upstream_zone_init_hosts(cycle, uscfp[i], peers)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (peers->next
+            && ngx_http_upstream_zone_init_hosts(cycle, uscfp[i], peers->next)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_hosts(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_url_t                     u;
+    ngx_http_upstream_host_t     *host;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    host = NULL;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (!peer->resolve) {
+            host = NULL;
+            continue;
+        }
+
+        /* peers of a server are allocated one after another */
+
+        if (host
+            && host->server->len == peer->server.len
+            && ngx_strncmp(host->server->data, peer->server.data,
+                           peer->server.len)
+               == 0)
+        {
+            host->npeers++;
+            continue;
+        }
+
+        ngx_memzero(&u, sizeof(ngx_url_t));
+
+        u.url = peer->server;
+        u.default_port = 80;
+        u.no_resolve = 1;
+
+        if (ngx_parse_url(cycle->pool, &u) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        host = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_host_t));
+        if (host == NULL) {
+            return NGX_ERROR;
+        }
+
+        host->uscf = uscf;
+        host->peers = peers;
+        host->peer = peer;
+        host->npeers = 1;
+        host->server = &peer->server;
+        host->name = u.host;
+        host->port = u.port;
+
+        host->event.handler = ngx_http_upstream_zone_resolve_timer;
+        host->event.data = host;
+        host->event.log = cycle->log;
+        host->event.cancelable = 1;
+
+        ngx_add_timer(&host->event, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *event)
+{
+    ngx_resolver_ctx_t        *ctx;
+    ngx_http_upstream_host_t  *host;
+
+    host = event->data;
+
+    ctx = ngx_resolve_start(host->uscf->resolver, NULL);
+
+    if (ctx == NULL) {
+        goto retry;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "no resolver defined to resolve %V", &host->name);
+        goto retry;
+    }
+
+    ctx->name = host->name;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = host;
+    ctx->timeout = host->uscf->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+retry:
+
+    ngx_add_timer(event, 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                     now;
+    ngx_msec_t                 timer;
+    ngx_http_upstream_host_t  *host;
+
+    host = ctx->data;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                      "upstream \"%V\": %V could not be resolved (%i: %s)",
+                      &host->uscf->host, &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        /* the addresses known are kept unless the name is gone */
+
+        if (ctx->state == NGX_RESOLVE_NXDOMAIN) {
+            ngx_http_upstream_zone_update_host(host, NULL, 0);
+        }
+
+    } else {
+        ngx_http_upstream_zone_update_host(host, ctx->addrs, ctx->naddrs);
+    }
+
+    now = ngx_time();
+
+    timer = (ctx->valid > now) ? (ngx_msec_t) (ctx->valid - now) * 1000
+                               : 1000;
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(&host->event, timer);
+}
+
+
+static void
+ngx_http_upstream_zone_update_host(ngx_http_upstream_host_t *host,
+    ngx_resolver_addr_t *addrs, ngx_uint_t naddrs)
+{
+    ngx_uint_t                     i, j;
+    ngx_http_upstream_rr_peer_t   *peer, *spare;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = host->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* remove peers with addresses the name no longer resolves to */
+
+    for (peer = host->peer, i = 0; i < host->npeers; peer = peer->next, i++) {
+
+        if (peer->spare) {
+            continue;
+        }
+
+        for (j = 0; j < naddrs; j++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[j].sockaddr, addrs[j].socklen, 0)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (j < naddrs) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream \"%V\": server %V removed",
+                      &host->uscf->host, &peer->name);
+
+        peer->down = 1;
+        peer->spare = 1;
+        peers->tries--;
+        peers->spare_weight += peer->weight;
+    }
+
+    /* use spare peers for new addresses, preferably idle ones */
+
+    for (j = 0; j < naddrs; j++) {
+
+        spare = NULL;
+
+        for (peer = host->peer, i = 0;
+             i < host->npeers;
+             peer = peer->next, i++)
+        {
+            if (peer->spare) {
+                if (spare == NULL || (spare->conns && peer->conns == 0)) {
+                    spare = peer;
+                }
+
+                continue;
+            }
+
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[j].sockaddr, addrs[j].socklen, 0)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < host->npeers) {
+            continue;
+        }
+
+        if (spare == NULL) {
+            ngx_log_error(NGX_LOG_WARN, host->event.log, 0,
+                          "upstream \"%V\": too many addresses for %V",
+                          &host->uscf->host, host->server);
+            break;
+        }
+
+        ngx_memcpy(spare->sockaddr, addrs[j].sockaddr, addrs[j].socklen);
+        spare->socklen = addrs[j].socklen;
+
+        ngx_inet_set_port(spare->sockaddr, host->port);
+
+        spare->name.len = ngx_sock_ntop(spare->sockaddr, spare->socklen,
+                                        spare->name.data,
+                                        NGX_SOCKADDR_STRLEN, 1);
+
+        spare->current_weight = 0;
+        spare->effective_weight = spare->weight;
+        spare->fails = 0;
+        spare->ewma = 0;
+        spare->start_time = ngx_current_msec;
+
+        spare->down = 0;
+        spare->spare = 0;
+        peers->tries++;
+        peers->spare_weight -= spare->weight;
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream \"%V\": server %V added",
+                      &host->uscf->host, &spare->name);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
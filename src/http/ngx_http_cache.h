@@ -27,7 +27,7 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      128
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
-#define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_VERSION       7
 
 
 typedef struct {
@@ -36,6 +36,23 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_tag_link_s  ngx_http_file_cache_tag_link_t;
+
+
+/*
+ * ranges present in a partially cached response, one bit per slice,
+ * followed by the slices being fetched, locked until lock_time
+ */
+
+typedef struct {
+    off_t                            length;
+    size_t                           size;
+    ngx_msec_t                       lock_time;
+    u_char                          *busy;
+    u_char                           bitmap[1];
+} ngx_http_file_cache_partial_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +68,9 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         protected:1;
+    unsigned                         unindexed:1;
+                                     /* 8 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +78,30 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+
+    ngx_http_file_cache_tag_link_t  *tags;
+    ngx_http_file_cache_partial_t   *partial;
 } ngx_http_file_cache_node_t;
 
 
+/* a key prefix or a surrogate key of the invalidation index */
+
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_rbtree_t                    *tree;
+    ngx_queue_t                      links;
+    u_char                           data[1];
+} ngx_http_file_cache_tag_t;
+
+
+struct ngx_http_file_cache_tag_link_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_tag_link_t  *next;
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -82,10 +122,18 @@ struct ngx_http_cache_s {
 
     size_t                           buffer_size;
     size_t                           header_start;
+    size_t                           headers_start;
     size_t                           body_start;
     off_t                            length;
     off_t                            fs_size;
 
+    size_t                           partial_size;
+    off_t                            partial_length;
+    off_t                            partial_start;
+    off_t                            partial_end;
+    off_t                            range_start;
+    off_t                            range_end;
+
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
@@ -122,6 +170,11 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         partial:1;
+    unsigned                         partial_update:1;
+    unsigned                         partial_updating:1;
+    unsigned                         partial_waiting:1;
 };
 
 
@@ -136,6 +189,8 @@ typedef struct {
     u_short                          valid_msec;
     u_short                          header_start;
     u_short                          body_start;
+    u_short                          headers_start;
+    u_char                           partial;
     u_char                           etag_len;
     u_char                           etag[NGX_HTTP_CACHE_ETAG_LEN];
     u_char                           vary_len;
@@ -144,15 +199,62 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+/*
+ * pre-parsed response headers stored between the raw response header
+ * and the body: ngx_http_file_cache_headers_t and the status line followed
+ * by ngx_http_file_cache_header_elt_t and null-terminated name, value,
+ * and lowercased name of each header
+ */
+
+typedef struct {
+    ngx_uint_t                       status;
+    off_t                            content_length_n;
+    u_short                          status_line_len;
+    u_short                          count;
+} ngx_http_file_cache_headers_t;
+
+
+typedef struct {
+    ngx_uint_t                       hash;
+    u_short                          key_len;
+    u_short                          value_len;
+    u_char                           null_value;
+} ngx_http_file_cache_header_elt_t;
+
+
+typedef struct {
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     admitted;
+    ngx_atomic_t                     rejected;
+    ngx_atomic_t                     evicted;
+} ngx_http_file_cache_stat_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
+    ngx_queue_t                      protected;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
     off_t                            size;
     ngx_uint_t                       count;
+    ngx_uint_t                       protected_count;
     ngx_uint_t                       watermark;
+
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_width;
+    ngx_uint_t                       sketch_additions;
+    ngx_uint_t                       sketch_aging;
+
+    ngx_rbtree_t                     prefixes;
+    ngx_rbtree_node_t                prefixes_sentinel;
+    ngx_rbtree_t                     tags;
+    ngx_rbtree_node_t                tags_sentinel;
+    ngx_uint_t                       unindexed;
+
+    ngx_http_file_cache_stat_t       stat;
 } ngx_http_file_cache_sh_t;
 
 
@@ -182,8 +284,19 @@ struct ngx_http_file_cache_s {
 
     ngx_shm_zone_t                  *shm_zone;
 
+    ngx_uint_t                       admit_uses;
+
+    ngx_uint_t                       prefix_index;
+    ngx_str_t                        tag_header;
+
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
+    ngx_uint_t                       admission;
+                                     /* unsigned admission:1 */
+    ngx_uint_t                       preallocate;
+                                     /* unsigned preallocate:1 */
+    ngx_uint_t                       write_behind;
+                                     /* unsigned write_behind:1 */
 };
 
 
@@ -191,12 +304,19 @@ ngx_int_t ngx_http_file_cache_new(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_wait(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_partial_open(ngx_http_request_t *r,
+    ngx_temp_file_t *tf, ngx_buf_t *b);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
+ngx_http_file_cache_t *ngx_http_file_cache_find(ngx_cycle_t *cycle,
+    ngx_str_t *name);
+ngx_int_t ngx_http_file_cache_invalidate(ngx_http_file_cache_t *cache,
+    ngx_str_t *value, ngx_uint_t prefix, ngx_uint_t *count);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
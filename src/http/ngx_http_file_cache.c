@@ -11,6 +11,7 @@
 #include <ngx_md5.h>
 
 
+static ngx_int_t ngx_http_file_cache_init_sketch(ngx_shm_zone_t *shm_zone);
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -45,6 +46,38 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
+static void ngx_http_file_cache_drop_pages(void *data);
+static ngx_int_t ngx_http_file_cache_test_partial(ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_partial_slices(ngx_http_cache_t *c,
+    ngx_http_file_cache_partial_t *partial, ngx_uint_t *first,
+    ngx_uint_t *last);
+static ngx_uint_t ngx_http_file_cache_partial_busy(ngx_http_cache_t *c,
+    ngx_http_file_cache_partial_t *partial);
+static void ngx_http_file_cache_partial_unlock(ngx_http_cache_t *c);
+static void ngx_http_file_cache_set_partial(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_uint_t freq);
+static ngx_uint_t ngx_http_file_cache_sketch_add(ngx_http_file_cache_sh_t *sh,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_sh_t *sh, u_char *key);
+static void ngx_http_file_cache_sketch_counters(ngx_http_file_cache_sh_t *sh,
+    u_char *key, u_char **counters);
+static void ngx_http_file_cache_enqueue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t promote);
+static ngx_queue_t *ngx_http_file_cache_victim(ngx_http_file_cache_sh_t *sh);
+static ngx_queue_t *ngx_http_file_cache_oldest(ngx_http_file_cache_sh_t *sh);
+static void ngx_http_file_cache_index(ngx_http_request_t *r,
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_add_tag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_rbtree_t *tree, ngx_str_t *value);
+static ngx_uint_t ngx_http_file_cache_prefix_end(u_char *p, size_t len,
+    size_t i);
+static void ngx_http_file_cache_unindex(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
@@ -79,6 +112,14 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+#define NGX_HTTP_FILE_CACHE_SKETCH_DEPTH   4
+#define NGX_HTTP_FILE_CACHE_SKETCH_SAMPLE  10
+#define NGX_HTTP_FILE_CACHE_SKETCH_MAX     255
+
+/* the protected segment share of all nodes, in percents */
+#define NGX_HTTP_FILE_CACHE_PROTECTED      80
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -121,6 +162,10 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
+        if (cache->admission && cache->sh->sketch == NULL) {
+            return ngx_http_file_cache_init_sketch(shm_zone);
+        }
+
         return NGX_OK;
     }
 
@@ -145,11 +190,19 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
                     ngx_http_file_cache_rbtree_insert_value);
 
     ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->protected);
+
+    ngx_rbtree_init(&cache->sh->prefixes, &cache->sh->prefixes_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&cache->sh->tags, &cache->sh->tags_sentinel,
+                    ngx_str_rbtree_insert_value);
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
+    cache->sh->protected_count = 0;
+    cache->sh->unindexed = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
@@ -168,6 +221,44 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    if (cache->admission) {
+        return ngx_http_file_cache_init_sketch(shm_zone);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_init_sketch(ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t              n, width;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    /*
+     * the sketch is sized to have about one counter in each row
+     * for every node the keys zone is able to hold
+     */
+
+    n = shm_zone->shm.size / sizeof(ngx_http_file_cache_node_t);
+
+    for (width = 64; width < n; width <<= 1) { /* void */ }
+
+    cache->sh->sketch = ngx_slab_calloc(cache->shpool,
+                                    NGX_HTTP_FILE_CACHE_SKETCH_DEPTH * width);
+    if (cache->sh->sketch == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "could not allocate admission sketch%s",
+                      cache->shpool->log_ctx);
+        return NGX_ERROR;
+    }
+
+    cache->sh->sketch_width = width;
+    cache->sh->sketch_additions = 0;
+    cache->sh->sketch_aging = 0;
+
     return NGX_OK;
 }
 
@@ -216,6 +307,11 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    if (c->node == NULL) {
+        /* not admitted */
+        return NGX_DECLINED;
+    }
+
     if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
         return NGX_ERROR;
     }
@@ -265,7 +361,7 @@ ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
     ngx_int_t                  rc, rv;
-    ngx_uint_t                 test;
+    ngx_uint_t                 test, lookup;
     ngx_http_cache_t          *c;
     ngx_pool_cleanup_t        *cln;
     ngx_open_file_info_t       of;
@@ -284,6 +380,8 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     cache = c->file_cache;
 
+    lookup = 0;
+
     if (c->node == NULL) {
         cln = ngx_pool_cleanup_add(r->pool, 0);
         if (cln == NULL) {
@@ -292,6 +390,8 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
         cln->handler = ngx_http_file_cache_cleanup;
         cln->data = c;
+
+        lookup = !c->secondary;
     }
 
     c->buffer_size = c->body_start;
@@ -305,6 +405,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return rc;
     }
 
+    if (lookup) {
+        if (rc == NGX_OK && (c->exists || c->error)) {
+            (void) ngx_atomic_fetch_add(&cache->sh->stat.hits, 1);
+
+        } else {
+            (void) ngx_atomic_fetch_add(&cache->sh->stat.misses, 1);
+        }
+    }
+
     if (rc == NGX_AGAIN) {
         return NGX_HTTP_CACHE_SCARCE;
     }
@@ -440,6 +549,29 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_HTTP_CACHE_SCARCE;
     }
 
+    return ngx_http_file_cache_wait(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_wait(ngx_http_request_t *r)
+{
+    ngx_msec_t         now, timer;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    /*
+     * wait for another request to update the cache element under
+     * the cache lock, either a new one or an expired one
+     */
+
+    if (c->lock_timeout == 0) {
+        return NGX_DECLINED;
+    }
+
+    now = ngx_current_msec;
+
     c->waiting = 1;
 
     if (c->wait_time == 0) {
@@ -483,9 +615,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                      wait;
+    ngx_msec_t                      now, timer;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_partial_t  *partial;
 
     now = ngx_current_msec;
 
@@ -503,10 +636,22 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    timer = c->node->lock_time - now;
+    if (c->partial_waiting) {
+        partial = c->node->partial;
+        timer = partial ? partial->lock_time - now : 0;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
-        wait = 1;
+        if ((ngx_msec_int_t) timer > 0
+            && ngx_http_file_cache_partial_busy(c, partial))
+        {
+            wait = 1;
+        }
+
+    } else {
+        timer = c->node->lock_time - now;
+
+        if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+            wait = 1;
+        }
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
@@ -519,6 +664,7 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 wakeup:
 
     c->waiting = 0;
+    c->partial_waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
@@ -584,6 +730,16 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_DECLINED;
     }
 
+    if (h->headers_start
+        && (h->headers_start < h->header_start
+            || h->headers_start > h->body_start))
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect headers offset",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
     if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
         ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
                       "cache file \"%s\" has incorrect vary length",
@@ -603,12 +759,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     c->buf->last += n;
 
-    c->valid_sec = h->valid_sec;
+    /* an invalidated entry is neither fresh nor usable as stale */
+
+    c->valid_sec = c->purged ? 0 : h->valid_sec;
     c->updating_sec = h->updating_sec;
     c->error_sec = h->error_sec;
     c->last_modified = h->last_modified;
     c->date = h->date;
     c->valid_msec = h->valid_msec;
+    c->headers_start = h->headers_start;
     c->body_start = h->body_start;
     c->etag.len = h->etag_len;
     c->etag.data = h->etag;
@@ -629,6 +788,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->fs_size = c->fs_size;
 
             cache->sh->size += c->fs_size;
+
+            /* a file stored before the start is not in the index */
+
+            c->node->unindexed = 1;
+            cache->sh->unindexed++;
         }
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
@@ -636,17 +800,55 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     now = ngx_time();
 
-    if (c->valid_sec < now) {
+    if (h->partial) {
+        rc = ngx_http_file_cache_test_partial(c);
+
+        if (rc == NGX_BUSY) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache partial lock");
+
+            if (c->lock_timeout == 0) {
+                return NGX_HTTP_CACHE_SCARCE;
+            }
+
+            c->partial_waiting = 1;
+
+            return ngx_http_file_cache_wait(r);
+        }
+
+        if (rc == NGX_AGAIN && c->valid_sec >= now) {
+            c->partial_update = 1;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache partial miss: %i u:%d",
+                           rc, c->partial_update);
+            return NGX_DECLINED;
+        }
+
+        c->partial = 1;
+    }
+
+    if (c->valid_sec < now || c->purged) {
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (c->node->updating) {
+        /*
+         * only one request across all workers updates an expired element;
+         * if it does not complete within lock_age, another one may take over
+         */
+
+        if (c->node->updating
+            && (ngx_msec_int_t) (c->node->lock_time - ngx_current_msec) > 0)
+        {
             rc = NGX_HTTP_CACHE_UPDATING;
 
         } else {
             c->node->updating = 1;
+            c->node->lock_time = ngx_current_msec + c->lock_age;
             c->updating = 1;
             c->lock_time = c->node->lock_time;
             rc = NGX_HTTP_CACHE_STALE;
@@ -822,14 +1024,22 @@ static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
     ngx_int_t                    rc;
+    ngx_uint_t                   freq, promote;
     ngx_http_file_cache_node_t  *fcn;
 
+    freq = 0;
+    promote = 0;
+
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     fcn = c->node;
 
     if (fcn == NULL) {
         fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (cache->admission && cache->sh->sketch) {
+            freq = ngx_http_file_cache_sketch_add(cache->sh, c->key);
+        }
     }
 
     if (fcn) {
@@ -838,96 +1048,1040 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         if (c->node == NULL) {
             fcn->uses++;
             fcn->count++;
+
+            promote = fcn->exists;
         }
 
         if (fcn->error) {
 
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
-            }
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        if (fcn->exists || fcn->uses >= c->min_uses) {
+
+            c->exists = fcn->exists;
+            if (fcn->body_start && !c->update_variant) {
+                c->body_start = fcn->body_start;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        rc = NGX_AGAIN;
+
+        goto done;
+    }
+
+    if (freq && !c->update_variant && !cache->sh->cold) {
+
+        if (ngx_http_file_cache_admit(cache, c, freq) != NGX_OK) {
+            (void) ngx_atomic_fetch_add(&cache->sh->stat.rejected, 1);
+            rc = NGX_AGAIN;
+            goto failed;
+        }
+
+        (void) ngx_atomic_fetch_add(&cache->sh->stat.admitted, 1);
+    }
+
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        (void) ngx_http_file_cache_forced_expire(cache);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
+            rc = NGX_ERROR;
+            goto failed;
+        }
+    }
+
+    cache->sh->count++;
+
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+    fcn->uses = 1;
+    fcn->count = 1;
+
+renew:
+
+    rc = NGX_DECLINED;
+
+    if (fcn->unindexed) {
+        fcn->unindexed = 0;
+        cache->sh->unindexed--;
+    }
+
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->valid_sec = 0;
+    fcn->uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
+
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_http_file_cache_enqueue(cache, fcn, promote);
+
+    c->uniq = fcn->uniq;
+    c->error = fcn->error;
+    c->purged = fcn->purged;
+    c->node = fcn;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_test_partial(ngx_http_cache_t *c)
+{
+    ngx_int_t                       rc;
+    ngx_msec_t                      now;
+    ngx_uint_t                      i, n, first, last;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_partial_t  *partial;
+
+    if (c->partial_size == 0) {
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    partial = c->node->partial;
+
+    if (partial == NULL
+        || c->node->uniq != c->uniq
+        || partial->size != c->partial_size)
+    {
+        goto done;
+    }
+
+    c->partial_length = partial->length;
+
+    rc = NGX_OK;
+
+    if (ngx_http_file_cache_partial_slices(c, partial, &first, &last)
+        != NGX_OK)
+    {
+        goto done;
+    }
+
+    for (i = first; i <= last; i++) {
+        if ((partial->bitmap[i / 8] & (1 << (i % 8))) == 0) {
+            rc = NGX_AGAIN;
+            break;
+        }
+    }
+
+    if (rc == NGX_OK || !c->lock) {
+        goto done;
+    }
+
+    /*
+     * as with the cache lock, the missing slices are fetched by one
+     * request at a time, other requests for them wait until they are
+     * stored; the locks of all slices expire together
+     */
+
+    now = ngx_current_msec;
+
+    if ((ngx_msec_int_t) (partial->lock_time - now) <= 0) {
+        n = (ngx_uint_t) ((partial->length + partial->size - 1)
+                          / partial->size);
+
+        ngx_memzero(partial->busy, (n + 7) / 8);
+
+    } else if (ngx_http_file_cache_partial_busy(c, partial)) {
+        rc = NGX_BUSY;
+        goto done;
+    }
+
+    for (i = first; i <= last; i++) {
+        if ((partial->bitmap[i / 8] & (1 << (i % 8))) == 0) {
+            partial->busy[i / 8] |= (u_char) (1 << (i % 8));
+        }
+    }
+
+    c->partial_updating = 1;
+
+    if ((ngx_msec_int_t) (now + c->lock_age - partial->lock_time) > 0) {
+        partial->lock_time = now + c->lock_age;
+    }
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_partial_slices(ngx_http_cache_t *c,
+    ngx_http_file_cache_partial_t *partial, ngx_uint_t *first,
+    ngx_uint_t *last)
+{
+    off_t  end;
+
+    if (partial->size != c->partial_size
+        || c->range_start >= partial->length)
+    {
+        return NGX_DECLINED;
+    }
+
+    end = partial->length - 1;
+
+    if (c->range_end != -1 && c->range_end < end) {
+        end = c->range_end;
+    }
+
+    *first = (ngx_uint_t) (c->range_start / partial->size);
+    *last = (ngx_uint_t) (end / partial->size);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_partial_busy(ngx_http_cache_t *c,
+    ngx_http_file_cache_partial_t *partial)
+{
+    ngx_uint_t  i, first, last;
+
+    if (ngx_http_file_cache_partial_slices(c, partial, &first, &last)
+        != NGX_OK)
+    {
+        return 0;
+    }
+
+    for (i = first; i <= last; i++) {
+        if ((partial->busy[i / 8] & (1 << (i % 8)))
+            && (partial->bitmap[i / 8] & (1 << (i % 8))) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_file_cache_partial_unlock(ngx_http_cache_t *c)
+{
+    ngx_uint_t                      i, first, last;
+    ngx_http_file_cache_partial_t  *partial;
+
+    if (!c->partial_updating) {
+        return;
+    }
+
+    c->partial_updating = 0;
+
+    partial = c->node->partial;
+
+    if (partial == NULL
+        || ngx_http_file_cache_partial_slices(c, partial, &first, &last)
+           != NGX_OK)
+    {
+        return;
+    }
+
+    for (i = first; i <= last; i++) {
+        partial->busy[i / 8] &= (u_char) ~(1 << (i % 8));
+    }
+}
+
+
+static void
+ngx_http_file_cache_set_partial(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    off_t                           end;
+    size_t                          len;
+    ngx_uint_t                      i, n;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_partial_t  *partial;
+
+    fcn = c->node;
+
+    if (!c->partial) {
+        if (fcn->partial) {
+            ngx_slab_free_locked(cache->shpool, fcn->partial);
+            fcn->partial = NULL;
+        }
+
+        return;
+    }
+
+    n = (ngx_uint_t) ((c->partial_length + c->partial_size - 1)
+                      / c->partial_size);
+
+    if (!c->partial_update) {
+
+        /* a new cache file, only the range just stored is present */
+
+        if (fcn->partial) {
+            ngx_slab_free_locked(cache->shpool, fcn->partial);
+        }
+
+        len = offsetof(ngx_http_file_cache_partial_t, bitmap)
+              + 2 * ((n + 7) / 8);
+
+        fcn->partial = ngx_slab_calloc_locked(cache->shpool, len);
+        if (fcn->partial == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate partial cache bitmap%s",
+                          cache->shpool->log_ctx);
+            return;
+        }
+
+        fcn->partial->length = c->partial_length;
+        fcn->partial->size = c->partial_size;
+        fcn->partial->busy = fcn->partial->bitmap + (n + 7) / 8;
+    }
+
+    partial = fcn->partial;
+
+    /* only slices stored completely are marked */
+
+    for (i = (ngx_uint_t) ((c->partial_start + c->partial_size - 1)
+                           / c->partial_size);
+         i < n;
+         i++)
+    {
+        end = (off_t) ((i + 1) * c->partial_size);
+
+        if (end > c->partial_length) {
+            end = c->partial_length;
+        }
+
+        if (end > c->partial_end + 1) {
+            break;
+        }
+
+        partial->bitmap[i / 8] |= (u_char) (1 << (i % 8));
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache partial: %O-%O/%O u:%d",
+                   c->partial_start, c->partial_end, c->partial_length,
+                   c->partial_update);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_partial_open(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    ngx_buf_t *b)
+{
+    ssize_t                   n;
+    ngx_fd_t                  fd;
+    ngx_file_info_t           fi;
+    ngx_http_cache_t         *c;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    c = r->cache;
+
+    if (!c->partial_update) {
+
+        /* the response header is written first, the range is written after */
+
+        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                 tf->persistent, tf->clean, tf->access)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        n = ngx_write_file(&tf->file, b->pos, b->last - b->pos, 0);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        /* the file is extended to its full size, missing ranges are holes */
+
+        if (c->partial_length) {
+            n = ngx_write_file(&tf->file, (u_char *) "", 1,
+                               c->body_start + c->partial_length - 1);
+
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        tf->offset = c->body_start + c->partial_start;
+
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(c->file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->connection->log;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (ngx_file_uniq(&fi) != c->uniq) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    tf->file.fd = fd;
+    tf->file.name = c->file.name;
+    tf->offset = c->body_start + c->partial_start;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache, ngx_http_cache_t *c,
+    ngx_uint_t freq)
+{
+    ngx_uint_t                   victim;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    if (freq < cache->admit_uses) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                       "http file cache admission: %ui < %ui",
+                       freq, cache->admit_uses);
+        return NGX_DECLINED;
+    }
+
+    if (cache->sh->size < cache->max_size
+        && cache->sh->count < cache->sh->watermark)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the cache is full, so a new node is only admitted
+     * if it is requested more often than the eviction candidate
+     */
+
+    q = ngx_http_file_cache_victim(cache->sh);
+
+    if (q == NULL) {
+        return NGX_OK;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    victim = ngx_http_file_cache_sketch_estimate(cache->sh, key);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache admission: %ui victim:%ui",
+                   freq, victim);
+
+    return (freq > victim) ? NGX_OK : NGX_DECLINED;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_sh_t *sh, u_char *key)
+{
+    u_char      *counters[NGX_HTTP_FILE_CACHE_SKETCH_DEPTH];
+    ngx_uint_t   i, min;
+
+    ngx_http_file_cache_sketch_counters(sh, key, counters);
+
+    min = NGX_HTTP_FILE_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        if (*counters[i] < min) {
+            min = *counters[i];
+        }
+    }
+
+    if (min == NGX_HTTP_FILE_CACHE_SKETCH_MAX) {
+        return min;
+    }
+
+    /* conservative update: only the smallest counters are incremented */
+
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        if (*counters[i] == min) {
+            (*counters[i])++;
+        }
+    }
+
+    /*
+     * aging: all counters are halved once per sample of "width * SAMPLE"
+     * additions; this is done a column at a time, so that the work under
+     * the zone lock does not depend on the size of the sketch
+     */
+
+    if (++sh->sketch_additions == NGX_HTTP_FILE_CACHE_SKETCH_SAMPLE) {
+        sh->sketch_additions = 0;
+
+        for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+            sh->sketch[i * sh->sketch_width + sh->sketch_aging] >>= 1;
+        }
+
+        sh->sketch_aging = (sh->sketch_aging + 1) & (sh->sketch_width - 1);
+    }
+
+    return min + 1;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_sh_t *sh, u_char *key)
+{
+    u_char      *counters[NGX_HTTP_FILE_CACHE_SKETCH_DEPTH];
+    ngx_uint_t   i, min;
+
+    ngx_http_file_cache_sketch_counters(sh, key, counters);
+
+    min = NGX_HTTP_FILE_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        if (*counters[i] < min) {
+            min = *counters[i];
+        }
+    }
+
+    return min;
+}
+
+
+static void
+ngx_http_file_cache_sketch_counters(ngx_http_file_cache_sh_t *sh, u_char *key,
+    u_char **counters)
+{
+    uint32_t    hash;
+    ngx_uint_t  i;
+
+    /* the key is an md5 hash, so its words are used as row hashes */
+
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        counters[i] = sh->sketch + i * sh->sketch_width
+                      + (hash & (sh->sketch_width - 1));
+    }
+}
+
+
+static void
+ngx_http_file_cache_enqueue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t promote)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *last;
+
+    sh = cache->sh;
+
+    if (!cache->admission) {
+        if (fcn->protected) {
+            fcn->protected = 0;
+            sh->protected_count--;
+        }
+
+        ngx_queue_insert_head(&sh->queue, &fcn->queue);
+        return;
+    }
+
+    /*
+     * segmented LRU: nodes enter the probation segment,
+     * and are promoted to the protected one on a hit
+     */
+
+    if (promote && !fcn->protected) {
+        fcn->protected = 1;
+        sh->protected_count++;
+    }
+
+    if (!fcn->protected) {
+        ngx_queue_insert_head(&sh->queue, &fcn->queue);
+        return;
+    }
+
+    ngx_queue_insert_head(&sh->protected, &fcn->queue);
+
+    while (sh->protected_count * 100
+           > sh->count * NGX_HTTP_FILE_CACHE_PROTECTED)
+    {
+        q = ngx_queue_last(&sh->protected);
+        last = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+
+        last->protected = 0;
+        sh->protected_count--;
+
+        ngx_queue_insert_head(&sh->queue, q);
+    }
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_victim(ngx_http_file_cache_sh_t *sh)
+{
+    if (!ngx_queue_empty(&sh->queue)) {
+        return ngx_queue_last(&sh->queue);
+    }
+
+    if (!ngx_queue_empty(&sh->protected)) {
+        return ngx_queue_last(&sh->protected);
+    }
+
+    return NULL;
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_oldest(ngx_http_file_cache_sh_t *sh)
+{
+    ngx_queue_t                 *q, *p;
+    ngx_http_file_cache_node_t  *fcn, *fcp;
+
+    if (ngx_queue_empty(&sh->protected)) {
+        return ngx_queue_empty(&sh->queue) ? NULL : ngx_queue_last(&sh->queue);
+    }
+
+    p = ngx_queue_last(&sh->protected);
+
+    if (ngx_queue_empty(&sh->queue)) {
+        return p;
+    }
+
+    q = ngx_queue_last(&sh->queue);
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    fcp = ngx_queue_data(p, ngx_http_file_cache_node_t, queue);
+
+    return (fcp->expire < fcn->expire) ? p : q;
+}
+
+
+static void
+ngx_http_file_cache_index(ngx_http_request_t *r, ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    u_char            *p, *last, *start;
+    size_t             len;
+    ngx_str_t          value, *key;
+    ngx_uint_t         i, n;
+    ngx_list_part_t   *part;
+    ngx_table_elt_t   *h;
+    ngx_http_cache_t  *c;
+
+    ngx_http_file_cache_unindex(cache, fcn);
+
+    if (fcn->unindexed) {
+        fcn->unindexed = 0;
+        cache->sh->unindexed--;
+    }
+
+    c = r->cache;
+
+    if (cache->prefix_index) {
+
+        /*
+         * index key prefixes which end with "/",
+         * skipping "//" as in "http://"
+         */
+
+        len = 0;
+        key = c->keys.elts;
+
+        for (i = 0; i < c->keys.nelts; i++) {
+            len += key[i].len;
+        }
+
+        start = ngx_pnalloc(r->pool, len);
+        if (start == NULL) {
+            return;
+        }
+
+        p = start;
+
+        for (i = 0; i < c->keys.nelts; i++) {
+            p = ngx_cpymem(p, key[i].data, key[i].len);
+        }
+
+        n = 0;
+
+        for (i = 0; i < len && n < cache->prefix_index; i++) {
+
+            if (!ngx_http_file_cache_prefix_end(start, len, i)) {
+                continue;
+            }
+
+            value.len = i + 1;
+            value.data = start;
+
+            if (ngx_http_file_cache_add_tag(cache, fcn, &cache->sh->prefixes,
+                                            &value)
+                != NGX_OK)
+            {
+                return;
+            }
+
+            n++;
+        }
+    }
+
+    if (cache->tag_header.len == 0 || r->upstream == NULL) {
+        return;
+    }
+
+    /* surrogate keys are separated by spaces or commas */
+
+    part = &r->upstream->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0
+            || h[i].key.len != cache->tag_header.len
+            || ngx_strncasecmp(h[i].key.data, cache->tag_header.data,
+                               h[i].key.len)
+               != 0)
+        {
+            continue;
+        }
+
+        p = h[i].value.data;
+        last = p + h[i].value.len;
+
+        while (p < last) {
+
+            if (*p == ' ' || *p == ',') {
+                p++;
+                continue;
+            }
+
+            start = p;
+
+            while (p < last && *p != ' ' && *p != ',') {
+                p++;
+            }
+
+            value.len = p - start;
+            value.data = start;
+
+            if (ngx_http_file_cache_add_tag(cache, fcn, &cache->sh->tags,
+                                            &value)
+                != NGX_OK)
+            {
+                return;
+            }
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_tag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_rbtree_t *tree, ngx_str_t *value)
+{
+    uint32_t                         hash;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_tag_link_t  *link;
+
+    hash = ngx_crc32_long(value->data, value->len);
+
+    tag = (ngx_http_file_cache_tag_t *)
+              ngx_str_rbtree_lookup(tree, value, hash);
+
+    if (tag) {
+        for (link = fcn->tags; link; link = link->next) {
+            if (link->tag == tag) {
+                return NGX_OK;
+            }
+        }
+
+    } else {
+        tag = ngx_slab_alloc_locked(cache->shpool,
+                                    offsetof(ngx_http_file_cache_tag_t, data)
+                                    + value->len);
+        if (tag == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(tag->data, value->data, value->len);
+
+        tag->sn.node.key = hash;
+        tag->sn.str.len = value->len;
+        tag->sn.str.data = tag->data;
+        tag->tree = tree;
+
+        ngx_queue_init(&tag->links);
+
+        ngx_rbtree_insert(tree, &tag->sn.node);
+    }
+
+    link = ngx_slab_alloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_tag_link_t));
+    if (link == NULL) {
+
+        if (ngx_queue_empty(&tag->links)) {
+            ngx_rbtree_delete(tree, &tag->sn.node);
+            ngx_slab_free_locked(cache->shpool, tag);
+        }
+
+        goto failed;
+    }
+
+    link->tag = tag;
+    link->node = fcn;
+    link->next = fcn->tags;
+    fcn->tags = link;
+
+    ngx_queue_insert_tail(&tag->links, &link->queue);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                  "could not allocate cache index entry%s",
+                  cache->shpool->log_ctx);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_prefix_end(u_char *p, size_t len, size_t i)
+{
+    /* a prefix ends with "/", but not with "//" as in "http://" */
+
+    return p[i] == '/'
+           && (i == 0 || p[i - 1] != '/')
+           && (i + 1 == len || p[i + 1] != '/');
+}
+
+
+static void
+ngx_http_file_cache_unindex(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_tag_link_t  *link, *next;
+
+    for (link = fcn->tags; link; link = next) {
+        next = link->next;
+        tag = link->tag;
+
+        ngx_queue_remove(&link->queue);
+
+        if (ngx_queue_empty(&tag->links)) {
+            ngx_rbtree_delete(tag->tree, &tag->sn.node);
+            ngx_slab_free_locked(cache->shpool, tag);
+        }
+
+        ngx_slab_free_locked(cache->shpool, link);
+    }
+
+    fcn->tags = NULL;
+}
+
+
+ngx_int_t
+ngx_http_file_cache_invalidate(ngx_http_file_cache_t *cache, ngx_str_t *value,
+    ngx_uint_t prefix, ngx_uint_t *count)
+{
+    time_t                           now;
+    size_t                           i;
+    uint32_t                         hash;
+    ngx_uint_t                       n;
+    ngx_queue_t                     *q;
+    ngx_rbtree_t                    *tree;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_node_t      *fcn;
+    ngx_http_file_cache_tag_link_t  *link;
+
+    if (prefix) {
+
+        /*
+         * only the prefixes of the first prefix_index levels are
+         * indexed, other ones cannot be matched without reading
+         * all cache files
+         */
+
+        n = 0;
+
+        for (i = 0; i < value->len; i++) {
+            if (ngx_http_file_cache_prefix_end(value->data, value->len, i)) {
+                n++;
+            }
+        }
+
+        if (n == 0
+            || n > cache->prefix_index
+            || !ngx_http_file_cache_prefix_end(value->data, value->len,
+                                               value->len - 1))
+        {
+            return NGX_DECLINED;
+        }
+
+        tree = &cache->sh->prefixes;
 
-            rc = NGX_OK;
+    } else {
 
-            goto done;
+        if (cache->tag_header.len == 0) {
+            return NGX_DECLINED;
         }
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
+        tree = &cache->sh->tags;
+    }
 
-            c->exists = fcn->exists;
-            if (fcn->body_start && !c->update_variant) {
-                c->body_start = fcn->body_start;
-            }
+    hash = ngx_crc32_long(value->data, value->len);
 
-            rc = NGX_OK;
+    n = 0;
+    now = ngx_time();
 
-            goto done;
-        }
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        rc = NGX_AGAIN;
+    tag = (ngx_http_file_cache_tag_t *)
+              ngx_str_rbtree_lookup(tree, value, hash);
 
+    if (tag == NULL) {
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
-
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
-        (void) ngx_http_file_cache_forced_expire(cache);
+    /*
+     * matching entries are marked as stale and moved to the tail
+     * of the inactive queue, so the cache manager deletes them
+     * unless they are requested before
+     */
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    for (q = ngx_queue_head(&tag->links);
+         q != ngx_queue_sentinel(&tag->links);
+         q = ngx_queue_next(q))
+    {
+        link = ngx_queue_data(q, ngx_http_file_cache_tag_link_t, queue);
+        fcn = link->node;
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
-            rc = NGX_ERROR;
-            goto failed;
+        if (fcn->purged) {
+            continue;
         }
-    }
 
-    cache->sh->count++;
+        fcn->purged = 1;
+        fcn->expire = now;
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        /* neither a cached error nor a pending update is kept */
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        fcn->valid_sec = 0;
+        fcn->updating = 0;
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        if (fcn->protected) {
+            fcn->protected = 0;
+            cache->sh->protected_count--;
+        }
 
-    fcn->uses = 1;
-    fcn->count = 1;
+        ngx_queue_remove(&fcn->queue);
+        ngx_queue_insert_tail(&cache->sh->queue, &fcn->queue);
 
-renew:
+        n++;
+    }
 
-    rc = NGX_DECLINED;
+done:
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-done:
+    *count = n;
 
-    fcn->expire = ngx_time() + cache->inactive;
+    return NGX_OK;
+}
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+static void
+ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_unindex(cache, fcn);
 
-failed:
+    if (fcn->partial) {
+        ngx_slab_free_locked(cache->shpool, fcn->partial);
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (fcn->protected) {
+        cache->sh->protected_count--;
+    }
 
-    return rc;
+    if (fcn->unindexed) {
+        cache->sh->unindexed--;
+    }
+
+    ngx_queue_remove(&fcn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+    ngx_slab_free_locked(cache->shpool, fcn);
+    cache->sh->count--;
 }
 
 
@@ -1267,6 +2421,8 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
     h->valid_msec = (u_short) c->valid_msec;
     h->header_start = (u_short) c->header_start;
     h->body_start = (u_short) c->body_start;
+    h->headers_start = (u_short) c->headers_start;
+    h->partial = (u_char) c->partial;
 
     if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
         h->etag_len = (u_char) c->etag.len;
@@ -1358,13 +2514,15 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    off_t                     fs_size;
+    ngx_int_t                 rc;
+    ngx_file_uniq_t           uniq;
+    ngx_file_info_t           fi;
+    ngx_http_cache_t         *c;
+    ngx_pool_cleanup_t       *cln;
+    ngx_ext_rename_file_t     ext;
+    ngx_http_file_cache_t    *cache;
+    ngx_pool_cleanup_file_t  *clnf;
 
     c = r->cache;
 
@@ -1394,7 +2552,15 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     ext.delete_file = 1;
     ext.log = r->connection->log;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    if (c->partial_update) {
+
+        /* the range was written into the cache file itself */
+
+        rc = NGX_OK;
+
+    } else {
+        rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    }
 
     if (rc == NGX_OK) {
 
@@ -1408,11 +2574,54 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
             uniq = ngx_file_uniq(&fi);
             fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
         }
+
+        if (tf->file.write_behind) {
+
+            /*
+             * the file may still be sent to the client, so its pages
+             * are dropped when the request pool is destroyed, before
+             * the file is closed by ngx_pool_cleanup_file()
+             */
+
+            cln = ngx_pool_cleanup_add(r->pool,
+                                       sizeof(ngx_pool_cleanup_file_t));
+            if (cln) {
+                clnf = cln->data;
+
+                clnf->fd = tf->file.fd;
+                clnf->name = c->file.name.data;
+                clnf->log = r->connection->log;
+
+                cln->handler = ngx_http_file_cache_drop_pages;
+            }
+        }
     }
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     c->node->count--;
+
+    ngx_http_file_cache_partial_unlock(c);
+
+    if (c->partial_update) {
+
+        /* the cache file may have been replaced meanwhile */
+
+        if (rc == NGX_OK
+            && c->node->partial
+            && c->node->uniq == uniq
+            && c->node->partial->length == c->partial_length)
+        {
+            cache->sh->size += fs_size - c->node->fs_size;
+            c->node->fs_size = fs_size;
+
+            ngx_http_file_cache_set_partial(cache, c);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
     c->node->error = 0;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
@@ -1422,6 +2631,21 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     if (rc == NGX_OK) {
         c->node->exists = 1;
+
+        /*
+         * an entry invalidated while the response was being received
+         * stays invalidated, as the response may predate invalidation
+         */
+
+        if (c->purged) {
+            c->node->purged = 0;
+        }
+
+        ngx_http_file_cache_set_partial(cache, c);
+
+        if (cache->prefix_index || cache->tag_header.len) {
+            ngx_http_file_cache_index(r, cache, c->node);
+        }
     }
 
     c->node->updating = 0;
@@ -1433,6 +2657,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 void
 ngx_http_file_cache_update_header(ngx_http_request_t *r)
 {
+    u_char                         partial;
     ssize_t                        n;
     ngx_err_t                      err;
     ngx_file_t                     file;
@@ -1506,7 +2731,8 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
         || h.last_modified != c->last_modified
         || h.crc32 != c->crc32
         || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
+        || (size_t) h.body_start != c->body_start
+        || (size_t) h.headers_start != c->headers_start)
     {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache \"%s\" content changed",
@@ -1519,6 +2745,8 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
      * notably h.valid_sec and h.date
      */
 
+    partial = h.partial;
+
     ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
 
     h.version = NGX_HTTP_CACHE_VERSION;
@@ -1531,6 +2759,8 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     h.valid_msec = (u_short) c->valid_msec;
     h.header_start = (u_short) c->header_start;
     h.body_start = (u_short) c->body_start;
+    h.headers_start = (u_short) c->headers_start;
+    h.partial = partial;
 
     if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
         h.etag_len = (u_char) c->etag.len;
@@ -1550,8 +2780,14 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
         ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    n = ngx_write_file(&file, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == sizeof(ngx_http_file_cache_header_t) && c->purged) {
+        ngx_shmtx_lock(&c->file_cache->shpool->mutex);
+        c->node->purged = 0;
+        ngx_shmtx_unlock(&c->file_cache->shpool->mutex);
+    }
 
 done:
 
@@ -1565,16 +2801,33 @@ done:
 ngx_int_t
 ngx_http_cache_send(ngx_http_request_t *r)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    ngx_int_t               rc;
+    ngx_buf_t              *b;
+    ngx_chain_t             out;
+    ngx_http_cache_t       *c;
+    ngx_http_file_cache_t  *cache;
 
     c = r->cache;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache send: %s", c->file.name.data);
 
+    cache = c->file_cache;
+
+    if (c->node->unindexed
+        && (cache->prefix_index || cache->tag_header.len))
+    {
+        /* an entry loaded from disk is indexed once it is sent */
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (c->node->unindexed) {
+            ngx_http_file_cache_index(r, cache, c->node);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
     if (r != r->main && c->length - c->body_start == 0) {
         return ngx_http_send_header(r);
     }
@@ -1635,6 +2888,8 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     fcn = c->node;
     fcn->count--;
 
+    ngx_http_file_cache_partial_unlock(c);
+
     if (c->updating && fcn->lock_time == c->lock_time) {
         fcn->updating = 0;
     }
@@ -1648,10 +2903,7 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         }
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_http_file_cache_free_node(cache, fcn);
         c->node = NULL;
     }
 
@@ -1660,7 +2912,7 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     c->updated = 1;
     c->updating = 0;
 
-    if (c->temp_file) {
+    if (c->temp_file && !c->partial_update) {
         if (tf && tf->file.fd != NGX_INVALID_FILE) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                            "http file cache incomplete: \"%s\"",
@@ -1701,6 +2953,21 @@ ngx_http_file_cache_cleanup(void *data)
 }
 
 
+static void
+ngx_http_file_cache_drop_pages(void *data)
+{
+    ngx_pool_cleanup_file_t  *clnf = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, clnf->log, 0,
+                   "http file cache drop pages: %d", clnf->fd);
+
+    if (ngx_drop_file_cache(clnf->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, clnf->log, ngx_errno,
+                      ngx_drop_file_cache_n " \"%s\" failed", clnf->name);
+    }
+}
+
+
 static time_t
 ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 {
@@ -1733,13 +3000,9 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
+        q = ngx_http_file_cache_victim(cache->sh);
 
-        q = ngx_queue_last(&cache->sh->queue);
-
-        if (q == sentinel) {
+        if (q == NULL || q == sentinel) {
             break;
         }
 
@@ -1752,6 +3015,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
         if (fcn->count == 0) {
             ngx_http_file_cache_delete(cache, q, name);
+            (void) ngx_atomic_fetch_add(&cache->sh->stat.evicted, 1);
             wait = 0;
             break;
         }
@@ -1774,7 +3038,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_http_file_cache_enqueue(cache, fcn, 0);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1836,13 +3100,13 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        q = ngx_http_file_cache_oldest(cache->sh);
+
+        if (q == NULL) {
             wait = 10;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
-
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
         wait = fcn->expire - now;
@@ -1867,6 +3131,17 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
+        if (fcn->purged) {
+
+            /* an invalidated entry is in use, it is revalidated on access */
+
+            ngx_queue_remove(q);
+            fcn->expire = ngx_time() + cache->inactive;
+            ngx_http_file_cache_enqueue(cache, fcn, 0);
+
+            goto next;
+        }
+
         p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
                          sizeof(ngx_rbtree_key_t));
         len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
@@ -1880,7 +3155,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_http_file_cache_enqueue(cache, fcn, 0);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1954,10 +3229,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
     }
 
     if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_http_file_cache_free_node(cache, fcn);
     }
 }
 
@@ -2252,6 +3524,11 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         fcn->exists = 1;
         fcn->fs_size = c->fs_size;
 
+        /* neither key prefixes nor tags are known without reading the file */
+
+        fcn->unindexed = 1;
+        cache->sh->unindexed++;
+
         cache->sh->size += c->fs_size;
 
     } else {
@@ -2260,7 +3537,7 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_http_file_cache_enqueue(cache, fcn, 0);
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
@@ -2319,6 +3596,44 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 }
 
 
+ngx_http_file_cache_t *
+ngx_http_file_cache_find(ngx_cycle_t *cycle, ngx_str_t *name)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_shm_zone_t   *shm_zone;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_http_file_cache_init) {
+            continue;
+        }
+
+        if (name->len == shm_zone[i].shm.name.len
+            && ngx_strncmp(name->data, shm_zone[i].shm.name.data, name->len)
+               == 0)
+        {
+            return shm_zone[i].data;
+        }
+    }
+
+    return NULL;
+}
+
+
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -2328,11 +3643,13 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                 *last, *p;
     time_t                  inactive;
     ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_str_t               s, name, tag_header, *value;
+    ngx_int_t               loader_files, manager_files, admit_uses,
+                            prefix_index;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, admission, preallocate,
+                            write_behind;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2348,6 +3665,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     use_temp_path = 1;
 
+    admission = 0;
+    admit_uses = NGX_CONF_UNSET;
+
+    preallocate = 0;
+    write_behind = 0;
+
+    prefix_index = 0;
+    ngx_str_null(&tag_header);
+
     inactive = 600;
 
     loader_files = 100;
@@ -2433,6 +3759,107 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "admission=", 10) == 0) {
+
+            if (ngx_strcmp(&value[i].data[10], "on") == 0) {
+                admission = 1;
+
+            } else if (ngx_strcmp(&value[i].data[10], "off") == 0) {
+                admission = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid admission value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "admit_uses=", 11) == 0) {
+
+            admit_uses = ngx_atoi(value[i].data + 11, value[i].len - 11);
+
+            /* sketch counters saturate, a larger value is never reached */
+
+            if (admit_uses == NGX_ERROR
+                || admit_uses == 0
+                || admit_uses > NGX_HTTP_FILE_CACHE_SKETCH_MAX)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid admit_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "preallocate=", 12) == 0) {
+
+            if (ngx_strcmp(&value[i].data[12], "on") == 0) {
+                preallocate = 1;
+
+            } else if (ngx_strcmp(&value[i].data[12], "off") == 0) {
+                preallocate = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid preallocate value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "write_behind=", 13) == 0) {
+
+            if (ngx_strcmp(&value[i].data[13], "on") == 0) {
+                write_behind = 1;
+
+            } else if (ngx_strcmp(&value[i].data[13], "off") == 0) {
+                write_behind = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid write_behind value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "prefix_index=", 13) == 0) {
+
+            prefix_index = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (prefix_index == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid prefix_index value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "tag_header=", 11) == 0) {
+
+            tag_header.len = value[i].len - 11;
+            tag_header.data = value[i].data + 11;
+
+            if (tag_header.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid tag_header value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2616,6 +4043,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (admit_uses != NGX_CONF_UNSET && !admission) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"admit_uses\" requires \"admission=on\"");
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2649,6 +4082,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     cache->use_temp_path = use_temp_path;
 
+    cache->admission = admission;
+    cache->admit_uses = (admit_uses == NGX_CONF_UNSET) ? 1 : admit_uses;
+
+    cache->preallocate = preallocate;
+    cache->write_behind = write_behind;
+
+    cache->prefix_index = prefix_index;
+    cache->tag_header = tag_header;
+
     cache->inactive = inactive;
     cache->max_size = max_size;
     cache->min_free = min_free;
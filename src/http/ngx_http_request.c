@@ -11,7 +11,8 @@
 
 
 static void ngx_http_wait_request_handler(ngx_event_t *ev);
-static ngx_http_request_t *ngx_http_alloc_request(ngx_connection_t *c);
+static ngx_http_request_t *ngx_http_alloc_request(ngx_connection_t *c,
+    ngx_pool_t *pool);
 static void ngx_http_process_request_line(ngx_event_t *rev);
 static void ngx_http_process_request_headers(ngx_event_t *rev);
 static ssize_t ngx_http_read_request_header(ngx_http_request_t *r);
@@ -504,12 +505,19 @@ ngx_http_wait_request_handler(ngx_event_t *rev)
 
 ngx_http_request_t *
 ngx_http_create_request(ngx_connection_t *c)
+{
+    return ngx_http_create_request_in_pool(c, NULL);
+}
+
+
+ngx_http_request_t *
+ngx_http_create_request_in_pool(ngx_connection_t *c, ngx_pool_t *pool)
 {
     ngx_http_request_t        *r;
     ngx_http_log_ctx_t        *ctx;
     ngx_http_core_loc_conf_t  *clcf;
 
-    r = ngx_http_alloc_request(c);
+    r = ngx_http_alloc_request(c, pool);
     if (r == NULL) {
         return NULL;
     }
@@ -535,9 +543,8 @@ ngx_http_create_request(ngx_connection_t *c)
 
 
 static ngx_http_request_t *
-ngx_http_alloc_request(ngx_connection_t *c)
+ngx_http_alloc_request(ngx_connection_t *c, ngx_pool_t *pool)
 {
-    ngx_pool_t                 *pool;
     ngx_time_t                 *tp;
     ngx_http_request_t         *r;
     ngx_http_connection_t      *hc;
@@ -548,9 +555,11 @@ ngx_http_alloc_request(ngx_connection_t *c)
 
     cscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_core_module);
 
-    pool = ngx_create_pool(cscf->request_pool_size, c->log);
     if (pool == NULL) {
-        return NULL;
+        pool = ngx_create_pool(cscf->request_pool_size, c->log);
+        if (pool == NULL) {
+            return NULL;
+        }
     }
 
     r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
@@ -991,7 +1000,7 @@ ngx_http_ssl_certificate(ngx_ssl_conn_t *ssl_conn, void *arg)
         return 0;
     }
 
-    r = ngx_http_alloc_request(c);
+    r = ngx_http_alloc_request(c, NULL);
     if (r == NULL) {
         return 0;
     }
@@ -3623,6 +3632,19 @@ ngx_http_close_request(ngx_http_request_t *r, ngx_int_t rc)
 
 void
 ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_pool_t  *pool;
+
+    pool = ngx_http_release_request(r, rc);
+
+    if (pool) {
+        ngx_destroy_pool(pool);
+    }
+}
+
+
+ngx_pool_t *
+ngx_http_release_request(ngx_http_request_t *r, ngx_int_t rc)
 {
     ngx_log_t                 *log;
     ngx_pool_t                *pool;
@@ -3637,7 +3659,7 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
 
     if (r->pool == NULL) {
         ngx_log_error(NGX_LOG_ALERT, log, 0, "http request already closed");
-        return;
+        return NULL;
     }
 
     cln = r->cleanup;
@@ -3707,7 +3729,7 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
     pool = r->pool;
     r->pool = NULL;
 
-    ngx_destroy_pool(pool);
+    return pool;
 }
 
 
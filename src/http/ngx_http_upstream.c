@@ -17,10 +17,20 @@ static ngx_int_t ngx_http_upstream_cache_get(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_http_file_cache_t **cache);
 static ngx_int_t ngx_http_upstream_cache_send(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_process_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_store_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_partial_range(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_partial(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_partial_headers(ngx_http_request_t *r,
+    off_t length);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
@@ -77,6 +87,13 @@ static void
 static void
     ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_splice_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_splice_cleanup(void *data);
+#endif
 #if (NGX_THREADS)
 static ngx_int_t ngx_http_upstream_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
@@ -95,6 +112,37 @@ static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static ngx_int_t ngx_http_upstream_test_budget(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_hedge_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hedge_resume(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close_connection(ngx_http_request_t *r,
+    ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_collapse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse_lead(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *key, uint32_t hash);
+static void ngx_http_upstream_collapse_detach(
+    ngx_http_upstream_collapse_wait_t *w);
+static void ngx_http_upstream_collapse_cleanup(void *data);
+static void ngx_http_upstream_collapse_wait_cleanup(void *data);
+static void ngx_http_upstream_collapse_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse_body(
+    ngx_http_upstream_collapsing_t *c, ngx_chain_t *in);
+static void ngx_http_upstream_collapse_finish(ngx_http_upstream_t *u,
+    ngx_int_t rc);
+static void ngx_http_upstream_collapse_handler(ngx_event_t *ev);
+static void ngx_http_upstream_collapse_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_cleanup(void *data);
 static void ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc);
@@ -169,6 +217,8 @@ static ngx_int_t ngx_http_upstream_cookie_variable(ngx_http_request_t *r,
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_retry_budget(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 static ngx_int_t ngx_http_upstream_set_local(ngx_http_request_t *r,
   ngx_http_upstream_t *u, ngx_http_upstream_local_t *local);
@@ -183,8 +233,6 @@ static void ngx_http_upstream_ssl_handshake_handler(ngx_connection_t *c);
 static void ngx_http_upstream_ssl_handshake(ngx_http_request_t *,
     ngx_http_upstream_t *u, ngx_connection_t *c);
 static void ngx_http_upstream_ssl_save_session(ngx_connection_t *c);
-static ngx_int_t ngx_http_upstream_ssl_name(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_connection_t *c);
 static ngx_int_t ngx_http_upstream_ssl_certificate(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_connection_t *c);
 #endif
@@ -339,6 +387,13 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("retry_budget"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_retry_budget,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -602,6 +657,23 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 
 #endif
 
+    if (u->conf->collapse
+        && u->collapsing == NULL && u->collapse_wait == NULL)
+    {
+        switch (ngx_http_upstream_collapse(r, u)) {
+
+        case NGX_ERROR:
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+
+        case NGX_DONE:
+            return;
+
+        default: /* NGX_DECLINED */
+            break;
+        }
+    }
+
     u->store = u->conf->store;
 
     if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
@@ -638,6 +710,10 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
         u->peer.so_keepalive = 1;
     }
 
+    if (u->conf->socket_fastopen) {
+        u->peer.fastopen = 1;
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     u->output.alignment = clcf->directio_alignment;
@@ -732,6 +808,12 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
                 return;
             }
 
+            if (u->init_peer && u->init_peer(r) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
             ngx_http_upstream_connect(r, u);
 
             return;
@@ -801,6 +883,16 @@ found:
         return;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (uscf->retry_budget) {
+        ngx_http_upstream_rr_peers_request(uscf->peer.data);
+    }
+
     u->peer.start_time = ngx_current_msec;
 
     if (u->conf->next_upstream_tries
@@ -888,6 +980,10 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
 
+        if (u->conf->cache_partial) {
+            ngx_http_upstream_cache_partial_range(r, u);
+        }
+
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
 
@@ -902,7 +998,7 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         if (((u->conf->cache_use_stale & NGX_HTTP_UPSTREAM_FT_UPDATING)
              || c->stale_updating) && !r->background
-            && u->conf->cache_background_update)
+            && (u->conf->cache_background_update || c->stale_updating))
         {
             if (ngx_http_upstream_cache_background_update(r, u) == NGX_OK) {
                 r->cache->background = 1;
@@ -924,6 +1020,16 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
             u->cache_status = rc;
             rc = NGX_OK;
 
+        } else if (c->lock && !r->background
+                   && ngx_http_file_cache_wait(r) == NGX_AGAIN)
+        {
+            /*
+             * with the cache lock enabled, wait for the request already
+             * updating the element, up to *_cache_lock_timeout
+             */
+
+            rc = NGX_AGAIN;
+
         } else {
             rc = NGX_HTTP_CACHE_STALE;
         }
@@ -966,6 +1072,7 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
     case NGX_HTTP_CACHE_SCARCE:
 
         u->cacheable = 0;
+        c->partial_size = 0;
 
         break;
 
@@ -986,7 +1093,9 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return rc;
     }
 
-    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
+    if (!c->partial_size
+        && ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED)
+    {
         u->cacheable = 0;
     }
 
@@ -1076,7 +1185,12 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return NGX_ERROR;
     }
 
-    rc = u->process_header(r);
+    if (c->headers_start) {
+        rc = ngx_http_upstream_cache_process_headers(r, u);
+
+    } else {
+        rc = u->process_header(r);
+    }
 
     if (rc == NGX_OK) {
 
@@ -1084,6 +1198,10 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->partial) {
+            ngx_http_upstream_cache_partial_headers(r, c->partial_length);
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1107,6 +1225,215 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_process_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    u_char                            *p, *last;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    ngx_table_elt_t                   *h;
+    ngx_http_cache_t                  *c;
+    ngx_http_upstream_header_t        *hh;
+    ngx_http_upstream_main_conf_t     *umcf;
+    ngx_http_file_cache_headers_t      hs;
+    ngx_http_file_cache_header_elt_t   he;
+
+    c = r->cache;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    p = c->buf->pos + c->headers_start;
+    last = c->buf->pos + c->body_start;
+
+    if (last > c->buf->last
+        || (size_t) (last - p) < sizeof(ngx_http_file_cache_headers_t))
+    {
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    ngx_memcpy(&hs, p, sizeof(ngx_http_file_cache_headers_t));
+    p += sizeof(ngx_http_file_cache_headers_t);
+
+    if ((size_t) (last - p) < hs.status_line_len) {
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    u->headers_in.status_n = hs.status;
+    u->headers_in.status_line.len = hs.status_line_len;
+    u->headers_in.status_line.data = p;
+
+    p += hs.status_line_len;
+
+    for (i = 0; i < hs.count; i++) {
+
+        if ((size_t) (last - p) < sizeof(ngx_http_file_cache_header_elt_t)) {
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        ngx_memcpy(&he, p, sizeof(ngx_http_file_cache_header_elt_t));
+        p += sizeof(ngx_http_file_cache_header_elt_t);
+
+        if ((size_t) (last - p) < 2 * (size_t) he.key_len + he.value_len + 3) {
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = he.hash;
+
+        h->key.len = he.key_len;
+        h->key.data = p;
+        p += he.key_len + 1;
+
+        h->value.len = he.value_len;
+        h->value.data = he.null_value ? NULL : p;
+        p += he.value_len + 1;
+
+        h->lowcase_key = p;
+        p += he.key_len + 1;
+
+        h->next = NULL;
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                           h->lowcase_key, h->key.len);
+
+        if (hh) {
+            rc = hh->handler(r, h, hh->offset);
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream cached header: \"%V: %V\"",
+                       &h->key, &h->value);
+    }
+
+    u->headers_in.content_length_n = hs.content_length_n;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_cache_store_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    size_t                             len;
+    u_char                            *p;
+    ngx_uint_t                         i, n;
+    ngx_list_part_t                   *part;
+    ngx_table_elt_t                   *h;
+    ngx_http_file_cache_headers_t      hs;
+    ngx_http_file_cache_header_elt_t   he;
+
+    r->cache->headers_start = 0;
+
+    len = sizeof(ngx_http_file_cache_headers_t)
+          + u->headers_in.status_line.len;
+    n = 0;
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len > 0xffff || h[i].value.len > 0xffff) {
+            return;
+        }
+
+        len += sizeof(ngx_http_file_cache_header_elt_t)
+               + 2 * h[i].key.len + h[i].value.len + 3;
+        n++;
+    }
+
+    /*
+     * the headers are placed after the raw response header,
+     * moving the part of the body already read
+     */
+
+    if (len > (size_t) (u->buffer.end - u->buffer.last)
+        || (size_t) (u->buffer.pos - u->buffer.start) + len > 0xffff
+        || n > 0xffff
+        || u->headers_in.status_line.len > 0xffff)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream cache headers do not fit");
+        return;
+    }
+
+    ngx_memmove(u->buffer.pos + len, u->buffer.pos,
+                u->buffer.last - u->buffer.pos);
+
+    p = u->buffer.pos;
+
+    ngx_memzero(&hs, sizeof(ngx_http_file_cache_headers_t));
+
+    hs.status = u->headers_in.status_n;
+    hs.content_length_n = u->headers_in.content_length_n;
+    hs.status_line_len = (u_short) u->headers_in.status_line.len;
+    hs.count = (u_short) n;
+
+    p = ngx_cpymem(p, &hs, sizeof(ngx_http_file_cache_headers_t));
+    p = ngx_cpymem(p, u->headers_in.status_line.data,
+                   u->headers_in.status_line.len);
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        ngx_memzero(&he, sizeof(ngx_http_file_cache_header_elt_t));
+
+        he.hash = h[i].hash;
+        he.key_len = (u_short) h[i].key.len;
+        he.value_len = (u_short) h[i].value.len;
+        he.null_value = (h[i].value.data == NULL);
+
+        p = ngx_cpymem(p, &he, sizeof(ngx_http_file_cache_header_elt_t));
+
+        p = ngx_cpymem(p, h[i].key.data, h[i].key.len);
+        *p++ = '\0';
+
+        p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+        *p++ = '\0';
+
+        p = ngx_cpymem(p, h[i].lowcase_key, h[i].key.len);
+        *p++ = '\0';
+    }
+
+    r->cache->headers_start = u->buffer.pos - u->buffer.start;
+
+    u->buffer.pos += len;
+    u->buffer.last += len;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
@@ -1179,90 +1506,364 @@ ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     return NGX_OK;
 }
 
-#endif
-
 
 static void
-ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
+ngx_http_upstream_cache_partial_range(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
 {
-    ngx_uint_t                     run_posted;
-    ngx_connection_t              *c;
-    ngx_http_request_t            *r;
-    ngx_http_upstream_t           *u;
-    ngx_http_upstream_resolved_t  *ur;
+    off_t              start, end, size;
+    u_char            *p, *last;
+    ngx_table_elt_t   *h;
+    ngx_http_cache_t  *c;
 
-    run_posted = ctx->async;
+    /* only a single "bytes=start-end" or "bytes=start-" range is cached */
 
-    r = ctx->data;
-    c = r->connection;
+    h = r->headers_in.range;
 
-    u = r->upstream;
-    ur = u->resolved;
+    if (r != r->main
+        || h == NULL
+        || r->headers_in.if_range
+        || h->value.len < 7
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
+    {
+        return;
+    }
 
-    ngx_http_set_log_request(c->log, r);
+    p = h->value.data + 6;
+    last = h->value.data + h->value.len;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream resolve: \"%V?%V\"", &r->uri, &r->args);
+    while (p < last && *p == ' ') { p++; }
 
-    if (ctx->state) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "%V could not be resolved (%i: %s)",
-                      &ctx->name, ctx->state,
-                      ngx_resolver_strerror(ctx->state));
+    start = 0;
 
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
-        goto failed;
+    if (p == last || *p < '0' || *p > '9') {
+        return;
     }
 
-    ur->naddrs = ctx->naddrs;
-    ur->addrs = ctx->addrs;
-
-#if (NGX_DEBUG)
-    {
-    u_char      text[NGX_SOCKADDR_STRLEN];
-    ngx_str_t   addr;
-    ngx_uint_t  i;
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (start >= NGX_MAX_OFF_T_VALUE / 10) {
+            return;
+        }
 
-    addr.data = text;
+        start = start * 10 + (*p++ - '0');
+    }
 
-    for (i = 0; i < ctx->naddrs; i++) {
-        addr.len = ngx_sock_ntop(ur->addrs[i].sockaddr, ur->addrs[i].socklen,
-                                 text, NGX_SOCKADDR_STRLEN, 0);
+    while (p < last && *p == ' ') { p++; }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "name was resolved to %V", &addr);
-    }
+    if (p == last || *p++ != '-') {
+        return;
     }
-#endif
 
-    if (ngx_http_upstream_create_round_robin_peer(r, ur) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        goto failed;
-    }
+    while (p < last && *p == ' ') { p++; }
 
-    ngx_resolve_name_done(ctx);
-    ur->ctx = NULL;
+    if (p == last) {
+        end = -1;
 
-    u->peer.start_time = ngx_current_msec;
+    } else {
+        end = 0;
 
-    if (u->conf->next_upstream_tries
-        && u->peer.tries > u->conf->next_upstream_tries)
-    {
-        u->peer.tries = u->conf->next_upstream_tries;
-    }
+        while (p < last && *p >= '0' && *p <= '9') {
+            if (end >= NGX_MAX_OFF_T_VALUE / 10) {
+                return;
+            }
 
-    ngx_http_upstream_connect(r, u);
+            end = end * 10 + (*p++ - '0');
+        }
 
-failed:
+        while (p < last && *p == ' ') { p++; }
 
-    if (run_posted) {
-        ngx_http_run_posted_requests(c);
+        if (p != last || end < start) {
+            return;
+        }
     }
+
+    c = r->cache;
+    size = u->conf->cache_partial;
+
+    c->partial_size = u->conf->cache_partial;
+    c->range_start = start;
+    c->range_end = end;
+
+    /* upstream requests are aligned to slice boundaries */
+
+    c->partial_start = start - start % size;
+    c->partial_end = (end == -1) ? -1 : (end / size + 1) * size - 1;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache partial: %O-%O, fetch %O-%O",
+                   c->range_start, c->range_end,
+                   c->partial_start, c->partial_end);
 }
 
 
-static void
+static ngx_int_t
+ngx_http_upstream_cache_partial(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t              start, end, length;
+    u_char            *p, *last;
+    ngx_table_elt_t   *h;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    /*
+     * a 206 response to the aligned range is converted into a 200
+     * response with the content offset set, as in the slice module,
+     * so the range filter extracts the range requested by the client
+     */
+
+    h = r->headers_out.content_range;
+
+    if (h == NULL
+        || h->value.len < 7
+        || ngx_strncmp(h->value.data, "bytes ", 6) != 0)
+    {
+        goto invalid;
+    }
+
+    p = h->value.data + 6;
+    last = h->value.data + h->value.len;
+
+    start = 0;
+    end = 0;
+    length = 0;
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (start >= NGX_MAX_OFF_T_VALUE / 10) {
+            goto invalid;
+        }
+
+        start = start * 10 + (*p++ - '0');
+    }
+
+    if (p == last || *p++ != '-') {
+        goto invalid;
+    }
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (end >= NGX_MAX_OFF_T_VALUE / 10) {
+            goto invalid;
+        }
+
+        end = end * 10 + (*p++ - '0');
+    }
+
+    if (p == last || *p++ != '/') {
+        goto invalid;
+    }
+
+    /* the complete length must be known */
+
+    if (p == last) {
+        goto invalid;
+    }
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (length >= NGX_MAX_OFF_T_VALUE / 10) {
+            goto invalid;
+        }
+
+        length = length * 10 + (*p++ - '0');
+    }
+
+    if (p != last || start > end || end >= length) {
+        goto invalid;
+    }
+
+    if (start > c->range_start
+        || (end < c->range_end && end != length - 1)
+        || (c->range_end == -1 && end != length - 1)
+        || (u->headers_in.content_length_n != -1
+            && u->headers_in.content_length_n != end - start + 1))
+    {
+        goto invalid;
+    }
+
+    if (c->partial_update
+        && (length != c->partial_length
+            || u->headers_in.last_modified_time != c->last_modified
+            || (u->headers_in.etag == NULL) != (c->etag.len == 0)
+            || (u->headers_in.etag
+                && (u->headers_in.etag->value.len != c->etag.len
+                    || ngx_strncmp(u->headers_in.etag->value.data,
+                                   c->etag.data, c->etag.len)
+                       != 0))))
+    {
+        /* the resource has changed, the cache file is replaced */
+
+        c->partial_update = 0;
+        c->valid_sec = 0;
+    }
+
+    c->partial = 1;
+    c->partial_start = start;
+    c->partial_end = end;
+    c->partial_length = length;
+
+    ngx_http_upstream_cache_partial_headers(r, length);
+
+    r->headers_out.content_offset = start;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "upstream sent invalid \"Content-Range\" header "
+                  "for partial cache");
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_cache_partial_headers(ngx_http_request_t *r, off_t length)
+{
+    /*
+     * the 206 response header, either received or cached, is sent
+     * as a 200 response header for the whole resource
+     */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_length_n = length;
+
+    if (r->headers_out.content_range) {
+        r->headers_out.content_range->hash = 0;
+        r->headers_out.content_range = NULL;
+    }
+
+    r->allow_ranges = 1;
+    r->single_range = 1;
+}
+
+
+ngx_int_t
+ngx_http_upstream_cache_range(ngx_http_request_t *r, ngx_str_t *range)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    /*
+     * the "Range" header value with the slices needed for a partially
+     * cached response, for modules which pass it as a parameter
+     */
+
+    c = r->cache;
+
+    if (!r->upstream->cacheable || c == NULL || c->partial_size == 0) {
+        range->len = 0;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    range->data = p;
+
+    p = ngx_sprintf(p, "bytes=%O-", c->partial_start);
+
+    if (c->partial_end != -1) {
+        p = ngx_sprintf(p, "%O", c->partial_end);
+    }
+
+    range->len = p - range->data;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    ngx_uint_t                     run_posted;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_resolved_t  *ur;
+
+    run_posted = ctx->async;
+
+    r = ctx->data;
+    c = r->connection;
+
+    u = r->upstream;
+    ur = u->resolved;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream resolve: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "%V could not be resolved (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+        goto failed;
+    }
+
+    ur->naddrs = ctx->naddrs;
+    ur->addrs = ctx->addrs;
+
+#if (NGX_DEBUG)
+    {
+    u_char      text[NGX_SOCKADDR_STRLEN];
+    ngx_str_t   addr;
+    ngx_uint_t  i;
+
+    addr.data = text;
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        addr.len = ngx_sock_ntop(ur->addrs[i].sockaddr, ur->addrs[i].socklen,
+                                 text, NGX_SOCKADDR_STRLEN, 0);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "name was resolved to %V", &addr);
+    }
+    }
+#endif
+
+    if (ngx_http_upstream_create_round_robin_peer(r, ur) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto failed;
+    }
+
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto failed;
+    }
+
+    ngx_resolve_name_done(ctx);
+    ur->ctx = NULL;
+
+    u->peer.start_time = ngx_current_msec;
+
+    if (u->conf->next_upstream_tries
+        && u->peer.tries > u->conf->next_upstream_tries)
+    {
+        u->peer.tries = u->conf->next_upstream_tries;
+    }
+
+    ngx_http_upstream_connect(r, u);
+
+failed:
+
+    if (run_posted) {
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+static void
 ngx_http_upstream_handler(ngx_event_t *ev)
 {
     ngx_connection_t     *c;
@@ -1546,7 +2147,14 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->peer = u->peer.name;
 
     if (rc == NGX_BUSY) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
+
+        /* a hedged request silently falls back to the original one */
+
+        if (u->hedging == NULL || u->hedging->connection == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "no live upstreams");
+        }
+
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
     }
@@ -1834,7 +2442,7 @@ ngx_http_upstream_ssl_save_session(ngx_connection_t *c)
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_connection_t *c)
 {
@@ -2160,6 +2768,14 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
         ngx_add_timer(c->read, u->conf->read_timeout);
 
+        if (u->conf->hedge && !u->hedged
+            && ngx_http_upstream_hedge_init(r, u) != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
         if (c->read->ready) {
             ngx_http_upstream_process_header(r, u);
             return;
@@ -2445,6 +3061,10 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->buffer.last += n;
 
+        if (u->hedging) {
+            ngx_http_upstream_hedge_close(r, u);
+        }
+
 #if 0
         u->valid_header_in = 0;
 
@@ -2485,6 +3105,11 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->state->header_time = ngx_current_msec - u->start_time;
 
+    if (u->upstream) {
+        ngx_http_upstream_rr_peers_latency(u->upstream->peer.data,
+                                           u->state->header_time);
+    }
+
     if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
@@ -2999,6 +3624,33 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->partial_size) {
+
+        if (u->headers_in.status_n == NGX_HTTP_PARTIAL_CONTENT) {
+            if (ngx_http_upstream_cache_partial(r, u) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                                   NGX_HTTP_BAD_GATEWAY);
+                return;
+            }
+
+        } else {
+            if (r->cache->partial_update) {
+                r->cache->partial_update = 0;
+                r->cache->valid_sec = 0;
+            }
+
+            r->cache->partial = 0;
+        }
+    }
+
+#endif
+
+    if (u->collapsing) {
+        ngx_http_upstream_collapse_header(r, u);
+    }
+
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
@@ -3136,9 +3788,18 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
             /* create cache if previously bypassed */
 
-            if (ngx_http_file_cache_create(r) != NGX_OK) {
+            switch (ngx_http_file_cache_create(r)) {
+
+            case NGX_ERROR:
                 ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
                 return;
+
+            case NGX_DECLINED:
+                u->cacheable = 0;
+                break;
+
+            default: /* NGX_OK */
+                break;
             }
         }
 
@@ -3154,14 +3815,23 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         if (valid == 0) {
             valid = ngx_http_file_cache_valid(u->conf->cache_valid,
-                                              u->headers_in.status_n);
+                                              r->cache->partial
+                                              ? NGX_HTTP_OK
+                                              : u->headers_in.status_n);
             if (valid) {
                 r->cache->valid_sec = now + valid;
             }
         }
 
-        if (valid) {
+        if (valid && r->cache->partial_update) {
+
+            /* the range is written into the existing cache file */
+
+        } else if (valid) {
             r->cache->date = now;
+
+            ngx_http_upstream_cache_store_headers(r, u);
+
             r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
 
             if (u->headers_in.status_n == NGX_HTTP_OK
@@ -3240,6 +3910,21 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             p->temp_file->path = r->cache->file_cache->path;
             p->temp_file->file.name = r->cache->file.name;
         }
+
+        if (r->cache && u->cacheable) {
+
+            if (r->cache->file_cache->preallocate
+                && u->headers_in.content_length_n > 0)
+            {
+                p->temp_file->preallocate = r->cache->body_start
+                                        + u->headers_in.content_length_n;
+            }
+
+            /* writeback is started as soon as a part is written */
+
+            p->temp_file->file.write_behind =
+                                        r->cache->file_cache->write_behind;
+        }
 #endif
 
     } else {
@@ -3251,6 +3936,11 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     p->max_temp_file_size = u->conf->max_temp_file_size;
     p->temp_file_write_size = u->conf->temp_file_write_size;
 
+    if (u->collapsing) {
+        /* the shared copy is taken from memory buffers only */
+        p->max_temp_file_size = 0;
+    }
+
 #if (NGX_THREADS)
     if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_write) {
         p->thread_handler = ngx_http_upstream_thread_handler;
@@ -3270,17 +3960,47 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     p->preread_size = u->buffer.last - u->buffer.pos;
 
-    if (u->cacheable) {
+#if (NGX_HTTP_CACHE)
 
-        p->buf_to_file = ngx_calloc_buf(r->pool);
-        if (p->buf_to_file == NULL) {
+    if (u->cacheable && r->cache->partial) {
+        ngx_buf_t  b;
+
+        ngx_memzero(&b, sizeof(ngx_buf_t));
+
+        b.pos = u->buffer.start;
+        b.last = u->buffer.pos;
+
+        switch (ngx_http_file_cache_partial_open(r, p->temp_file, &b)) {
+
+        case NGX_ERROR:
             ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
             return;
-        }
 
-        p->buf_to_file->start = u->buffer.start;
-        p->buf_to_file->pos = u->buffer.start;
-        p->buf_to_file->last = u->buffer.pos;
+        case NGX_DECLINED:
+            u->cacheable = 0;
+            p->cacheable = u->store;
+            ngx_http_file_cache_free(r->cache, p->temp_file);
+            break;
+
+        default: /* NGX_OK */
+            break;
+        }
+
+    } else
+
+#endif
+
+    if (u->cacheable) {
+
+        p->buf_to_file = ngx_calloc_buf(r->pool);
+        if (p->buf_to_file == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        p->buf_to_file->start = u->buffer.start;
+        p->buf_to_file->pos = u->buffer.start;
+        p->buf_to_file->last = u->buffer.pos;
         p->buf_to_file->temporary = 1;
     }
 
@@ -3685,6 +4405,18 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice) {
+            if (ngx_http_upstream_splice_body(r, u) == NGX_DONE) {
+                return;
+            }
+
+            break;
+        }
+
+#endif
+
         if (do_write) {
 
             if (u->out_bufs || u->busy_bufs || downstream->buffered) {
@@ -3725,6 +4457,17 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
                 b->pos = b->start;
                 b->last = b->start;
+
+#if (NGX_HAVE_SPLICE)
+
+                if (u->raw_body
+                    && u->conf->splice
+                    && ngx_http_upstream_splice_init(r, u) == NGX_OK)
+                {
+                    continue;
+                }
+
+#endif
             }
         }
 
@@ -3795,6 +4538,219 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+#define NGX_HTTP_UPSTREAM_SPLICE_SIZE  65536
+
+
+static ngx_int_t
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t            *c;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_upstream_splice_t  *sp;
+
+    c = r->connection;
+
+    /* tested once, as soon as the buffered part of the body is sent */
+
+    u->raw_body = 0;
+
+    /* the body must not be seen or framed by filters */
+
+    if (r != r->main
+        || c->data != r
+        || r->postponed
+        || c->buffered
+        || r->main_filter_need_in_memory
+        || r->filter_need_in_memory
+        || r->filter_need_temporary
+        || r->chunked
+#if (NGX_HTTP_V2)
+        || r->stream
+#endif
+#if (NGX_HTTP_V3)
+        || c->quic
+#endif
+#if (NGX_HTTP_SSL)
+        || c->ssl
+        || u->peer.connection->ssl
+#endif
+        )
+    {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_upstream_splice_t));
+    if (cln == NULL) {
+        return NGX_DECLINED;
+    }
+
+    sp = cln->data;
+
+    if (pipe2(sp->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "pipe2() failed");
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream splice: %d:%d", sp->fd[0], sp->fd[1]);
+
+    sp->size = 0;
+
+    cln->handler = ngx_http_upstream_splice_cleanup;
+
+    u->splice = sp;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_splice_body(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    size_t                       size;
+    ssize_t                      n;
+    ngx_err_t                    err;
+    ngx_connection_t            *downstream, *upstream;
+    ngx_http_upstream_splice_t  *sp;
+
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    sp = u->splice;
+
+    for ( ;; ) {
+
+        if (sp->size) {
+
+            if (!downstream->write->ready) {
+                break;
+            }
+
+            n = splice(sp->fd[0], NULL, downstream->fd, NULL, sp->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, downstream->log, 0,
+                           "splice to client: %z of %uz", n, sp->size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN || err == NGX_EINTR) {
+                    downstream->write->ready = 0;
+                    break;
+                }
+
+                downstream->error = 1;
+                downstream->write->error = 1;
+
+                ngx_connection_error(downstream, err, "splice() failed");
+
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return NGX_DONE;
+            }
+
+            sp->size -= n;
+            downstream->sent += n;
+
+            continue;
+        }
+
+        if (u->length == 0
+            || (upstream->read->eof && u->length == -1))
+        {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return NGX_DONE;
+        }
+
+        if (upstream->read->eof) {
+            ngx_log_error(NGX_LOG_ERR, upstream->log, 0,
+                          "upstream prematurely closed connection");
+
+            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+            return NGX_DONE;
+        }
+
+        if (upstream->read->error) {
+            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+            return NGX_DONE;
+        }
+
+        if (!upstream->read->ready) {
+            break;
+        }
+
+        size = NGX_HTTP_UPSTREAM_SPLICE_SIZE;
+
+        if (u->length != -1 && (off_t) size > u->length) {
+            size = (size_t) u->length;
+        }
+
+        n = splice(upstream->fd, NULL, sp->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, upstream->log, 0,
+                       "splice from upstream: %z of %uz", n, size);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN || err == NGX_EINTR) {
+                upstream->read->ready = 0;
+                break;
+            }
+
+            upstream->read->error = 1;
+
+            ngx_connection_error(upstream, err, "splice() failed");
+
+            continue;
+        }
+
+        if (n == 0) {
+            upstream->read->ready = 0;
+            upstream->read->eof = 1;
+            continue;
+        }
+
+        sp->size = n;
+
+        u->state->bytes_received += n;
+        u->state->response_length += n;
+
+        if (u->length != -1) {
+            u->length -= n;
+
+            if (u->length == 0) {
+                u->keepalive = !u->headers_in.connection_close;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_splice_cleanup(void *data)
+{
+    ngx_http_upstream_splice_t  *sp = data;
+
+    if (close(sp->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    if (close(sp->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+}
+
+#endif
+
+
 ngx_int_t
 ngx_http_upstream_non_buffered_filter_init(void *data)
 {
@@ -3985,12 +4941,20 @@ ngx_http_upstream_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_upstream_output_filter(void *data, ngx_chain_t *chain)
 {
-    ngx_int_t            rc;
-    ngx_event_pipe_t    *p;
-    ngx_http_request_t  *r;
+    ngx_int_t             rc;
+    ngx_event_pipe_t     *p;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
 
     r = data;
-    p = r->upstream->pipe;
+    u = r->upstream;
+    p = u->pipe;
+
+    if (u->collapsing
+        && ngx_http_upstream_collapse_body(u->collapsing, chain) != NGX_OK)
+    {
+        ngx_http_upstream_collapse_finish(u, NGX_DECLINED);
+    }
 
     rc = ngx_http_output_filter(r, chain);
 
@@ -4154,13 +5118,20 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
                 ngx_http_file_cache_update(r, p->temp_file);
 
             } else if (p->upstream_eof) {
+                off_t  start;
 
                 tf = p->temp_file;
 
+                start = r->cache->body_start;
+
+                if (r->cache->partial) {
+                    start += r->cache->partial_start;
+                }
+
                 if (p->length == -1
                     && (u->headers_in.content_length_n == -1
                         || u->headers_in.content_length_n
-                           == tf->offset - (off_t) r->cache->body_start))
+                           == tf->offset - start))
                 {
                     ngx_http_file_cache_update(r, tf);
 
@@ -4330,6 +5301,23 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
                       "upstream timed out");
     }
 
+    if (u->hedging) {
+
+        if (u->hedging->connection) {
+
+            /* the hedged request failed, wait for the original one */
+
+            if (ngx_http_upstream_hedge_resume(r, u) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            }
+
+            return;
+        }
+
+        ngx_http_upstream_hedge_close(r, u);
+    }
+
     if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
         /* TODO: inform balancer instead */
         u->peer.tries++;
@@ -4390,7 +5378,8 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     if (u->peer.tries == 0
         || ((u->conf->next_upstream & ft_type) != ft_type)
         || (u->request_sent && r->request_body_no_buffering)
-        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout)
+        || ngx_http_upstream_test_budget(r, u) != NGX_OK)
     {
 #if (NGX_HTTP_CACHE)
 
@@ -4422,33 +5411,1020 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
         }
 #endif
 
-        ngx_http_upstream_finalize_request(r, u, status);
+        ngx_http_upstream_finalize_request(r, u, status);
+        return;
+    }
+
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close http upstream connection: %d",
+                       u->peer.connection->fd);
+#if (NGX_HTTP_SSL)
+
+        if (u->peer.connection->ssl) {
+            u->peer.connection->ssl->no_wait_shutdown = 1;
+            u->peer.connection->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(u->peer.connection);
+        }
+#endif
+
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
+
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_test_budget(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = u->upstream;
+
+    if (uscf == NULL || uscf->retry_budget == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_upstream_rr_peers_retry(uscf->peer.data, uscf->retry_budget,
+                                         uscf->retry_budget_min)
+        == NGX_OK)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "upstream retry budget exhausted");
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                    delay;
+    ngx_http_upstream_hedge_t    *hedge;
+    ngx_http_upstream_hedging_t  *h;
+
+    /*
+     * a hedged request is only sent for idempotent methods with
+     * a buffered request body, and if there is another peer to try
+     */
+
+    if (u->conf->preserve_output
+        || r->request_body_no_buffering
+        || (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+        || (u->conf->next_upstream & NGX_HTTP_UPSTREAM_FT_OFF)
+        || u->peer.tries < 2)
+    {
+        return NGX_OK;
+    }
+
+    hedge = u->conf->hedge;
+
+    if (hedge->percentile) {
+
+        if (u->upstream == NULL) {
+            return NGX_OK;
+        }
+
+        delay = ngx_http_upstream_rr_peers_percentile(u->upstream->peer.data,
+                                                      hedge->percentile);
+
+        if (delay == (ngx_msec_t) -1) {
+            return NGX_OK;
+        }
+
+    } else {
+        delay = hedge->delay;
+    }
+
+    h = u->hedging;
+
+    if (h == NULL) {
+        h = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedging_t));
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->event.handler = ngx_http_upstream_hedge_handler;
+        h->event.data = r;
+        h->event.log = r->connection->log;
+
+        u->hedging = h;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge delay: %M", delay);
+
+    ngx_add_timer(&h->event, delay);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge timer \"%V?%V\"", &r->uri, &r->args);
+
+    ngx_http_upstream_hedge(r, r->upstream);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_hedge(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                    timeout;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hedging_t  *h;
+
+    c = u->peer.connection;
+
+    timeout = u->conf->next_upstream_timeout;
+
+    if (c == NULL
+        || c->read->ready
+        || u->state->bytes_received
+        || !u->request_body_sent
+        || u->peer.tries < 2
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout)
+        || ngx_http_upstream_test_budget(r, u) != NGX_OK)
+    {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge, fd:%d", c->fd);
+
+    h = u->hedging;
+
+    h->connection = c;
+    h->name = u->peer.name;
+    h->state = r->upstream_states->nelts - 1;
+    h->start_time = u->start_time;
+
+    u->hedged = 1;
+    u->state->bytes_sent = c->sent;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->read->handler = ngx_http_upstream_hedge_event_handler;
+    c->write->handler = ngx_http_upstream_hedge_event_handler;
+
+    /*
+     * the peer is released to the balancer, so the hedged request
+     * goes to another one, while the connection is kept open
+     */
+
+    u->peer.connection = NULL;
+
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, 0);
+        u->peer.sockaddr = NULL;
+    }
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static void
+ngx_http_upstream_hedge_event_handler(ngx_event_t *ev)
+{
+    int                   n;
+    char                  buf[1];
+    ngx_err_t             err;
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    if (ev->write) {
+        return;
+    }
+
+    c = ev->data;
+    r = c->data;
+    u = r->upstream;
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        goto resume;
+    }
+
+#endif
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, err,
+                   "http upstream hedge recv(): %d", n);
+
+    if (n == -1 && err == NGX_EAGAIN) {
+        return;
+    }
+
+    if (n <= 0) {
+
+        /* the original peer failed, the hedged request goes on */
+
+        ngx_log_error(NGX_LOG_ERR, c->log, n == 0 ? 0 : err,
+                      "upstream prematurely closed connection");
+
+        ngx_http_upstream_hedge_close(r, u);
+        goto done;
+    }
+
+#if (NGX_HTTP_SSL)
+resume:
+#endif
+
+    /* the original peer responded first, the hedged request is cancelled */
+
+    if (ngx_http_upstream_hedge_resume(r, u) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto done;
+    }
+
+    ngx_http_upstream_process_header(r, u);
+
+done:
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_resume(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t             *c;
+    ngx_http_upstream_hedging_t  *h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge resume");
+
+    h = u->hedging;
+
+    if (u->peer.sockaddr) {
+        if (u->peer.connection) {
+            u->state->bytes_sent = u->peer.connection->sent;
+        }
+
+        u->peer.free(&u->peer, u->peer.data, 0);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (u->peer.connection) {
+        ngx_http_upstream_hedge_close_connection(r, u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    if (u->state->response_time == (ngx_msec_t) -1) {
+        u->state->response_time = ngx_current_msec - u->start_time;
+    }
+
+    /*
+     * the original peer was released to the balancer when the hedged
+     * request was sent, so u->peer.sockaddr is left unset
+     */
+
+    u->state = r->upstream_states->elts;
+    u->state += h->state;
+    u->state->response_time = (ngx_msec_t) -1;
+    u->start_time = h->start_time;
+
+    c = h->connection;
+    h->connection = NULL;
+
+    u->peer.connection = c;
+    u->peer.name = h->name;
+
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
+
+    u->writer.out = NULL;
+    u->writer.last = &u->writer.out;
+    u->writer.connection = c;
+
+    if (ngx_http_upstream_reinit(r, u) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u->request_sent = 1;
+    u->request_body_sent = 1;
+    u->request_body_blocked = 0;
+
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
+
+    ngx_add_timer(c->read, u->conf->read_timeout);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hedge_close(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    if (u->hedging->event.timer_set) {
+        ngx_del_timer(&u->hedging->event);
+    }
+
+    c = u->hedging->connection;
+
+    if (c == NULL) {
+        return;
+    }
+
+    u->hedging->connection = NULL;
+
+    ngx_http_upstream_hedge_close_connection(r, c);
+}
+
+
+static void
+ngx_http_upstream_hedge_close_connection(ngx_http_request_t *r,
+    ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "close http upstream hedged connection: %d", c->fd);
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
+    }
+#endif
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+}
+
+static ngx_int_t
+ngx_http_upstream_collapse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    uint32_t                            hash;
+    ngx_str_t                           key;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_upstream_collapsing_t     *c;
+    ngx_http_upstream_collapse_wait_t  *w;
+    ngx_http_upstream_main_conf_t      *umcf;
+
+    if (r->method != NGX_HTTP_GET
+        || r->subrequest_in_memory
+        || u->conf->store)
+    {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (u->conf->cache) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    if (ngx_http_complex_value(r, &u->conf->collapse->key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    c = (ngx_http_upstream_collapsing_t *)
+            ngx_str_rbtree_lookup(&umcf->collapse, &key, hash);
+
+    if (c) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream collapsed: \"%V\"", &key);
+
+        w = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_collapse_wait_t));
+        if (w == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        w->request = r;
+        w->collapsing = c;
+        w->waiting = 1;
+
+        w->event.handler = ngx_http_upstream_collapse_handler;
+        w->event.data = w;
+        w->event.log = r->connection->log;
+
+        ngx_queue_insert_tail(&c->waiting, &w->queue);
+        c->count++;
+
+        cln->handler = ngx_http_upstream_collapse_wait_cleanup;
+        cln->data = w;
+
+        u->collapse_wait = w;
+
+        ngx_add_timer(&w->event, u->conf->collapse->timeout);
+
+        r->write_event_handler = ngx_http_request_empty_handler;
+
+        if (u->conf->ignore_client_abort) {
+            return NGX_DONE;
+        }
+
+        r->read_event_handler = ngx_http_test_reading;
+
+        if (r->connection->read->ready) {
+            ngx_post_event(r->connection->read, &ngx_posted_events);
+
+        } else if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_DONE;
+    }
+
+    if (ngx_http_upstream_collapse_lead(r, u, &key, hash) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse_lead(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_pool_t                      *pool;
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_upstream_collapsing_t  *c;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    /* a conditional or range response cannot be shared */
+
+    if (r->headers_in.if_modified_since
+        || r->headers_in.if_unmodified_since
+        || r->headers_in.if_match
+        || r->headers_in.if_none_match
+        || r->headers_in.range
+        || r->headers_in.if_range)
+    {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    c = ngx_pcalloc(pool, sizeof(ngx_http_upstream_collapsing_t));
+    if (c == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    c->sn.str.data = ngx_pstrdup(pool, key);
+    if (c->sn.str.data == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    c->sn.str.len = key->len;
+    c->sn.node.key = hash;
+
+    c->pool = pool;
+    c->request = r;
+    c->max_size = u->conf->collapse->max_size;
+    c->last_out = &c->out;
+
+    ngx_queue_init(&c->waiting);
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    ngx_rbtree_insert(&umcf->collapse, &c->sn.node);
+
+    cln->handler = ngx_http_upstream_collapse_cleanup;
+    cln->data = u;
+
+    u->collapsing = c;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_collapse_cleanup(void *data)
+{
+    ngx_http_upstream_t  *u = data;
+
+    if (u->collapsing) {
+        ngx_http_upstream_collapse_finish(u, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_http_upstream_collapse_wait_cleanup(void *data)
+{
+    ngx_http_upstream_collapse_wait_t  *w = data;
+
+    if (w->event.posted) {
+        ngx_delete_posted_event(&w->event);
+    }
+
+    ngx_http_upstream_collapse_detach(w);
+}
+
+
+static void
+ngx_http_upstream_collapse_detach(ngx_http_upstream_collapse_wait_t *w)
+{
+    ngx_http_upstream_collapsing_t  *c;
+
+    c = w->collapsing;
+
+    if (c == NULL) {
+        return;
+    }
+
+    w->collapsing = NULL;
+
+    if (w->waiting) {
+        ngx_queue_remove(&w->queue);
+        w->waiting = 0;
+    }
+
+    if (w->event.timer_set) {
+        ngx_del_timer(&w->event);
+    }
+
+    if (--c->count == 0 && c->request == NULL) {
+        ngx_destroy_pool(c->pool);
+    }
+}
+
+
+static void
+ngx_http_upstream_collapse_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    u_char                          *p;
+    ngx_uint_t                       i;
+    ngx_list_part_t                 *part;
+    ngx_table_elt_t                 *h, *header;
+    ngx_http_upstream_collapsing_t  *c;
+
+    c = u->collapsing;
+
+    /* neither a partial nor a not modified response can be shared */
+
+    if (u->headers_in.status_n != NGX_HTTP_OK
+        || !u->buffering || u->upgrade || u->headers_in.set_cookie)
+    {
+        goto failed;
+    }
+
+    if (ngx_array_init(&c->headers, c->pool, 16, sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    part = &u->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        h = ngx_array_push(&c->headers);
+        if (h == NULL) {
+            goto failed;
+        }
+
+        p = ngx_pnalloc(c->pool, 2 * header[i].key.len + header[i].value.len);
+        if (p == NULL) {
+            goto failed;
+        }
+
+        *h = header[i];
+        h->next = NULL;
+
+        h->key.data = p;
+        p = ngx_cpymem(p, header[i].key.data, header[i].key.len);
+
+        h->lowcase_key = p;
+        p = ngx_cpymem(p, header[i].lowcase_key, header[i].key.len);
+
+        if (header[i].value.data) {
+            h->value.data = p;
+            ngx_memcpy(p, header[i].value.data, header[i].value.len);
+        }
+    }
+
+    c->status = u->headers_in.status_n;
+
+    if (u->headers_in.status_line.len) {
+        c->status_line.data = ngx_pstrdup(c->pool, &u->headers_in.status_line);
+        if (c->status_line.data == NULL) {
+            goto failed;
+        }
+
+        c->status_line.len = u->headers_in.status_line.len;
+    }
+
+    c->header = 1;
+
+    return;
+
+failed:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream response is not collapsed");
+
+    ngx_http_upstream_collapse_finish(u, NGX_DECLINED);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse_body(ngx_http_upstream_collapsing_t *c,
+    ngx_chain_t *in)
+{
+    size_t        size, n;
+    u_char       *p;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            return NGX_DECLINED;
+        }
+
+        size = b->last - b->pos;
+
+        if (c->size + size > c->max_size) {
+            return NGX_DECLINED;
+        }
+
+        c->size += size;
+
+        for (p = b->pos; size; size -= n) {
+
+            if (c->buf == NULL || c->buf->last == c->buf->end) {
+                cl = ngx_alloc_chain_link(c->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                c->buf = ngx_create_temp_buf(c->pool,
+                                             ngx_max(size, ngx_pagesize));
+                if (c->buf == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = c->buf;
+                cl->next = NULL;
+
+                *c->last_out = cl;
+                c->last_out = &cl->next;
+            }
+
+            n = ngx_min(size, (size_t) (c->buf->end - c->buf->last));
+
+            c->buf->last = ngx_cpymem(c->buf->last, p, n);
+            p += n;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_collapse_finish(ngx_http_upstream_t *u, ngx_int_t rc)
+{
+    ngx_queue_t                        *q;
+    ngx_http_request_t                 *r;
+    ngx_http_upstream_collapsing_t     *c, *next;
+    ngx_http_upstream_collapse_wait_t  *w;
+    ngx_http_upstream_main_conf_t      *umcf;
+
+    c = u->collapsing;
+    r = c->request;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse finish: %i, waiting: %ui",
+                   rc, c->count);
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    ngx_rbtree_delete(&umcf->collapse, &c->sn.node);
+
+    u->collapsing = NULL;
+    c->request = NULL;
+    c->done = (rc == NGX_OK);
+
+    /*
+     * if the response itself cannot be shared, all waiting requests go
+     * to the upstream at once; if the leader failed, the first waiting
+     * request able to lead takes over, and the rest wait for it
+     */
+
+    for (q = ngx_queue_head(&c->waiting);
+         rc == NGX_ERROR && q != ngx_queue_sentinel(&c->waiting);
+         q = ngx_queue_next(q))
+    {
+        w = ngx_queue_data(q, ngx_http_upstream_collapse_wait_t, queue);
+        r = w->request;
+
+        switch (ngx_http_upstream_collapse_lead(r, r->upstream, &c->sn.str,
+                                                c->sn.node.key))
+        {
+        case NGX_DECLINED:
+            continue;
+
+        case NGX_ERROR:
+            rc = NGX_DECLINED;
+            continue;
+        }
+
+        rc = NGX_OK;
+
+        ngx_queue_remove(q);
+
+        w->waiting = 0;
+        w->collapsing = NULL;
+        c->count--;
+
+        if (w->event.timer_set) {
+            ngx_del_timer(&w->event);
+        }
+
+        ngx_post_event(&w->event, &ngx_posted_events);
+
+        next = r->upstream->collapsing;
+
+        while (!ngx_queue_empty(&c->waiting)) {
+            q = ngx_queue_head(&c->waiting);
+            ngx_queue_remove(q);
+
+            w = ngx_queue_data(q, ngx_http_upstream_collapse_wait_t, queue);
+            w->collapsing = next;
+
+            ngx_queue_insert_tail(&next->waiting, q);
+
+            next->count++;
+            c->count--;
+        }
+
+        break;
+    }
+
+    while (!ngx_queue_empty(&c->waiting)) {
+        q = ngx_queue_head(&c->waiting);
+        ngx_queue_remove(q);
+
+        w = ngx_queue_data(q, ngx_http_upstream_collapse_wait_t, queue);
+        w->waiting = 0;
+
+        if (w->event.timer_set) {
+            ngx_del_timer(&w->event);
+        }
+
+        ngx_post_event(&w->event, &ngx_posted_events);
+    }
+
+    if (c->count == 0) {
+        ngx_destroy_pool(c->pool);
+    }
+}
+
+
+static void
+ngx_http_upstream_collapse_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_upstream_collapse_wait_t  *w;
+
+    w = ev->data;
+    r = w->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "collapse timeout");
+        ngx_http_upstream_collapse_detach(w);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream collapsed response: %d \"%V?%V\"",
+                   w->collapsing && w->collapsing->done, &r->uri, &r->args);
+
+    if (w->collapsing && w->collapsing->done) {
+        ngx_http_upstream_collapse_send(r, r->upstream);
+
+    } else {
+
+        /* the response was not shared, go to the upstream ourselves */
+
+        ngx_http_upstream_init_request(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_collapse_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_uint_t                       i;
+    ngx_chain_t                     *cl, *out, **ll;
+    ngx_table_elt_t                 *h, *header;
+    ngx_http_cleanup_t              *cln;
+    ngx_http_upstream_header_t      *hh;
+    ngx_http_upstream_collapsing_t  *c;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    c = u->collapse_wait->collapsing;
+
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln->handler = ngx_http_upstream_cleanup;
+    cln->data = r;
+    u->cleanup = &cln->handler;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, c->headers.nelts + 1,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_list_init(&u->headers_in.trailers, r->pool, 2,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    u->headers_in.status_n = c->status;
+    u->headers_in.status_line = c->status_line;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    header = c->headers.elts;
+
+    for (i = 0; i < c->headers.nelts; i++) {
+
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        *h = header[i];
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                           h->lowcase_key, h->key.len);
+
+        if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    u->headers_in.content_length_n = c->size;
+
+    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+        return;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
+
+    u->header_sent = 1;
+
+    if (r->header_only || c->out == NULL) {
+        ngx_http_upstream_finalize_request(r, u, rc);
         return;
     }
 
-    if (u->peer.connection) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "close http upstream connection: %d",
-                       u->peer.connection->fd);
-#if (NGX_HTTP_SSL)
+    ll = &out;
 
-        if (u->peer.connection->ssl) {
-            u->peer.connection->ssl->no_wait_shutdown = 1;
-            u->peer.connection->ssl->no_send_shutdown = 1;
+    for (cl = c->out; cl; cl = cl->next) {
 
-            (void) ngx_ssl_shutdown(u->peer.connection);
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
         }
-#endif
 
-        if (u->peer.connection->pool) {
-            ngx_destroy_pool(u->peer.connection->pool);
+        b->start = cl->buf->pos;
+        b->pos = cl->buf->pos;
+        b->last = cl->buf->last;
+        b->end = cl->buf->last;
+        b->memory = 1;
+
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
         }
 
-        ngx_close_connection(u->peer.connection);
-        u->peer.connection = NULL;
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
     }
 
-    ngx_http_upstream_connect(r, u);
+    *ll = NULL;
+
+    rc = ngx_http_output_filter(r, out);
+
+    ngx_http_upstream_finalize_request(r, u, rc == NGX_ERROR ? NGX_ERROR : 0);
 }
 
 
@@ -4487,6 +6463,17 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
         u->resolved->ctx = NULL;
     }
 
+    if (u->hedging) {
+        ngx_http_upstream_hedge_close(r, u);
+    }
+
+    if (u->collapsing) {
+        ngx_http_upstream_collapse_finish(u,
+                                          (rc == 0 && u->collapsing->header
+                                           && !u->pipe->downstream_error)
+                                          ? NGX_OK : NGX_ERROR);
+    }
+
     if (u->state && u->state->response_time == (ngx_msec_t) -1) {
         u->state->response_time = ngx_current_msec - u->start_time;
 
@@ -6015,10 +8002,11 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
     void                          *mconf;
     ngx_str_t                     *value;
     ngx_url_t                      u;
-    ngx_uint_t                     m;
+    ngx_uint_t                     i, m;
     ngx_conf_t                     pcf;
     ngx_http_module_t             *module;
     ngx_http_conf_ctx_t           *ctx, *http_ctx;
+    ngx_http_upstream_server_t    *us;
     ngx_http_upstream_srv_conf_t  *uscf;
 
     ngx_memzero(&u, sizeof(ngx_url_t));
@@ -6034,7 +8022,8 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
                                          |NGX_HTTP_UPSTREAM_MAX_FAILS
                                          |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                                          |NGX_HTTP_UPSTREAM_DOWN
-                                         |NGX_HTTP_UPSTREAM_BACKUP);
+                                         |NGX_HTTP_UPSTREAM_BACKUP
+                                         |NGX_HTTP_UPSTREAM_SLOW_START);
     if (uscf == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -6120,6 +8109,23 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
         return NGX_CONF_ERROR;
     }
 
+    if (uscf->flags & NGX_HTTP_UPSTREAM_SLOW_START) {
+        return rv;
+    }
+
+    /* the balancing method may have been set after the servers */
+
+    us = uscf->servers->elts;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+        if (us[i].slow_start) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "balancing method does not support "
+                               "parameter \"slow_start\"");
+            return NGX_CONF_ERROR;
+        }
+    }
+
     return rv;
 }
 
@@ -6133,6 +8139,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                   *value, s;
     ngx_url_t                    u;
     ngx_int_t                    weight, max_conns, max_fails;
+    ngx_msec_t                   slow_start;
     ngx_uint_t                   i;
     ngx_http_upstream_server_t  *us;
 
@@ -6149,6 +8156,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_conns = 0;
     max_fails = 1;
     fail_timeout = 10;
+    slow_start = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -6226,6 +8234,24 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_SLOW_START)) {
+                goto not_supported;
+            }
+
+            s.len = value[i].len - 11;
+            s.data = &value[i].data[11];
+
+            slow_start = ngx_parse_time(&s, 0);
+
+            if (slow_start == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "down") == 0) {
 
             if (!(uscf->flags & NGX_HTTP_UPSTREAM_DOWN)) {
@@ -6237,13 +8263,27 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+#endif
+
         goto invalid;
     }
 
+    if (us->resolve && us->down) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"resolve\" cannot be used with \"down\"");
+        return NGX_CONF_ERROR;
+    }
+
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = value[1];
     u.default_port = 80;
+    u.no_resolve = us->resolve;
 
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
@@ -6254,6 +8294,23 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (us->resolve) {
+
+        if (u.naddrs) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"resolve\" requires a domain name "
+                               "in upstream \"%V\"", &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        /* the name is resolved at run time if it cannot be resolved now */
+
+        if (ngx_inet_resolve_host(cf->pool, &u) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "%s in upstream \"%V\"", u.err, &u.url);
+        }
+    }
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
@@ -6261,6 +8318,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     us->max_conns = max_conns;
     us->max_fails = max_fails;
     us->fail_timeout = fail_timeout;
+    us->slow_start = slow_start;
 
     return NGX_CONF_OK;
 
@@ -6281,6 +8339,66 @@ not_supported:
 }
 
 
+static char *
+ngx_http_upstream_retry_budget(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t   ratio, min;
+    ngx_str_t  *value;
+    ngx_uint_t  i;
+
+    if (uscf->retry_budget) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len < 2 || value[1].data[value[1].len - 1] != '%') {
+        i = 1;
+        goto invalid;
+    }
+
+    ratio = ngx_atoi(value[1].data, value[1].len - 1);
+
+    if (ratio == NGX_ERROR || ratio == 0 || ratio > 100) {
+        i = 1;
+        goto invalid;
+    }
+
+    min = 10;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+
+            min = ngx_atoi(&value[i].data[4], value[i].len - 4);
+
+            if (min == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf->retry_budget = ratio;
+    uscf->retry_budget_min = min;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 ngx_http_upstream_srv_conf_t *
 ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
 {
@@ -6589,6 +8707,218 @@ ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+char *
+ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t                    n;
+    ngx_str_t                   *value;
+    ngx_msec_t                   delay;
+    ngx_http_upstream_hedge_t  **phedge, *hedge;
+
+    phedge = (ngx_http_upstream_hedge_t **) (p + cmd->offset);
+
+    if (*phedge != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *phedge = NULL;
+        return NGX_CONF_OK;
+    }
+
+    hedge = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_t));
+    if (hedge == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].data[0] == 'p') {
+
+        /* a percentile of response header times, "p95" */
+
+        n = ngx_atoi(&value[1].data[1], value[1].len - 1);
+
+        if (n < 1 || n > 99) {
+            goto invalid;
+        }
+
+        hedge->percentile = n;
+
+    } else {
+        delay = ngx_parse_time(&value[1], 0);
+
+        if (delay == (ngx_msec_t) NGX_ERROR) {
+            goto invalid;
+        }
+
+        hedge->delay = delay;
+    }
+
+    *phedge = hedge;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+char *
+ngx_http_upstream_multiplex_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t         *np, n;
+    ngx_str_t         *value;
+    ngx_event_conf_t  *ecf;
+
+    np = (ngx_int_t *) (p + cmd->offset);
+
+    if (*np != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *np = 0;
+        return NGX_CONF_OK;
+    }
+
+    /* the number of requests per connection, "0" is the same as "off" */
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n > 65535) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    *np = n;
+
+    /*
+     * the mux connections rely on edge-triggered events, and requests
+     * are not multiplexed otherwise; the event method is only known here
+     * if the "events" block precedes the "http" one
+     */
+
+    if (n && ngx_get_conf(cf->cycle->conf_ctx, ngx_events_module)) {
+        ecf = ngx_event_get_conf(cf->cycle->conf_ctx, ngx_event_core_module);
+
+        if (ngx_strcmp(ecf->name, "epoll") != 0
+            && ngx_strcmp(ecf->name, "kqueue") != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "\"%V\" is ignored with the \"%s\" "
+                               "event method", &cmd->name, ecf->name);
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_upstream_collapse_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ssize_t                             size;
+    ngx_str_t                          *value, s;
+    ngx_uint_t                          i;
+    ngx_http_upstream_collapse_t      **pcollapse, *collapse;
+    ngx_http_compile_complex_value_t    ccv;
+
+    pcollapse = (ngx_http_upstream_collapse_t **) (p + cmd->offset);
+
+    if (*pcollapse != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *pcollapse = NULL;
+        return NGX_CONF_OK;
+    }
+
+    collapse = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_collapse_t));
+    if (collapse == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &collapse->key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    collapse->max_size = 1024 * 1024;
+    collapse->timeout = 5000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size == 0) {
+                goto invalid;
+            }
+
+            collapse->max_size = size;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            collapse->timeout = ngx_parse_time(&s, 0);
+
+            if (collapse->timeout == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    *pcollapse = collapse;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 ngx_int_t
 ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
@@ -6729,6 +9059,9 @@ ngx_http_upstream_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_rbtree_init(&umcf->collapse, &umcf->collapse_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return umcf;
 }
 
@@ -74,6 +74,9 @@ typedef struct {
     ngx_hash_t                       headers_in_hash;
     ngx_array_t                      upstreams;
                                              /* ngx_http_upstream_srv_conf_t */
+
+    ngx_rbtree_t                     collapse;
+    ngx_rbtree_node_t                collapse_sentinel;
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
@@ -103,6 +106,7 @@ typedef struct {
     ngx_uint_t                       down;
 
     unsigned                         backup:1;
+    unsigned                         resolve:1;
 
     NGX_COMPAT_BEGIN(6)
     NGX_COMPAT_END
@@ -116,6 +120,7 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
 #define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
+#define NGX_HTTP_UPSTREAM_SLOW_START    0x0200
 
 
 struct ngx_http_upstream_srv_conf_s {
@@ -131,8 +136,17 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
 
+    ngx_uint_t                       retry_budget;
+    ngx_uint_t                       retry_budget_min;
+
+#if (NGX_HTTP_SSL)
+    ngx_ssl_t                       *ssl;      /* for health checks */
+#endif
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
 #endif
 };
 
@@ -146,6 +160,19 @@ typedef struct {
 } ngx_http_upstream_local_t;
 
 
+typedef struct {
+    ngx_msec_t                       delay;
+    ngx_uint_t                       percentile;
+} ngx_http_upstream_hedge_t;
+
+
+typedef struct {
+    ngx_http_complex_value_t         key;
+    size_t                           max_size;
+    ngx_msec_t                       timeout;
+} ngx_http_upstream_collapse_t;
+
+
 typedef struct {
     ngx_http_upstream_srv_conf_t    *upstream;
 
@@ -174,6 +201,7 @@ typedef struct {
     ngx_uint_t                       next_upstream_tries;
     ngx_flag_t                       buffering;
     ngx_flag_t                       request_buffering;
+    ngx_flag_t                       splice;
     ngx_flag_t                       pass_request_headers;
     ngx_flag_t                       pass_request_body;
 
@@ -190,6 +218,10 @@ typedef struct {
 
     ngx_http_upstream_local_t       *local;
     ngx_flag_t                       socket_keepalive;
+    ngx_flag_t                       socket_fastopen;
+
+    ngx_http_upstream_hedge_t       *hedge;
+    ngx_http_upstream_collapse_t    *collapse;
 
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache_zone;
@@ -200,6 +232,7 @@ typedef struct {
     ngx_uint_t                       cache_methods;
 
     off_t                            cache_max_range_offset;
+    size_t                           cache_partial;
 
     ngx_flag_t                       cache_lock;
     ngx_msec_t                       cache_lock_timeout;
@@ -298,6 +331,51 @@ typedef struct {
 } ngx_http_upstream_headers_in_t;
 
 
+typedef struct {
+    ngx_event_t                      event;
+    ngx_connection_t                *connection;
+    ngx_str_t                       *name;
+    ngx_uint_t                       state;
+    ngx_msec_t                       start_time;
+} ngx_http_upstream_hedging_t;
+
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+} ngx_http_upstream_splice_t;
+
+
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_pool_t                      *pool;
+    ngx_http_request_t              *request;
+    ngx_queue_t                      waiting;
+    ngx_uint_t                       count;
+
+    ngx_uint_t                       status;
+    ngx_str_t                        status_line;
+    ngx_array_t                      headers;
+    ngx_chain_t                     *out;
+    ngx_chain_t                    **last_out;
+    ngx_buf_t                       *buf;
+    size_t                           size;
+    size_t                           max_size;
+
+    unsigned                         header:1;
+    unsigned                         done:1;
+} ngx_http_upstream_collapsing_t;
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_event_t                      event;
+    ngx_http_request_t              *request;
+    ngx_http_upstream_collapsing_t  *collapsing;
+    unsigned                         waiting:1;
+} ngx_http_upstream_collapse_wait_t;
+
+
 typedef struct {
     ngx_str_t                        host;
     in_port_t                        port;
@@ -340,6 +418,10 @@ struct ngx_http_upstream_s {
     ngx_http_upstream_headers_in_t   headers_in;
 
     ngx_http_upstream_resolved_t    *resolved;
+    ngx_http_upstream_hedging_t     *hedging;
+    ngx_http_upstream_splice_t      *splice;
+    ngx_http_upstream_collapsing_t  *collapsing;
+    ngx_http_upstream_collapse_wait_t  *collapse_wait;
 
     ngx_buf_t                        from_client;
 
@@ -363,6 +445,7 @@ struct ngx_http_upstream_s {
     void                           (*abort_request)(ngx_http_request_t *r);
     void                           (*finalize_request)(ngx_http_request_t *r,
                                          ngx_int_t rc);
+    ngx_int_t                      (*init_peer)(ngx_http_request_t *r);
     ngx_int_t                      (*rewrite_redirect)(ngx_http_request_t *r,
                                          ngx_table_elt_t *h, size_t prefix);
     ngx_int_t                      (*rewrite_cookie)(ngx_http_request_t *r,
@@ -399,6 +482,8 @@ struct ngx_http_upstream_s {
     unsigned                         request_body_sent:1;
     unsigned                         request_body_blocked:1;
     unsigned                         header_sent:1;
+    unsigned                         hedged:1;
+    unsigned                         raw_body:1;
 };
 
 
@@ -425,9 +510,23 @@ char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_upstream_multiplex_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_upstream_collapse_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
+#if (NGX_HTTP_CACHE)
+ngx_int_t ngx_http_upstream_cache_range(ngx_http_request_t *r,
+    ngx_str_t *range);
+#endif
+#if (NGX_HTTP_SSL)
+ngx_int_t ngx_http_upstream_ssl_name(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c);
+#endif
 
 
 #define ngx_http_conf_upstream_srv_conf(uscf, module)                         \
@@ -0,0 +1,1004 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_http_request_t               *request;
+    ngx_http_upstream_mux_conf_t     *conf;
+    ngx_http_upstream_mux_handler_t  *handler;
+    ngx_http_upstream_mux_stream_t   *stream;
+
+    void                             *data;
+
+    ngx_event_get_peer_pt             original_get_peer;
+    ngx_event_free_peer_pt            original_free_peer;
+} ngx_http_upstream_mux_peer_data_t;
+
+
+#define NGX_HTTP_UPSTREAM_MUX_BUFS     8
+#define NGX_HTTP_UPSTREAM_MUX_TIMEOUT  60000
+
+
+static ngx_int_t ngx_http_upstream_mux_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_mux_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_http_upstream_mux_t *ngx_http_upstream_mux_connect(
+    ngx_peer_connection_t *pc, ngx_http_upstream_mux_peer_data_t *mp,
+    ngx_int_t *rc);
+static void ngx_http_upstream_mux_attach(ngx_http_upstream_mux_t *mux,
+    ngx_http_upstream_mux_stream_t *stream);
+static void ngx_http_upstream_mux_detach(
+    ngx_http_upstream_mux_stream_t *stream);
+static ngx_http_upstream_mux_stream_t *ngx_http_upstream_mux_stream(
+    ngx_connection_t *c);
+static ssize_t ngx_http_upstream_mux_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_upstream_mux_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *cl, off_t limit);
+static ngx_chain_t *ngx_http_upstream_mux_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_upstream_mux_write(ngx_http_upstream_mux_t *mux);
+static void ngx_http_upstream_mux_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_mux_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_mux_idle(ngx_http_upstream_mux_t *mux);
+static void ngx_http_upstream_mux_close(ngx_http_upstream_mux_t *mux,
+    ngx_uint_t error);
+static u_char *ngx_http_upstream_mux_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+
+ngx_int_t
+ngx_http_upstream_mux_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_mux_conf_t *mcf, ngx_http_upstream_mux_handler_t *h)
+{
+    ngx_http_upstream_t                *u;
+    ngx_http_upstream_mux_peer_data_t  *mp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init upstream mux peer");
+
+    mp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_mux_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    mp->request = r;
+    mp->conf = mcf;
+    mp->handler = h;
+    mp->stream = NULL;
+    mp->data = u->peer.data;
+    mp->original_get_peer = u->peer.get;
+    mp->original_free_peer = u->peer.free;
+
+    u->peer.data = mp;
+    u->peer.get = ngx_http_upstream_mux_get_peer;
+    u->peer.free = ngx_http_upstream_mux_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_mux_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_mux_peer_data_t  *mp = data;
+
+    ngx_int_t                        rc;
+    ngx_queue_t                     *q;
+    ngx_http_upstream_mux_t         *mux;
+    ngx_http_upstream_mux_conf_t    *mcf;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    rc = mp->original_get_peer(pc, mp->data);
+
+    if (rc != NGX_OK) {
+
+        /* NGX_DONE: a connection cached by keepalive is used as is */
+
+        return rc;
+    }
+
+    stream = ngx_pcalloc(mp->request->pool, mp->handler->stream_size);
+    if (stream == NULL) {
+        return NGX_ERROR;
+    }
+
+    mcf = mp->conf;
+
+    for (q = ngx_queue_head(&mcf->connections);
+         q != ngx_queue_sentinel(&mcf->connections);
+         q = ngx_queue_next(q))
+    {
+        mux = ngx_queue_data(q, ngx_http_upstream_mux_t, queue);
+
+        if (mux->used < mux->max
+            && mux->local == pc->local
+            && ngx_cmp_sockaddr(mux->sockaddr, mux->socklen,
+                                pc->sockaddr, pc->socklen, 1)
+               == NGX_OK)
+        {
+            goto found;
+        }
+    }
+
+    mux = ngx_http_upstream_mux_connect(pc, mp, &rc);
+
+    if (mux == NULL) {
+        return rc;
+    }
+
+found:
+
+    ngx_http_upstream_mux_attach(mux, stream);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get upstream mux peer: connection %p, stream %ui of %ui",
+                   mux->connection, stream->id, mux->used);
+
+    mp->stream = stream;
+    pc->connection = &stream->connection;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_mux_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_mux_peer_data_t  *mp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free upstream mux peer");
+
+    if (mp->stream) {
+        ngx_http_upstream_mux_detach(mp->stream);
+
+        mp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    mp->original_free_peer(pc, mp->data, state);
+}
+
+
+static ngx_http_upstream_mux_t *
+ngx_http_upstream_mux_connect(ngx_peer_connection_t *pc,
+    ngx_http_upstream_mux_peer_data_t *mp, ngx_int_t *rc)
+{
+    ngx_pool_t                    *pool;
+    ngx_connection_t              *c;
+    ngx_peer_connection_t          peer;
+    ngx_http_upstream_mux_t       *mux;
+    ngx_http_upstream_conf_t      *conf;
+    ngx_http_upstream_mux_conf_t  *mcf;
+
+    *rc = NGX_ERROR;
+
+    mcf = mp->conf;
+    conf = mp->request->upstream->conf;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    mux = ngx_pcalloc(pool, mp->handler->mux_size);
+    if (mux == NULL) {
+        goto failed;
+    }
+
+    mux->streams = ngx_pcalloc(pool, mcf->multiplex
+                               * sizeof(ngx_http_upstream_mux_stream_t *));
+    if (mux->streams == NULL) {
+        goto failed;
+    }
+
+    mux->sockaddr = ngx_palloc(pool, pc->socklen);
+    if (mux->sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(mux->sockaddr, pc->sockaddr, pc->socklen);
+    mux->socklen = pc->socklen;
+
+    mux->name.data = ngx_pstrdup(pool, pc->name);
+    if (mux->name.data == NULL) {
+        goto failed;
+    }
+
+    mux->name.len = pc->name->len;
+
+    mux->buffer = ngx_create_temp_buf(pool, conf->buffer_size);
+    if (mux->buffer == NULL) {
+        goto failed;
+    }
+
+    mux->pool = pool;
+    mux->handler = mp->handler;
+    mux->local = pc->local;
+    mux->max = mcf->multiplex;
+    mux->buffer_size = conf->buffer_size;
+    mux->send_timeout = conf->send_timeout;
+
+    if (mux->handler->init
+        && mux->handler->init(mux, mp->request) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    mux->log = *ngx_cycle->log;
+    mux->log.handler = ngx_http_upstream_mux_log_error;
+    mux->log.data = mux;
+    mux->log.action = NULL;
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = mux->sockaddr;
+    peer.socklen = mux->socklen;
+    peer.name = &mux->name;
+    peer.local = pc->local;
+    peer.type = pc->type;
+    peer.get = ngx_event_get_peer;
+    peer.log = pc->log;
+    peer.log_error = pc->log_error;
+
+    *rc = ngx_event_connect_peer(&peer);
+
+    if (*rc == NGX_ERROR || *rc == NGX_BUSY || *rc == NGX_DECLINED) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = peer.connection;
+
+    c->data = mux;
+    c->log = &mux->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->read->handler = ngx_http_upstream_mux_read_handler;
+    c->write->handler = ngx_http_upstream_mux_write_handler;
+
+    mux->connection = c;
+
+    if (*rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, conf->connect_timeout);
+    }
+
+    ngx_queue_insert_tail(&mcf->connections, &mux->queue);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "upstream mux connection %p to %V%V",
+                   c, &mux->handler->schema, &mux->name);
+
+    return mux;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_mux_attach(ngx_http_upstream_mux_t *mux,
+    ngx_http_upstream_mux_stream_t *stream)
+{
+    ngx_uint_t         i;
+    ngx_event_t       *rev, *wev;
+    ngx_connection_t  *c;
+
+    for (i = 0; mux->streams[i]; i++) { /* void */ }
+
+    mux->streams[i] = stream;
+    mux->used++;
+    mux->attached++;
+
+    stream->mux = mux;
+    stream->id = i + 1;
+
+    /*
+     * the request sees a connection of its own, which shares
+     * the socket with other requests but reads and writes
+     * only its own data
+     */
+
+    c = &stream->connection;
+    rev = &stream->read;
+    wev = &stream->write;
+
+    c->fd = mux->connection->fd;
+    c->read = rev;
+    c->write = wev;
+    c->recv = ngx_http_upstream_mux_recv;
+    c->recv_chain = ngx_http_upstream_mux_recv_chain;
+    c->send_chain = ngx_http_upstream_mux_send_chain;
+    c->log = ngx_cycle->log;
+
+    rev->data = c;
+    rev->index = NGX_INVALID_INDEX;
+    rev->log = c->log;
+    rev->active = 1;
+
+    wev->data = c;
+    wev->index = NGX_INVALID_INDEX;
+    wev->log = c->log;
+    wev->write = 1;
+    wev->active = 1;
+    wev->ready = 1;
+
+    c = mux->connection;
+
+    c->idle = 0;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_mux_detach(ngx_http_upstream_mux_stream_t *stream)
+{
+    ngx_connection_t         *c;
+    ngx_http_upstream_mux_t  *mux;
+
+    mux = stream->mux;
+    c = &stream->connection;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "upstream mux detach stream %ui, started:%ud done:%ud",
+                   stream->id, stream->started, stream->done);
+
+    if (stream->read.timer_set) {
+        ngx_del_timer(&stream->read);
+    }
+
+    if (stream->write.timer_set) {
+        ngx_del_timer(&stream->write);
+    }
+
+    if (stream->read.posted) {
+        ngx_delete_posted_event(&stream->read);
+    }
+
+    if (stream->write.posted) {
+        ngx_delete_posted_event(&stream->write);
+    }
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+        c->pool = NULL;
+    }
+
+    if (stream->in) {
+        stream->in_last->next = mux->free;
+        mux->free = stream->in;
+    }
+
+    if (stream->out) {
+        stream->out_last->next = mux->free;
+        mux->free = stream->out;
+    }
+
+    mux->attached--;
+
+    if (mux->connection == NULL) {
+
+        if (mux->attached == 0) {
+            ngx_destroy_pool(mux->pool);
+        }
+
+        return;
+    }
+
+    if (stream->blocked) {
+        mux->blocked_writes--;
+    }
+
+    if (mux->blocked == stream) {
+        mux->blocked = NULL;
+        ngx_post_event(mux->connection->read, &ngx_posted_events);
+    }
+
+    if (stream->done || !stream->started) {
+        ngx_http_upstream_mux_release(mux, stream->id);
+        ngx_http_upstream_mux_idle(mux);
+        return;
+    }
+
+    /*
+     * the upstream server already knows the request, so the id
+     * is kept until the rest of the response is read and discarded
+     */
+
+    mux->streams[stream->id - 1] = NGX_HTTP_UPSTREAM_MUX_ABORTED;
+
+    if (mux->handler->abort == NULL) {
+        return;
+    }
+
+    if (mux->handler->abort(stream) != NGX_OK) {
+        ngx_http_upstream_mux_close(mux, 1);
+        return;
+    }
+
+    (void) ngx_http_upstream_mux_write(mux);
+}
+
+
+static ngx_http_upstream_mux_stream_t *
+ngx_http_upstream_mux_stream(ngx_connection_t *c)
+{
+    ngx_http_request_t                 *r;
+    ngx_http_upstream_mux_peer_data_t  *mp;
+
+    r = c->data;
+    mp = r->upstream->peer.data;
+
+    return mp->stream;
+}
+
+
+static ssize_t
+ngx_http_upstream_mux_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                           n, len;
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *cl;
+    ngx_http_upstream_mux_t         *mux;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    stream = ngx_http_upstream_mux_stream(c);
+    mux = stream->mux;
+
+    n = 0;
+
+    while (stream->in && n < size) {
+        cl = stream->in;
+        b = cl->buf;
+
+        len = ngx_min(size - n, (size_t) (b->last - b->pos));
+
+        ngx_memcpy(buf + n, b->pos, len);
+
+        b->pos += len;
+        n += len;
+
+        if (b->pos == b->last) {
+            stream->in = cl->next;
+            cl->next = mux->free;
+            mux->free = cl;
+        }
+    }
+
+    if (n) {
+        stream->size -= n;
+
+        if (mux->blocked == stream
+            && stream->size < NGX_HTTP_UPSTREAM_MUX_BUFS * mux->buffer_size)
+        {
+            mux->blocked = NULL;
+            ngx_post_event(mux->connection->read, &ngx_posted_events);
+        }
+
+        if (stream->in == NULL) {
+            stream->in_last = NULL;
+
+            if (mux->connection && !stream->done) {
+                c->read->ready = 0;
+            }
+        }
+
+        return n;
+    }
+
+    if (stream->done) {
+
+        /* the whole response was read */
+
+        c->read->eof = 1;
+        return 0;
+    }
+
+    if (mux->connection == NULL) {
+
+        if (mux->error) {
+            c->read->error = 1;
+            return NGX_ERROR;
+        }
+
+        c->read->eof = 1;
+        return 0;
+    }
+
+    c->read->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_mux_recv_chain(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+
+        size = cl->buf->end - cl->buf->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            if ((off_t) size > limit - total) {
+                size = (size_t) (limit - total);
+            }
+        }
+
+        n = ngx_http_upstream_mux_recv(c, cl->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_mux_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    size_t                           size;
+    ngx_buf_t                       *b;
+    ngx_http_upstream_mux_t         *mux;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    stream = ngx_http_upstream_mux_stream(c);
+    mux = stream->mux;
+
+    if (mux->connection == NULL) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (mux->out) {
+
+        /* wait for the data of other requests to be sent */
+
+        if (!stream->blocked) {
+            stream->blocked = 1;
+            mux->blocked_writes++;
+        }
+
+        c->write->ready = 0;
+
+        return in;
+    }
+
+    /* sendfile is disabled, so all buffers are in memory */
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        size = b->last - b->pos;
+
+        if (mux->handler->send(stream, b->pos, size) != NGX_OK) {
+            ngx_http_upstream_mux_close(mux, 1);
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        b->pos = b->last;
+
+        if (b->in_file) {
+            b->file_pos = b->file_last;
+        }
+
+        c->sent += size;
+    }
+
+    if (ngx_http_upstream_mux_write(mux) != NGX_OK) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_http_upstream_mux_append(ngx_http_upstream_mux_t *mux, ngx_chain_t **chain,
+    ngx_chain_t **last, u_char *p, size_t size)
+{
+    size_t        n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    while (size) {
+
+        cl = *last;
+
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+
+            cl = mux->free;
+
+            if (cl) {
+                mux->free = cl->next;
+
+                b = cl->buf;
+                b->pos = b->start;
+                b->last = b->start;
+
+            } else {
+                cl = ngx_alloc_chain_link(mux->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = ngx_create_temp_buf(mux->pool, mux->buffer_size);
+                if (cl->buf == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            cl->next = NULL;
+
+            if (*last) {
+                (*last)->next = cl;
+
+            } else {
+                *chain = cl;
+            }
+
+            *last = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min((size_t) (b->end - b->last), size);
+
+        b->last = ngx_cpymem(b->last, p, n);
+
+        p += n;
+        size -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_upstream_mux_input(ngx_http_upstream_mux_stream_t *stream, u_char *p,
+    size_t size)
+{
+    if (ngx_http_upstream_mux_append(stream->mux, &stream->in,
+                                     &stream->in_last, p, size)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    stream->size += size;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_upstream_mux_post(ngx_http_upstream_mux_stream_t *stream)
+{
+    ngx_http_upstream_mux_t  *mux;
+
+    mux = stream->mux;
+
+    stream->read.ready = 1;
+    ngx_post_event(&stream->read, &ngx_posted_events);
+
+    if (stream->size >= NGX_HTTP_UPSTREAM_MUX_BUFS * mux->buffer_size) {
+
+        /* reading stops until the request catches up */
+
+        mux->blocked = stream;
+    }
+}
+
+
+void
+ngx_http_upstream_mux_release(ngx_http_upstream_mux_t *mux, ngx_uint_t id)
+{
+    mux->streams[id - 1] = NULL;
+    mux->used--;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_mux_write(ngx_http_upstream_mux_t *mux)
+{
+    ngx_uint_t                       i;
+    ngx_chain_t                     *cl, *out;
+    ngx_connection_t                *c;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    c = mux->connection;
+
+    if (mux->out && c->write->ready) {
+
+        c->log->action = "sending to upstream";
+
+        out = c->send_chain(c, mux->out, 0);
+
+        c->log->action = NULL;
+
+        if (out == NGX_CHAIN_ERROR) {
+            ngx_http_upstream_mux_close(mux, 1);
+            return NGX_ERROR;
+        }
+
+        while (mux->out != out) {
+            cl = mux->out;
+            mux->out = cl->next;
+
+            cl->next = mux->free;
+            mux->free = cl;
+        }
+
+        if (out == NULL) {
+            mux->out_last = NULL;
+        }
+    }
+
+    if (mux->out) {
+
+        if (!c->write->timer_set) {
+            ngx_add_timer(c->write, mux->send_timeout);
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            ngx_http_upstream_mux_close(mux, 1);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (mux->blocked_writes == 0) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < mux->max; i++) {
+        stream = mux->streams[i];
+
+        if (stream == NULL
+            || stream == NGX_HTTP_UPSTREAM_MUX_ABORTED
+            || !stream->blocked)
+        {
+            continue;
+        }
+
+        stream->blocked = 0;
+        stream->write.ready = 1;
+
+        ngx_post_event(&stream->write, &ngx_posted_events);
+    }
+
+    mux->blocked_writes = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_mux_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t         *c;
+    ngx_http_upstream_mux_t  *mux;
+
+    c = wev->data;
+    mux = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_upstream_mux_close(mux, 1);
+        return;
+    }
+
+    (void) ngx_http_upstream_mux_write(mux);
+}
+
+
+static void
+ngx_http_upstream_mux_read_handler(ngx_event_t *rev)
+{
+    ssize_t                   n;
+    ngx_buf_t                *b;
+    ngx_int_t                 rc;
+    ngx_connection_t         *c;
+    ngx_http_upstream_mux_t  *mux;
+
+    c = rev->data;
+    mux = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "upstream mux read handler, %ui requests", mux->used);
+
+    if (c->close || rev->timedout) {
+        ngx_http_upstream_mux_close(mux, 0);
+        return;
+    }
+
+    b = mux->buffer;
+
+    for ( ;; ) {
+
+        if (b->pos < b->last) {
+            rc = mux->handler->parse(mux);
+
+            if (rc == NGX_ERROR) {
+                ngx_http_upstream_mux_close(mux, 1);
+                return;
+            }
+
+            if (rc == NGX_AGAIN) {
+
+                /* a request does not read its response fast enough */
+
+                return;
+            }
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+
+        c->log->action = "reading from upstream";
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        c->log->action = NULL;
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_http_upstream_mux_close(mux, n == NGX_ERROR);
+            return;
+        }
+
+        b->last += n;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_mux_close(mux, 1);
+        return;
+    }
+
+    ngx_http_upstream_mux_idle(mux);
+}
+
+
+static void
+ngx_http_upstream_mux_idle(ngx_http_upstream_mux_t *mux)
+{
+    ngx_connection_t  *c;
+
+    if (mux->used) {
+        return;
+    }
+
+    c = mux->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "upstream mux connection %p is idle", c);
+
+    if (ngx_terminate || ngx_exiting) {
+        ngx_http_upstream_mux_close(mux, 0);
+        return;
+    }
+
+    c->idle = 1;
+
+    ngx_add_timer(c->read, NGX_HTTP_UPSTREAM_MUX_TIMEOUT);
+}
+
+
+static void
+ngx_http_upstream_mux_close(ngx_http_upstream_mux_t *mux, ngx_uint_t error)
+{
+    ngx_uint_t                       i;
+    ngx_http_upstream_mux_stream_t  *stream;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mux->connection->log, 0,
+                   "close upstream mux connection %p, error:%ui",
+                   mux->connection, error);
+
+    ngx_queue_remove(&mux->queue);
+
+    ngx_close_connection(mux->connection);
+
+    mux->connection = NULL;
+    mux->error = error;
+    mux->blocked = NULL;
+
+    /* the requests will see the end of the connection */
+
+    for (i = 0; i < mux->max; i++) {
+        stream = mux->streams[i];
+
+        if (stream == NULL || stream == NGX_HTTP_UPSTREAM_MUX_ABORTED) {
+            continue;
+        }
+
+        stream->connection.fd = (ngx_socket_t) -1;
+
+        stream->read.ready = 1;
+        ngx_post_event(&stream->read, &ngx_posted_events);
+
+        if (stream->blocked) {
+            stream->write.ready = 1;
+            ngx_post_event(&stream->write, &ngx_posted_events);
+        }
+    }
+
+    if (mux->attached == 0) {
+        ngx_destroy_pool(mux->pool);
+    }
+}
+
+
+static u_char *
+ngx_http_upstream_mux_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                   *p;
+    ngx_http_upstream_mux_t  *mux;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    mux = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: %V%V",
+                     &mux->handler->schema, &mux->name);
+
+    return p;
+}
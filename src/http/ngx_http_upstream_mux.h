@@ -0,0 +1,121 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_UPSTREAM_MUX_H_INCLUDED_
+#define _NGX_HTTP_UPSTREAM_MUX_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct ngx_http_upstream_mux_s         ngx_http_upstream_mux_t;
+typedef struct ngx_http_upstream_mux_stream_s  ngx_http_upstream_mux_stream_t;
+
+
+typedef ngx_int_t (*ngx_http_upstream_mux_init_pt)(
+    ngx_http_upstream_mux_t *mux, ngx_http_request_t *r);
+typedef ngx_int_t (*ngx_http_upstream_mux_send_pt)(
+    ngx_http_upstream_mux_stream_t *stream, u_char *p, size_t size);
+typedef ngx_int_t (*ngx_http_upstream_mux_parse_pt)(
+    ngx_http_upstream_mux_t *mux);
+typedef ngx_int_t (*ngx_http_upstream_mux_abort_pt)(
+    ngx_http_upstream_mux_stream_t *stream);
+
+
+typedef struct {
+    ngx_int_t                         multiplex;
+    ngx_queue_t                       connections;
+} ngx_http_upstream_mux_conf_t;
+
+
+typedef struct {
+    ngx_str_t                         schema;
+
+    /* the protocol structures start with the generic ones */
+    size_t                            mux_size;
+    size_t                            stream_size;
+
+    ngx_http_upstream_mux_init_pt     init;
+    ngx_http_upstream_mux_send_pt     send;
+    ngx_http_upstream_mux_parse_pt    parse;
+    ngx_http_upstream_mux_abort_pt    abort;
+} ngx_http_upstream_mux_handler_t;
+
+
+struct ngx_http_upstream_mux_stream_s {
+    ngx_connection_t                  connection;
+    ngx_event_t                       read;
+    ngx_event_t                       write;
+
+    ngx_http_upstream_mux_t          *mux;
+    ngx_uint_t                        id;
+
+    ngx_chain_t                      *in;
+    ngx_chain_t                      *in_last;
+    size_t                            size;
+
+    /* the data not yet ready to be interleaved with other streams */
+    ngx_chain_t                      *out;
+    ngx_chain_t                      *out_last;
+
+    unsigned                          started:1;
+    unsigned                          done:1;
+    unsigned                          blocked:1;
+};
+
+
+struct ngx_http_upstream_mux_s {
+    ngx_connection_t                 *connection;
+    ngx_pool_t                       *pool;
+    ngx_log_t                         log;
+    ngx_queue_t                       queue;
+
+    ngx_http_upstream_mux_handler_t  *handler;
+
+    struct sockaddr                  *sockaddr;
+    socklen_t                         socklen;
+    ngx_str_t                         name;
+    ngx_addr_t                       *local;
+
+    /* the streams are indexed by their ids minus one */
+    ngx_http_upstream_mux_stream_t  **streams;
+    ngx_uint_t                        max;
+    ngx_uint_t                        used;
+    ngx_uint_t                        attached;
+    ngx_uint_t                        blocked_writes;
+
+    size_t                            buffer_size;
+    ngx_msec_t                        send_timeout;
+
+    ngx_buf_t                        *buffer;
+    ngx_chain_t                      *out;
+    ngx_chain_t                      *out_last;
+    ngx_chain_t                      *free;
+
+    ngx_http_upstream_mux_stream_t   *blocked;
+
+    unsigned                          error:1;
+};
+
+
+#define NGX_HTTP_UPSTREAM_MUX_ABORTED                                        \
+    ((ngx_http_upstream_mux_stream_t *) -1)
+
+
+ngx_int_t ngx_http_upstream_mux_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_mux_conf_t *mcf, ngx_http_upstream_mux_handler_t *h);
+ngx_int_t ngx_http_upstream_mux_append(ngx_http_upstream_mux_t *mux,
+    ngx_chain_t **chain, ngx_chain_t **last, u_char *p, size_t size);
+ngx_int_t ngx_http_upstream_mux_input(ngx_http_upstream_mux_stream_t *stream,
+    u_char *p, size_t size);
+void ngx_http_upstream_mux_post(ngx_http_upstream_mux_stream_t *stream);
+void ngx_http_upstream_mux_release(ngx_http_upstream_mux_t *mux,
+    ngx_uint_t id);
+
+
+#endif /* _NGX_HTTP_UPSTREAM_MUX_H_INCLUDED_ */
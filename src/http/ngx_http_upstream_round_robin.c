@@ -32,7 +32,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_url_t                      u;
-    ngx_uint_t                     i, j, n, w, t;
+    ngx_uint_t                     i, j, n, r, w, t;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
@@ -57,6 +57,15 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             if (!server[i].down) {
                 t += server[i].naddrs;
             }
+
+            if (server[i].resolve
+                && server[i].naddrs < NGX_HTTP_UPSTREAM_RESOLVE_SLOTS)
+            {
+                r = NGX_HTTP_UPSTREAM_RESOLVE_SLOTS - server[i].naddrs;
+
+                n += r;
+                w += r * server[i].weight;
+            }
         }
 
         if (n == 0) {
@@ -101,13 +110,40 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
+                peer[n].resolve = server[i].resolve;
                 peer[n].server = server[i].name;
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
                 n++;
             }
+
+            if (!server[i].resolve) {
+                continue;
+            }
+
+            /* spare peers for addresses the name may be resolved to */
+
+            for ( /* void */ ; j < NGX_HTTP_UPSTREAM_RESOLVE_SLOTS; j++) {
+                peer[n].weight = server[i].weight;
+                peer[n].effective_weight = server[i].weight;
+                peer[n].max_conns = server[i].max_conns;
+                peer[n].max_fails = server[i].max_fails;
+                peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
+                peer[n].down = 1;
+                peer[n].resolve = 1;
+                peer[n].spare = 1;
+                peer[n].server = server[i].name;
+
+                *peerp = &peer[n];
+                peerp = &peer[n].next;
+                n++;
+
+                peers->spare_weight += server[i].weight;
+            }
         }
 
         us->peer.data = peers;
@@ -129,6 +165,15 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             if (!server[i].down) {
                 t += server[i].naddrs;
             }
+
+            if (server[i].resolve
+                && server[i].naddrs < NGX_HTTP_UPSTREAM_RESOLVE_SLOTS)
+            {
+                r = NGX_HTTP_UPSTREAM_RESOLVE_SLOTS - server[i].naddrs;
+
+                n += r;
+                w += r * server[i].weight;
+            }
         }
 
         if (n == 0) {
@@ -171,12 +216,39 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
+                peer[n].resolve = server[i].resolve;
+                peer[n].server = server[i].name;
+
+                *peerp = &peer[n];
+                peerp = &peer[n].next;
+                n++;
+            }
+
+            if (!server[i].resolve) {
+                continue;
+            }
+
+            /* spare peers for addresses the name may be resolved to */
+
+            for ( /* void */ ; j < NGX_HTTP_UPSTREAM_RESOLVE_SLOTS; j++) {
+                peer[n].weight = server[i].weight;
+                peer[n].effective_weight = server[i].weight;
+                peer[n].max_conns = server[i].max_conns;
+                peer[n].max_fails = server[i].max_fails;
+                peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
+                peer[n].down = 1;
+                peer[n].resolve = 1;
+                peer[n].spare = 1;
                 peer[n].server = server[i].name;
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
                 n++;
+
+                backup->spare_weight += server[i].weight;
             }
         }
 
@@ -524,16 +596,19 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
     time_t                        now;
     uintptr_t                     m;
     ngx_int_t                     total;
-    ngx_uint_t                    i, n, p;
-    ngx_http_upstream_rr_peer_t  *peer, *best;
+    ngx_uint_t                    i, n, p, sp;
+    ngx_msec_t                    elapsed;
+    ngx_http_upstream_rr_peer_t  *peer, *best, *starting;
 
     now = ngx_time();
 
     best = NULL;
+    starting = NULL;
     total = 0;
 
 #if (NGX_SUPPRESS_WARN)
     p = 0;
+    sp = 0;
 #endif
 
     for (peer = rrp->peers->peer, i = 0;
@@ -562,6 +637,27 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
+        if (peer->slow_start && peer->start_time) {
+
+            /*
+             * a recovered server gets a share of requests growing
+             * linearly during the slow start period
+             */
+
+            elapsed = ngx_current_msec - peer->start_time;
+
+            if (elapsed < peer->slow_start
+                && (ngx_msec_t) ngx_random() % peer->slow_start >= elapsed)
+            {
+                if (starting == NULL) {
+                    starting = peer;
+                    sp = i;
+                }
+
+                continue;
+            }
+        }
+
         peer->current_weight += peer->effective_weight;
         total += peer->effective_weight;
 
@@ -576,7 +672,13 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
     }
 
     if (best == NULL) {
-        return NULL;
+
+        if (starting == NULL) {
+            return NULL;
+        }
+
+        best = starting;
+        p = sp;
     }
 
     rrp->current = best;
@@ -670,6 +772,151 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 }
 
 
+static ngx_uint_t
+ngx_http_upstream_rr_stats_period(ngx_http_upstream_rr_stats_t *stats)
+{
+    ngx_uint_t    n;
+    ngx_atomic_t  period, now;
+
+    now = ngx_time() / NGX_HTTP_UPSTREAM_RR_PERIOD;
+    period = stats->period;
+
+    n = now % 2;
+
+    if (period != now && ngx_atomic_cmp_set(&stats->period, period, now)) {
+
+        /* the worker which moved to the new period resets its counters */
+
+        stats->requests[n] = 0;
+        stats->retries[n] = 0;
+
+        if (now - period > 1) {
+            stats->requests[n ^ 1] = 0;
+            stats->retries[n ^ 1] = 0;
+        }
+    }
+
+    return n;
+}
+
+
+void
+ngx_http_upstream_rr_peers_request(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t  n;
+
+    n = ngx_http_upstream_rr_stats_period(&peers->stats);
+
+    (void) ngx_atomic_fetch_add(&peers->stats.requests[n], 1);
+}
+
+
+ngx_int_t
+ngx_http_upstream_rr_peers_retry(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t ratio, ngx_uint_t min)
+{
+    ngx_uint_t                     n, requests, retries;
+    ngx_http_upstream_rr_stats_t  *stats;
+
+    stats = &peers->stats;
+
+    n = ngx_http_upstream_rr_stats_period(stats);
+
+    requests = stats->requests[0] + stats->requests[1];
+    retries = stats->retries[0] + stats->retries[1];
+
+    if (retries >= min && retries * 100 >= requests * ratio) {
+        return NGX_DECLINED;
+    }
+
+    (void) ngx_atomic_fetch_add(&stats->retries[n], 1);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_upstream_rr_peers_latency(ngx_http_upstream_rr_peers_t *peers,
+    ngx_msec_t time)
+{
+    ngx_uint_t                     i;
+    ngx_http_upstream_rr_stats_t  *stats;
+
+    stats = &peers->stats;
+
+    for (i = 0; time && i < NGX_HTTP_UPSTREAM_RR_BUCKETS - 1; i++) {
+        time >>= 1;
+    }
+
+    (void) ngx_atomic_fetch_add(&stats->latency[i], 1);
+
+    if (ngx_atomic_fetch_add(&stats->samples, 1)
+        != NGX_HTTP_UPSTREAM_RR_SAMPLES - 1)
+    {
+        return;
+    }
+
+    /*
+     * halve the histogram to follow changes in latency;
+     * concurrent updates may be lost, which is harmless here
+     */
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_RR_BUCKETS; i++) {
+        stats->latency[i] /= 2;
+    }
+
+    stats->samples = NGX_HTTP_UPSTREAM_RR_SAMPLES / 2;
+}
+
+
+ngx_msec_t
+ngx_http_upstream_rr_peers_percentile(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t percentile)
+{
+    ngx_msec_t  lo, hi;
+    ngx_uint_t  i, total, rank, n;
+    ngx_uint_t  latency[NGX_HTTP_UPSTREAM_RR_BUCKETS];
+
+    total = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_RR_BUCKETS; i++) {
+        latency[i] = peers->stats.latency[i];
+        total += latency[i];
+    }
+
+    if (total < NGX_HTTP_UPSTREAM_RR_MIN_SAMPLES) {
+        return (ngx_msec_t) -1;
+    }
+
+    rank = total * percentile / 100;
+
+    n = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_RR_BUCKETS - 1; i++) {
+        if (n + latency[i] > rank) {
+            break;
+        }
+
+        n += latency[i];
+    }
+
+    if (i == 0) {
+        return 0;
+    }
+
+    /* bucket i holds times from 2^(i-1) to 2^i - 1 */
+
+    lo = (ngx_msec_t) 1 << (i - 1);
+    hi = (ngx_msec_t) 1 << i;
+
+    if (latency[i] == 0) {
+        return lo;
+    }
+
+    return lo + (hi - lo) * (rank - n) / latency[i];
+}
+
+
 #if (NGX_HTTP_SSL)
 
 ngx_int_t
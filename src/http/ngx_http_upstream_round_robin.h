@@ -14,6 +14,34 @@
 #include <ngx_http.h>
 
 
+/* the number of peers reserved for a server resolved at run time */
+
+#define NGX_HTTP_UPSTREAM_RESOLVE_SLOTS  16
+
+
+/*
+ * upstream statistics: requests and retries are counted in two periods
+ * of NGX_HTTP_UPSTREAM_RR_PERIOD seconds, response header times are kept
+ * in a histogram of power of two buckets halved every
+ * NGX_HTTP_UPSTREAM_RR_SAMPLES samples
+ */
+
+#define NGX_HTTP_UPSTREAM_RR_PERIOD      5
+#define NGX_HTTP_UPSTREAM_RR_BUCKETS     20
+#define NGX_HTTP_UPSTREAM_RR_SAMPLES     1024
+#define NGX_HTTP_UPSTREAM_RR_MIN_SAMPLES 32
+
+
+typedef struct {
+    ngx_atomic_t                    period;
+    ngx_atomic_t                    requests[2];
+    ngx_atomic_t                    retries[2];
+
+    ngx_atomic_t                    samples;
+    ngx_atomic_t                    latency[NGX_HTTP_UPSTREAM_RR_BUCKETS];
+} ngx_http_upstream_rr_stats_t;
+
+
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
 
 struct ngx_http_upstream_rr_peer_s {
@@ -38,8 +66,14 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_msec_t                      ewma;
+    ngx_msec_t                      ewma_updated;
+
     ngx_uint_t                      down;
 
+    unsigned                        resolve:1;
+    unsigned                        spare:1;
+
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
     int                             ssl_session_len;
@@ -69,12 +103,15 @@ struct ngx_http_upstream_rr_peers_s {
 
     ngx_uint_t                      total_weight;
     ngx_uint_t                      tries;
+    ngx_uint_t                      spare_weight;
 
     unsigned                        single:1;
     unsigned                        weighted:1;
 
     ngx_str_t                      *name;
 
+    ngx_http_upstream_rr_stats_t    stats;
+
     ngx_http_upstream_rr_peers_t   *next;
 
     ngx_http_upstream_rr_peer_t    *peer;
@@ -145,6 +182,14 @@ ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
 void ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+void ngx_http_upstream_rr_peers_request(ngx_http_upstream_rr_peers_t *peers);
+ngx_int_t ngx_http_upstream_rr_peers_retry(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t ratio, ngx_uint_t min);
+void ngx_http_upstream_rr_peers_latency(ngx_http_upstream_rr_peers_t *peers,
+    ngx_msec_t time);
+ngx_msec_t ngx_http_upstream_rr_peers_percentile(
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t percentile);
+
 #if (NGX_HTTP_SSL)
 ngx_int_t
     ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
@@ -54,12 +54,34 @@ typedef struct {
 
 #define NGX_HTTP_V2_FRAME_BUFFER_SIZE            24
 
+#define NGX_HTTP_V2_SEND_BUFFER_SIZE             16384
+#define NGX_HTTP_V2_MIN_DATA_FRAME_SIZE          4096
+#define NGX_HTTP_V2_SCHEDULE_SIZE                (128 * 1024)
+#define NGX_HTTP_V2_TCP_INFO_INTERVAL            100
+
+#define NGX_HTTP_V2_MAX_POOL_BLOCKS              4
+
 #define NGX_HTTP_V2_ROOT                         (void *) -1
 
 
+static u_char  ngx_http_v2_bdp_ping[NGX_HTTP_V2_PING_SIZE] =
+    { 'n', 'g', 'x', 'b', 'd', 'p', 0, 0 };
+
+
 static void ngx_http_v2_read_handler(ngx_event_t *rev);
 static void ngx_http_v2_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_v2_write_output_queue(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t buffer);
+static ngx_int_t ngx_http_v2_buffer_chain(ngx_http_v2_connection_t *h2c,
+    ngx_chain_t *in);
+static ngx_http_v2_out_frame_t *ngx_http_v2_pop_frame(
+    ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_requeue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame);
 static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
+#if (NGX_HAVE_TCP_INFO)
+static void ngx_http_v2_update_send_cwnd(ngx_http_v2_connection_t *h2c);
+#endif
 static void ngx_http_v2_lingering_close(ngx_connection_t *c);
 static void ngx_http_v2_lingering_close_handler(ngx_event_t *rev);
 
@@ -129,6 +151,11 @@ static ngx_int_t ngx_http_v2_parse_int(ngx_http_v2_connection_t *h2c,
 
 static ngx_http_v2_stream_t *ngx_http_v2_create_stream(
     ngx_http_v2_connection_t *h2c, ngx_uint_t push);
+static ngx_pool_t *ngx_http_v2_get_pool(ngx_array_t *free, size_t size,
+    ngx_log_t *log);
+static void ngx_http_v2_free_pool(ngx_http_v2_connection_t *h2c,
+    ngx_array_t **free, ngx_pool_t *pool);
+static void ngx_http_v2_destroy_free_pools(ngx_http_v2_connection_t *h2c);
 static ngx_http_v2_node_t *ngx_http_v2_get_node_by_id(
     ngx_http_v2_connection_t *h2c, ngx_uint_t sid, ngx_uint_t alloc);
 static ngx_http_v2_node_t *ngx_http_v2_get_closed_node(
@@ -145,6 +172,8 @@ static ngx_int_t ngx_http_v2_send_rst_stream(ngx_http_v2_connection_t *h2c,
     ngx_uint_t sid, ngx_uint_t status);
 static ngx_int_t ngx_http_v2_send_goaway(ngx_http_v2_connection_t *h2c,
     ngx_uint_t status);
+static ngx_int_t ngx_http_v2_send_bdp_ping(ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_update_bdp(ngx_http_v2_connection_t *h2c);
 
 static ngx_http_v2_out_frame_t *ngx_http_v2_get_frame(
     ngx_http_v2_connection_t *h2c, size_t length, ngx_uint_t type,
@@ -176,6 +205,7 @@ static ngx_int_t ngx_http_v2_process_request_body(ngx_http_request_t *r,
     u_char *pos, size_t size, ngx_uint_t last, ngx_uint_t flush);
 static ngx_int_t ngx_http_v2_filter_request_body(ngx_http_request_t *r);
 static void ngx_http_v2_read_client_request_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_tune_body_window(ngx_http_request_t *r);
 
 static ngx_int_t ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_stream_t *stream, ngx_uint_t status);
@@ -191,6 +221,8 @@ static ngx_int_t ngx_http_v2_adjust_windows(ngx_http_v2_connection_t *h2c,
 static void ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_node_t *node, ngx_uint_t depend, ngx_uint_t exclusive);
 static void ngx_http_v2_node_children_update(ngx_http_v2_node_t *node);
+static void ngx_http_v2_scheduled_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
 static void ngx_http_v2_pool_cleanup(void *data);
 
@@ -277,6 +309,10 @@ ngx_http_v2_init(ngx_event_t *rev)
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->concurrent_pushes = h2scf->concurrent_pushes;
+
+    h2c->encoder.limit = h2scf->hpack_table_size;
+    h2c->encoder.peer = NGX_HTTP_V2_TABLE_SIZE;
+
     h2c->priority_limit = ngx_max(h2scf->concurrent_streams, 100);
 
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
@@ -321,6 +357,9 @@ ngx_http_v2_init(ngx_event_t *rev)
     ngx_queue_init(&h2c->dependencies);
     ngx_queue_init(&h2c->closed);
 
+    ngx_rbtree_init(&h2c->scheduled, &h2c->scheduled_sentinel,
+                    ngx_http_v2_scheduled_insert_value);
+
     c->data = h2c;
 
     rev->handler = ngx_http_v2_read_handler;
@@ -455,7 +494,9 @@ ngx_http_v2_read_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_has_output(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -487,7 +528,7 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
 
-    if (h2c->last_out == NULL && !c->buffered) {
+    if (!ngx_http_v2_has_output(h2c) && !c->buffered) {
 
         if (wev->timer_set) {
             ngx_del_timer(wev);
@@ -518,12 +559,30 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
 ngx_int_t
 ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
+{
+    return ngx_http_v2_write_output_queue(h2c, 0);
+}
+
+
+ngx_int_t
+ngx_http_v2_buffer_output_queue(ngx_http_v2_connection_t *h2c)
+{
+    return ngx_http_v2_write_output_queue(h2c, 1);
+}
+
+
+static ngx_int_t
+ngx_http_v2_write_output_queue(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t buffer)
 {
     int                        tcp_nodelay;
-    ngx_chain_t               *cl;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl, **ll;
     ngx_event_t               *wev;
     ngx_connection_t          *c;
-    ngx_http_v2_out_frame_t   *out, *frame, *fn;
+    size_t                     size, limit;
+    ngx_http_v2_out_frame_t   *out, *frame, *fn, **fl, *requeue;
     ngx_http_core_loc_conf_t  *clcf;
 
     c = h2c->connection;
@@ -537,8 +596,39 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
-    cl = NULL;
-    out = NULL;
+    clcf = ngx_http_get_module_loc_conf(h2c->http_connection->conf_ctx,
+                                        ngx_http_core_module);
+
+    /*
+     * scheduled stream frames follow all the ordered frames; they are
+     * taken one by one from the first scheduled stream, up to about
+     * a congestion window per pass
+     */
+
+    ll = &cl;
+    fl = &out;
+
+    size = 0;
+    limit = ngx_max(h2c->send_cwnd, NGX_HTTP_V2_SCHEDULE_SIZE);
+
+    while (size < limit) {
+        frame = ngx_http_v2_pop_frame(h2c);
+
+        if (frame == NULL) {
+            break;
+        }
+
+        *ll = frame->first;
+        ll = &frame->last->next;
+
+        *fl = frame;
+        fl = &frame->next;
+
+        size += frame->length;
+    }
+
+    *ll = NULL;
+    *fl = NULL;
 
     for (frame = h2c->last_out; frame; frame = fn) {
         frame->last->next = cl;
@@ -554,14 +644,53 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
                        out->blocked, out->length);
     }
 
+    if (buffer) {
+
+        /*
+         * small frames of all streams ready in this cycle are gathered
+         * in the send buffer, which is flushed from the posted write event
+         */
+
+        rc = ngx_http_v2_buffer_chain(h2c, cl);
+
+        if (rc == NGX_ERROR) {
+            goto error;
+        }
+
+        if (rc == NGX_OK) {
+            ngx_post_event(wev, &ngx_posted_events);
+            goto sent;
+        }
+    }
+
+    if (c->buffered & NGX_HTTP_V2_BUFFERED) {
+        h2c->send_buffer->next = cl;
+        cl = h2c->send_buffer;
+    }
+
     cl = c->send_chain(c, cl, 0);
 
     if (cl == NGX_CHAIN_ERROR) {
         goto error;
     }
 
-    clcf = ngx_http_get_module_loc_conf(h2c->http_connection->conf_ctx,
-                                        ngx_http_core_module);
+    if (c->buffered & NGX_HTTP_V2_BUFFERED) {
+        b = h2c->send_buffer->buf;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+
+            c->buffered &= ~NGX_HTTP_V2_BUFFERED;
+        }
+    }
+
+#if (NGX_HAVE_TCP_INFO)
+    if (ngx_current_msec - h2c->tcp_info_time >= NGX_HTTP_V2_TCP_INFO_INTERVAL)
+    {
+        ngx_http_v2_update_send_cwnd(h2c);
+    }
+#endif
 
     if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
         goto error;
@@ -584,9 +713,19 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         goto error;
     }
 
+sent:
+
     for ( /* void */ ; out; out = fn) {
         fn = out->next;
 
+        if (out->scheduled) {
+            out->scheduled = 0;
+
+            if ((ngx_rbtree_key_int_t) (out->vfinish - h2c->vtime) > 0) {
+                h2c->vtime = out->vfinish;
+            }
+        }
+
         if (out->handler(h2c, out) != NGX_OK) {
             out->blocked = 1;
             break;
@@ -599,20 +738,39 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
     }
 
     frame = NULL;
+    requeue = NULL;
 
     for ( /* void */ ; out; out = fn) {
         fn = out->next;
+
+        if (out->scheduled) {
+            out->next = requeue;
+            requeue = out;
+            continue;
+        }
+
         out->next = frame;
         frame = out;
     }
 
     h2c->last_out = frame;
 
+    /* frames not sent go back in front of their streams, last first */
+
+    for (frame = requeue; frame; frame = fn) {
+        fn = frame->next;
+        ngx_http_v2_requeue_frame(h2c, frame);
+    }
+
     if (!wev->ready) {
         ngx_add_timer(wev, clcf->send_timeout);
         return NGX_AGAIN;
     }
 
+    if (h2c->scheduled.root != h2c->scheduled.sentinel) {
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+
     if (wev->timer_set) {
         ngx_del_timer(wev);
     }
@@ -631,6 +789,203 @@ error:
 }
 
 
+static ngx_http_v2_out_frame_t *
+ngx_http_v2_pop_frame(ngx_http_v2_connection_t *h2c)
+{
+    ngx_queue_t              *q;
+    ngx_rbtree_node_t        *node;
+    ngx_http_v2_stream_t     *stream;
+    ngx_http_v2_out_frame_t  *frame;
+
+    if (h2c->scheduled.root == h2c->scheduled.sentinel) {
+        return NULL;
+    }
+
+    node = ngx_rbtree_min(h2c->scheduled.root, h2c->scheduled.sentinel);
+
+    stream = ngx_rbtree_data(node, ngx_http_v2_stream_t, node_scheduled);
+
+    ngx_rbtree_delete(&h2c->scheduled, node);
+
+    q = ngx_queue_head(&stream->scheduled);
+    ngx_queue_remove(q);
+
+    if (!ngx_queue_empty(&stream->scheduled)) {
+        frame = ngx_queue_data(ngx_queue_head(&stream->scheduled),
+                               ngx_http_v2_out_frame_t, queue);
+
+        node->key = frame->vfinish;
+
+        ngx_rbtree_insert(&h2c->scheduled, node);
+    }
+
+    return ngx_queue_data(q, ngx_http_v2_out_frame_t, queue);
+}
+
+
+static void
+ngx_http_v2_requeue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_http_v2_stream_t  *stream;
+
+    stream = frame->stream;
+
+    if (!ngx_queue_empty(&stream->scheduled)) {
+        ngx_rbtree_delete(&h2c->scheduled, &stream->node_scheduled);
+    }
+
+    ngx_queue_insert_head(&stream->scheduled, &frame->queue);
+
+    stream->node_scheduled.key = frame->vfinish;
+
+    ngx_rbtree_insert(&h2c->scheduled, &stream->node_scheduled);
+}
+
+
+static ngx_int_t
+ngx_http_v2_buffer_chain(ngx_http_v2_connection_t *h2c, ngx_chain_t *in)
+{
+    size_t        size;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(cl->buf)) {
+            return NGX_DECLINED;
+        }
+
+        size += cl->buf->last - cl->buf->pos;
+    }
+
+    if (h2c->send_buffer == NULL) {
+        h2c->send_buffer = ngx_alloc_chain_link(h2c->pool);
+        if (h2c->send_buffer == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ngx_create_temp_buf(h2c->pool, NGX_HTTP_V2_SEND_BUFFER_SIZE);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->flush = 1;
+
+        h2c->send_buffer->buf = b;
+
+    } else {
+        b = h2c->send_buffer->buf;
+    }
+
+    if (size > (size_t) (b->end - b->last)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 send buffer copy: %uz", size);
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        b->last = ngx_cpymem(b->last, cl->buf->pos,
+                             cl->buf->last - cl->buf->pos);
+
+        cl->buf->pos = cl->buf->last;
+
+        if (cl->buf->in_file) {
+            cl->buf->file_pos = cl->buf->file_last;
+        }
+    }
+
+    h2c->connection->buffered |= NGX_HTTP_V2_BUFFERED;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_TCP_INFO)
+
+static void
+ngx_http_v2_update_send_cwnd(ngx_http_v2_connection_t *h2c)
+{
+    socklen_t          len;
+    struct tcp_info    ti;
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    h2c->tcp_info_time = ngx_current_msec;
+
+    len = sizeof(struct tcp_info);
+
+    if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1) {
+        h2c->send_cwnd = 0;
+        return;
+    }
+
+#if (NGX_LINUX)
+    h2c->send_cwnd = (size_t) ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+#else
+    h2c->send_cwnd = ti.tcpi_snd_cwnd;
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 send cwnd: %uz", h2c->send_cwnd);
+}
+
+#endif
+
+
+size_t
+ngx_http_v2_data_frame_size(ngx_http_v2_connection_t *h2c)
+{
+    size_t  size, limit;
+
+    size = h2c->frame_size;
+
+#if (NGX_HTTP_SSL)
+
+    /* fit a frame with its header into a single TLS record */
+
+    if (h2c->connection->ssl) {
+        limit = h2c->connection->ssl->buffer_size;
+
+        if (limit > NGX_HTTP_V2_FRAME_HEADER_SIZE
+            && limit - NGX_HTTP_V2_FRAME_HEADER_SIZE < size)
+        {
+            size = limit - NGX_HTTP_V2_FRAME_HEADER_SIZE;
+        }
+    }
+
+#endif
+
+    /*
+     * with a small congestion window, allow at least two frames
+     * per round trip to keep streams interleaved
+     */
+
+    if (h2c->send_cwnd) {
+        limit = ngx_max(h2c->send_cwnd / 2, NGX_HTTP_V2_MIN_DATA_FRAME_SIZE);
+
+        if (limit < size) {
+            size = limit;
+        }
+    }
+
+    return size;
+}
+
+
 static void
 ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
 {
@@ -638,7 +993,7 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
-    if (h2c->last_out || h2c->processing || h2c->pushing) {
+    if (ngx_http_v2_has_output(h2c) || h2c->processing || h2c->pushing) {
         return;
     }
 
@@ -686,11 +1041,13 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
         return;
     }
 
+    ngx_http_v2_destroy_free_pools(h2c);
     ngx_destroy_pool(h2c->pool);
 
     h2c->pool = NULL;
     h2c->free_frames = NULL;
     h2c->frames = 0;
+    h2c->send_buffer = NULL;
     h2c->free_fake_connections = NULL;
 
 #if (NGX_HTTP_SSL)
@@ -951,9 +1308,10 @@ ngx_http_v2_state_head(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
 static u_char *
 ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
 {
-    size_t                 size;
-    ngx_http_v2_node_t    *node;
-    ngx_http_v2_stream_t  *stream;
+    size_t                   size;
+    ngx_http_v2_node_t      *node;
+    ngx_http_v2_stream_t    *stream;
+    ngx_http_v2_loc_conf_t  *h2lcf;
 
     size = h2c->state.length;
 
@@ -1008,6 +1366,10 @@ ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
 
     h2c->recv_window -= size;
 
+    if (h2c->bdp_ping) {
+        h2c->bdp_received += size;
+    }
+
     if (h2c->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
 
         if (ngx_http_v2_send_window_update(h2c, 0, NGX_HTTP_V2_MAX_WINDOW
@@ -1051,6 +1413,18 @@ ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
 
     stream->recv_window -= size;
 
+    if (!stream->no_flow_control && !h2c->bdp_ping) {
+        h2lcf = ngx_http_get_module_loc_conf(stream->request,
+                                             ngx_http_v2_module);
+
+        if (h2lcf->max_body_window
+            && ngx_http_v2_send_bdp_ping(h2c) == NGX_ERROR)
+        {
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_INTERNAL_ERROR);
+        }
+    }
+
     if (stream->no_flow_control
         && stream->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4)
     {
@@ -1299,7 +1673,8 @@ ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c, u_char *pos,
 
     h2c->last_sid = h2c->state.sid;
 
-    h2c->state.pool = ngx_create_pool(1024, h2c->connection->log);
+    h2c->state.pool = ngx_http_v2_get_pool(h2c->free_pools, 1024,
+                                           h2c->connection->log);
     if (h2c->state.pool == NULL) {
         return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
     }
@@ -1918,7 +2293,7 @@ ngx_http_v2_state_header_complete(ngx_http_v2_connection_t *h2c, u_char *pos,
     }
 
     if (!h2c->state.keep_pool) {
-        ngx_destroy_pool(h2c->state.pool);
+        ngx_http_v2_free_pool(h2c, &h2c->free_pools, h2c->state.pool);
     }
 
     h2c->state.pool = NULL;
@@ -2282,6 +2657,7 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
+            h2c->encoder.peer = value;
             h2c->table_update = 1;
             break;
 
@@ -2354,7 +2730,16 @@ ngx_http_v2_state_ping(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
     }
 
     if (h2c->state.flags & NGX_HTTP_V2_ACK_FLAG) {
-        return ngx_http_v2_state_skip(h2c, pos, end);
+
+        if (h2c->bdp_ping
+            && ngx_memcmp(pos, ngx_http_v2_bdp_ping, NGX_HTTP_V2_PING_SIZE)
+               == 0)
+        {
+            ngx_http_v2_update_bdp(h2c);
+        }
+
+        return ngx_http_v2_state_complete(h2c, pos + NGX_HTTP_V2_PING_SIZE,
+                                          end);
     }
 
     frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_PING_SIZE,
@@ -2750,7 +3135,7 @@ ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent, ngx_str_t *path)
 
     h2c = parent->connection;
 
-    pool = ngx_create_pool(1024, h2c->connection->log);
+    pool = ngx_http_v2_get_pool(h2c->free_pools, 1024, h2c->connection->log);
     if (pool == NULL) {
         goto rst_stream;
     }
@@ -2758,7 +3143,7 @@ ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent, ngx_str_t *path)
     node = ngx_http_v2_get_node_by_id(h2c, h2c->last_push, 1);
 
     if (node == NULL) {
-        ngx_destroy_pool(pool);
+        ngx_http_v2_free_pool(h2c, &h2c->free_pools, pool);
         goto rst_stream;
     }
 
@@ -2776,7 +3161,7 @@ ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent, ngx_str_t *path)
             h2c->closed_nodes++;
         }
 
-        ngx_destroy_pool(pool);
+        ngx_http_v2_free_pool(h2c, &h2c->free_pools, pool);
         goto rst_stream;
     }
 
@@ -2931,6 +3316,7 @@ ngx_http_v2_send_settings(ngx_http_v2_connection_t *h2c)
     frame->length = len;
 #endif
     frame->blocked = 0;
+    frame->scheduled = 0;
 
     buf->last = ngx_http_v2_write_len_and_type(buf->last, len,
                                                NGX_HTTP_V2_SETTINGS_FRAME);
@@ -3064,6 +3450,73 @@ ngx_http_v2_send_goaway(ngx_http_v2_connection_t *h2c, ngx_uint_t status)
 }
 
 
+static ngx_int_t
+ngx_http_v2_send_bdp_ping(ngx_http_v2_connection_t *h2c)
+{
+    ngx_buf_t                *buf;
+    ngx_http_v2_out_frame_t  *frame;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 send PING frame");
+
+    frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_PING_SIZE,
+                                  NGX_HTTP_V2_PING_FRAME,
+                                  NGX_HTTP_V2_NO_FLAG, 0);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf = frame->first->buf;
+
+    buf->last = ngx_cpymem(buf->last, ngx_http_v2_bdp_ping,
+                           NGX_HTTP_V2_PING_SIZE);
+
+    ngx_http_v2_queue_blocked_frame(h2c, frame);
+
+    h2c->bdp_ping = 1;
+    h2c->bdp_received = 0;
+    h2c->bdp_time = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_update_bdp(ngx_http_v2_connection_t *h2c)
+{
+    size_t      rate;
+    ngx_msec_t  rtt;
+
+    /*
+     * the amount of data received during a PING round trip is a sample
+     * of the bandwidth-delay product; if it approaches the estimate,
+     * the sender is limited by windows, and the estimate is doubled
+     * unless the bandwidth went down
+     */
+
+    h2c->bdp_ping = 0;
+
+    rtt = ngx_current_msec - h2c->bdp_time;
+
+    if (rtt == 0) {
+        rtt = 1;
+    }
+
+    rate = h2c->bdp_received / rtt;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 bdp sample:%uz rtt:%M bdp:%uz",
+                   h2c->bdp_received, rtt, h2c->recv_bdp);
+
+    if (h2c->bdp_received < h2c->recv_bdp / 3 * 2 || rate < h2c->bdp_rate) {
+        return;
+    }
+
+    h2c->bdp_rate = rate;
+    h2c->recv_bdp = ngx_min(h2c->bdp_received * 2, NGX_HTTP_V2_MAX_WINDOW);
+}
+
+
 static ngx_http_v2_out_frame_t *
 ngx_http_v2_get_frame(ngx_http_v2_connection_t *h2c, size_t length,
     ngx_uint_t type, u_char flags, ngx_uint_t sid)
@@ -3081,6 +3534,7 @@ ngx_http_v2_get_frame(ngx_http_v2_connection_t *h2c, size_t length,
         buf->pos = buf->start;
 
         frame->blocked = 0;
+        frame->scheduled = 0;
 
     } else if (h2c->frames < 10000) {
         pool = h2c->pool ? h2c->pool : h2c->connection->pool;
@@ -3163,6 +3617,7 @@ static ngx_http_v2_stream_t *
 ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t push)
 {
     ngx_log_t                 *log;
+    ngx_pool_t                *pool;
     ngx_event_t               *rev, *wev;
     ngx_connection_t          *fc;
     ngx_http_log_ctx_t        *ctx;
@@ -3245,7 +3700,16 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t push)
     fc->sndlowat = 1;
     fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
 
-    r = ngx_http_create_request(fc);
+    cscf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                        ngx_http_core_module);
+
+    pool = ngx_http_v2_get_pool(h2c->free_request_pools,
+                                cscf->request_pool_size, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    r = ngx_http_create_request_in_pool(fc, pool);
     if (r == NULL) {
         return NULL;
     }
@@ -3258,8 +3722,6 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t push)
     fc->data = r;
     h2c->connection->requests++;
 
-    cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
-
     r->header_in = ngx_create_temp_buf(r->pool,
                                        cscf->client_header_buffer_size);
     if (r->header_in == NULL) {
@@ -3288,6 +3750,8 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t push)
     stream->request = r;
     stream->connection = h2c;
 
+    ngx_queue_init(&stream->scheduled);
+
     h2scf = ngx_http_get_module_srv_conf(r, ngx_http_v2_module);
 
     stream->send_window = h2c->init_window;
@@ -3310,6 +3774,111 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t push)
 }
 
 
+static ngx_pool_t *
+ngx_http_v2_get_pool(ngx_array_t *free, size_t size, ngx_log_t *log)
+{
+    ngx_pool_t  *pool, **pools;
+
+    if (free == NULL || free->nelts == 0) {
+        return ngx_create_pool(size, log);
+    }
+
+    pools = free->elts;
+    pool = pools[--free->nelts];
+
+    pool->log = log;
+
+    return pool;
+}
+
+
+static void
+ngx_http_v2_free_pool(ngx_http_v2_connection_t *h2c, ngx_array_t **free,
+    ngx_pool_t *pool)
+{
+#if !(NGX_DEBUG_PALLOC)
+
+    ngx_uint_t           n;
+    ngx_pool_t          *p, **pp;
+    ngx_pool_cleanup_t  *cln;
+
+    /*
+     * pools of closed streams are reset and kept until the connection
+     * becomes idle; pools which grew large are not worth keeping
+     */
+
+    n = 0;
+
+    for (p = pool; p; p = p->d.next) {
+        n++;
+    }
+
+    if (n > NGX_HTTP_V2_MAX_POOL_BLOCKS || h2c->pool == NULL) {
+        goto destroy;
+    }
+
+    if (*free == NULL) {
+        *free = ngx_array_create(h2c->pool, 4, sizeof(ngx_pool_t *));
+        if (*free == NULL) {
+            goto destroy;
+        }
+    }
+
+    pp = ngx_array_push(*free);
+    if (pp == NULL) {
+        goto destroy;
+    }
+
+    for (cln = pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler) {
+            cln->handler(cln->data);
+        }
+    }
+
+    pool->cleanup = NULL;
+
+    ngx_reset_pool(pool);
+
+    *pp = pool;
+
+    return;
+
+destroy:
+
+#endif
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_v2_destroy_free_pools(ngx_http_v2_connection_t *h2c)
+{
+    ngx_uint_t    i;
+    ngx_pool_t  **pools;
+
+    if (h2c->free_pools) {
+        pools = h2c->free_pools->elts;
+
+        for (i = 0; i < h2c->free_pools->nelts; i++) {
+            ngx_destroy_pool(pools[i]);
+        }
+
+        h2c->free_pools = NULL;
+    }
+
+    if (h2c->free_request_pools) {
+        pools = h2c->free_request_pools->elts;
+
+        for (i = 0; i < h2c->free_request_pools->nelts; i++) {
+            ngx_destroy_pool(pools[i]);
+        }
+
+        h2c->free_request_pools = NULL;
+    }
+}
+
+
 static ngx_http_v2_node_t *
 ngx_http_v2_get_node_by_id(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
     ngx_uint_t alloc)
@@ -4443,6 +5012,12 @@ ngx_http_v2_read_client_request_body_handler(ngx_http_request_t *r)
     buf->pos = buf->start;
     buf->last = buf->start;
 
+    if (ngx_http_v2_tune_body_window(r) != NGX_OK) {
+        stream->skip_data = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     window = buf->end - buf->start;
 
     if (h2c->state.stream == stream) {
@@ -4482,6 +5057,69 @@ ngx_http_v2_read_client_request_body_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_v2_tune_body_window(ngx_http_request_t *r)
+{
+    off_t                      rest;
+    size_t                     size;
+    u_char                    *p;
+    ngx_buf_t                 *buf;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_loc_conf_t    *h2lcf;
+    ngx_http_v2_connection_t  *h2c;
+
+    /*
+     * the body buffer, and hence the stream window, grows up to
+     * the estimated bandwidth-delay product while the client
+     * exhausts the window
+     */
+
+    stream = r->stream;
+    h2c = stream->connection;
+    buf = r->request_body->buf;
+
+    size = buf->end - buf->start;
+
+    if (h2c->recv_bdp <= size || stream->recv_window > size / 4) {
+        return NGX_OK;
+    }
+
+    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
+
+    size = ngx_min(h2c->recv_bdp, h2lcf->max_body_window);
+
+    if (r->headers_in.content_length_n >= 0) {
+        rest = r->headers_in.content_length_n - r->request_body->received;
+
+        if (rest < (off_t) size) {
+            size = (size_t) rest + 1;
+        }
+    }
+
+    if (size <= (size_t) (buf->end - buf->start)) {
+        return NGX_OK;
+    }
+
+    p = ngx_palloc(r->pool, size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 body window: %uz -> %uz",
+                   (size_t) (buf->end - buf->start), size);
+
+    ngx_pfree(r->pool, buf->start);
+
+    buf->start = p;
+    buf->pos = p;
+    buf->last = p;
+    buf->end = p + size;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r)
 {
@@ -4538,6 +5176,11 @@ ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r)
     buf->pos = buf->start;
     buf->last = buf->start;
 
+    if (ngx_http_v2_tune_body_window(r) != NGX_OK) {
+        stream->skip_data = 1;
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
     window = buf->end - buf->start;
     h2c = stream->connection;
 
@@ -4608,7 +5251,7 @@ ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
 void
 ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 {
-    ngx_pool_t                *pool;
+    ngx_pool_t                *pool, *request_pool;
     ngx_uint_t                 push;
     ngx_event_t               *ev;
     ngx_connection_t          *fc;
@@ -4665,19 +5308,23 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 
     /*
      * This pool keeps decoded request headers which can be used by log phase
-     * handlers in ngx_http_free_request().
+     * handlers in ngx_http_release_request().
      *
      * The pointer is stored into local variable because the stream object
-     * will be destroyed after a call to ngx_http_free_request().
+     * will be released after a call to ngx_http_release_request().
      */
     pool = stream->pool;
 
     h2c->frames -= stream->frames;
 
-    ngx_http_free_request(stream->request, rc);
+    request_pool = ngx_http_release_request(stream->request, rc);
+
+    if (request_pool) {
+        ngx_http_v2_free_pool(h2c, &h2c->free_request_pools, request_pool);
+    }
 
     if (pool != h2c->state.pool) {
-        ngx_destroy_pool(pool);
+        ngx_http_v2_free_pool(h2c, &h2c->free_pools, pool);
 
     } else {
         /* pool will be destroyed when the complete header is parsed */
@@ -4790,7 +5437,9 @@ ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_has_output(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -4899,6 +5548,9 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
     h2c->last_out = NULL;
 
+    ngx_rbtree_init(&h2c->scheduled, &h2c->scheduled_sentinel,
+                    ngx_http_v2_scheduled_insert_value);
+
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
 
@@ -5110,6 +5762,7 @@ ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
 static void
 ngx_http_v2_node_children_update(ngx_http_v2_node_t *node)
 {
+    double               rel_weight;
     ngx_queue_t         *q;
     ngx_http_v2_node_t  *child;
 
@@ -5119,14 +5772,60 @@ ngx_http_v2_node_children_update(ngx_http_v2_node_t *node)
     {
         child = ngx_queue_data(q, ngx_http_v2_node_t, queue);
 
+        rel_weight = (node->rel_weight / 256) * child->weight;
+
+        /* descendants of an unchanged node are up to date */
+
+        if (child->rank == node->rank + 1 && child->rel_weight == rel_weight) {
+            continue;
+        }
+
         child->rank = node->rank + 1;
-        child->rel_weight = (node->rel_weight / 256) * child->weight;
+        child->rel_weight = rel_weight;
 
         ngx_http_v2_node_children_update(child);
     }
 }
 
 
+static void
+ngx_http_v2_scheduled_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t     **p;
+    ngx_http_v2_stream_t   *s, *t;
+
+    s = ngx_rbtree_data(node, ngx_http_v2_stream_t, node_scheduled);
+
+    for ( ;; ) {
+
+        t = ngx_rbtree_data(temp, ngx_http_v2_stream_t, node_scheduled);
+
+        if (s->rank != t->rank) {
+            p = (s->rank < t->rank) ? &temp->left : &temp->right;
+
+        } else {
+            /* virtual time may wrap around, as timers do */
+
+            p = ((ngx_rbtree_key_int_t) (node->key - temp->key) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 static void
 ngx_http_v2_pool_cleanup(void *data)
 {
@@ -5137,6 +5836,7 @@ ngx_http_v2_pool_cleanup(void *data)
     }
 
     if (h2c->pool) {
+        ngx_http_v2_destroy_free_pools(h2c);
         ngx_destroy_pool(h2c->pool);
     }
 }
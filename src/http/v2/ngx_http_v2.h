@@ -24,6 +24,9 @@
 #define NGX_HTTP_V2_MAX_FIELD                                                 \
     (127 + (1 << (NGX_HTTP_V2_INT_OCTETS - 1) * 7) - 1)
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_MAX_TABLE_SIZE       65536
+
 #define NGX_HTTP_V2_STREAM_ID_SIZE       4
 
 #define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
@@ -114,6 +117,36 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_uint_t                       hash;
+    ngx_uint_t                       name_hash;
+    ngx_uint_t                       next;
+    ngx_uint_t                       name_next;
+    u_char                          *data;
+    size_t                           name_len;
+    size_t                           value_len;
+} ngx_http_v2_encoder_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_encoder_entry_t     *entries;
+    ngx_uint_t                      *buckets;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           limit;
+    size_t                           peer;
+
+    u_char                          *storage;
+    u_char                          *end;
+    u_char                          *pos;
+} ngx_http_v2_encoder_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -133,22 +166,37 @@ struct ngx_http_v2_connection_s {
     size_t                           recv_window;
     size_t                           init_window;
 
+    size_t                           recv_bdp;
+    size_t                           bdp_received;
+    size_t                           bdp_rate;
+    ngx_msec_t                       bdp_time;
+
     size_t                           frame_size;
+    size_t                           send_cwnd;
+    ngx_msec_t                       tcp_info_time;
 
     ngx_queue_t                      waiting;
 
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_encoder_t            encoder;
 
     ngx_pool_t                      *pool;
 
     ngx_http_v2_out_frame_t         *free_frames;
     ngx_connection_t                *free_fake_connections;
+    ngx_array_t                     *free_pools;
+    ngx_array_t                     *free_request_pools;
 
     ngx_http_v2_node_t             **streams_index;
 
     ngx_http_v2_out_frame_t         *last_out;
+    ngx_chain_t                     *send_buffer;
+
+    ngx_rbtree_t                     scheduled;
+    ngx_rbtree_node_t                scheduled_sentinel;
+    ngx_rbtree_key_t                 vtime;
 
     ngx_queue_t                      dependencies;
     ngx_queue_t                      closed;
@@ -164,6 +212,7 @@ struct ngx_http_v2_connection_s {
     unsigned                         blocked:1;
     unsigned                         goaway:1;
     unsigned                         push_disabled:1;
+    unsigned                         bdp_ping:1;
 };
 
 
@@ -205,6 +254,11 @@ struct ngx_http_v2_stream_s {
 
     ngx_queue_t                      queue;
 
+    ngx_rbtree_node_t                node_scheduled;
+    ngx_queue_t                      scheduled;
+    ngx_rbtree_key_t                 vfinish;
+    ngx_uint_t                       rank;
+
     ngx_array_t                     *cookies;
 
     ngx_pool_t                      *pool;
@@ -230,34 +284,51 @@ struct ngx_http_v2_out_frame_s {
     ngx_http_v2_stream_t            *stream;
     size_t                           length;
 
+    ngx_queue_t                      queue;
+    ngx_rbtree_key_t                 vfinish;
+
     unsigned                         blocked:1;
     unsigned                         fin:1;
+    unsigned                         scheduled:1;
 };
 
 
+#define ngx_http_v2_has_output(h2c)                                           \
+    ((h2c)->last_out || (h2c)->scheduled.root != (h2c)->scheduled.sentinel)
+
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
+    ngx_rbtree_key_t       start;
+    ngx_http_v2_stream_t  *stream;
 
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+    /*
+     * streams are sent by dependency level first, and within a level
+     * by the virtual finish time of their first frame, which advances
+     * inversely to the stream weight; the level is kept while the stream
+     * has frames scheduled, so its frames are not reordered
+     */
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
+    stream = frame->stream;
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
-            break;
-        }
+    start = ((ngx_rbtree_key_int_t) (stream->vfinish - h2c->vtime) > 0)
+            ? stream->vfinish : h2c->vtime;
+
+    stream->vfinish = start + frame->length * 256 / stream->node->weight;
+
+    frame->vfinish = stream->vfinish;
+    frame->scheduled = 1;
+
+    if (ngx_queue_empty(&stream->scheduled)) {
+        stream->rank = stream->node->rank;
+        stream->node_scheduled.key = frame->vfinish;
+
+        ngx_rbtree_insert(&h2c->scheduled, &stream->node_scheduled);
     }
 
-    frame->next = *out;
-    *out = frame;
+    ngx_queue_insert_tail(&stream->scheduled, &frame->queue);
 }
 
 
@@ -299,6 +370,8 @@ ngx_http_v2_stream_t *ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent,
 void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
+ngx_int_t ngx_http_v2_buffer_output_queue(ngx_http_v2_connection_t *h2c);
+size_t ngx_http_v2_data_frame_size(ngx_http_v2_connection_t *h2c);
 
 
 ngx_str_t *ngx_http_v2_get_static_name(ngx_uint_t index);
@@ -310,6 +383,15 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+ngx_uint_t ngx_http_v2_get_static_index(ngx_str_t *name);
+ngx_int_t ngx_http_v2_encoder_init(ngx_http_v2_connection_t *h2c);
+size_t ngx_http_v2_encoder_size(ngx_http_v2_connection_t *h2c);
+ngx_uint_t ngx_http_v2_encoder_find(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_uint_t name_hash, ngx_str_t *value, ngx_uint_t hash,
+    ngx_uint_t *name_index);
+void ngx_http_v2_encoder_add(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_uint_t name_hash, ngx_str_t *value, ngx_uint_t hash);
+
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
@@ -405,12 +487,18 @@ ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 #define NGX_HTTP_V2_LAST_MODIFIED_INDEX   44
 #define NGX_HTTP_V2_LOCATION_INDEX        46
 #define NGX_HTTP_V2_SERVER_INDEX          54
+#define NGX_HTTP_V2_SET_COOKIE_INDEX      55
 #define NGX_HTTP_V2_USER_AGENT_INDEX      58
 #define NGX_HTTP_V2_VARY_INDEX            59
 
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_header_encode(ngx_http_v2_connection_t *h2c, u_char *dst,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp,
+    ngx_uint_t indexing);
+u_char *ngx_http_v2_table_size_encode(ngx_http_v2_connection_t *h2c,
+    u_char *dst);
 
 
 #endif /* _NGX_HTTP_V2_H_INCLUDED_ */
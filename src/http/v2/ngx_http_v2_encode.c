@@ -40,6 +40,83 @@ ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len, u_char *tmp,
 }
 
 
+u_char *
+ngx_http_v2_header_encode(ngx_http_v2_connection_t *h2c, u_char *dst,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp,
+    ngx_uint_t indexing)
+{
+    ngx_str_t   lname;
+    ngx_uint_t  i, hash, name_hash, found;
+
+    if (name == NULL) {
+        lname = *ngx_http_v2_get_static_name(index);
+        name_hash = ngx_hash_key(lname.data, lname.len);
+
+    } else {
+        lname.len = name->len;
+        lname.data = tmp;
+
+        name_hash = ngx_hash_strlow(tmp, name->data, name->len);
+
+        if (index == 0) {
+            index = ngx_http_v2_get_static_index(&lname);
+        }
+    }
+
+    hash = name_hash;
+
+    for (i = 0; i < value->len; i++) {
+        hash = ngx_hash(hash, value->data[i]);
+    }
+
+    found = ngx_http_v2_encoder_find(h2c, &lname, name_hash, value, hash,
+                                     &index);
+
+    if (found) {
+        *dst = 0x80;
+        return ngx_http_v2_write_int(dst, ngx_http_v2_prefix(7), found);
+    }
+
+    if (index == NGX_HTTP_V2_SET_COOKIE_INDEX) {
+        *dst = 0x10;
+        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(4), index);
+
+    } else if (indexing
+               && 32 + lname.len + value->len <= h2c->encoder.size / 4 * 3)
+    {
+        ngx_http_v2_encoder_add(h2c, &lname, name_hash, value, hash);
+
+        *dst = 0x40;
+        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(6), index);
+
+    } else {
+        *dst = 0;
+        dst = ngx_http_v2_write_int(dst, ngx_http_v2_prefix(4), index);
+    }
+
+    if (index == 0) {
+        dst = ngx_http_v2_write_name(dst, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(dst, value->data, value->len, tmp);
+}
+
+
+u_char *
+ngx_http_v2_table_size_encode(ngx_http_v2_connection_t *h2c, u_char *dst)
+{
+    size_t  size;
+
+    size = ngx_http_v2_encoder_size(h2c);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", size);
+
+    *dst = 0x20;
+    return ngx_http_v2_write_int(dst, ngx_http_v2_prefix(5), size);
+}
+
+
 static u_char *
 ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
 {
@@ -13,17 +13,6 @@
 #include <ngx_http_v2_module.h>
 
 
-/*
- * This returns precise number of octets for values in range 0..253
- * and estimate number for the rest, but not smaller than required.
- */
-
-#define ngx_http_v2_integer_octets(v)  (1 + (v) / 127)
-
-#define ngx_http_v2_literal_size(h)                                           \
-    (ngx_http_v2_integer_octets(sizeof(h) - 1) + sizeof(h) - 1)
-
-
 #define NGX_HTTP_V2_NO_TRAILERS           (ngx_http_v2_out_frame_t *) -1
 
 
@@ -54,7 +43,7 @@ static ngx_http_v2_push_header_t  ngx_http_v2_push_headers[] = {
 
 static ngx_int_t ngx_http_v2_push_resources(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_push_resource(ngx_http_request_t *r,
-    ngx_str_t *path, ngx_str_t *binary);
+    ngx_str_t *path);
 
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end, ngx_uint_t fin);
@@ -135,7 +124,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, value;
     ngx_uint_t                 i, port, fin;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -147,20 +136,16 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[ngx_max(NGX_OFF_T_LEN,
+                                   sizeof("Wed, 31 Dec 1986 18:00:00 GMT"))];
 
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
+    static ngx_str_t  nginx = ngx_string("nginx");
+    static ngx_str_t  nginx_ver = ngx_string(NGINX_VER);
+    static ngx_str_t  nginx_ver_build = ngx_string(NGINX_VER_BUILD);
 #if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
+    static ngx_str_t  accept_encoding = ngx_string("Accept-Encoding");
 #endif
 
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
-
-    static size_t nginx_ver_build_len =
-                                  ngx_http_v2_literal_size(NGINX_VER_BUILD);
-    static u_char nginx_ver_build[ngx_http_v2_literal_size(NGINX_VER_BUILD)];
-
     stream = r->stream;
 
     if (!stream) {
@@ -253,31 +238,40 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = h2c->table_update ? 1 : 0;
+    if (ngx_http_v2_encoder_init(h2c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * header fields with a static name index are encoded with
+     * an index of up to NGX_HTTP_V2_INT_OCTETS octets
+     */
 
-    len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
+    len = h2c->table_update ? NGX_HTTP_V2_INT_OCTETS : 0;
+
+    len += status ? 1 : 2 * NGX_HTTP_V2_INT_OCTETS + sizeof("418") - 1;
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            len += 1 + nginx_ver_len;
+            len += 2 * NGX_HTTP_V2_INT_OCTETS + nginx_ver.len;
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            len += 1 + nginx_ver_build_len;
+            len += 2 * NGX_HTTP_V2_INT_OCTETS + nginx_ver_build.len;
 
         } else {
-            len += 1 + sizeof(nginx);
+            len += 2 * NGX_HTTP_V2_INT_OCTETS + nginx.len;
         }
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 * NGX_HTTP_V2_INT_OCTETS + ngx_cached_http_time.len;
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+        len += 2 * NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -289,13 +283,14 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += 2 * NGX_HTTP_V2_INT_OCTETS + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 * NGX_HTTP_V2_INT_OCTETS
+               + sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -373,7 +368,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += 2 * NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -381,7 +377,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += 2 * NGX_HTTP_V2_INT_OCTETS + accept_encoding.len;
 
         } else {
             r->gzip_vary = 0;
@@ -444,9 +440,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
+        pos = ngx_http_v2_table_size_encode(h2c, pos);
         h2c->table_update = 0;
     }
 
@@ -458,66 +452,43 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
+
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                        NULL, &value, tmp, 1);
     }
 
     if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"server: %s\"",
-                           NGINX_VER);
+            value = nginx_ver;
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"server: %s\"",
-                           NGINX_VER_BUILD);
+            value = nginx_ver_build;
 
         } else {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"server: nginx\"");
+            value = nginx;
         }
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
-
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
-
-        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            if (nginx_ver_build[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver_build,
-                                            (u_char *) NGINX_VER_BUILD,
-                                            sizeof(NGINX_VER_BUILD) - 1, tmp);
-                nginx_ver_build_len = p - nginx_ver_build;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"server: %V\"", &value);
 
-        } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
-        }
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                        NULL, &value, tmp, 1);
     }
 
     if (r->headers_out.date == NULL) {
+        value = ngx_cached_http_time;
+
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"date: %V\"",
-                       &ngx_cached_http_time);
+                       "http2 output header: \"date: %V\"", &value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_DATE_INDEX,
+                                        NULL, &value, tmp, 1);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -548,8 +519,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_CONTENT_TYPE_INDEX, NULL,
+                                        &r->headers_out.content_type, tmp, 1);
     }
 
     if (r->headers_out.content_length == NULL
@@ -559,30 +531,31 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        /* lengths are rarely repeated, do not waste the table on them */
+
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_CONTENT_LENGTH_INDEX, NULL,
+                                        &value, tmp, 0);
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        value.data = buf;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
 
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
-
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"",
+                       &value);
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_LAST_MODIFIED_INDEX, NULL,
+                                        &value, tmp, 1);
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -590,9 +563,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                        NULL, &r->headers_out.location->value,
+                                        tmp, 1);
     }
 
 #if (NGX_HTTP_GZIP)
@@ -600,8 +573,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_VARY_INDEX,
+                                        NULL, &accept_encoding, tmp, 1);
     }
 #endif
 
@@ -634,13 +607,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
-
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
-
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos, 0, &header[i].key,
+                                        &header[i].value, tmp, 1);
     }
 
     fin = r->header_only
@@ -681,13 +649,10 @@ ngx_http_v2_push_resources(ngx_http_request_t *r)
     ngx_table_elt_t           *h;
     ngx_http_v2_loc_conf_t    *h2lcf;
     ngx_http_complex_value_t  *pushes;
-    ngx_str_t                  binary[NGX_HTTP_V2_PUSH_HEADERS];
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http2 push resources");
 
-    ngx_memzero(binary, NGX_HTTP_V2_PUSH_HEADERS * sizeof(ngx_str_t));
-
     h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
 
     if (h2lcf->pushes) {
@@ -707,7 +672,7 @@ ngx_http_v2_push_resources(ngx_http_request_t *r)
                 continue;
             }
 
-            rc = ngx_http_v2_push_resource(r, &path, binary);
+            rc = ngx_http_v2_push_resource(r, &path);
 
             if (rc == NGX_ERROR) {
                 return NGX_ERROR;
@@ -870,7 +835,7 @@ ngx_http_v2_push_resources(ngx_http_request_t *r)
         if (push && path.len
             && !(path.len > 1 && path.data[0] == '/' && path.data[1] == '/'))
         {
-            rc = ngx_http_v2_push_resource(r, &path, binary);
+            rc = ngx_http_v2_push_resource(r, &path);
 
             if (rc == NGX_ERROR) {
                 return NGX_ERROR;
@@ -894,12 +859,10 @@ ngx_http_v2_push_resources(ngx_http_request_t *r)
 
 
 static ngx_int_t
-ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
-    ngx_str_t *binary)
+ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path)
 {
     u_char                      *start, *pos, *tmp;
-    size_t                       len;
-    ngx_str_t                   *value;
+    size_t                       len, tmp_len;
     ngx_uint_t                   i;
     ngx_table_elt_t            **h;
     ngx_connection_t            *fc;
@@ -943,73 +906,37 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
     ph = ngx_http_v2_push_headers;
 
-    len = ngx_max(r->schema.len, path->len);
-
-    if (binary[0].len) {
-        tmp = ngx_palloc(r->pool, len);
-        if (tmp == NULL) {
-            return NGX_ERROR;
-        }
-
-    } else {
-        for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
-            h = (ngx_table_elt_t **) ((char *) &r->headers_in + ph[i].offset);
-
-            if (*h) {
-                len = ngx_max(len, (*h)->value.len);
-            }
-        }
-
-        tmp = ngx_palloc(r->pool, len);
-        if (tmp == NULL) {
-            return NGX_ERROR;
-        }
-
-        for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
-            h = (ngx_table_elt_t **) ((char *) &r->headers_in + ph[i].offset);
-
-            if (*h == NULL) {
-                continue;
-            }
-
-            value = &(*h)->value;
-
-            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
-
-            pos = ngx_pnalloc(r->pool, len);
-            if (pos == NULL) {
-                return NGX_ERROR;
-            }
-
-            binary[i].data = pos;
-
-            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
-            pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
-
-            binary[i].len = pos - binary[i].data;
-        }
+    if (ngx_http_v2_encoder_init(h2c) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    len = (h2c->table_update ? 1 : 0)
+    len = (h2c->table_update ? NGX_HTTP_V2_INT_OCTETS : 0)
           + 1
-          + 1 + NGX_HTTP_V2_INT_OCTETS + path->len
-          + 1 + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
+          + 2 * NGX_HTTP_V2_INT_OCTETS + path->len
+          + 2 * NGX_HTTP_V2_INT_OCTETS + r->schema.len;
+
+    tmp_len = ngx_max(r->schema.len, path->len);
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
-        len += binary[i].len;
+        h = (ngx_table_elt_t **) ((char *) &r->headers_in + ph[i].offset);
+
+        if (*h) {
+            len += 2 * NGX_HTTP_V2_INT_OCTETS + (*h)->value.len;
+            tmp_len = ngx_max(tmp_len, (*h)->value.len);
+        }
     }
 
+    tmp = ngx_palloc(r->pool, tmp_len);
     pos = ngx_pnalloc(r->pool, len);
-    if (pos == NULL) {
+
+    if (pos == NULL || tmp == NULL) {
         return NGX_ERROR;
     }
 
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
+        pos = ngx_http_v2_table_size_encode(h2c, pos);
         h2c->table_update = 0;
     }
 
@@ -1021,8 +948,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":path: %V\"", path);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
-    pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
+    pos = ngx_http_v2_header_encode(h2c, pos, NGX_HTTP_V2_PATH_INDEX, NULL,
+                                    path, tmp, 1);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":scheme: %V\"", &r->schema);
@@ -1036,8 +963,9 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->schema.data, r->schema.len, tmp);
+        pos = ngx_http_v2_header_encode(h2c, pos,
+                                        NGX_HTTP_V2_SCHEME_HTTP_INDEX, NULL,
+                                        &r->schema, tmp, 1);
     }
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
@@ -1051,7 +979,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
                        "http2 push header: \"%V: %V\"",
                        &ph[i].name, &(*h)->value);
 
-        pos = ngx_cpymem(pos, binary[i].data, binary[i].len);
+        pos = ngx_http_v2_header_encode(h2c, pos, ph[i].index, NULL,
+                                        &(*h)->value, tmp, 1);
     }
 
     frame = ngx_http_v2_create_push_frame(r, start, pos);
@@ -1097,6 +1026,7 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
     frame->stream = stream;
     frame->length = rest;
     frame->blocked = 1;
+    frame->scheduled = 0;
     frame->fin = fin;
 
     ll = &frame->first;
@@ -1203,6 +1133,7 @@ ngx_http_v2_create_push_frame(ngx_http_request_t *r, u_char *pos, u_char *end)
     frame->stream = stream;
     frame->length = rest;
     frame->blocked = 1;
+    frame->scheduled = 0;
     frame->fin = 0;
 
     ll = &frame->first;
@@ -1504,8 +1435,11 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 
     h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
 
-    frame_size = (h2lcf->chunk_size < h2c->frame_size)
-                 ? h2lcf->chunk_size : h2c->frame_size;
+    frame_size = ngx_http_v2_data_frame_size(h2c);
+
+    if (h2lcf->chunk_size < frame_size) {
+        frame_size = h2lcf->chunk_size;
+    }
 
     trailers = NGX_HTTP_V2_NO_TRAILERS;
 
@@ -1752,6 +1686,7 @@ ngx_http_v2_filter_get_data_frame(ngx_http_v2_stream_t *stream,
     frame->stream = stream;
     frame->length = len;
     frame->blocked = 0;
+    frame->scheduled = 0;
     frame->fin = last->buf->last_buf;
 
     return frame;
@@ -1825,7 +1760,7 @@ ngx_http_v2_filter_send(ngx_connection_t *fc, ngx_http_v2_stream_t *stream)
 
     stream->blocked = 1;
 
-    if (ngx_http_v2_send_output_queue(stream->connection) == NGX_ERROR) {
+    if (ngx_http_v2_buffer_output_queue(stream->connection) == NGX_ERROR) {
         fc->error = 1;
         return NGX_ERROR;
     }
@@ -2154,6 +2089,23 @@ ngx_http_v2_filter_cleanup(void *data)
         fn = &frame->next;
     }
 
+    if (stream->queued && !ngx_queue_empty(&stream->scheduled)) {
+
+        ngx_rbtree_delete(&h2c->scheduled, &stream->node_scheduled);
+
+        while (!ngx_queue_empty(&stream->scheduled)) {
+            q = ngx_queue_head(&stream->scheduled);
+            ngx_queue_remove(q);
+
+            frame = ngx_queue_data(q, ngx_http_v2_out_frame_t, queue);
+
+            frame->scheduled = 0;
+
+            window += frame->length;
+            stream->queued--;
+        }
+    }
+
     if (h2c->send_window == 0 && window) {
 
         while (!ngx_queue_empty(&h2c->waiting)) {
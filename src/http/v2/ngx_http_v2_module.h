@@ -26,11 +26,13 @@ typedef struct {
     ngx_uint_t                      concurrent_pushes;
     size_t                          preread_size;
     ngx_uint_t                      streams_index_mask;
+    size_t                          hpack_table_size;
 } ngx_http_v2_srv_conf_t;
 
 
 typedef struct {
     size_t                          chunk_size;
+    size_t                          max_body_window;
 
     ngx_flag_t                      push_preload;
 
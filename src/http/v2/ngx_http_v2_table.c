@@ -10,11 +10,12 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
+#define NGX_HTTP_V2_ENCODER_BUCKETS  64
 
 
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static void ngx_http_v2_encoder_evict(ngx_http_v2_connection_t *h2c);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -361,3 +362,255 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+ngx_uint_t
+ngx_http_v2_get_static_index(ngx_str_t *name)
+{
+    ngx_uint_t  i;
+
+    /* skip pseudo-headers */
+
+    for (i = NGX_HTTP_V2_STATUS_500_INDEX;
+         i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES;
+         i++)
+    {
+        if (ngx_http_v2_static_table[i].name.len == name->len
+            && ngx_strncmp(ngx_http_v2_static_table[i].name.data, name->data,
+                           name->len)
+               == 0)
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_int_t
+ngx_http_v2_encoder_init(ngx_http_v2_connection_t *h2c)
+{
+    size_t                  size;
+    ngx_http_v2_encoder_t  *enc;
+
+    enc = &h2c->encoder;
+
+    if (enc->entries) {
+        return NGX_OK;
+    }
+
+    size = ngx_min(enc->limit, enc->peer);
+
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    /*
+     * every entry takes at least 33 bytes of the table size, and twice
+     * the table size of storage allows entries to be kept contiguous
+     */
+
+    enc->allocated = size / 32 + 1;
+
+    enc->entries = ngx_palloc(h2c->connection->pool,
+                              sizeof(ngx_http_v2_encoder_entry_t)
+                              * enc->allocated);
+    if (enc->entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->buckets = ngx_pcalloc(h2c->connection->pool,
+                               2 * NGX_HTTP_V2_ENCODER_BUCKETS
+                               * sizeof(ngx_uint_t));
+    if (enc->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->storage = ngx_palloc(h2c->connection->pool, 2 * size);
+    if (enc->storage == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->end = enc->storage + 2 * size;
+    enc->pos = enc->storage;
+
+    enc->size = size;
+    enc->free = size;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 hpack encoder table size: %uz", size);
+
+    return NGX_OK;
+}
+
+
+size_t
+ngx_http_v2_encoder_size(ngx_http_v2_connection_t *h2c)
+{
+    size_t                  size;
+    ngx_http_v2_encoder_t  *enc;
+
+    enc = &h2c->encoder;
+
+    size = ngx_min(enc->limit, enc->peer);
+
+    if (enc->entries == NULL) {
+        return size;
+    }
+
+    size = ngx_min(size, (size_t) (enc->end - enc->storage) / 2);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 new hpack encoder table size: %uz was:%uz",
+                   size, enc->size);
+
+    while (enc->size - enc->free > size) {
+        ngx_http_v2_encoder_evict(h2c);
+    }
+
+    enc->free = size - (enc->size - enc->free);
+    enc->size = size;
+
+    return size;
+}
+
+
+ngx_uint_t
+ngx_http_v2_encoder_find(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_uint_t name_hash, ngx_str_t *value, ngx_uint_t hash,
+    ngx_uint_t *name_index)
+{
+    ngx_uint_t                    id;
+    ngx_http_v2_encoder_t        *enc;
+    ngx_http_v2_encoder_entry_t  *entry;
+
+    enc = &h2c->encoder;
+
+    if (enc->entries == NULL) {
+        return 0;
+    }
+
+    for (id = enc->buckets[hash % NGX_HTTP_V2_ENCODER_BUCKETS];
+         id > enc->deleted;
+         id = entry->next)
+    {
+        entry = &enc->entries[id % enc->allocated];
+
+        if (entry->hash == hash
+            && entry->name_len == name->len
+            && entry->value_len == value->len
+            && ngx_memcmp(entry->data, name->data, name->len) == 0
+            && ngx_memcmp(entry->data + name->len, value->data, value->len)
+               == 0)
+        {
+            return NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1 + enc->added - id;
+        }
+    }
+
+    if (*name_index) {
+        return 0;
+    }
+
+    for (id = enc->buckets[NGX_HTTP_V2_ENCODER_BUCKETS
+                           + name_hash % NGX_HTTP_V2_ENCODER_BUCKETS];
+         id > enc->deleted;
+         id = entry->name_next)
+    {
+        entry = &enc->entries[id % enc->allocated];
+
+        if (entry->name_hash == name_hash
+            && entry->name_len == name->len
+            && ngx_memcmp(entry->data, name->data, name->len) == 0)
+        {
+            *name_index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1
+                          + enc->added - id;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+void
+ngx_http_v2_encoder_add(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_uint_t name_hash, ngx_str_t *value, ngx_uint_t hash)
+{
+    u_char                       *p;
+    size_t                        len, size;
+    ngx_uint_t                    id, *bucket;
+    ngx_http_v2_encoder_t        *enc;
+    ngx_http_v2_encoder_entry_t  *entry;
+
+    enc = &h2c->encoder;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 hpack encoder add: \"%V: %V\"", name, value);
+
+    len = name->len + value->len;
+    size = 32 + len;
+
+    if (size > enc->size) {
+        while (enc->added != enc->deleted) {
+            ngx_http_v2_encoder_evict(h2c);
+        }
+
+        return;
+    }
+
+    while (size > enc->free) {
+        ngx_http_v2_encoder_evict(h2c);
+    }
+
+    enc->free -= size;
+
+    /*
+     * live entries never take more than the table size, so either
+     * the tail of storage or its beginning is always large enough
+     */
+
+    p = enc->pos;
+
+    if ((size_t) (enc->end - p) < len) {
+        p = enc->storage;
+    }
+
+    enc->pos = ngx_cpymem(ngx_cpymem(p, name->data, name->len),
+                          value->data, value->len);
+
+    id = ++enc->added;
+    entry = &enc->entries[id % enc->allocated];
+
+    entry->data = p;
+    entry->name_len = name->len;
+    entry->value_len = value->len;
+
+    entry->hash = hash;
+    bucket = &enc->buckets[hash % NGX_HTTP_V2_ENCODER_BUCKETS];
+    entry->next = *bucket;
+    *bucket = id;
+
+    entry->name_hash = name_hash;
+    bucket = &enc->buckets[NGX_HTTP_V2_ENCODER_BUCKETS
+                           + name_hash % NGX_HTTP_V2_ENCODER_BUCKETS];
+    entry->name_next = *bucket;
+    *bucket = id;
+}
+
+
+static void
+ngx_http_v2_encoder_evict(ngx_http_v2_connection_t *h2c)
+{
+    ngx_http_v2_encoder_t        *enc;
+    ngx_http_v2_encoder_entry_t  *entry;
+
+    enc = &h2c->encoder;
+
+    entry = &enc->entries[++enc->deleted % enc->allocated];
+    enc->free += 32 + entry->name_len + entry->value_len;
+
+    if (enc->deleted == enc->added) {
+        enc->pos = enc->storage;
+    }
+}
@@ -88,6 +88,9 @@ typedef struct {
 
     size_t         nbytes;
     ngx_err_t      err;
+
+    ngx_uint_t     write_behind;   /* unsigned  write_behind:1; */
+    ngx_err_t      write_behind_err;
 } ngx_thread_file_ctx_t;
 
 
@@ -513,6 +516,12 @@ ngx_thread_write_chain_to_file(ngx_file_t *file, ngx_chain_t *cl, off_t offset,
             return NGX_ERROR;
         }
 
+        if (ctx->write_behind_err) {
+            ngx_log_error(NGX_LOG_ALERT, file->log, ctx->write_behind_err,
+                          ngx_write_behind_n " \"%s\" failed",
+                          file->name.data);
+        }
+
         file->offset += ctx->nbytes;
         return ctx->nbytes;
     }
@@ -524,6 +533,7 @@ ngx_thread_write_chain_to_file(ngx_file_t *file, ngx_chain_t *cl, off_t offset,
     ctx->fd = file->fd;
     ctx->chain = cl;
     ctx->offset = offset;
+    ctx->write_behind = file->write_behind;
 
     if (file->thread_handler(task, file) != NGX_OK) {
         return NGX_ERROR;
@@ -555,6 +565,7 @@ ngx_thread_write_chain_to_file_handler(void *data, ngx_log_t *log)
 
     ctx->nbytes = 0;
     ctx->err = 0;
+    ctx->write_behind_err = 0;
 
     do {
         /* create the iovec and coalesce the neighbouring bufs */
@@ -586,6 +597,15 @@ eintr:
         offset += n;
     } while (cl);
 
+    /* start writeback of the written range, do not wait for it */
+
+    if (ctx->write_behind
+        && ngx_write_behind(ctx->fd, ctx->offset, ctx->nbytes)
+           == NGX_FILE_ERROR)
+    {
+        ctx->write_behind_err = ngx_errno;
+    }
+
 #else
 
     ctx->err = NGX_ENOSYS;
@@ -826,6 +846,25 @@ ngx_read_ahead(ngx_fd_t fd, size_t n)
 #endif
 
 
+#if (NGX_HAVE_POSIX_FADVISE)
+
+ngx_int_t
+ngx_drop_file_cache(ngx_fd_t fd)
+{
+    int  err;
+
+    err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    if (err == 0) {
+        return NGX_OK;
+    }
+
+    ngx_set_errno(err);
+    return NGX_FILE_ERROR;
+}
+
+#endif
+
 #if (NGX_HAVE_O_DIRECT)
 
 ngx_int_t
@@ -348,6 +348,47 @@ ngx_int_t ngx_directio_off(ngx_fd_t fd);
 
 #endif
 
+
+#if (NGX_HAVE_FALLOCATE)
+
+#define ngx_preallocate_file(fd, size)                                       \
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size)
+#define ngx_preallocate_file_n   "fallocate(FALLOC_FL_KEEP_SIZE)"
+
+#else
+
+#define ngx_preallocate_file(fd, size)  0
+#define ngx_preallocate_file_n   "ngx_preallocate_file_n"
+
+#endif
+
+
+#if (NGX_HAVE_SYNC_FILE_RANGE)
+
+#define ngx_write_behind(fd, offset, size)                                   \
+    sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WRITE)
+#define ngx_write_behind_n       "sync_file_range(SYNC_FILE_RANGE_WRITE)"
+
+#else
+
+#define ngx_write_behind(fd, offset, size)  0
+#define ngx_write_behind_n       "ngx_write_behind_n"
+
+#endif
+
+
+#if (NGX_HAVE_POSIX_FADVISE)
+
+ngx_int_t ngx_drop_file_cache(ngx_fd_t fd);
+#define ngx_drop_file_cache_n    "posix_fadvise(POSIX_FADV_DONTNEED)"
+
+#else
+
+#define ngx_drop_file_cache(fd)  0
+#define ngx_drop_file_cache_n    "ngx_drop_file_cache_n"
+
+#endif
+
 size_t ngx_fs_bsize(u_char *name);
 off_t ngx_fs_available(u_char *name);
 
@@ -258,6 +258,15 @@ ngx_int_t ngx_directio_on(ngx_fd_t fd);
 ngx_int_t ngx_directio_off(ngx_fd_t fd);
 #define ngx_directio_off_n          "ngx_directio_off_n"
 
+#define ngx_preallocate_file(fd, size)      0
+#define ngx_preallocate_file_n      "ngx_preallocate_file_n"
+
+#define ngx_write_behind(fd, offset, size)  0
+#define ngx_write_behind_n          "ngx_write_behind_n"
+
+#define ngx_drop_file_cache(fd)             0
+#define ngx_drop_file_cache_n       "ngx_drop_file_cache_n"
+
 size_t ngx_fs_bsize(u_char *name);
 off_t ngx_fs_available(u_char *name);
 
@@ -2190,6 +2190,15 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    /* the upstream is probed over TLS as well */
+
+    if (conf->ssl_enable
+        && conf->upstream
+        && conf->upstream->ssl == NULL)
+    {
+        conf->upstream->ssl = conf->ssl;
+    }
+
 #endif
 
     return NGX_CONF_OK;
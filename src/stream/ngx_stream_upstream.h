@@ -22,6 +22,7 @@
 #define NGX_STREAM_UPSTREAM_DOWN          0x0010
 #define NGX_STREAM_UPSTREAM_BACKUP        0x0020
 #define NGX_STREAM_UPSTREAM_MAX_CONNS     0x0100
+#define NGX_STREAM_UPSTREAM_SLOW_START    0x0200
 
 
 #define NGX_STREAM_UPSTREAM_NOTIFY_CONNECT     0x1
@@ -61,6 +62,7 @@ typedef struct {
     ngx_uint_t                         down;
 
     unsigned                           backup:1;
+    unsigned                           resolve:1;
 
     NGX_COMPAT_BEGIN(4)
     NGX_COMPAT_END
@@ -81,8 +83,14 @@ struct ngx_stream_upstream_srv_conf_s {
     in_port_t                          port;
     ngx_uint_t                         no_port;  /* unsigned no_port:1 */
 
+#if (NGX_STREAM_SSL)
+    ngx_ssl_t                         *ssl;      /* for health checks */
+#endif
+
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_shm_zone_t                    *shm_zone;
+    ngx_resolver_t                    *resolver;
+    ngx_msec_t                         resolver_timeout;
 #endif
 };
 
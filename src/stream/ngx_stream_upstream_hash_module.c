@@ -25,6 +25,7 @@ typedef struct {
 typedef struct {
     ngx_stream_complex_value_t            key;
     ngx_stream_upstream_chash_points_t   *points;
+    ngx_uint_t                            bounded_load;
 } ngx_stream_upstream_hash_srv_conf_t;
 
 
@@ -58,6 +59,12 @@ static ngx_int_t ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 static ngx_int_t ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_uint_t ngx_stream_upstream_maglev_size(ngx_uint_t n);
+static ngx_int_t ngx_stream_upstream_init_maglev_peer(
+    ngx_stream_session_t *s, ngx_stream_upstream_srv_conf_t *us);
+
 static void *ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -66,7 +73,7 @@ static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_stream_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE123,
       ngx_stream_upstream_hash,
       NGX_STREAM_SRV_CONF_OFFSET,
       0,
@@ -178,7 +185,9 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || hp->rrp.peers->total_weight == hp->rrp.peers->spare_weight)
+    {
         ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -210,12 +219,19 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         hp->hash += hash;
         hp->rehash++;
 
-        w = hp->hash % hp->rrp.peers->total_weight;
+        /* spare peers of servers resolved at run time are not hashed */
+
+        w = hp->hash % (hp->rrp.peers->total_weight
+                        - hp->rrp.peers->spare_weight);
         peer = hp->rrp.peers->peer;
         p = 0;
 
-        while (w >= peer->weight) {
-            w -= peer->weight;
+        while (peer->spare || w >= peer->weight) {
+
+            if (!peer->spare) {
+                w -= peer->weight;
+            }
+
             peer = peer->next;
             p++;
         }
@@ -500,7 +516,7 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     intptr_t                              m;
     ngx_str_t                            *server;
     ngx_int_t                             total;
-    ngx_uint_t                            i, n, best_i;
+    ngx_uint_t                            i, n, best_i, conns, weight;
     ngx_stream_upstream_rr_peer_t        *peer, *best;
     ngx_stream_upstream_chash_point_t    *point;
     ngx_stream_upstream_chash_points_t   *points;
@@ -524,6 +540,19 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    conns = 0;
+    weight = 0;
+
+    if (hcf->bounded_load) {
+        for (peer = hp->rrp.peers->peer; peer; peer = peer->next) {
+            conns += peer->conns;
+
+            if (!peer->down) {
+                weight += peer->weight;
+            }
+        }
+    }
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -568,6 +597,20 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            /*
+             * with bounded load, a peer which already has more than
+             * its share of connections multiplied by the factor is
+             * skipped, and the next point is used
+             */
+
+            if (hcf->bounded_load
+                && (uint64_t) peer->conns * weight * 100
+                   >= (uint64_t) hcf->bounded_load * (conns + 1)
+                      * peer->weight)
+            {
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -618,6 +661,141 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    size_t                                size;
+    ngx_uint_t                            i, w, m, n, filled, *pos, *skip;
+    ngx_stream_upstream_rr_peer_t        *peer;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_chash_points_t   *points;
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+
+    /*
+     * Maglev lookup table: each peer fills the slots in the order
+     * of its own permutation of the table, taking as many turns in
+     * a round as its weight; the table size is a prime number, so
+     * any permutation (offset + j * skip) % m covers all slots
+     */
+
+    m = ngx_stream_upstream_maglev_size(peers->total_weight * 160);
+
+    size = sizeof(ngx_stream_upstream_chash_points_t)
+           + sizeof(ngx_stream_upstream_chash_point_t) * (m - 1);
+
+    points = ngx_pcalloc(cf->pool, size);
+    if (points == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = peers->number;
+
+    pos = ngx_alloc(2 * n * sizeof(ngx_uint_t), cf->log);
+    if (pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = pos + n;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        pos[i] = ngx_crc32_long(peer->server.data, peer->server.len) % m;
+        skip[i] = ngx_murmur_hash2(peer->server.data, peer->server.len)
+                  % (m - 1) + 1;
+    }
+
+    filled = 0;
+
+    for ( ;; ) {
+
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            for (w = 0; w < (ngx_uint_t) peer->weight; w++) {
+
+                while (points->point[pos[i]].server) {
+                    pos[i] = (pos[i] + skip[i]) % m;
+                }
+
+                points->point[pos[i]].hash = (uint32_t) pos[i];
+                points->point[pos[i]].server = &peer->server;
+
+                if (++filled == m) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_free(pos);
+
+    points->number = m;
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+    hcf->points = points;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_stream_upstream_maglev_size(ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    /* the smallest prime not less than n */
+
+    for (n |= 1; /* void */; n += 2) {
+
+        for (i = 3; i * i <= n; i += 2) {
+            if (n % i == 0) {
+                break;
+            }
+        }
+
+        if (i * i > n) {
+            return n;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_srv_conf_t   *hcf;
+    ngx_stream_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_stream_upstream_init_hash_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_chash_peer;
+
+    hp = s->upstream->peer.data;
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    /* the table is indexed directly, no lookup is needed */
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len)
+               % hcf->points->number;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -629,6 +807,7 @@ ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->bounded_load = 0;
 
     return conf;
 }
@@ -639,7 +818,9 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_stream_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                            n;
     ngx_str_t                           *value;
+    ngx_uint_t                           i;
     ngx_stream_upstream_srv_conf_t      *uscf;
     ngx_stream_compile_complex_value_t   ccv;
 
@@ -669,15 +850,49 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                   |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
                   |NGX_STREAM_UPSTREAM_DOWN;
 
-    if (cf->args->nelts == 2) {
-        uscf->peer.init_upstream = ngx_stream_upstream_init_hash;
+    uscf->peer.init_upstream = ngx_stream_upstream_init_hash;
 
-    } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
-        uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
+    for (i = 2; i < cf->args->nelts; i++) {
 
-    } else {
+        if (ngx_strcmp(value[i].data, "consistent") == 0
+            && uscf->peer.init_upstream == ngx_stream_upstream_init_hash)
+        {
+            uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "maglev") == 0
+            && uscf->peer.init_upstream == ngx_stream_upstream_init_hash)
+        {
+            uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "bounded_load=", 13) == 0) {
+
+            n = ngx_atofp(value[i].data + 13, value[i].len - 13, 2);
+
+            if (n == NGX_ERROR || n < 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid load factor \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            hcf->bounded_load = n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (hcf->bounded_load
+        && uscf->peer.init_upstream == ngx_stream_upstream_init_hash)
+    {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
+                           "\"bounded_load\" requires \"consistent\" "
+                           "or \"maglev\"");
         return NGX_CONF_ERROR;
     }
 
@@ -0,0 +1,513 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <ngx_event_probe.h>
+
+
+typedef struct {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+    ngx_str_t                           send;
+    ngx_str_t                           expect;
+    ngx_uint_t                          type;
+    ngx_flag_t                          enable;
+} ngx_stream_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_event_probe_t                   probe;
+
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+
+    unsigned                            down:1;
+} ngx_stream_upstream_hc_peer_t;
+
+
+static ngx_int_t ngx_stream_upstream_hc_init_peers(ngx_cycle_t *cycle,
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_hc_srv_conf_t *hcf);
+static ngx_int_t ngx_stream_upstream_hc_peer(ngx_event_probe_t *probe);
+static ngx_int_t ngx_stream_upstream_hc_match(ngx_event_probe_t *probe);
+static void ngx_stream_upstream_hc_done(ngx_event_probe_t *probe,
+    ngx_int_t rc);
+
+static void *ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_hc_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static char *ngx_stream_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_stream_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_hc,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    ngx_stream_upstream_hc_init_main_conf, /* init main configuration */
+
+    ngx_stream_upstream_hc_create_conf,    /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_hc_module_ctx,    /* module context */
+    ngx_stream_upstream_hc_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_upstream_hc_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                           i;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_main_conf_t     *umcf;
+    ngx_stream_upstream_hc_srv_conf_t   *hcf;
+
+    /* checks are run by the first worker process only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                                ngx_stream_upstream_hc_module);
+
+        if (!hcf->enable) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        if (ngx_stream_upstream_hc_init_peers(cycle, uscfp[i], peers, hcf)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (peers->next
+            && ngx_stream_upstream_hc_init_peers(cycle, uscfp[i], peers->next,
+                                                 hcf)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_peers(ngx_cycle_t *cycle,
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_hc_srv_conf_t *hcf)
+{
+    ngx_stream_upstream_rr_peer_t  *peer;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->down && !peer->resolve) {
+            continue;
+        }
+
+        hp = ngx_pcalloc(cycle->pool, sizeof(ngx_stream_upstream_hc_peer_t));
+        if (hp == NULL) {
+            return NGX_ERROR;
+        }
+
+        hp->peers = peers;
+        hp->peer = peer;
+        hp->conf = hcf;
+
+        hp->probe.interval = hcf->interval;
+        hp->probe.timeout = hcf->timeout;
+        hp->probe.type = hcf->type;
+        hp->probe.request = hcf->send;
+
+#if (NGX_STREAM_SSL)
+
+        /* probes use TLS if the upstream is proxied to over TLS */
+
+        hp->probe.ssl = uscf->ssl;
+        hp->probe.ssl_name = uscf->host;
+
+#endif
+
+        hp->probe.peer = ngx_stream_upstream_hc_peer;
+        hp->probe.check = hcf->expect.len ? ngx_stream_upstream_hc_match
+                                          : NULL;
+        hp->probe.done = ngx_stream_upstream_hc_done;
+        hp->probe.data = hp;
+
+        if (ngx_event_probe_init(&hp->probe, cycle->pool, cycle->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_peer(ngx_event_probe_t *probe)
+{
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    hp = probe->data;
+
+    ngx_stream_upstream_rr_peers_rlock(hp->peers);
+
+    if (hp->peer->spare) {
+
+        /* a slot of a server resolved at run time, not in use */
+
+        ngx_stream_upstream_rr_peers_unlock(hp->peers);
+
+        hp->fails = 0;
+        hp->passes = 0;
+        hp->down = 0;
+
+        return NGX_DECLINED;
+    }
+
+    probe->pc.sockaddr = hp->peer->sockaddr;
+    probe->pc.socklen = hp->peer->socklen;
+    probe->pc.name = &hp->peer->name;
+
+    ngx_stream_upstream_rr_peers_unlock(hp->peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_match(ngx_event_probe_t *probe)
+{
+    u_char                         *p, *last;
+    ngx_str_t                      *expect;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    hp = probe->data;
+    expect = &hp->conf->expect;
+
+    p = probe->response->pos;
+    last = probe->response->last;
+
+    /* the response may contain binary data */
+
+    for ( /* void */ ; last - p >= (ssize_t) expect->len; p++) {
+        if (ngx_memcmp(p, expect->data, expect->len) == 0) {
+            return NGX_OK;
+        }
+    }
+
+    if (!probe->eof) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, probe->event.log, 0,
+                  "health check of upstream server %V: "
+                  "response does not match", &hp->peer->name);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_stream_upstream_hc_done(ngx_event_probe_t *probe, ngx_int_t rc)
+{
+    ngx_stream_upstream_hc_peer_t      *hp;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hp = probe->data;
+    hcf = hp->conf;
+    peer = hp->peer;
+
+    ngx_stream_upstream_rr_peers_rlock(hp->peers);
+    ngx_stream_upstream_rr_peer_lock(hp->peers, peer);
+
+    if (rc == NGX_OK) {
+        hp->fails = 0;
+        hp->passes++;
+
+        if (hp->down && hp->passes >= hcf->passes && !peer->spare) {
+            hp->down = 0;
+
+            peer->down = 0;
+            peer->fails = 0;
+            peer->start_time = ngx_current_msec;
+
+            ngx_log_error(NGX_LOG_NOTICE, probe->event.log, 0,
+                          "upstream server %V is healthy", &peer->name);
+        }
+
+    } else {
+        hp->passes = 0;
+        hp->fails++;
+
+        /* the slot may have been refilled with a new address */
+
+        if (hp->fails >= hcf->fails && !peer->down) {
+            hp->down = 1;
+
+            peer->down = 1;
+
+            ngx_log_error(NGX_LOG_WARN, probe->event.log, 0,
+                          "upstream server %V is unhealthy", &peer->name);
+        }
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(hp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(hp->peers);
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->send = { 0, NULL };
+     *     conf->expect = { 0, NULL };
+     *     conf->enable = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                           i;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_upstream_main_conf_t     *umcf;
+    ngx_stream_upstream_hc_srv_conf_t   *hcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                                ngx_stream_upstream_hc_module);
+
+        if (!hcf->enable) {
+            continue;
+        }
+
+        /* the state of servers is shared by all worker processes */
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires upstream \"%V\" "
+                          "to be in shared memory in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *hcf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value, s;
+    ngx_uint_t  i;
+
+    if (hcf->enable) {
+        return "is duplicate";
+    }
+
+    hcf->enable = 1;
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+    hcf->type = SOCK_STREAM;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR
+                || hcf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "udp") == 0) {
+            hcf->type = SOCK_DGRAM;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "send=", 5) == 0) {
+
+            hcf->send.len = value[i].len - 5;
+            hcf->send.data = &value[i].data[5];
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "expect=", 7) == 0) {
+
+            hcf->expect.len = value[i].len - 7;
+            hcf->expect.data = &value[i].data[7];
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hcf->type == SOCK_DGRAM && hcf->send.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "UDP health check requires \"send\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -0,0 +1,483 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+#define NGX_STREAM_UPSTREAM_LT_CONNECT      0
+#define NGX_STREAM_UPSTREAM_LT_FIRST_BYTE   1
+#define NGX_STREAM_UPSTREAM_LT_LAST_BYTE    2
+
+
+/* the time over which old response time samples lose most of their weight */
+
+#define NGX_STREAM_UPSTREAM_LT_DECAY        10000
+
+
+typedef struct {
+    ngx_uint_t                                  mode;
+} ngx_stream_upstream_least_time_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_stream_upstream_rr_peer_data_t          rrp;
+
+    ngx_stream_upstream_least_time_srv_conf_t  *conf;
+    ngx_stream_upstream_t                      *upstream;
+} ngx_stream_upstream_least_time_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_least_time_peer(
+    ngx_stream_session_t *s, ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_least_time_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_stream_upstream_free_least_time_peer(
+    ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static void *ngx_stream_upstream_least_time_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_least_time(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_least_time_commands[] = {
+
+    { ngx_string("least_time"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_stream_upstream_least_time,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_least_time_module_ctx = {
+    NULL,                                    /* preconfiguration */
+    NULL,                                    /* postconfiguration */
+
+    NULL,                                    /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_upstream_least_time_create_conf,
+                                             /* create server configuration */
+    NULL                                     /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_least_time_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_least_time_module_ctx, /* module context */
+    ngx_stream_upstream_least_time_commands, /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                    /* init master */
+    NULL,                                    /* init module */
+    NULL,                                    /* init process */
+    NULL,                                    /* init thread */
+    NULL,                                    /* exit thread */
+    NULL,                                    /* exit process */
+    NULL,                                    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_least_time(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0,
+                   "init least time");
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_least_time_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_least_time_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_least_time_peer_data_t  *ltp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init least time peer");
+
+    ltp = ngx_palloc(s->connection->pool,
+                     sizeof(ngx_stream_upstream_least_time_peer_data_t));
+    if (ltp == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.data = &ltp->rrp;
+
+    if (ngx_stream_upstream_init_round_robin_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_least_time_peer;
+    s->upstream->peer.free = ngx_stream_upstream_free_least_time_peer;
+
+    ltp->conf = ngx_stream_conf_upstream_srv_conf(us,
+                                         ngx_stream_upstream_least_time_module);
+    ltp->upstream = s->upstream;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_least_time_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_rr_peer_data_t  *rrp = data;
+
+    time_t                           now;
+    uint64_t                         cost, best_cost;
+    uintptr_t                        m;
+    ngx_int_t                        rc, total;
+    ngx_uint_t                       i, n, p, many;
+    ngx_stream_upstream_rr_peer_t   *peer, *best;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get least time peer, try: %ui", pc->tries);
+
+    if (rrp->peers->single) {
+        return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = rrp->peers;
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    best = NULL;
+    best_cost = 0;
+    total = 0;
+
+#if (NGX_SUPPRESS_WARN)
+    many = 0;
+    p = 0;
+#endif
+
+    for (peer = peers->peer, i = 0;
+         peer;
+         peer = peer->next, i++)
+    {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        /*
+         * the expected time of a new connection is the peak-EWMA time
+         * scaled by the number of active connections, so a slow peer
+         * is chosen until its queue outweighs the faster ones; if there
+         * are multiple peers with the same cost, select based on
+         * round-robin
+         */
+
+        cost = (uint64_t) (peer->ewma + 1) * (peer->conns + 1);
+
+        if (best == NULL
+            || cost * best->weight < best_cost * peer->weight)
+        {
+            best = peer;
+            best_cost = cost;
+            many = 0;
+            p = i;
+
+        } else if (cost * best->weight == best_cost * peer->weight) {
+            many = 1;
+        }
+    }
+
+    if (best == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get least time peer, no peer found");
+
+        goto failed;
+    }
+
+    if (many) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get least time peer, many");
+
+        for (peer = best, i = p;
+             peer;
+             peer = peer->next, i++)
+        {
+            n = i / (8 * sizeof(uintptr_t));
+            m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+            if (rrp->tried[n] & m) {
+                continue;
+            }
+
+            if (peer->down) {
+                continue;
+            }
+
+            cost = (uint64_t) (peer->ewma + 1) * (peer->conns + 1);
+
+            if (cost * best->weight != best_cost * peer->weight) {
+                continue;
+            }
+
+            if (peer->max_fails
+                && peer->fails >= peer->max_fails
+                && now - peer->checked <= peer->fail_timeout)
+            {
+                continue;
+            }
+
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                continue;
+            }
+
+            peer->current_weight += peer->effective_weight;
+            total += peer->effective_weight;
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            if (peer->current_weight > best->current_weight) {
+                best = peer;
+                best_cost = cost;
+                p = i;
+            }
+        }
+    }
+
+    best->current_weight -= total;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    rrp->current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get least time peer, backup servers");
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+
+        rc = ngx_stream_upstream_get_least_time_peer(pc, rrp);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_stream_upstream_rr_peers_wlock(peers);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_stream_upstream_free_least_time_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state)
+{
+    ngx_stream_upstream_least_time_peer_data_t  *ltp = data;
+
+    ngx_msec_t                      time, elapsed;
+    ngx_stream_upstream_t          *u;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    u = ltp->upstream;
+    peer = ltp->rrp.current;
+
+    if (u->state == NULL || peer == NULL) {
+        goto done;
+    }
+
+    /*
+     * a failed connection, or one without the time measured yet, counts
+     * with the time elapsed, so unresponsive peers are penalized as well
+     */
+
+    switch (ltp->conf->mode) {
+
+    case NGX_STREAM_UPSTREAM_LT_CONNECT:
+        time = u->state->connect_time;
+        break;
+
+    case NGX_STREAM_UPSTREAM_LT_FIRST_BYTE:
+        time = u->state->first_byte_time;
+        break;
+
+    default: /* NGX_STREAM_UPSTREAM_LT_LAST_BYTE */
+        time = u->state->response_time;
+    }
+
+    if (time == (ngx_msec_t) -1 || (state & NGX_PEER_FAILED)) {
+        time = ngx_current_msec - u->start_time;
+    }
+
+    ngx_stream_upstream_rr_peers_rlock(ltp->rrp.peers);
+    ngx_stream_upstream_rr_peer_lock(ltp->rrp.peers, peer);
+
+    elapsed = ngx_current_msec - peer->ewma_updated;
+
+    if (time >= peer->ewma || peer->ewma_updated == 0) {
+
+        /* peaks are taken immediately */
+
+        peer->ewma = time;
+
+    } else {
+        if (elapsed == 0) {
+            elapsed = 1;
+
+        } else if (elapsed > NGX_STREAM_UPSTREAM_LT_DECAY) {
+            elapsed = NGX_STREAM_UPSTREAM_LT_DECAY;
+        }
+
+        peer->ewma = (ngx_msec_t)
+                     (((uint64_t) peer->ewma * NGX_STREAM_UPSTREAM_LT_DECAY
+                       + (uint64_t) time * elapsed)
+                      / (NGX_STREAM_UPSTREAM_LT_DECAY + elapsed));
+    }
+
+    peer->ewma_updated = ngx_current_msec;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free least time peer \"%V\", time: %M, ewma: %M",
+                   &peer->name, time, peer->ewma);
+
+    ngx_stream_upstream_rr_peer_unlock(ltp->rrp.peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(ltp->rrp.peers);
+
+done:
+
+    ngx_stream_upstream_free_round_robin_peer(pc, &ltp->rrp, state);
+}
+
+
+static void *
+ngx_stream_upstream_least_time_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_least_time_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_upstream_least_time_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->mode = NGX_STREAM_UPSTREAM_LT_CONNECT;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_least_time(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_least_time_srv_conf_t  *ltcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "connect") == 0) {
+        ltcf->mode = NGX_STREAM_UPSTREAM_LT_CONNECT;
+
+    } else if (ngx_strcmp(value[1].data, "first_byte") == 0) {
+        ltcf->mode = NGX_STREAM_UPSTREAM_LT_FIRST_BYTE;
+
+    } else if (ngx_strcmp(value[1].data, "last_byte") == 0) {
+        ltcf->mode = NGX_STREAM_UPSTREAM_LT_LAST_BYTE;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_least_time;
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN
+                  |NGX_STREAM_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
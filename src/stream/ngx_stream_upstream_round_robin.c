@@ -38,7 +38,7 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us)
 {
     ngx_url_t                        u;
-    ngx_uint_t                       i, j, n, w, t;
+    ngx_uint_t                       i, j, n, r, w, t;
     ngx_stream_upstream_server_t    *server;
     ngx_stream_upstream_rr_peer_t   *peer, **peerp;
     ngx_stream_upstream_rr_peers_t  *peers, *backup;
@@ -63,6 +63,15 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
             if (!server[i].down) {
                 t += server[i].naddrs;
             }
+
+            if (server[i].resolve
+                && server[i].naddrs < NGX_STREAM_UPSTREAM_RESOLVE_SLOTS)
+            {
+                r = NGX_STREAM_UPSTREAM_RESOLVE_SLOTS - server[i].naddrs;
+
+                n += r;
+                w += r * server[i].weight;
+            }
         }
 
         if (n == 0) {
@@ -107,12 +116,39 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
+                peer[n].resolve = server[i].resolve;
+                peer[n].server = server[i].name;
+
+                *peerp = &peer[n];
+                peerp = &peer[n].next;
+                n++;
+            }
+
+            if (!server[i].resolve) {
+                continue;
+            }
+
+            /* spare peers for addresses the name may be resolved to */
+
+            for ( /* void */ ; j < NGX_STREAM_UPSTREAM_RESOLVE_SLOTS; j++) {
+                peer[n].weight = server[i].weight;
+                peer[n].effective_weight = server[i].weight;
+                peer[n].max_conns = server[i].max_conns;
+                peer[n].max_fails = server[i].max_fails;
+                peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
+                peer[n].down = 1;
+                peer[n].resolve = 1;
+                peer[n].spare = 1;
                 peer[n].server = server[i].name;
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
                 n++;
+
+                peers->spare_weight += server[i].weight;
             }
         }
 
@@ -135,6 +171,15 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
             if (!server[i].down) {
                 t += server[i].naddrs;
             }
+
+            if (server[i].resolve
+                && server[i].naddrs < NGX_STREAM_UPSTREAM_RESOLVE_SLOTS)
+            {
+                r = NGX_STREAM_UPSTREAM_RESOLVE_SLOTS - server[i].naddrs;
+
+                n += r;
+                w += r * server[i].weight;
+            }
         }
 
         if (n == 0) {
@@ -177,13 +222,40 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
+                peer[n].resolve = server[i].resolve;
                 peer[n].server = server[i].name;
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
                 n++;
             }
+
+            if (!server[i].resolve) {
+                continue;
+            }
+
+            /* spare peers for addresses the name may be resolved to */
+
+            for ( /* void */ ; j < NGX_STREAM_UPSTREAM_RESOLVE_SLOTS; j++) {
+                peer[n].weight = server[i].weight;
+                peer[n].effective_weight = server[i].weight;
+                peer[n].max_conns = server[i].max_conns;
+                peer[n].max_fails = server[i].max_fails;
+                peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
+                peer[n].down = 1;
+                peer[n].resolve = 1;
+                peer[n].spare = 1;
+                peer[n].server = server[i].name;
+
+                *peerp = &peer[n];
+                peerp = &peer[n].next;
+                n++;
+
+                backup->spare_weight += server[i].weight;
+            }
         }
 
         peers->next = backup;
@@ -533,16 +605,19 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
     time_t                          now;
     uintptr_t                       m;
     ngx_int_t                       total;
-    ngx_uint_t                      i, n, p;
-    ngx_stream_upstream_rr_peer_t  *peer, *best;
+    ngx_uint_t                      i, n, p, sp;
+    ngx_msec_t                      elapsed;
+    ngx_stream_upstream_rr_peer_t  *peer, *best, *starting;
 
     now = ngx_time();
 
     best = NULL;
+    starting = NULL;
     total = 0;
 
 #if (NGX_SUPPRESS_WARN)
     p = 0;
+    sp = 0;
 #endif
 
     for (peer = rrp->peers->peer, i = 0;
@@ -571,6 +646,27 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
+        if (peer->slow_start && peer->start_time) {
+
+            /*
+             * a recovered server gets a share of requests growing
+             * linearly during the slow start period
+             */
+
+            elapsed = ngx_current_msec - peer->start_time;
+
+            if (elapsed < peer->slow_start
+                && (ngx_msec_t) ngx_random() % peer->slow_start >= elapsed)
+            {
+                if (starting == NULL) {
+                    starting = peer;
+                    sp = i;
+                }
+
+                continue;
+            }
+        }
+
         peer->current_weight += peer->effective_weight;
         total += peer->effective_weight;
 
@@ -585,7 +681,13 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
     }
 
     if (best == NULL) {
-        return NULL;
+
+        if (starting == NULL) {
+            return NULL;
+        }
+
+        best = starting;
+        p = sp;
     }
 
     rrp->current = best;
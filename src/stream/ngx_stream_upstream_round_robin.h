@@ -14,6 +14,11 @@
 #include <ngx_stream.h>
 
 
+/* the number of peers reserved for a server resolved at run time */
+
+#define NGX_STREAM_UPSTREAM_RESOLVE_SLOTS  16
+
+
 typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
 
 struct ngx_stream_upstream_rr_peer_s {
@@ -38,8 +43,14 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_msec_t                       slow_start;
     ngx_msec_t                       start_time;
 
+    ngx_msec_t                       ewma;
+    ngx_msec_t                       ewma_updated;
+
     ngx_uint_t                       down;
 
+    unsigned                         resolve:1;
+    unsigned                         spare:1;
+
     void                            *ssl_session;
     int                              ssl_session_len;
 
@@ -67,6 +78,7 @@ struct ngx_stream_upstream_rr_peers_s {
 
     ngx_uint_t                       total_weight;
     ngx_uint_t                       tries;
+    ngx_uint_t                       spare_weight;
 
     unsigned                         single:1;
     unsigned                         weighted:1;